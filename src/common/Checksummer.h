@@ -5,6 +5,7 @@
 #define CEPH_OS_BLUESTORE_CHECKSUMMER
 
 #include "include/buffer.h"
+#include "include/crc32c.h"
 #include "xxHash/xxhash.h"
 
 class Checksummer {
@@ -56,6 +57,31 @@ public:
     }
   }
 
+  /// max csum values computed per calc_many() pass during verify
+  static const size_t VERIFY_BATCH = 64;
+
+  // crc32c of many contiguous blocks, truncated to T
+  template<class T>
+  static void crc32c_many(
+    size_t len,
+    size_t blocks,
+    const char *data,
+    T *out,
+    uint32_t mask
+    ) {
+    uint32_t v[VERIFY_BATCH];
+    while (blocks > 0) {
+      size_t n = std::min(blocks, VERIFY_BATCH);
+      ceph_crc32c_multi(-1, (const unsigned char*)data, len, n, v);
+      for (size_t i = 0; i < n; ++i) {
+	out[i] = v[i] & mask;
+      }
+      data += n * len;
+      out += n;
+      blocks -= n;
+    }
+  }
+
   struct crc32c {
     typedef __le32 value_t;
 
@@ -73,6 +99,16 @@ public:
       ) {
       return p.crc32c(len, -1);
     }
+
+    static void calc_many(
+      state_t state,
+      size_t len,
+      size_t blocks,
+      const char *data,
+      value_t *out
+      ) {
+      crc32c_many(len, blocks, data, out, 0xffffffff);
+    }
   };
 
   struct crc32c_16 {
@@ -92,6 +128,16 @@ public:
       ) {
       return p.crc32c(len, -1) & 0xffff;
     }
+
+    static void calc_many(
+      state_t state,
+      size_t len,
+      size_t blocks,
+      const char *data,
+      value_t *out
+      ) {
+      crc32c_many(len, blocks, data, out, 0xffff);
+    }
   };
 
   struct crc32c_8 {
@@ -111,6 +157,16 @@ public:
       ) {
       return p.crc32c(len, -1) & 0xff;
     }
+
+    static void calc_many(
+      state_t state,
+      size_t len,
+      size_t blocks,
+      const char *data,
+      value_t *out
+      ) {
+      crc32c_many(len, blocks, data, out, 0xff);
+    }
   };
 
   struct xxhash32 {
@@ -138,6 +194,20 @@ public:
       }
       return XXH32_digest(state);
     }
+
+    static void calc_many(
+      state_t state,
+      size_t len,
+      size_t blocks,
+      const char *data,
+      value_t *out
+      ) {
+      // the one-shot hash skips the streaming state entirely
+      while (blocks--) {
+	*out++ = XXH32(data, len, -1);
+	data += len;
+      }
+    }
   };
 
   struct xxhash64 {
@@ -165,8 +235,49 @@ public:
       }
       return XXH64_digest(state);
     }
+
+    static void calc_many(
+      state_t state,
+      size_t len,
+      size_t blocks,
+      const char *data,
+      value_t *out
+      ) {
+      while (blocks--) {
+	*out++ = XXH64(data, len, -1);
+	data += len;
+      }
+    }
   };
 
+  /**
+   * Checksum up to @blocks csum blocks at @p into @out
+   *
+   * Whole blocks that are contiguous in memory are handed to
+   * Alg::calc_many in one go; a block straddling two buffers is done on
+   * its own.  Advances @p past the blocks done and returns how many.
+   */
+  template<class Alg>
+  static size_t calc_blocks(
+    typename Alg::state_t state,
+    size_t csum_block_size,
+    size_t blocks,
+    bufferlist::const_iterator& p,
+    typename Alg::value_t *out
+    ) {
+    const char *data;
+    bufferlist::const_iterator q = p;
+    size_t l = q.get_ptr_and_advance(blocks * csum_block_size, &data);
+    size_t n = l / csum_block_size;
+    if (n) {
+      Alg::calc_many(state, csum_block_size, n, data, out);
+      p.advance(n * csum_block_size);
+      return n;
+    }
+    *out = Alg::calc(state, csum_block_size, p);
+    return 1;
+  }
+
   template<class Alg>
   static int calculate(
     size_t csum_block_size,
@@ -189,9 +300,10 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, csum_block_size, p);
-      ++pv;
+    while (blocks) {
+      size_t n = calc_blocks<Alg>(state, csum_block_size, blocks, p, pv);
+      pv += n;
+      blocks -= n;
     }
     Alg::fini(&state);
     return 0;
@@ -217,17 +329,23 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
-    while (length > 0) {
-      typename Alg::value_t v = Alg::calc(state, csum_block_size, p);
-      if (*pv != v) {
-	if (bad_csum) {
-	  *bad_csum = v;
+    size_t blocks = length / csum_block_size;
+    typename Alg::value_t v[VERIFY_BATCH];
+    while (blocks > 0) {
+      size_t n = calc_blocks<Alg>(state, csum_block_size,
+				  std::min(blocks, VERIFY_BATCH), p, v);
+      for (size_t i = 0; i < n; ++i) {
+	if (pv[i] != v[i]) {
+	  if (bad_csum) {
+	    *bad_csum = v[i];
+	  }
+	  Alg::fini(&state);
+	  return pos + i * csum_block_size;
 	}
-	return pos;
       }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
+      pv += n;
+      pos += n * csum_block_size;
+      blocks -= n;
     }
     Alg::fini(&state);
     return -1;  // no errors
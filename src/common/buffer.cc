@@ -33,7 +33,9 @@
 #endif
 
 #include <errno.h>
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 #include <sys/uio.h>
 #include <limits.h>
@@ -241,6 +243,147 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
 
   MEMPOOL_DEFINE_FACTORY(char, char, buffer_data);
 
+  /*
+   * Per-thread caches of page aligned data buffers in a few common sizes,
+   * so that small ops don't hit the allocator on every message and read.
+   * A buffer freed by another thread is handed back to the cache of the
+   * thread that allocated it.  Cached buffers stay allocated from, and
+   * accounted in, mempool::buffer_data.  Set CEPH_BUFFER_NO_SLAB to
+   * bypass the caches.
+   */
+  namespace {
+  const int SLAB_CLASSES = 3;
+  const unsigned slab_size[SLAB_CLASSES] = { 4096, 8192, 65536 };
+  // at most 1MB of each class cached per thread
+  const unsigned slab_max[SLAB_CLASSES] = { 256, 128, 16 };
+  const bool buffer_slab_disabled = get_env_bool("CEPH_BUFFER_NO_SLAB");
+
+  int slab_class(unsigned len, unsigned align) {
+    if (buffer_slab_disabled || align > CEPH_PAGE_SIZE)
+      return -1;
+    for (int c = 0; c < SLAB_CLASSES; ++c) {
+      if (len == slab_size[c])
+	return c;
+    }
+    return -1;
+  }
+
+  char *slab_allocate(int c) {
+    char *p = mempool::buffer_data::alloc_char.allocate_aligned(
+      slab_size[c], CEPH_PAGE_SIZE);
+    if (!p)
+      throw bad_alloc();
+    return p;
+  }
+
+  void slab_deallocate(int c, char *p) {
+    mempool::buffer_data::alloc_char.deallocate_aligned(p, slab_size[c]);
+  }
+
+  struct buffer_slab {
+    std::vector<char*> local[SLAB_CLASSES];   ///< owner thread only
+    std::mutex remote_lock;
+    std::vector<char*> remote[SLAB_CLASSES];  ///< freed by other threads
+    std::atomic<unsigned> num_remote = {0};
+    bool orphan = false;  ///< no owner thread; protected by remote_lock
+
+    char *get(int c) {
+      if (local[c].empty() && num_remote.load(std::memory_order_relaxed))
+	reap_remote();
+      if (local[c].empty())
+	return slab_allocate(c);
+      char *p = local[c].back();
+      local[c].pop_back();
+      return p;
+    }
+
+    void put_local(int c, char *p) {
+      if (local[c].size() < slab_max[c])
+	local[c].push_back(p);
+      else
+	slab_deallocate(c, p);
+    }
+
+    void put_remote(int c, char *p) {
+      std::lock_guard<std::mutex> l(remote_lock);
+      if (orphan || remote[c].size() >= slab_max[c]) {
+	slab_deallocate(c, p);
+	return;
+      }
+      remote[c].push_back(p);
+      ++num_remote;
+    }
+
+    void reap_remote() {
+      std::lock_guard<std::mutex> l(remote_lock);
+      for (int c = 0; c < SLAB_CLASSES; ++c) {
+	for (auto p : remote[c])
+	  put_local(c, p);
+	remote[c].clear();
+      }
+      num_remote = 0;
+    }
+
+    void release() {
+      std::lock_guard<std::mutex> l(remote_lock);
+      orphan = true;
+      for (int c = 0; c < SLAB_CLASSES; ++c) {
+	for (auto p : local[c])
+	  slab_deallocate(c, p);
+	local[c].clear();
+	for (auto p : remote[c])
+	  slab_deallocate(c, p);
+	remote[c].clear();
+      }
+      num_remote = 0;
+    }
+  };
+
+  // buffers may outlive the thread that allocated them, so slabs are
+  // never freed; those of exited threads are handed to new threads.
+  std::mutex slab_orphans_lock;
+  std::vector<buffer_slab*> slab_orphans;
+
+  __thread buffer_slab *tls_slab = nullptr;
+  __thread bool tls_slab_exited = false;
+
+  struct buffer_slab_owner {
+    buffer_slab *slab = nullptr;
+    ~buffer_slab_owner() {
+      tls_slab = nullptr;
+      tls_slab_exited = true;
+      if (slab) {
+	slab->release();
+	std::lock_guard<std::mutex> l(slab_orphans_lock);
+	slab_orphans.push_back(slab);
+      }
+    }
+  };
+  thread_local buffer_slab_owner slab_owner;
+
+  buffer_slab *get_tls_slab() {
+    if (tls_slab || tls_slab_exited)
+      return tls_slab;
+    buffer_slab *s = nullptr;
+    {
+      std::lock_guard<std::mutex> l(slab_orphans_lock);
+      if (!slab_orphans.empty()) {
+	s = slab_orphans.back();
+	slab_orphans.pop_back();
+      }
+    }
+    if (s) {
+      std::lock_guard<std::mutex> l(s->remote_lock);
+      s->orphan = false;
+    } else {
+      s = new buffer_slab;
+    }
+    slab_owner.slab = s;
+    tls_slab = s;
+    return s;
+  }
+  }
+
   /*
    * raw_combined is always placed within a single allocation along
    * with the data buffer.  the data goes at the beginning, and
@@ -344,13 +487,20 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
 
   class buffer::raw_posix_aligned : public buffer::raw {
     unsigned align;
+    int slab;              ///< slab class of data, or -1
+    buffer_slab *owner;    ///< slab data came from, if any
   public:
     MEMPOOL_CLASS_HELPERS();
 
     raw_posix_aligned(unsigned l, unsigned _align) : raw(l) {
       align = _align;
       assert((align >= sizeof(void *)) && (align & (align - 1)) == 0);
-      data = mempool::buffer_data::alloc_char.allocate_aligned(len, align);
+      slab = slab_class(len, align);
+      owner = slab >= 0 ? get_tls_slab() : nullptr;
+      if (owner)
+	data = owner->get(slab);
+      else
+	data = mempool::buffer_data::alloc_char.allocate_aligned(len, align);
       if (!data)
 	throw bad_alloc();
       inc_total_alloc(len);
@@ -358,7 +508,12 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
       bdout << "raw_posix_aligned " << this << " alloc " << (void *)data << " l=" << l << ", align=" << align << " total_alloc=" << buffer::get_total_alloc() << bendl;
     }
     ~raw_posix_aligned() {
-      mempool::buffer_data::alloc_char.deallocate_aligned(data, len);
+      if (!owner)
+	mempool::buffer_data::alloc_char.deallocate_aligned(data, len);
+      else if (owner == tls_slab)
+	owner->put_local(slab, data);
+      else
+	owner->put_remote(slab, data);
       dec_total_alloc(len);
       bdout << "raw_posix_aligned " << this << " free " << (void *)data << " " << buffer::get_total_alloc() << bendl;
     }
@@ -739,8 +894,11 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     //
     // I also see better performance from a separate buffer::raw once the
     // size passes 8KB.
+    //
+    // Buffers of the sizes the slab caches keep go there as well.
     if ((align & ~CEPH_PAGE_MASK) == 0 ||
-	len >= CEPH_PAGE_SIZE * 2) {
+	len >= CEPH_PAGE_SIZE * 2 ||
+	slab_class(len, align) >= 0) {
 #ifndef __CYGWIN__
       return new raw_posix_aligned(len, align);
 #else
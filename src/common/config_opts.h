@@ -188,6 +188,10 @@ OPTION(ms_die_on_unhandled_msg, OPT_BOOL, false)
 OPTION(ms_die_on_old_message, OPT_BOOL, false)     // assert if we get a dup incoming message and shouldn't have (may be triggered by pre-541cd3c64be0dfa04e8a2df39422e0eb9541a428 code)
 OPTION(ms_die_on_skipped_message, OPT_BOOL, false)  // assert if we skip a seq (kernel client does this intentionally)
 OPTION(ms_dispatch_throttle_bytes, OPT_U64, 100 << 20)
+// dispatch threads for messages that can't be fast dispatched; each
+// connection sticks to one of them.  Only for daemons whose Dispatchers
+// take their own locks in ms_dispatch.
+OPTION(ms_dispatch_shards, OPT_INT, 1)
 OPTION(ms_bind_ipv6, OPT_BOOL, false)
 OPTION(ms_bind_port_min, OPT_INT, 6800)
 OPTION(ms_bind_port_max, OPT_INT, 7300)
@@ -223,6 +227,21 @@ OPTION(ms_async_set_affinity, OPT_BOOL, true)
 // core
 OPTION(ms_async_affinity_cores, OPT_STR, "")
 OPTION(ms_async_send_inline, OPT_BOOL, false)
+// transmit with MSG_ZEROCOPY (posix stack, linux 4.14+); the kernel then
+// pins the pages of sends at least ms_async_zerocopy_min_bytes long
+// instead of copying them
+OPTION(ms_async_zerocopy_send, OPT_BOOL, false)
+OPTION(ms_async_zerocopy_min_bytes, OPT_U64, 65536)
+// on-wire compression (async messenger): asked for when connecting and
+// agreed to when accepting unless set to "none"; the connecting side's
+// algorithm (snappy, zlib, zstd) is used if the accepting side has it
+OPTION(ms_compression_algorithm, OPT_STR, "none")
+// only fronts and data payloads at least this long are compressed
+OPTION(ms_compression_min_size, OPT_U32, 65536)
+// comma separated list of networks (e.g. "10.1.0.0/16, 10.2.0.0/16");
+// connections to peers within any of them are never compressed, so
+// that only traffic leaving the local site pays for compression
+OPTION(ms_compression_local_networks, OPT_STR, "")
 OPTION(ms_async_rdma_device_name, OPT_STR, "")
 OPTION(ms_async_rdma_enable_hugepage, OPT_BOOL, false)
 OPTION(ms_async_rdma_buffer_size, OPT_INT, 8192)
@@ -472,6 +491,7 @@ OPTION(objecter_completion_locks_per_session, OPT_U64, 32) // num of completion
 OPTION(objecter_inject_no_watch_ping, OPT_BOOL, false)   // suppress watch pings
 OPTION(objecter_retry_writes_after_first_reply, OPT_BOOL, false)   // ignore the first reply for each write, and resend the osd op instead
 OPTION(objecter_debug_inject_relock_delay, OPT_BOOL, false)
+OPTION(objecter_fast_submit, OPT_BOOL, true) // target and send ops, and look up the session of replies, against a published copy of the osdmap and sessions rather than under the objecter's rwlock
 
 // Max number of deletes at once in a single Filer::purge call
 OPTION(filer_max_purge_ops, OPT_U32, 10)
@@ -720,6 +740,9 @@ OPTION(osd_map_max_advance, OPT_INT, 150) // make this < cache_size!
 OPTION(osd_map_cache_size, OPT_INT, 200)
 OPTION(osd_map_message_max, OPT_INT, 100)  // max maps per MOSDMap message
 OPTION(osd_map_share_max_epochs, OPT_INT, 100)  // cap on # of inc maps we send to peers, clients
+// if > 0, OSDs and clients keep a precomputed pg mapping of each new osdmap,
+// updated incrementally between epochs and computed with this many threads
+OPTION(osd_map_pg_mapping_threads, OPT_INT, 0)
 OPTION(osd_inject_bad_map_crc_probability, OPT_FLOAT, 0)
 OPTION(osd_inject_failure_on_pg_removal, OPT_BOOL, false)
 // shutdown the OSD if stuatus flipping more than max_markdown_count times in recent max_markdown_period seconds
@@ -737,14 +760,37 @@ OPTION(osd_recovery_threads, OPT_INT, 1)
 OPTION(osd_recover_clone_overlap, OPT_BOOL, true)   // preserve clone_overlap during recovery/migration
 OPTION(osd_op_num_threads_per_shard, OPT_INT, 2)
 OPTION(osd_op_num_shards, OPT_INT, 5)
-OPTION(osd_op_queue, OPT_STR, "wpq") // PrioritzedQueue (prio), Weighted Priority Queue (wpq), or debug_random
+OPTION(osd_op_queue, OPT_STR, "wpq") // PrioritzedQueue (prio), Weighted Priority Queue (wpq), mClock by op class (mclock_opclass), or debug_random
 OPTION(osd_op_queue_cut_off, OPT_STR, "low") // Min priority to go to strict queue. (low, high, debug_random)
 
+// mclock_opclass reservation (ops/s), weight and limit (ops/s, 0 = none)
+// for each class of work
+OPTION(osd_op_queue_mclock_client_op_res, OPT_DOUBLE, 1000.0)
+OPTION(osd_op_queue_mclock_client_op_wgt, OPT_DOUBLE, 500.0)
+OPTION(osd_op_queue_mclock_client_op_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_osd_subop_res, OPT_DOUBLE, 1000.0)
+OPTION(osd_op_queue_mclock_osd_subop_wgt, OPT_DOUBLE, 500.0)
+OPTION(osd_op_queue_mclock_osd_subop_lim, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_snap_res, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_snap_wgt, OPT_DOUBLE, 1.0)
+OPTION(osd_op_queue_mclock_snap_lim, OPT_DOUBLE, 0.001)
+OPTION(osd_op_queue_mclock_recov_res, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_recov_wgt, OPT_DOUBLE, 1.0)
+OPTION(osd_op_queue_mclock_recov_lim, OPT_DOUBLE, 0.001)
+OPTION(osd_op_queue_mclock_scrub_res, OPT_DOUBLE, 0.0)
+OPTION(osd_op_queue_mclock_scrub_wgt, OPT_DOUBLE, 1.0)
+OPTION(osd_op_queue_mclock_scrub_lim, OPT_DOUBLE, 0.001)
+
 // Set to true for testing.  Users should NOT set this.
 // If set to true even after reading enough shards to
 // decode the object, any error will be reported.
 OPTION(osd_read_ec_check_for_errors, OPT_BOOL, false) // return error if any ec shard has an error
 
+// Overwrite a few data chunks of an EC stripe by updating the coding
+// chunks from the change of the data (if the plugin supports it),
+// instead of reading and re-encoding the whole stripe.
+OPTION(osd_ec_parity_delta_write, OPT_BOOL, true)
+
 // Only use clone_overlap for recovery if there are fewer than
 // osd_recover_clone_overlap_limit entries in the overlap set
 OPTION(osd_recover_clone_overlap_limit, OPT_INT, 10)
@@ -812,6 +858,8 @@ OPTION(osd_scrub_auto_repair_num_errors, OPT_U32, 5)   // only auto-repair when
 OPTION(osd_deep_scrub_interval, OPT_FLOAT, 60*60*24*7) // once a week
 OPTION(osd_deep_scrub_randomize_ratio, OPT_FLOAT, 0.15) // scrubs will randomly become deep scrubs at this rate (0.15 -> 15% of scrubs are deep)
 OPTION(osd_deep_scrub_stride, OPT_INT, 524288)
+OPTION(osd_deep_scrub_checksum_only, OPT_BOOL, false) // digest object data with ObjectStore::scrub_crc32c instead of reading and hashing it
+OPTION(osd_deep_scrub_max_bytes_per_sec, OPT_U64, 0) // cap on deep scrub data read rate shared by all pgs on the osd (0 = unlimited)
 OPTION(osd_deep_scrub_update_digest_min_age, OPT_INT, 2*60*60)   // objects must be this old (seconds) before we update the whole-object digest on scrub
 OPTION(osd_scan_list_ping_tp_interval, OPT_U64, 100)
 OPTION(osd_class_dir, OPT_STR, CEPH_LIBDIR "/rados-classes") // where rados plugins are stored
@@ -828,6 +876,7 @@ OPTION(osd_kill_backfill_at, OPT_INT, 0)
 
 // Bounds how infrequently a new map epoch will be persisted for a pg
 OPTION(osd_pg_epoch_persisted_max_stale, OPT_U32, 150) // make this < map_cache_size!
+OPTION(osd_load_pgs_threads, OPT_INT, 4) // read pg info and logs with this many threads at boot
 
 OPTION(osd_min_pg_log_entries, OPT_U32, 3000)  // number of entries to keep in the pg log when trimming it
 OPTION(osd_max_pg_log_entries, OPT_U32, 10000) // max entries, say when degraded, before we trim
@@ -971,6 +1020,8 @@ OPTION(bdev_inject_crash_flush_delay, OPT_INT, 2) // wait N more seconds on flus
 OPTION(bdev_aio, OPT_BOOL, true)
 OPTION(bdev_aio_poll_ms, OPT_INT, 250)  // milliseconds
 OPTION(bdev_aio_max_queue_depth, OPT_INT, 32)
+OPTION(bdev_ioring, OPT_BOOL, false)  // use io_uring instead of libaio, if available
+OPTION(bdev_ioring_queues, OPT_INT, 2)  // io_uring rings, each with its own completion thread
 OPTION(bdev_block_size, OPT_INT, 4096)
 OPTION(bdev_debug_aio, OPT_BOOL, false)
 OPTION(bdev_debug_aio_suicide_timeout, OPT_FLOAT, 60.0)
@@ -992,7 +1043,7 @@ OPTION(bluefs_log_compact_min_size, OPT_U64, 16*1048576)  // before we consider
 OPTION(bluefs_min_flush_size, OPT_U64, 524288)  // ignore flush until its this big
 OPTION(bluefs_compact_log_sync, OPT_BOOL, false)  // sync or async log compaction?
 OPTION(bluefs_buffered_io, OPT_BOOL, false)
-OPTION(bluefs_allocator, OPT_STR, "bitmap")     // stupid | bitmap
+OPTION(bluefs_allocator, OPT_STR, "bitmap")     // stupid | bitmap | hybrid
 OPTION(bluefs_preextend_wal_files, OPT_BOOL, false)  // this *requires* that rocksdb has recycling enabled
 
 OPTION(bluestore_bluefs, OPT_BOOL, true)
@@ -1034,6 +1085,9 @@ OPTION(bluestore_compression_mode, OPT_STR, "none")  // force|aggressive|passive
 OPTION(bluestore_compression_algorithm, OPT_STR, "snappy")
 OPTION(bluestore_compression_min_blob_size, OPT_U32, 128*1024)
 OPTION(bluestore_compression_max_blob_size, OPT_U32, 512*1024)
+OPTION(bluestore_compression_dict_size, OPT_U32, 0)  // train a per-pool dictionary of up to this many bytes, for algorithms which support one (0 = off)
+OPTION(bluestore_compression_dict_samples, OPT_U32, 128)  // blobs sampled from a pool to train its dictionary
+OPTION(bluestore_compression_dict_sample_bytes, OPT_U64, 8*1024*1024)  // bytes of samples held for training, over all pools
 OPTION(bluestore_max_blob_size, OPT_U32, 512*1024)
 /*
  * Require the net gain of compression at least to be at this ratio,
@@ -1053,10 +1107,18 @@ OPTION(bluestore_2q_cache_kin_ratio, OPT_DOUBLE, .5)    // kin page slot size /
 OPTION(bluestore_2q_cache_kout_ratio, OPT_DOUBLE, .5)   // number of kout page slot / total number of page slot
 OPTION(bluestore_cache_size, OPT_U64, 1024*1024*1024)
 OPTION(bluestore_cache_meta_ratio, OPT_DOUBLE, .9)
+// balance bluestore_cache_size between onodes, buffers and the kv store's
+// block cache by hit rate, instead of the static ratio + rocksdb_cache_size
+OPTION(bluestore_cache_autotune, OPT_BOOL, false)
+OPTION(bluestore_cache_autotune_interval, OPT_DOUBLE, 5)
+OPTION(bluestore_cache_autotune_chunk_size, OPT_U64, 32*1024*1024) // bytes moved per interval
+OPTION(bluestore_cache_autotune_min_ratio, OPT_DOUBLE, .05) // no cache is shrunk below this share
 OPTION(bluestore_kvbackend, OPT_STR, "rocksdb")
-OPTION(bluestore_allocator, OPT_STR, "bitmap")     // stupid | bitmap
+OPTION(bluestore_allocator, OPT_STR, "bitmap")     // stupid | bitmap | hybrid
+OPTION(bluestore_hybrid_alloc_mem_cap, OPT_U64, 64*1024*1024) // hybrid: range tree memory before spilling small extents to the bitmap
 OPTION(bluestore_freelist_type, OPT_STR, "bitmap") // extent | bitmap
 OPTION(bluestore_freelist_blocks_per_key, OPT_INT, 128)
+OPTION(bluestore_freelist_load_threads, OPT_INT, 4) // scan the freelist in parallel at mount
 OPTION(bluestore_bitmapallocator_blocks_per_zone, OPT_INT, 1024) // must be power of 2 aligned, e.g., 512, 1024, 2048...
 OPTION(bluestore_bitmapallocator_span_size, OPT_INT, 1024) // must be power of 2 aligned, e.g., 512, 1024, 2048...
 OPTION(bluestore_rocksdb_options, OPT_STR, "compression=kNoCompression,max_write_buffer_number=4,min_write_buffer_number_to_merge=1,recycle_log_file_num=4,write_buffer_size=268435456,writable_file_max_buffer_size=0")
@@ -1066,11 +1128,18 @@ OPTION(bluestore_fsck_on_umount, OPT_BOOL, false)
 OPTION(bluestore_fsck_on_umount_deep, OPT_BOOL, true)
 OPTION(bluestore_fsck_on_mkfs, OPT_BOOL, true)
 OPTION(bluestore_fsck_on_mkfs_deep, OPT_BOOL, false)
+OPTION(bluestore_fsck_threads, OPT_INT, 4) // walk the object keyspace in parallel
 OPTION(bluestore_sync_submit_transaction, OPT_BOOL, false) // submit kv txn in queueing thread (not kv_sync_thread)
 OPTION(bluestore_sync_wal_apply, OPT_BOOL, true)     // perform initial wal work synchronously (possibly in combination with aio so we only *queue* ios)
 OPTION(bluestore_wal_threads, OPT_INT, 4)
 OPTION(bluestore_wal_thread_timeout, OPT_INT, 30)
 OPTION(bluestore_wal_thread_suicide_timeout, OPT_INT, 120)
+// collect wal writes for this long per sequencer, merging them into few
+// large ios (0 = pick by device type below; off unless set there)
+OPTION(bluestore_wal_batch_window, OPT_DOUBLE, 0)
+OPTION(bluestore_wal_batch_window_hdd, OPT_DOUBLE, 0)
+OPTION(bluestore_wal_batch_window_ssd, OPT_DOUBLE, 0)
+OPTION(bluestore_wal_batch_max_bytes, OPT_U64, 4*1024*1024) // submit early once this big
 OPTION(bluestore_max_ops, OPT_U64, 512)
 OPTION(bluestore_max_bytes, OPT_U64, 64*1024*1024)
 OPTION(bluestore_wal_max_ops, OPT_U64, 512)
@@ -1090,7 +1159,7 @@ OPTION(bluestore_debug_inject_read_err, OPT_BOOL, false)
 OPTION(bluestore_debug_randomize_serial_transaction, OPT_INT, 0)
 OPTION(bluestore_debug_omit_block_device_write, OPT_BOOL, false)
 OPTION(bluestore_inject_wal_apply_delay, OPT_FLOAT, 0)
-OPTION(bluestore_shard_finishers, OPT_BOOL, false)
+OPTION(bluestore_shard_finishers, OPT_BOOL, true) // one completion finisher per osd op shard, picked by sequencer
 
 OPTION(kstore_max_ops, OPT_U64, 512)
 OPTION(kstore_max_bytes, OPT_U64, 64*1024*1024)
@@ -1274,6 +1343,11 @@ OPTION(rbd_cache_target_dirty, OPT_LONGLONG, 16<<20) // target dirty limit in by
 OPTION(rbd_cache_max_dirty_age, OPT_FLOAT, 1.0)      // seconds in cache before writeback starts
 OPTION(rbd_cache_max_dirty_object, OPT_INT, 0)       // dirty limit for objects - set to 0 for auto calculate from rbd_cache_size
 OPTION(rbd_cache_block_writes_upfront, OPT_BOOL, false) // whether to block writes to the cache before the aio_write call completes (true), or block before the aio completion is called (false)
+OPTION(rbd_persistent_cache, OPT_BOOL, false) // whether to put a persistent write-back log in a local file in front of the image
+OPTION(rbd_persistent_cache_path, OPT_STR, "") // directory holding the persistent cache files (must be set to enable the cache)
+OPTION(rbd_persistent_cache_size, OPT_U64, 1 << 30) // size of each image's persistent cache file in bytes
+OPTION(rbd_persistent_cache_writeback_max_bytes, OPT_U64, 4 << 20) // max bytes written back to the image in a single coalesced request
+OPTION(rbd_persistent_cache_debug_hold_writeback, OPT_BOOL, false) // only write back the persistent cache for flushes and other barriers (for testing)
 OPTION(rbd_concurrent_management_ops, OPT_INT, 10) // how many operations can be in flight for a management operation like deleting or resizing an image
 OPTION(rbd_balance_snap_reads, OPT_BOOL, false)
 OPTION(rbd_localize_snap_reads, OPT_BOOL, false)
@@ -9,6 +9,7 @@
 #include "common/sctp_crc32.h"
 #include "common/crc32c_intel_baseline.h"
 #include "common/crc32c_intel_fast.h"
+#include "common/crc32c_intel_multi.h"
 #include "common/crc32c_aarch64.h"
 
 /*
@@ -45,3 +46,36 @@ ceph_crc32c_func_t ceph_choose_crc32(void)
  */
 ceph_crc32c_func_t ceph_crc32c_func = ceph_choose_crc32();
 
+
+/*
+ * one block at a time with the chosen single buffer implementation.
+ */
+static void ceph_crc32c_multi_generic(uint32_t crc, unsigned char const *data,
+				      unsigned block_len, unsigned blocks,
+				      uint32_t *out)
+{
+  for (unsigned i = 0; i < blocks; ++i) {
+    out[i] = ceph_crc32c(crc, data, block_len);
+    data += block_len;
+  }
+}
+
+ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void)
+{
+  ceph_arch_probe();
+
+  if (ceph_arch_intel_sse42) {
+    return ceph_crc32c_intel_multi;
+  }
+
+  return ceph_crc32c_multi_generic;
+}
+
+ceph_crc32c_multi_func_t ceph_crc32c_multi_func = ceph_choose_crc32_multi();
+
+void ceph_crc32c_shift_init(struct ceph_crc32c_shift *s, unsigned length)
+{
+  for (unsigned i = 0; i < 32; ++i) {
+    s->col[i] = ceph_crc32c(1u << i, NULL, length);
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef CEPH_COMMON_CRC32C_INTEL_MULTI_H
+#define CEPH_COMMON_CRC32C_INTEL_MULTI_H
+
+#include "include/int_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __x86_64__
+
+/*
+ * crc32c of each of @blocks consecutive @block_len byte blocks, each
+ * seeded with @crc.  requires SSE 4.2.
+ */
+extern void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *buffer,
+				    unsigned block_len, unsigned blocks,
+				    uint32_t *out);
+
+#else
+
+static inline void ceph_crc32c_intel_multi(uint32_t crc,
+					   unsigned char const *buffer,
+					   unsigned block_len, unsigned blocks,
+					   uint32_t *out)
+{
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,385 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef MCLOCK_QUEUE_H
+#define MCLOCK_QUEUE_H
+
+#include "common/Formatter.h"
+#include "common/OpQueue.h"
+#include "common/ceph_time.h"
+#include "include/assert.h"
+
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <set>
+
+/**
+ * QoS parameters of a single mClock client
+ *
+ * reservation and limit are in requests per second, weight is a
+ * relative share of whatever capacity is left once every client's
+ * reservation is met.  A zero reservation means none is guaranteed and
+ * a zero limit means the client is not capped.
+ */
+struct mClockClientInfo {
+  double reservation;
+  double weight;
+  double limit;
+
+  mClockClientInfo(double r = 0.0, double w = 1.0, double l = 0.0)
+    : reservation(r), weight(w), limit(l) {}
+};
+
+/**
+ * mClock scheduler (Gulati et al., OSDI '10)
+ *
+ * Each client (class K) carries three tags for the request at the head
+ * of its queue: a reservation tag advancing by 1/reservation, a
+ * proportional tag advancing by 1/weight and a limit tag advancing by
+ * 1/limit.  Tags never fall behind the arrival time of the request, so
+ * an idle client does not bank credit.  On dequeue:
+ *
+ *  1. the client with the smallest reservation tag that is already due
+ *     is served (constraint-based phase); its later proportional tags
+ *     are pulled back so reserved service is not charged twice;
+ *  2. otherwise, among the clients whose limit tag is due, the one with
+ *     the smallest proportional tag is served (weight-based phase);
+ *  3. otherwise every backlogged client is over its limit; since the
+ *     OpQueue interface has no way to defer, the client that becomes
+ *     eligible soonest is served anyway.
+ *
+ * Tags are computed lazily when a request reaches the head of its
+ * client's queue, so enqueue_front just inherits the head's tags.  Cost
+ * is ignored: every request is charged as one unit.
+ *
+ * enqueue_strict and enqueue_strict_front queue items which are served
+ * in strict priority order before any mClock scheduling, as with the
+ * other OpQueue implementations.
+ */
+template <typename T, typename K>
+class mClockQueue : public OpQueue <T, K>
+{
+public:
+  typedef std::function<mClockClientInfo(const K&)> ClientInfoFunc;
+
+private:
+  /// idle client records older than this (seconds) are forgotten
+  static constexpr double IDLE_AGE = 600.0;
+  /// scan for idle client records every this many dequeues
+  static const unsigned CLEAN_EVERY = 1024;
+
+  struct Request {
+    T item;
+    double arrival;
+    Request(T& i, double a) : item(i), arrival(a) {}
+  };
+
+  struct ClientRec {
+    mClockClientInfo info;
+    std::deque<Request> requests;
+    // tags of requests.front(), or of the last request served if idle
+    double r_tag = 0.0;
+    double p_tag = 0.0;
+    double l_tag = 0.0;
+    bool ready = false;   ///< limit tag is due, indexed in ready_set
+    double idle_since = 0.0;
+
+    explicit ClientRec(const mClockClientInfo& i) : info(i) {}
+  };
+
+  typedef std::pair<double, ClientRec*> TagRef;
+
+  ClientInfoFunc client_info_f;
+
+  std::map<K, ClientRec> clients;
+  std::set<TagRef> resv_set;   ///< by reservation tag, if reserved
+  std::set<TagRef> limit_set;  ///< by limit tag, not yet ready
+  std::set<TagRef> ready_set;  ///< by proportional tag
+  unsigned normal_size = 0;
+  unsigned dequeues = 0;
+
+  typedef std::list<std::pair<K, T> > StrictList;
+  std::map<unsigned, StrictList> strict;
+  unsigned strict_size = 0;
+
+  static double now() {
+    return std::chrono::duration<double>(
+      ceph::mono_clock::now().time_since_epoch()).count();
+  }
+
+  static double next_tag(double prev, double rate, double t) {
+    if (rate <= 0.0) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return std::max(prev + 1.0 / rate, t);
+  }
+
+  void assign_tags(ClientRec& c, double t) {
+    c.r_tag = next_tag(c.r_tag, c.info.reservation, t);
+    c.p_tag = next_tag(c.p_tag, c.info.weight, t);
+    c.l_tag = c.info.limit > 0.0 ? next_tag(c.l_tag, c.info.limit, t) : 0.0;
+  }
+
+  void index(ClientRec& c, double t) {
+    if (c.r_tag != std::numeric_limits<double>::infinity()) {
+      resv_set.insert(TagRef(c.r_tag, &c));
+    }
+    c.ready = c.l_tag <= t;
+    if (c.ready) {
+      ready_set.insert(TagRef(c.p_tag, &c));
+    } else {
+      limit_set.insert(TagRef(c.l_tag, &c));
+    }
+  }
+
+  void unindex(ClientRec& c) {
+    if (c.r_tag != std::numeric_limits<double>::infinity()) {
+      resv_set.erase(TagRef(c.r_tag, &c));
+    }
+    if (c.ready) {
+      ready_set.erase(TagRef(c.p_tag, &c));
+    } else {
+      limit_set.erase(TagRef(c.l_tag, &c));
+    }
+  }
+
+  ClientRec& get_client(K& cl) {
+    auto i = clients.find(cl);
+    if (i == clients.end()) {
+      i = clients.emplace(cl, ClientRec(client_info_f(cl))).first;
+    }
+    return i->second;
+  }
+
+  void clean_idle(double t) {
+    for (auto i = clients.begin(); i != clients.end(); ) {
+      if (i->second.requests.empty() &&
+	  i->second.idle_since + IDLE_AGE < t) {
+	clients.erase(i++);
+      } else {
+	++i;
+      }
+    }
+  }
+
+  void insert(K& cl, T& item, bool front) {
+    ClientRec& c = get_client(cl);
+    double t = now();
+    if (c.requests.empty()) {
+      c.requests.push_back(Request(item, t));
+      assign_tags(c, t);
+      index(c, t);
+    } else if (front) {
+      c.requests.push_front(Request(item, t));
+    } else {
+      c.requests.push_back(Request(item, t));
+    }
+    ++normal_size;
+  }
+
+  T pop_normal() {
+    double t = now();
+    ClientRec *c;
+    bool reserved = false;
+    if (!resv_set.empty() && resv_set.begin()->first <= t) {
+      c = resv_set.begin()->second;
+      reserved = true;
+    } else {
+      while (!limit_set.empty() && limit_set.begin()->first <= t) {
+	ClientRec *r = limit_set.begin()->second;
+	limit_set.erase(limit_set.begin());
+	r->ready = true;
+	ready_set.insert(TagRef(r->p_tag, r));
+      }
+      if (!ready_set.empty()) {
+	c = ready_set.begin()->second;
+      } else {
+	assert(!limit_set.empty());
+	c = limit_set.begin()->second;
+      }
+    }
+
+    unindex(*c);
+    T ret = c->requests.front().item;
+    c->requests.pop_front();
+    --normal_size;
+    if (reserved && c->info.weight > 0.0) {
+      c->p_tag -= 1.0 / c->info.weight;
+    }
+    if (!c->requests.empty()) {
+      assign_tags(*c, c->requests.front().arrival);
+      index(*c, t);
+    } else {
+      c->idle_since = t;
+    }
+
+    if (++dequeues % CLEAN_EVERY == 0) {
+      clean_idle(t);
+    }
+    return ret;
+  }
+
+public:
+  explicit mClockQueue(ClientInfoFunc info_f)
+    : client_info_f(info_f) {}
+
+  unsigned length() const override final {
+    return strict_size + normal_size;
+  }
+
+  void remove_by_filter(std::function<bool (T)> f) override final {
+    for (auto& p : clients) {
+      ClientRec& c = p.second;
+      if (c.requests.empty()) {
+	continue;
+      }
+      for (auto i = c.requests.begin(); i != c.requests.end(); ) {
+	if (f(i->item)) {
+	  i = c.requests.erase(i);
+	  --normal_size;
+	} else {
+	  ++i;
+	}
+      }
+      if (c.requests.empty()) {
+	unindex(c);
+	c.idle_since = now();
+      }
+    }
+    for (auto p = strict.begin(); p != strict.end(); ) {
+      for (auto i = p->second.begin(); i != p->second.end(); ) {
+	if (f(i->second)) {
+	  i = p->second.erase(i);
+	  --strict_size;
+	} else {
+	  ++i;
+	}
+      }
+      if (p->second.empty()) {
+	strict.erase(p++);
+      } else {
+	++p;
+      }
+    }
+  }
+
+  void remove_by_class(K cl, std::list<T> *out = 0) override final {
+    for (auto p = strict.begin(); p != strict.end(); ) {
+      for (auto i = p->second.begin(); i != p->second.end(); ) {
+	if (i->first == cl) {
+	  if (out) {
+	    out->push_back(i->second);
+	  }
+	  i = p->second.erase(i);
+	  --strict_size;
+	} else {
+	  ++i;
+	}
+      }
+      if (p->second.empty()) {
+	strict.erase(p++);
+      } else {
+	++p;
+      }
+    }
+    auto i = clients.find(cl);
+    if (i == clients.end()) {
+      return;
+    }
+    ClientRec& c = i->second;
+    if (!c.requests.empty()) {
+      unindex(c);
+      normal_size -= c.requests.size();
+      if (out) {
+	for (auto& r : c.requests) {
+	  out->push_back(r.item);
+	}
+      }
+    }
+    clients.erase(i);
+  }
+
+  bool empty() const override final {
+    return !(strict_size + normal_size);
+  }
+
+  void enqueue_strict(K cl, unsigned priority, T item) override final {
+    strict[priority].push_back(std::make_pair(cl, item));
+    ++strict_size;
+  }
+
+  void enqueue_strict_front(K cl, unsigned priority, T item) override final {
+    strict[priority].push_front(std::make_pair(cl, item));
+    ++strict_size;
+  }
+
+  void enqueue(K cl, unsigned priority, unsigned cost, T item) override final {
+    insert(cl, item, false);
+  }
+
+  void enqueue_front(K cl, unsigned priority, unsigned cost,
+		     T item) override final {
+    insert(cl, item, true);
+  }
+
+  T dequeue() override final {
+    assert(strict_size + normal_size > 0);
+    if (!strict.empty()) {
+      auto p = --strict.end();
+      T ret = p->second.front().second;
+      p->second.pop_front();
+      if (p->second.empty()) {
+	strict.erase(p);
+      }
+      --strict_size;
+      return ret;
+    }
+    return pop_normal();
+  }
+
+  void dump(ceph::Formatter *f) const override final {
+    f->dump_int("strict_size", strict_size);
+    f->open_array_section("strict_queues");
+    for (auto& p : strict) {
+      f->open_object_section("subqueue");
+      f->dump_int("priority", p.first);
+      f->dump_int("size", p.second.size());
+      f->close_section();
+    }
+    f->close_section();
+    f->dump_int("size", normal_size);
+    f->dump_int("num_clients", clients.size());
+    f->open_array_section("clients");
+    for (auto& p : clients) {
+      const ClientRec& c = p.second;
+      if (c.requests.empty()) {
+	continue;
+      }
+      f->open_object_section("client");
+      f->dump_int("size", c.requests.size());
+      f->dump_float("reservation", c.info.reservation);
+      f->dump_float("weight", c.info.weight);
+      f->dump_float("limit", c.info.limit);
+      f->dump_float("r_tag", c.r_tag);
+      f->dump_float("p_tag", c.p_tag);
+      f->dump_float("l_tag", c.l_tag);
+      f->dump_bool("ready", c.ready);
+      f->close_section();
+    }
+    f->close_section();
+  }
+};
+
+#endif
@@ -13,6 +13,7 @@
  */
 
 #include <random>
+#include "acconfig.h"
 #include "Compressor.h"
 #include "CompressionPlugin.h"
 #include "common/dout.h"
@@ -23,6 +24,7 @@ const char * Compressor::get_comp_alg_name(int a) {
   case COMP_ALG_SNAPPY: return "snappy";
   case COMP_ALG_ZLIB: return "zlib";
   case COMP_ALG_ZSTD: return "zstd";
+  case COMP_ALG_LZ4: return "lz4";
   default: return "???";
   }
 }
@@ -34,6 +36,8 @@ boost::optional<Compressor::CompressionAlgorithm> Compressor::get_comp_alg_type(
     return COMP_ALG_ZLIB;
   if (s == "zstd")
     return COMP_ALG_ZSTD;
+  if (s == "lz4")
+    return COMP_ALG_LZ4;
   if (s == "")
     return COMP_ALG_NONE;
 
@@ -78,6 +82,11 @@ CompressorRef Compressor::create(CephContext *cct, const std::string &type)
     if (alg == COMP_ALG_NONE) {
       return nullptr;
     }
+#ifndef HAVE_LZ4
+    if (alg == COMP_ALG_LZ4) {
+      return nullptr;
+    }
+#endif
     return create(cct, alg);
   }
 
@@ -15,7 +15,9 @@
 #ifndef CEPH_COMPRESSOR_H
 #define CEPH_COMPRESSOR_H
 
+#include <errno.h>
 #include <string>
+#include <vector>
 #include <boost/optional.hpp>
 #include "include/memory.h"
 #include "include/buffer.h"
@@ -30,6 +32,7 @@ public:
     COMP_ALG_SNAPPY = 1,
     COMP_ALG_ZLIB = 2,
     COMP_ALG_ZSTD = 3,
+    COMP_ALG_LZ4 = 4,
     COMP_ALG_LAST	//the last value for range checks
   };
   // compression options
@@ -61,6 +64,39 @@ public:
   // alignment with decode methods
   virtual int decompress(bufferlist::iterator &p, size_t compressed_len, bufferlist &out) = 0;
 
+  /**
+   * Trained dictionaries
+   *
+   * Small buffers of similar data compress much better when both sides
+   * share a dictionary trained on samples of that data.  A raw
+   * dictionary, as returned by train_dictionary(), is only meaningful
+   * to the algorithm which trained it; load_dictionary() prepares it
+   * for use by the *_with_dict() calls.  Algorithms without dictionary
+   * support return -EOPNOTSUPP / a null ref.
+   */
+  class Dictionary {
+  public:
+    virtual ~Dictionary() {}
+  };
+  typedef std::shared_ptr<Dictionary> DictionaryRef;
+
+  virtual int train_dictionary(const std::vector<bufferlist> &samples,
+			       size_t max_len, bufferlist *dict) {
+    return -EOPNOTSUPP;
+  }
+  virtual DictionaryRef load_dictionary(const bufferlist &dict) {
+    return DictionaryRef();
+  }
+  virtual int compress_with_dict(const bufferlist &in, bufferlist &out,
+				 const Dictionary &dict) {
+    return -EOPNOTSUPP;
+  }
+  virtual int decompress_with_dict(bufferlist::iterator &p,
+				   size_t compressed_len, bufferlist &out,
+				   const Dictionary &dict) {
+    return -EOPNOTSUPP;
+  }
+
   static CompressorRef create(CephContext *cct, const std::string &type);
   static CompressorRef create(CephContext *cct, int alg);
 
@@ -0,0 +1,180 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_LZ4COMPRESSOR_H
+#define CEPH_LZ4COMPRESSOR_H
+
+#include <lz4.h>
+
+#include "include/buffer.h"
+#include "include/encoding.h"
+#include "compressor/Compressor.h"
+
+// LZ4 only looks back this far, so a longer dictionary is wasted
+#define LZ4_MAX_DICT_LEN 65536
+
+/**
+ * LZ4 block compression
+ *
+ * Each buffer of the input is compressed as one block of a single LZ4
+ * stream, so later blocks can refer back to earlier ones without the
+ * input having to be made contiguous.  The output is the block count,
+ * the (original, compressed) length of every block, then the blocks.
+ *
+ * LZ4 dictionaries are raw content: training keeps the tail of the
+ * concatenated samples.
+ */
+class LZ4Compressor : public Compressor {
+ public:
+  LZ4Compressor() : Compressor(COMP_ALG_LZ4, "lz4") {}
+
+  int compress(const bufferlist &src, bufferlist &dst) override {
+    return _compress(src, dst, nullptr);
+  }
+
+  int decompress(const bufferlist &src, bufferlist &dst) override {
+    bufferlist::iterator i = const_cast<bufferlist&>(src).begin();
+    return decompress(i, src.length(), dst);
+  }
+
+  int decompress(bufferlist::iterator &p,
+		 size_t compressed_len,
+		 bufferlist &dst) override {
+    return _decompress(p, compressed_len, dst, nullptr);
+  }
+
+  struct LZ4Dictionary : public Dictionary {
+    bufferptr data;
+    explicit LZ4Dictionary(const bufferptr& d) : data(d) {}
+  };
+
+  int train_dictionary(const std::vector<bufferlist> &samples,
+		       size_t max_len, bufferlist *dict) override {
+    bufferlist all;
+    for (auto& s : samples) {
+      all.append(s);
+    }
+    if (!all.length()) {
+      return -EINVAL;
+    }
+    size_t len = std::min<size_t>(all.length(),
+				  std::min<size_t>(max_len, LZ4_MAX_DICT_LEN));
+    dict->substr_of(all, all.length() - len, len);
+    return 0;
+  }
+
+  DictionaryRef load_dictionary(const bufferlist &dict) override {
+    if (!dict.length() || dict.length() > LZ4_MAX_DICT_LEN) {
+      return DictionaryRef();
+    }
+    bufferptr d(dict.length());
+    dict.copy(0, dict.length(), d.c_str());
+    return DictionaryRef(new LZ4Dictionary(d));
+  }
+
+  int compress_with_dict(const bufferlist &src, bufferlist &dst,
+			 const Dictionary &dict) override {
+    return _compress(src, dst, static_cast<const LZ4Dictionary*>(&dict));
+  }
+
+  int decompress_with_dict(bufferlist::iterator &p,
+			   size_t compressed_len,
+			   bufferlist &dst,
+			   const Dictionary &dict) override {
+    return _decompress(p, compressed_len, dst,
+		       static_cast<const LZ4Dictionary*>(&dict));
+  }
+
+ private:
+  int _compress(const bufferlist &src, bufferlist &dst,
+		const LZ4Dictionary *dict) {
+    size_t bound = 0;
+    for (auto& b : src.buffers()) {
+      bound += LZ4_compressBound(b.length());
+    }
+    bufferptr outptr = buffer::create_page_aligned(bound);
+
+    LZ4_stream_t s;
+    LZ4_resetStream(&s);
+    if (dict) {
+      LZ4_loadDict(&s, dict->data.c_str(), dict->data.length());
+    }
+
+    ::encode((uint32_t)src.get_num_buffers(), dst);
+    size_t pos = 0;
+    for (auto& b : src.buffers()) {
+      int r = LZ4_compress_fast_continue(
+	&s, b.c_str(), outptr.c_str() + pos, b.length(),
+	outptr.length() - pos, 1);
+      if (r <= 0) {
+	return -1;
+      }
+      ::encode((uint32_t)b.length(), dst);
+      ::encode((uint32_t)r, dst);
+      pos += r;
+    }
+    dst.append(outptr, 0, pos);
+    return 0;
+  }
+
+  int _decompress(bufferlist::iterator &p,
+		  size_t compressed_len,
+		  bufferlist &dst,
+		  const LZ4Dictionary *dict) {
+    if (compressed_len < 4) {
+      return -1;
+    }
+    uint32_t count;
+    ::decode(count, p);
+    compressed_len -= 4;
+    if (compressed_len < (uint64_t)count * 8) {
+      return -1;
+    }
+    std::vector<std::pair<uint32_t, uint32_t> > blocks(count);
+    uint64_t total_origin = 0, total_compressed = 0;
+    for (auto& b : blocks) {
+      ::decode(b.first, p);
+      ::decode(b.second, p);
+      total_origin += b.first;
+      total_compressed += b.second;
+    }
+    compressed_len -= count * 8;
+    if (total_compressed > compressed_len) {
+      return -1;
+    }
+
+    bufferlist in;
+    p.copy(total_compressed, in);
+    const char *c = in.c_str();
+    bufferptr dstptr(total_origin);
+
+    LZ4_streamDecode_t s;
+    if (dict) {
+      LZ4_setStreamDecode(&s, dict->data.c_str(), dict->data.length());
+    } else {
+      LZ4_setStreamDecode(&s, nullptr, 0);
+    }
+    char *out = dstptr.c_str();
+    for (auto& b : blocks) {
+      int r = LZ4_decompress_safe_continue(&s, c, out, b.second, b.first);
+      if (r < 0 || (uint32_t)r != b.first) {
+	return -1;
+      }
+      c += b.second;
+      out += b.first;
+    }
+    dst.append(dstptr);
+    return 0;
+  }
+};
+
+#endif
@@ -15,7 +15,9 @@
 #ifndef CEPH_ZSTDCOMPRESSOR_H
 #define CEPH_ZSTDCOMPRESSOR_H
 
+#define ZSTD_STATIC_LINKING_ONLY
 #include "zstd/lib/zstd.h"
+#include "zstd/lib/dictBuilder/zdict.h"
 #include "include/buffer.h"
 #include "include/encoding.h"
 #include "compressor/Compressor.h"
@@ -27,6 +29,77 @@ class ZstdCompressor : public Compressor {
   ZstdCompressor() : Compressor(COMP_ALG_ZSTD, "zstd") {}
 
   int compress(const bufferlist &src, bufferlist &dst) override {
+    return _compress(src, dst, nullptr);
+  }
+
+  int decompress(const bufferlist &src, bufferlist &dst) override {
+    bufferlist::iterator i = const_cast<bufferlist&>(src).begin();
+    return decompress(i, src.length(), dst);
+  }
+
+  int decompress(bufferlist::iterator &p,
+		 size_t compressed_len,
+		 bufferlist &dst) override {
+    return _decompress(p, compressed_len, dst, nullptr);
+  }
+
+  struct ZstdDictionary : public Dictionary {
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    ZstdDictionary(ZSTD_CDict *c, ZSTD_DDict *d) : cdict(c), ddict(d) {}
+    ~ZstdDictionary() override {
+      ZSTD_freeCDict(cdict);
+      ZSTD_freeDDict(ddict);
+    }
+  };
+
+  int train_dictionary(const std::vector<bufferlist> &samples,
+		       size_t max_len, bufferlist *dict) override {
+    bufferlist all;
+    std::vector<size_t> sizes;
+    for (auto& s : samples) {
+      all.append(s);
+      sizes.push_back(s.length());
+    }
+    bufferptr dictptr(max_len);
+    size_t r = ZDICT_trainFromBuffer(dictptr.c_str(), dictptr.length(),
+				     all.c_str(), sizes.data(), sizes.size());
+    if (ZDICT_isError(r)) {
+      return -EINVAL;
+    }
+    dict->append(dictptr, 0, r);
+    return 0;
+  }
+
+  DictionaryRef load_dictionary(const bufferlist &dict) override {
+    // both copy the dictionary content
+    bufferlist t = dict;
+    ZSTD_CDict *c = ZSTD_createCDict(t.c_str(), t.length(), COMPRESSION_LEVEL);
+    ZSTD_DDict *d = ZSTD_createDDict(t.c_str(), t.length());
+    if (!c || !d) {
+      ZSTD_freeCDict(c);
+      ZSTD_freeDDict(d);
+      return DictionaryRef();
+    }
+    return DictionaryRef(new ZstdDictionary(c, d));
+  }
+
+  int compress_with_dict(const bufferlist &src, bufferlist &dst,
+			 const Dictionary &dict) override {
+    return _compress(src, dst, static_cast<const ZstdDictionary*>(&dict));
+  }
+
+  int decompress_with_dict(bufferlist::iterator &p,
+			   size_t compressed_len,
+			   bufferlist &dst,
+			   const Dictionary &dict) override {
+    return _decompress(p, compressed_len, dst,
+		       static_cast<const ZstdDictionary*>(&dict));
+  }
+
+ private:
+  int _compress(const bufferlist &src, bufferlist &dst,
+		const ZstdDictionary *dict) {
     bufferptr outptr = buffer::create_page_aligned(
       ZSTD_compressBound(src.length()));
     ZSTD_outBuffer_s outbuf;
@@ -35,7 +108,11 @@ class ZstdCompressor : public Compressor {
     outbuf.pos = 0;
 
     ZSTD_CStream *s = ZSTD_createCStream();
-    ZSTD_initCStream(s, COMPRESSION_LEVEL);
+    if (dict) {
+      ZSTD_initCStream_usingCDict(s, dict->cdict);
+    } else {
+      ZSTD_initCStream(s, COMPRESSION_LEVEL);
+    }
     auto p = src.begin();
     size_t left = src.length();
     while (left) {
@@ -57,14 +134,10 @@ class ZstdCompressor : public Compressor {
     return 0;
   }
 
-  int decompress(const bufferlist &src, bufferlist &dst) override {
-    bufferlist::iterator i = const_cast<bufferlist&>(src).begin();
-    return decompress(i, src.length(), dst);
-  }
-
-  int decompress(bufferlist::iterator &p,
-		 size_t compressed_len,
-		 bufferlist &dst) override {
+  int _decompress(bufferlist::iterator &p,
+		  size_t compressed_len,
+		  bufferlist &dst,
+		  const ZstdDictionary *dict) {
     if (compressed_len < 4) {
       return -1;
     }
@@ -78,9 +151,14 @@ class ZstdCompressor : public Compressor {
     outbuf.size = dstptr.length();
     outbuf.pos = 0;
     ZSTD_DStream *s = ZSTD_createDStream();
-    ZSTD_initDStream(s);
+    if (dict) {
+      ZSTD_initDStream_usingDDict(s, dict->ddict);
+    } else {
+      ZSTD_initDStream(s);
+    }
     while (compressed_len > 0) {
       if (p.end()) {
+	ZSTD_freeDStream(s);
 	return -1;
       }
       ZSTD_inBuffer_s inbuf;
@@ -9,6 +9,9 @@
 #include "CrushWrapper.h"
 #include "CrushTreeDumper.h"
 
+#include <memory>
+#include <thread>
+
 #define dout_subsys ceph_subsys_crush
 
 bool CrushWrapper::has_v2_rules() const
@@ -1112,6 +1115,43 @@ int CrushWrapper::get_rule_weight_osd_map(unsigned ruleno, map<int,float> *pmap)
   return 0;
 }
 
+void CrushWrapper::do_rule_batch(int rule, const vector<int>& xs, int maxout,
+				 const vector<__u32>& weight,
+				 vector<int> *out, vector<int> *lens,
+				 unsigned nthreads) const
+{
+  unsigned n = xs.size();
+  out->assign((size_t)n * maxout, CRUSH_ITEM_NONE);
+  lens->assign(n, 0);
+  if (n == 0 || maxout <= 0)
+    return;
+
+  size_t work_size = crush_work_size(crush, maxout);
+  auto map_range = [&](unsigned begin, unsigned end) {
+    std::unique_ptr<char[]> work(new char[work_size]);
+    crush_init_workspace(crush, work.get());
+    crush_do_rule_batch(crush, rule, &xs[begin], end - begin,
+			&(*out)[(size_t)begin * maxout], &(*lens)[begin],
+			maxout, &weight[0], weight.size(), work.get());
+  };
+
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads <= 1) {
+    map_range(0, n);
+    return;
+  }
+  unsigned per = (n + nthreads - 1) / nthreads;
+  vector<std::thread> threads;
+  for (unsigned begin = per; begin < n; begin += per) {
+    threads.emplace_back(map_range, begin, std::min(begin + per, n));
+  }
+  map_range(0, per);
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
 int CrushWrapper::remove_rule(int ruleno)
 {
   if (ruleno >= (int)crush->max_rules)
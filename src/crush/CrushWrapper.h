@@ -1098,6 +1098,21 @@ public:
       out[i] = rawout[i];
   }
 
+  /**
+   * map many inputs with the same rule
+   *
+   * The result is the same as calling do_rule() for each input, but the
+   * CRUSH workspace is only set up once (per thread).  out is a flat
+   * table of xs.size() rows of maxout entries, padded with
+   * CRUSH_ITEM_NONE, and lens holds the number of results in each row.
+   * With nthreads > 1 the inputs are split into that many contiguous
+   * ranges which are mapped in parallel.
+   */
+  void do_rule_batch(int rule, const vector<int>& xs, int maxout,
+		     const vector<__u32>& weight,
+		     vector<int> *out, vector<int> *lens,
+		     unsigned nthreads = 1) const;
+
   bool check_crush_rule(int ruleset, int type, int size,  ostream& ss) {
     assert(crush);
 
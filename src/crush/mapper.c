@@ -1062,3 +1062,35 @@ int crush_do_rule(const struct crush_map *map,
 
 	return result_len;
 }
+
+/**
+ * crush_do_rule_batch - map a series of inputs with the same rule
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: array of @nx hash inputs
+ * @nx: number of inputs
+ * @result: @nx result vectors of @result_max entries each
+ * @result_len: number of results written to each vector
+ * @result_max: maximum result size
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: workspace initialized by crush_init_workspace
+ *
+ * The same as calling crush_do_rule for each input, but the one
+ * workspace is reused for all of them.
+ */
+void crush_do_rule_batch(const struct crush_map *map,
+			 int ruleno, const int *x, int nx,
+			 int *result, int *result_len, int result_max,
+			 const __u32 *weight, int weight_max,
+			 void *cwin)
+{
+	int i;
+
+	for (i = 0; i < nx; i++) {
+		result_len[i] = crush_do_rule(map, ruleno, x[i],
+					      result + i * result_max,
+					      result_max, weight, weight_max,
+					      cwin);
+	}
+}
@@ -16,6 +16,12 @@ extern int crush_do_rule(const struct crush_map *map,
 			 int x, int *result, int result_max,
 			 const __u32 *weights, int weight_max,
 			 void *cwin);
+extern void crush_do_rule_batch(const struct crush_map *map,
+				int ruleno,
+				const int *x, int nx,
+				int *result, int *result_len, int result_max,
+				const __u32 *weights, int weight_max,
+				void *cwin);
 
 /* Returns the exact amount of workspace that will need to be used
    for a given combination of crush_map and result_max. The caller can
@@ -16,6 +16,7 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include <vector>
 #include <algorithm>
 #include <ostream>
@@ -175,6 +176,83 @@ int ErasureCode::decode_chunks(const set<int> &want_to_read,
   assert("ErasureCode::decode_chunks not implemented" == 0);
 }
 
+int ErasureCode::encode_stripes(const set<int> &want_to_encode,
+                                unsigned int chunk_size,
+                                map<int, bufferlist> *chunks)
+{
+  unsigned int stripes = chunks->begin()->second.length() / chunk_size;
+  for (unsigned int s = 0; s < stripes; s++) {
+    map<int, bufferlist> stripe;
+    for (map<int, bufferlist>::iterator i = chunks->begin();
+         i != chunks->end();
+         ++i) {
+      assert(i->second.length() == stripes * chunk_size);
+      stripe[i->first].substr_of(i->second, s * chunk_size, chunk_size);
+    }
+    int r = encode_chunks(want_to_encode, &stripe);
+    if (r)
+      return r;
+  }
+  return 0;
+}
+
+int ErasureCode::decode_stripes(const set<int> &want_to_read,
+                                const set<int> &available,
+                                unsigned int chunk_size,
+                                map<int, bufferlist> *chunks)
+{
+  if (includes(available.begin(), available.end(),
+               want_to_read.begin(), want_to_read.end()))
+    return 0;
+  unsigned int stripes = chunks->begin()->second.length() / chunk_size;
+  for (unsigned int s = 0; s < stripes; s++) {
+    map<int, bufferlist> have;
+    map<int, bufferlist> stripe;
+    for (map<int, bufferlist>::iterator i = chunks->begin();
+         i != chunks->end();
+         ++i) {
+      assert(i->second.length() == stripes * chunk_size);
+      stripe[i->first].substr_of(i->second, s * chunk_size, chunk_size);
+      if (available.count(i->first))
+        have[i->first] = stripe[i->first];
+    }
+    int r = decode_chunks(want_to_read, have, &stripe);
+    if (r)
+      return r;
+  }
+  return 0;
+}
+
+int ErasureCode::encode_delta(const bufferptr &old_data,
+                              const bufferptr &new_data,
+                              bufferptr *delta)
+{
+  // all the codes work in GF(2^w), where subtraction is XOR
+  unsigned int length = old_data.length();
+  if (new_data.length() != length || delta->length() != length)
+    return -EINVAL;
+  const char *o = old_data.c_str();
+  const char *n = new_data.c_str();
+  char *d = delta->c_str();
+  unsigned int i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t ow, nw;
+    memcpy(&ow, o + i, sizeof(ow));
+    memcpy(&nw, n + i, sizeof(nw));
+    ow ^= nw;
+    memcpy(d + i, &ow, sizeof(ow));
+  }
+  for (; i < length; i++)
+    d[i] = o[i] ^ n[i];
+  return 0;
+}
+
+int ErasureCode::apply_delta(const map<int, bufferptr> &deltas,
+                             map<int, bufferptr> *coding)
+{
+  return -EOPNOTSUPP;
+}
+
 int ErasureCode::parse(const ErasureCodeProfile &profile,
 		       ostream *ss)
 {
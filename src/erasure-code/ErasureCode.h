@@ -78,6 +78,26 @@ namespace ceph {
                               const map<int, bufferlist> &chunks,
                               map<int, bufferlist> *decoded);
 
+    virtual int encode_stripes(const set<int> &want_to_encode,
+                               unsigned int chunk_size,
+                               map<int, bufferlist> *chunks);
+
+    virtual int decode_stripes(const set<int> &want_to_read,
+                               const set<int> &available,
+                               unsigned int chunk_size,
+                               map<int, bufferlist> *chunks);
+
+    virtual bool supports_parity_delta() const {
+      return false;
+    }
+
+    virtual int encode_delta(const bufferptr &old_data,
+                             const bufferptr &new_data,
+                             bufferptr *delta);
+
+    virtual int apply_delta(const map<int, bufferptr> &deltas,
+                            map<int, bufferptr> *coding);
+
     virtual const vector<int> &get_chunk_mapping() const;
 
     int to_mapping(const ErasureCodeProfile &profile,
@@ -400,6 +400,90 @@ namespace ceph {
                               const map<int, bufferlist> &chunks,
                               map<int, bufferlist> *decoded) = 0;
 
+    /**
+     * Encode many stripes in place.
+     *
+     * **chunks** maps every chunk index, from 0 to
+     * **get_chunk_count()** - 1, to a contiguous, page aligned
+     * buffer. Each buffer holds one **chunk_size** bytes long chunk
+     * per stripe, the chunk of stripe *s* starting at offset
+     * *s* * **chunk_size**. The data chunks are read and the coding
+     * chunks are overwritten; nothing is allocated or copied.
+     *
+     * The result is the same as calling **encode_chunks** once per
+     * stripe, but plugins whose coding works independently on each
+     * byte position encode all the stripes in a single pass.
+     *
+     * @param [in] want_to_encode chunk indexes to be encoded
+     * @param [in] chunk_size size of the chunk of one stripe
+     * @param [in,out] chunks map chunk indexes to chunk data
+     * @return **0** on success or a negative errno on error.
+     */
+    virtual int encode_stripes(const set<int> &want_to_encode,
+                               unsigned int chunk_size,
+                               map<int, bufferlist> *chunks) = 0;
+
+    /**
+     * Decode many stripes in place.
+     *
+     * **chunks** is laid out as for **encode_stripes** and must hold
+     * a buffer for every chunk index. The chunks listed in
+     * **available** are read; all the others may be overwritten and
+     * on success the ones listed in **want_to_read** are
+     * reconstructed.
+     *
+     * @param [in] want_to_read chunk indexes to be decoded
+     * @param [in] available chunk indexes holding valid data
+     * @param [in] chunk_size size of the chunk of one stripe
+     * @param [in,out] chunks map chunk indexes to chunk data
+     * @return **0** on success or a negative errno on error.
+     */
+    virtual int decode_stripes(const set<int> &want_to_read,
+                               const set<int> &available,
+                               unsigned int chunk_size,
+                               map<int, bufferlist> *chunks) = 0;
+
+    /**
+     * Return true if **apply_delta** is implemented, i.e. if every
+     * coding chunk is a linear combination of the data chunks and
+     * can be updated from the change of some of them, without
+     * reading the others.
+     *
+     * @return **true** if parity delta updates are supported
+     */
+    virtual bool supports_parity_delta() const = 0;
+
+    /**
+     * Compute the difference between the old and the new content of
+     * a data chunk, to be given to **apply_delta**. The three buffers
+     * have the same length. **delta** may be either of the inputs, in
+     * which case it is overwritten.
+     *
+     * @param [in] old_data content of the chunk before the write
+     * @param [in] new_data content of the chunk after the write
+     * @param [out] delta difference between the two
+     * @return **0** on success or a negative errno on error.
+     */
+    virtual int encode_delta(const bufferptr &old_data,
+                             const bufferptr &new_data,
+                             bufferptr *delta) = 0;
+
+    /**
+     * Update coding chunks in place for a change of some data
+     * chunks. **deltas** maps the chunk indexes of the changed data
+     * chunks to their **encode_delta** and **coding** maps the
+     * chunk indexes of the coding chunks to update to their current
+     * content. All the buffers have the same length; on success
+     * **coding** holds what **encode_chunks** would have computed
+     * from the new data.
+     *
+     * @param [in] deltas map data chunk indexes to their delta
+     * @param [in,out] coding map coding chunk indexes to chunk data
+     * @return **0** on success or a negative errno on error.
+     */
+    virtual int apply_delta(const map<int, bufferptr> &deltas,
+                            map<int, bufferptr> *coding) = 0;
+
     /**
      * Return the ordered list of chunks or an empty vector
      * if no remapping is necessary.
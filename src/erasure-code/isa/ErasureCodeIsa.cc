@@ -139,6 +139,32 @@ int ErasureCodeIsa::decode_chunks(const set<int> &want_to_read,
   return isa_decode(erasures, data, coding, blocksize);
 }
 
+int ErasureCodeIsa::encode_stripes(const set<int> &want_to_encode,
+                                   unsigned int chunk_size,
+                                   map<int, bufferlist> *chunks)
+{
+  // every byte position is coded independently: encode all the stripes
+  // as if they were one long chunk
+  return encode_chunks(want_to_encode, chunks);
+}
+
+int ErasureCodeIsa::decode_stripes(const set<int> &want_to_read,
+                                   const set<int> &available,
+                                   unsigned int chunk_size,
+                                   map<int, bufferlist> *chunks)
+{
+  if (includes(available.begin(), available.end(),
+               want_to_read.begin(), want_to_read.end()))
+    return 0;
+  map<int, bufferlist> have;
+  for (set<int>::const_iterator i = available.begin();
+       i != available.end();
+       ++i) {
+    have[*i] = (*chunks)[*i];
+  }
+  return decode_chunks(want_to_read, have, chunks);
+}
+
 // -----------------------------------------------------------------------------
 
 void
@@ -157,6 +183,72 @@ ErasureCodeIsaDefault::isa_encode(char **data,
 
 // -----------------------------------------------------------------------------
 
+int
+ErasureCodeIsaDefault::apply_delta(const map<int, bufferptr> &deltas,
+                                   map<int, bufferptr> *coding)
+{
+  if (coding->empty())
+    return 0;
+  unsigned blocksize = coding->begin()->second.length();
+  unsigned char *parity[m];
+  for (int i = 0; i < m; i++)
+    parity[i] = 0;
+  for (map<int, bufferptr>::iterator c = coding->begin();
+       c != coding->end();
+       ++c) {
+    if (c->first < k || c->first >= k + m ||
+        c->second.length() != blocksize)
+      return -EINVAL;
+    parity[c->first - k] = (unsigned char*) c->second.c_str();
+  }
+  for (map<int, bufferptr>::const_iterator d = deltas.begin();
+       d != deltas.end();
+       ++d) {
+    if (d->first < 0 || d->first >= k || d->second.length() != blocksize)
+      return -EINVAL;
+  }
+
+  if (m == 1) {
+    // single parity stripe, see isa_encode
+    for (map<int, bufferptr>::const_iterator d = deltas.begin();
+         d != deltas.end();
+         ++d) {
+      unsigned char *src = (unsigned char*) d->second.c_str();
+      unsigned vector_size = 0;
+      if (is_aligned(src, EC_ISA_VECTOR_OP_WORDSIZE) &&
+          is_aligned(parity[0], EC_ISA_VECTOR_OP_WORDSIZE)) {
+        vector_size = blocksize / EC_ISA_VECTOR_OP_WORDSIZE *
+          EC_ISA_VECTOR_OP_WORDSIZE;
+        vector_xor((vector_op_t*) src, (vector_op_t*) parity[0],
+                   (vector_op_t*) (src + vector_size));
+      }
+      byte_xor(src + vector_size, parity[0] + vector_size, src + blocksize);
+    }
+    return 0;
+  }
+
+  // ec_encode_data_update() adds the contribution of one data chunk to
+  // all the coding chunks, which is what a delta is; coding chunks we
+  // were not asked for go to a scratch buffer
+  bufferptr scratch;
+  for (int i = 0; i < m; i++) {
+    if (!parity[i]) {
+      if (!scratch.length())
+        scratch = buffer::create_page_aligned(blocksize);
+      parity[i] = (unsigned char*) scratch.c_str();
+    }
+  }
+  for (map<int, bufferptr>::const_iterator d = deltas.begin();
+       d != deltas.end();
+       ++d) {
+    ec_encode_data_update(blocksize, k, m, d->first, encode_tbls,
+                          (unsigned char*) d->second.c_str(), parity);
+  }
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
 bool
 ErasureCodeIsaDefault::erasure_contains(int *erasures, int i)
 {
@@ -94,6 +94,15 @@ public:
                             const map<int, bufferlist> &chunks,
                             map<int, bufferlist> *decoded);
 
+  virtual int encode_stripes(const set<int> &want_to_encode,
+                             unsigned int chunk_size,
+                             map<int, bufferlist> *chunks);
+
+  virtual int decode_stripes(const set<int> &want_to_read,
+                             const set<int> &available,
+                             unsigned int chunk_size,
+                             map<int, bufferlist> *chunks);
+
   virtual int init(ErasureCodeProfile &profile, ostream *ss);
 
   virtual void isa_encode(char **data,
@@ -148,6 +157,14 @@ public:
                           char **coding,
                           int blocksize);
 
+  virtual bool supports_parity_delta() const
+  {
+    return chunk_mapping.empty();
+  }
+
+  virtual int apply_delta(const map<int, bufferptr> &deltas,
+                          map<int, bufferptr> *coding);
+
   virtual bool erasure_contains(int *erasures, int i);
 
   virtual int isa_decode(int *erasures,
@@ -15,6 +15,8 @@
  * 
  */
 
+#include <algorithm>
+
 #include "common/debug.h"
 #include "ErasureCodeJerasure.h"
 #include "crush/CrushWrapper.h"
@@ -150,6 +152,80 @@ int ErasureCodeJerasure::decode_chunks(const set<int> &want_to_read,
   return jerasure_decode(erasures, data, coding, blocksize);
 }
 
+int ErasureCodeJerasure::encode_stripes(const set<int> &want_to_encode,
+                                        unsigned int chunk_size,
+                                        map<int, bufferlist> *chunks)
+{
+  // every w * packetsize block (or w bit word) is coded independently
+  // and chunk_size is a multiple of it: encode all the stripes as if
+  // they were one long chunk
+  return encode_chunks(want_to_encode, chunks);
+}
+
+int ErasureCodeJerasure::decode_stripes(const set<int> &want_to_read,
+                                        const set<int> &available,
+                                        unsigned int chunk_size,
+                                        map<int, bufferlist> *chunks)
+{
+  if (includes(available.begin(), available.end(),
+               want_to_read.begin(), want_to_read.end()))
+    return 0;
+  map<int, bufferlist> have;
+  for (set<int>::const_iterator i = available.begin();
+       i != available.end();
+       ++i) {
+    have[*i] = (*chunks)[*i];
+  }
+  return decode_chunks(want_to_read, have, chunks);
+}
+
+int ErasureCodeJerasure::matrix_apply_delta(int *matrix,
+                                            const map<int, bufferptr> &deltas,
+                                            map<int, bufferptr> *coding)
+{
+  // coding chunk i is the sum over the data chunks j of
+  // matrix[i * k + j] * chunk j: adding the same product of the delta
+  // of chunk j updates it for the new content of chunk j
+  for (map<int, bufferptr>::iterator c = coding->begin();
+       c != coding->end();
+       ++c) {
+    int i = c->first - k;
+    if (i < 0 || i >= m)
+      return -EINVAL;
+    int blocksize = c->second.length();
+    char *dest = c->second.c_str();
+    for (map<int, bufferptr>::const_iterator d = deltas.begin();
+         d != deltas.end();
+         ++d) {
+      int j = d->first;
+      if (j < 0 || j >= k || d->second.length() != (unsigned)blocksize)
+        return -EINVAL;
+      char *src = const_cast<char*>(d->second.c_str());
+      int coefficient = matrix[i * k + j];
+      if (coefficient == 0)
+        continue;
+      if (coefficient == 1) {
+        galois_region_xor(src, dest, blocksize);
+        continue;
+      }
+      switch (w) {
+      case 8:
+        galois_w08_region_multiply(src, coefficient, blocksize, dest, 1);
+        break;
+      case 16:
+        galois_w16_region_multiply(src, coefficient, blocksize, dest, 1);
+        break;
+      case 32:
+        galois_w32_region_multiply(src, coefficient, blocksize, dest, 1);
+        break;
+      default:
+        return -EINVAL;
+      }
+    }
+  }
+  return 0;
+}
+
 bool ErasureCodeJerasure::is_prime(int value)
 {
   int prime55[] = {
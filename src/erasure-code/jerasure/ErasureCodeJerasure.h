@@ -72,6 +72,15 @@ public:
 			    const map<int, bufferlist> &chunks,
 			    map<int, bufferlist> *decoded);
 
+  virtual int encode_stripes(const set<int> &want_to_encode,
+			     unsigned int chunk_size,
+			     map<int, bufferlist> *chunks);
+
+  virtual int decode_stripes(const set<int> &want_to_read,
+			     const set<int> &available,
+			     unsigned int chunk_size,
+			     map<int, bufferlist> *chunks);
+
   virtual int init(ErasureCodeProfile &profile, ostream *ss);
 
   virtual void jerasure_encode(char **data,
@@ -86,6 +95,9 @@ public:
   static bool is_prime(int value);
 protected:
   virtual int parse(ErasureCodeProfile &profile, ostream *ss);
+  int matrix_apply_delta(int *matrix,
+                         const map<int, bufferptr> &deltas,
+                         map<int, bufferptr> *coding);
 };
 
 class ErasureCodeJerasureReedSolomonVandermonde : public ErasureCodeJerasure {
@@ -112,6 +124,13 @@ public:
                                char **data,
                                char **coding,
                                int blocksize);
+  virtual bool supports_parity_delta() const {
+    return chunk_mapping.empty();
+  }
+  virtual int apply_delta(const map<int, bufferptr> &deltas,
+                          map<int, bufferptr> *coding) {
+    return matrix_apply_delta(matrix, deltas, coding);
+  }
   virtual unsigned get_alignment() const;
   virtual void prepare();
 private:
@@ -141,6 +160,13 @@ public:
                                char **data,
                                char **coding,
                                int blocksize);
+  virtual bool supports_parity_delta() const {
+    return chunk_mapping.empty();
+  }
+  virtual int apply_delta(const map<int, bufferptr> &deltas,
+                          map<int, bufferptr> *coding) {
+    return matrix_apply_delta(matrix, deltas, coding);
+  }
   virtual unsigned get_alignment() const;
   virtual void prepare();
 private:
@@ -99,6 +99,9 @@
 /* Define to 1 if you have libxfs */
 #cmakedefine HAVE_LIBXFS 1
 
+/* Define if you have lz4 */
+#cmakedefine HAVE_LZ4
+
 /* SPDK conditional compilation */
 #cmakedefine HAVE_SPDK
 
@@ -223,6 +226,9 @@
 /* Define to 1 if you have the <linux/version.h> header file. */
 #cmakedefine HAVE_LINUX_VERSION_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine HAVE_LINUX_IO_URING_H 1
+
 /* Define to 1 if you have sched.h. */
 #cmakedefine HAVE_SCHED 1
 
@@ -29,4 +29,66 @@ static inline uint32_t ceph_crc32c(uint32_t crc, unsigned char const *data, unsi
 	return ceph_crc32c_func(crc, data, length);
 }
 
+typedef void (*ceph_crc32c_multi_func_t)(uint32_t crc, unsigned char const *data,
+					 unsigned block_len, unsigned blocks,
+					 uint32_t *out);
+
+extern ceph_crc32c_multi_func_t ceph_crc32c_multi_func;
+
+extern ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void);
+
+/**
+ * calculate crc32c of many equally sized blocks
+ *
+ * Each block is checksummed independently, starting from the same
+ * initial value, which lets the implementation work on several blocks
+ * at once.
+ *
+ * @param crc initial value for each block
+ * @param data pointer to the first block (must not be NULL)
+ * @param block_len length of each block
+ * @param blocks number of consecutive blocks
+ * @param out array of @blocks crc values
+ */
+static inline void ceph_crc32c_multi(uint32_t crc, unsigned char const *data,
+				     unsigned block_len, unsigned blocks,
+				     uint32_t *out)
+{
+	ceph_crc32c_multi_func(crc, data, block_len, blocks, out);
+}
+
+/*
+ * ceph_crc32c(crc, NULL, length) is linear in crc, so for a fixed length
+ * it can be precomputed as a 32x32 bit matrix (one column per input bit)
+ * and then applied to any crc in a handful of operations.  Combined with
+ *
+ *   ceph_crc32c(a, data, len) == ceph_crc32c(b, data, len) ^
+ *                                ceph_crc32c(a ^ b, NULL, len)
+ *
+ * this extends a known crc of a block (e.g. a stored checksum) to the crc
+ * of the same block with another initial value, without the data.
+ */
+struct ceph_crc32c_shift {
+	uint32_t col[32];
+};
+
+extern void ceph_crc32c_shift_init(struct ceph_crc32c_shift *s,
+				   unsigned length);
+
+/**
+ * the same as ceph_crc32c(crc, NULL, length) for the length @s was
+ * initialized with
+ */
+static inline uint32_t ceph_crc32c_shift_apply(const struct ceph_crc32c_shift *s,
+					       uint32_t crc)
+{
+	uint32_t r = 0;
+	unsigned i;
+	for (i = 0; crc; i++, crc >>= 1) {
+		if (crc & 1)
+			r ^= s->col[i];
+	}
+	return r;
+}
+
 #endif
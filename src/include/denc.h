@@ -805,14 +805,82 @@ struct denc_traits<
 				 _denc::pushback_details<std::list<T, Ts...>>,
 				 T, Ts...> {};
 
+namespace _denc {
+  // element types whose in-memory representation is their encoding, so
+  // that contiguous arrays of them can be encoded and decoded with a
+  // single memcpy
+  template<typename T>
+  struct is_bulk_copyable : public std::false_type {};
+  template<> struct is_bulk_copyable<uint8_t> : public std::true_type {};
+#ifndef _CHAR_IS_SIGNED
+  template<> struct is_bulk_copyable<int8_t> : public std::true_type {};
+#endif
+  template<> struct is_bulk_copyable<ceph_le16> : public std::true_type {};
+  template<> struct is_bulk_copyable<ceph_le32> : public std::true_type {};
+  template<> struct is_bulk_copyable<ceph_le64> : public std::true_type {};
+#ifdef CEPH_LITTLE_ENDIAN
+  template<> struct is_bulk_copyable<uint16_t> : public std::true_type {};
+  template<> struct is_bulk_copyable<int16_t> : public std::true_type {};
+  template<> struct is_bulk_copyable<uint32_t> : public std::true_type {};
+  template<> struct is_bulk_copyable<int32_t> : public std::true_type {};
+  template<> struct is_bulk_copyable<uint64_t> : public std::true_type {};
+  template<> struct is_bulk_copyable<int64_t> : public std::true_type {};
+#endif
+}
+
 template<typename T, typename ...Ts>
 struct denc_traits<
   std::vector<T, Ts...>,
-  typename std::enable_if<denc_traits<T>::supported != 0>::type>
+  typename std::enable_if<denc_traits<T>::supported != 0 &&
+			  !_denc::is_bulk_copyable<T>::value>::type>
   : public _denc::container_base<std::vector,
 				 _denc::pushback_details<std::vector<T, Ts...>>,
 				 T, Ts...> {};
 
+// same encoding as above, element by element, but in one go
+template<typename T, typename ...Ts>
+struct denc_traits<
+  std::vector<T, Ts...>,
+  typename std::enable_if<_denc::is_bulk_copyable<T>::value>::type> {
+private:
+  using container = std::vector<T, Ts...>;
+public:
+  enum { supported = true };
+  enum { featured = false };
+  enum { bounded = false };
+
+  static void bound_encode(const container& s, size_t& p, uint64_t f=0) {
+    p += sizeof(uint32_t) + sizeof(T) * s.size();
+  }
+  static void encode(const container& s,
+		     buffer::list::contiguous_appender& p,
+		     uint64_t f=0) {
+    denc((uint32_t)s.size(), p);
+    encode_nohead(s, p);
+  }
+  static void decode(container& s, buffer::ptr::iterator& p, uint64_t f=0) {
+    uint32_t num;
+    denc(num, p);
+    decode_nohead(num, s, p);
+  }
+
+  static void encode_nohead(const container& s,
+			    buffer::list::contiguous_appender& p) {
+    if (!s.empty())
+      p.append((const char*)s.data(), sizeof(T) * s.size());
+  }
+  static void decode_nohead(size_t num, container& s,
+			    buffer::ptr::iterator& p, uint64_t f=0) {
+    // bounds check before trusting num
+    const char *src = p.get_pos_add(sizeof(T) * num);
+    s.clear();
+    if (num) {
+      s.resize(num);
+      memcpy(s.data(), src, sizeof(T) * num);
+    }
+  }
+};
+
 namespace _denc {
   template<typename Container>
   struct setlike_details : public container_details_base<Container> {
@@ -118,6 +118,12 @@ struct ceph_msg_connect_reply {
 } __attribute__ ((packed));
 
 #define CEPH_MSG_CONNECT_LOSSY  1  /* messages i send may be safely dropped */
+/*
+ * on-wire compression algorithm the connecting side asks for and the
+ * accepting side agrees to (by echoing it back); zero for none.
+ */
+#define CEPH_MSG_CONNECT_COMPRESS_SHIFT 1
+#define CEPH_MSG_CONNECT_COMPRESS_MASK  (7 << CEPH_MSG_CONNECT_COMPRESS_SHIFT)
 
 
 /*
@@ -162,6 +168,14 @@ struct ceph_msg_header {
 	__le32 crc;       /* header crc32c */
 } __attribute__ ((packed));
 
+/*
+ * header.reserved flags: front and/or data travel compressed with the
+ * algorithm negotiated at connect time; front_len and data_len are the
+ * compressed lengths and the crcs cover the uncompressed bytes.
+ */
+#define CEPH_MSG_HEADER_FRONT_COMPRESSED (1<<0)
+#define CEPH_MSG_HEADER_DATA_COMPRESSED  (1<<1)
+
 #define CEPH_MSG_PRIO_LOW     64
 #define CEPH_MSG_PRIO_DEFAULT 127
 #define CEPH_MSG_PRIO_HIGH    196
@@ -298,6 +298,19 @@ public:
     return -EOPNOTSUPP;
   }
 
+  /// bytes currently held by the store's own in-memory cache, if any
+  virtual int64_t get_cache_usage() const {
+    return -EOPNOTSUPP;
+  }
+  /// resize the store's own in-memory cache
+  virtual int set_cache_size(uint64_t s) {
+    return -EOPNOTSUPP;
+  }
+  /// lifetime hits and misses of that cache, if they are tracked
+  virtual int get_cache_hits_misses(uint64_t *hits, uint64_t *misses) const {
+    return -EOPNOTSUPP;
+  }
+
   virtual ~KeyValueDB() {}
 
   /// compact the underlying store
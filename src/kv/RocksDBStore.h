@@ -16,6 +16,7 @@
 #include "rocksdb/iostats_context.h"
 #include "rocksdb/statistics.h"
 #include "rocksdb/table.h"
+#include "rocksdb/cache.h"
 #include <errno.h>
 #include "common/errno.h"
 #include "common/dout.h"
@@ -153,6 +154,29 @@ public:
   void split_stats(const std::string &s, char delim, std::vector<std::string> &elems);
   void get_statistics(Formatter *f);
 
+  int64_t get_cache_usage() const override {
+    if (!bbt_opts.block_cache) {
+      return -ENOENT;
+    }
+    return bbt_opts.block_cache->GetUsage();
+  }
+  int set_cache_size(uint64_t s) override {
+    if (!bbt_opts.block_cache) {
+      return -ENOENT;
+    }
+    bbt_opts.block_cache->SetCapacity(s);
+    return 0;
+  }
+  int get_cache_hits_misses(uint64_t *hits, uint64_t *misses) const override {
+    // only tracked with rocksdb_perf
+    if (!dbstats) {
+      return -ENOENT;
+    }
+    *hits = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+    *misses = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+    return 0;
+  }
+
   struct  RocksWBHandler: public rocksdb::WriteBatch::Handler {
     std::string seen ;
     int num_seen = 0;
@@ -242,13 +242,21 @@ void AioImageRequest<I>::send() {
     return;
   }
 
-  if (m_bypass_image_cache || m_image_ctx.image_cache == nullptr) {
+  if (m_bypass_image_cache || m_image_ctx.image_cache == nullptr ||
+      !is_head()) {
     send_request();
   } else {
     send_image_cache_request();
   }
 }
 
+template <typename I>
+bool AioImageRequest<I>::is_head() const {
+  // the image cache only holds HEAD, snapshots are read from the image
+  RWLock::RLocker snap_locker(m_image_ctx.snap_lock);
+  return m_image_ctx.snap_id == CEPH_NOSNAP;
+}
+
 template <typename I>
 int AioImageRequest<I>::clip_request() {
   RWLock::RLocker snap_locker(m_image_ctx.snap_lock);
@@ -67,6 +67,7 @@ protected:
   }
 
   virtual int clip_request();
+  bool is_head() const;
   virtual void send_request() = 0;
   virtual void send_image_cache_request() = 0;
 
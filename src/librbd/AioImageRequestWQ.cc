@@ -11,6 +11,7 @@
 #include "librbd/ImageState.h"
 #include "librbd/internal.h"
 #include "librbd/Utils.h"
+#include "librbd/cache/ImageCache.h"
 
 #define dout_subsys ceph_subsys_rbd
 #undef dout_prefix
@@ -255,7 +256,7 @@ void AioImageRequestWQ::block_writes(Context *on_blocked) {
   }
 
   // ensure that all in-flight IO is flushed
-  m_image_ctx.flush(on_blocked);
+  flush_image(on_blocked);
 }
 
 void AioImageRequestWQ::unblock_writes() {
@@ -387,10 +388,22 @@ void AioImageRequestWQ::finish_in_progress_write() {
   }
 
   if (writes_blocked) {
-    m_image_ctx.flush(new C_BlockedWrites(this));
+    flush_image(new C_BlockedWrites(this));
   }
 }
 
+void AioImageRequestWQ::flush_image(Context *on_finish) {
+  if (m_image_ctx.image_cache != nullptr) {
+    // blocked writes must reach the image (e.g. before a snapshot is
+    // taken or the exclusive lock is released), so drain the image cache
+    // as well.  its flush ends with a flush of the image.
+    m_image_ctx.image_cache->flush(
+      util::create_async_context_callback(m_image_ctx, on_finish));
+    return;
+  }
+  m_image_ctx.flush(on_finish);
+}
+
 int AioImageRequestWQ::start_in_flight_op(AioCompletion *c) {
   RWLock::RLocker locker(m_lock);
 
@@ -109,6 +109,8 @@ private:
   int start_in_flight_op(AioCompletion *c);
   void finish_in_flight_op();
 
+  void flush_image(Context *on_finish);
+
   bool is_lock_required() const;
   void queue(AioImageRequest<ImageCtx> *req);
 
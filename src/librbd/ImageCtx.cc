@@ -30,6 +30,7 @@
 #include "librbd/operation/ResizeRequest.h"
 #include "librbd/Utils.h"
 #include "librbd/LibrbdWriteback.h"
+#include "librbd/cache/ImageCache.h"
 
 #include "osdc/Striper.h"
 #include <boost/bind.hpp>
@@ -792,6 +793,23 @@ struct C_InvalidateCache : public Context {
   }
 
   void ImageCtx::invalidate_cache(bool purge_on_error, Context *on_finish) {
+    if (image_cache != nullptr) {
+      // the image cache writes back through the object cacher
+      image_cache->invalidate(new FunctionContext(
+        [this, purge_on_error, on_finish](int r) {
+          if (r < 0) {
+            on_finish->complete(r);
+            return;
+          }
+          invalidate_object_cache(purge_on_error, on_finish);
+        }));
+      return;
+    }
+    invalidate_object_cache(purge_on_error, on_finish);
+  }
+
+  void ImageCtx::invalidate_object_cache(bool purge_on_error,
+                                         Context *on_finish) {
     if (object_cacher == NULL) {
       op_work_queue->queue(on_finish, 0);
       return;
@@ -946,6 +964,10 @@ struct C_InvalidateCache : public Context {
         "rbd_cache_max_dirty_age", false)(
         "rbd_cache_max_dirty_object", false)(
         "rbd_cache_block_writes_upfront", false)(
+        "rbd_persistent_cache", false)(
+        "rbd_persistent_cache_path", false)(
+        "rbd_persistent_cache_size", false)(
+        "rbd_persistent_cache_writeback_max_bytes", false)(
         "rbd_concurrent_management_ops", false)(
         "rbd_balance_snap_reads", false)(
         "rbd_localize_snap_reads", false)(
@@ -1003,6 +1025,10 @@ struct C_InvalidateCache : public Context {
     ASSIGN_OPTION(cache_max_dirty_age);
     ASSIGN_OPTION(cache_max_dirty_object);
     ASSIGN_OPTION(cache_block_writes_upfront);
+    ASSIGN_OPTION(persistent_cache);
+    ASSIGN_OPTION(persistent_cache_path);
+    ASSIGN_OPTION(persistent_cache_size);
+    ASSIGN_OPTION(persistent_cache_writeback_max_bytes);
     ASSIGN_OPTION(concurrent_management_ops);
     ASSIGN_OPTION(balance_snap_reads);
     ASSIGN_OPTION(localize_snap_reads);
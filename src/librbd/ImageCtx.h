@@ -167,6 +167,10 @@ namespace librbd {
     double cache_max_dirty_age;
     uint32_t cache_max_dirty_object;
     bool cache_block_writes_upfront;
+    bool persistent_cache;
+    std::string persistent_cache_path;
+    uint64_t persistent_cache_size;
+    uint64_t persistent_cache_writeback_max_bytes;
     uint32_t concurrent_management_ops;
     bool balance_snap_reads;
     bool localize_snap_reads;
@@ -280,6 +284,7 @@ namespace librbd {
     void shut_down_cache(Context *on_finish);
     int invalidate_cache(bool purge_on_error);
     void invalidate_cache(bool purge_on_error, Context *on_finish);
+    void invalidate_object_cache(bool purge_on_error, Context *on_finish);
     void clear_nonexistence_cache();
     bool is_cache_empty();
     void register_watch(Context *on_finish);
@@ -75,6 +75,13 @@ bool ManagedLock<I>::is_lock_owner() const {
   return is_lock_owner(m_lock);
 }
 
+template <typename I>
+std::string ManagedLock<I>::get_cookie() const {
+  Mutex::Locker locker(m_lock);
+
+  return is_lock_owner(m_lock) ? m_cookie : "";
+}
+
 template <typename I>
 bool ManagedLock<I>::is_lock_owner(Mutex &lock) const {
 
@@ -46,6 +46,7 @@ public:
   virtual ~ManagedLock();
 
   bool is_lock_owner() const;
+  std::string get_cookie() const;
 
   void shut_down(Context *on_shutdown);
   void acquire_lock(Context *on_acquired);
@@ -0,0 +1,1405 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "FileImageCache.h"
+#include "include/buffer.h"
+#include "include/compat.h"
+#include "include/interval_set.h"
+#include "include/intarith.h"
+#include "include/rados.h"
+#include "include/stringify.h"
+#include "common/dout.h"
+#include "common/errno.h"
+#include "common/safe_io.h"
+#include "common/WorkQueue.h"
+#include "librbd/ExclusiveLock.h"
+#include "librbd/ImageCtx.h"
+#include "librbd/Utils.h"
+#include "librbd/managed_lock/GetLockerRequest.h"
+#include <algorithm>
+#include <random>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define dout_subsys ceph_subsys_rbd
+#undef dout_prefix
+#define dout_prefix *_dout << "librbd::FileImageCache: " << this << " " \
+                           <<  __func__ << ": "
+
+namespace librbd {
+namespace cache {
+
+namespace {
+
+// The cache file holds a superblock followed by a ring of log entries.
+// Each entry is a header block followed by its payload, padded to the
+// block size.
+const uint64_t SUPERBLOCK_SIZE = 4096;
+const uint64_t BLOCK_SIZE = 512;
+const uint64_t HEADER_SIZE = BLOCK_SIZE;
+const uint64_t MIN_FILE_SIZE = 16 << 20;
+const uint64_t MAX_ENTRY_SIZE = 1 << 20;
+const uint64_t MAX_APPEND_BYTES = 8 << 20;   // per group commit
+const uint64_t MAX_PROMOTE_BYTES = 1 << 20;  // per read
+
+const uint32_t SUPERBLOCK_MAGIC = 0x52424443;
+const uint32_t ENTRY_MAGIC = 0x52424445;
+const uint32_t FORMAT_VERSION = 2;
+const uint32_t ENTRY_FLAG_DIRTY = 1 << 0;
+
+} // anonymous namespace
+
+using util::unique_lock_name;
+
+template <typename I>
+struct FileImageCache<I>::ReadRequest {
+  struct Segment {
+    bool hit;
+    uint64_t length;
+    uint64_t file_offset;  ///< hits only
+    bufferlist bl;         ///< cached data (hits only)
+  };
+
+  std::vector<Segment> segments;
+  Extents miss_extents;
+  uint64_t miss_length = 0;
+  bufferlist miss_bl;
+  bufferlist *out_bl = nullptr;
+  uint64_t gen = 0;
+  bool promote = false;
+  Context *on_finish = nullptr;
+};
+
+template <typename I>
+FileImageCache<I>::FileImageCache(I &image_ctx)
+  : m_image_ctx(image_ctx), m_image_writeback(image_ctx),
+    m_lock(unique_lock_name("librbd::cache::FileImageCache::m_lock", this)),
+    m_map_lock(unique_lock_name("librbd::cache::FileImageCache::m_map_lock",
+                                this)),
+    m_worker(this) {
+}
+
+template <typename I>
+FileImageCache<I>::~FileImageCache() {
+  assert(m_fd < 0);
+  assert(m_ops.empty());
+}
+
+template <typename I>
+bool FileImageCache<I>::is_head() const {
+  RWLock::RLocker snap_locker(m_image_ctx.snap_lock);
+  return m_image_ctx.snap_id == CEPH_NOSNAP;
+}
+
+template <typename I>
+void FileImageCache<I>::aio_read(Extents &&image_extents, bufferlist *bl,
+                                 int fadvise_flags, Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "image_extents=" << image_extents << ", "
+                 << "on_finish=" << on_finish << dendl;
+
+  if (!is_head()) {
+    // the cache only holds HEAD
+    m_image_writeback.aio_read(std::move(image_extents), bl, fadvise_flags,
+                               on_finish);
+    return;
+  }
+
+  ReadRequest *req = new ReadRequest();
+  req->out_bl = bl;
+  req->promote = (fadvise_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+                                   CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0;
+  req->on_finish = on_finish;
+
+  int r = 0;
+  while (true) {
+    {
+      RWLock::RLocker map_locker(m_map_lock);
+      map_lookup(image_extents, req);
+    }
+
+    // the hits are read without the map lock.  an extent's space is only
+    // reused after it is reclaimed, which bumps the map generation, so
+    // an unchanged generation means nothing we read was overwritten.
+    for (auto &segment : req->segments) {
+      if (!segment.hit) {
+        continue;
+      }
+      bufferptr bp(buffer::create_page_aligned(segment.length));
+      r = safe_pread_exact(m_fd, bp.c_str(), segment.length,
+                           segment.file_offset);
+      if (r < 0) {
+        break;
+      }
+      segment.bl.push_back(std::move(bp));
+    }
+    if (r < 0) {
+      break;
+    }
+
+    RWLock::RLocker map_locker(m_map_lock);
+    if (req->gen == m_map_gen) {
+      break;
+    }
+    ldout(cct, 20) << "raced with reclaim, retrying" << dendl;
+  }
+
+  if (r < 0) {
+    lderr(cct) << "failed to read from cache file: " << cpp_strerror(r)
+               << dendl;
+    delete req;
+    m_image_writeback.aio_read(std::move(image_extents), bl, fadvise_flags,
+                               on_finish);
+    return;
+  }
+
+  if (req->miss_extents.empty()) {
+    handle_read(req, 0);
+    return;
+  }
+
+  ldout(cct, 20) << "miss_extents=" << req->miss_extents << dendl;
+  Extents miss_extents(req->miss_extents);
+  m_image_writeback.aio_read(std::move(miss_extents), &req->miss_bl,
+                             fadvise_flags, new FunctionContext(
+    [this, req](int r) {
+      handle_read(req, r);
+    }));
+}
+
+template <typename I>
+void FileImageCache<I>::map_lookup(const Extents &image_extents,
+                                   ReadRequest *req) {
+  assert(m_map_lock.is_locked());
+
+  req->segments.clear();
+  req->miss_extents.clear();
+  req->miss_length = 0;
+  req->gen = m_map_gen;
+  for (auto &extent : image_extents) {
+    uint64_t pos = extent.first;
+    uint64_t end = extent.first + extent.second;
+    auto p = m_map.upper_bound(pos);
+    if (p != m_map.begin()) {
+      auto q = std::prev(p);
+      if (q->first + q->second.length > pos) {
+        p = q;
+      }
+    }
+    while (pos < end) {
+      if (p != m_map.end() && p->first <= pos) {
+        uint64_t len = std::min(end, p->first + p->second.length) - pos;
+        req->segments.push_back(
+          {true, len, p->second.file_offset + pos - p->first, {}});
+        pos += len;
+        ++p;
+        continue;
+      }
+
+      uint64_t next = end;
+      if (p != m_map.end()) {
+        next = std::min(end, p->first);
+      }
+      uint64_t len = next - pos;
+      if (!req->segments.empty() && !req->segments.back().hit &&
+          req->miss_extents.back().first +
+            req->miss_extents.back().second == pos) {
+        req->segments.back().length += len;
+        req->miss_extents.back().second += len;
+      } else {
+        req->segments.push_back({false, len, 0, {}});
+        req->miss_extents.emplace_back(pos, len);
+      }
+      req->miss_length += len;
+      pos = next;
+    }
+  }
+}
+
+template <typename I>
+void FileImageCache<I>::handle_read(ReadRequest *req, int r) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "r=" << r << dendl;
+
+  if (r < 0) {
+    req->on_finish->complete(r);
+    delete req;
+    return;
+  }
+
+  bool cache_hit = (req->miss_length == 0);
+  if (req->miss_bl.length() < req->miss_length) {
+    req->miss_bl.append_zero(req->miss_length - req->miss_bl.length());
+  }
+
+  req->out_bl->clear();
+  uint64_t miss_offset = 0;
+  for (auto &segment : req->segments) {
+    if (segment.hit) {
+      req->out_bl->claim_append(segment.bl);
+    } else {
+      bufferlist sub;
+      sub.substr_of(req->miss_bl, miss_offset, segment.length);
+      req->out_bl->claim_append(sub);
+      miss_offset += segment.length;
+    }
+  }
+
+  // snapshot data must never land in the HEAD map
+  if (req->promote && req->miss_length > 0 &&
+      req->miss_length <= MAX_PROMOTE_BYTES && is_head()) {
+    Op *op = new Op(OP_PROMOTE, nullptr);
+    op->gen = req->gen;
+    op->bl = std::move(req->miss_bl);
+    split_extents(std::move(req->miss_extents), op);
+    queue_op(op);
+  }
+
+  if (cache_hit) {
+    // served entirely from the cache file: complete asynchronously
+    m_image_ctx.op_work_queue->queue(req->on_finish, 0);
+  } else {
+    req->on_finish->complete(0);
+  }
+  delete req;
+}
+
+template <typename I>
+void FileImageCache<I>::aio_write(Extents &&image_extents,
+                                  bufferlist&& bl,
+                                  int fadvise_flags,
+                                  Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "image_extents=" << image_extents << ", "
+                 << "on_finish=" << on_finish << dendl;
+
+  Op *op = new Op(OP_WRITE, on_finish);
+  op->bl = std::move(bl);
+  split_extents(std::move(image_extents), op);
+  queue_op(op);
+}
+
+template <typename I>
+void FileImageCache<I>::aio_discard(uint64_t offset, uint64_t length,
+                                    Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "offset=" << offset << ", "
+                 << "length=" << length << ", "
+                 << "on_finish=" << on_finish << dendl;
+
+  Op *op = new Op(OP_DISCARD, on_finish);
+  op->extents.emplace_back(offset, length);
+  queue_op(op);
+}
+
+template <typename I>
+void FileImageCache<I>::aio_flush(Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "on_finish=" << on_finish << dendl;
+
+  // completed writes are already stable in the cache file
+  m_image_ctx.op_work_queue->queue(on_finish, 0);
+}
+
+template <typename I>
+void FileImageCache<I>::init(Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << dendl;
+
+  if (!m_image_ctx.test_features(RBD_FEATURE_EXCLUSIVE_LOCK)) {
+    // nothing else would keep other clients off the image while the log
+    // holds dirty data
+    lderr(cct) << "persistent cache requires the exclusive-lock feature"
+               << dendl;
+    on_finish->complete(-EOPNOTSUPP);
+    return;
+  }
+
+  int r = open_file();
+  if (r < 0) {
+    on_finish->complete(r);
+    return;
+  }
+
+  if (m_last_dirty_seq > m_flushed_seq) {
+    // only replay the dirty entries if their owner died holding the
+    // image lock: anyone else may have written to the image since
+    auto req = managed_lock::GetLockerRequest<I>::create(
+      m_image_ctx.md_ctx, m_image_ctx.header_oid, true, &m_locker,
+      new FunctionContext([this, on_finish](int r) {
+          handle_get_locker(r, on_finish);
+        }));
+    req->send();
+    return;
+  }
+
+  m_worker.create("rbd_pcache");
+  on_finish->complete(0);
+}
+
+template <typename I>
+void FileImageCache<I>::handle_get_locker(int r, Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 10) << "r=" << r << dendl;
+
+  if (r < 0 && r != -ENOENT) {
+    lderr(cct) << "failed to retrieve image lock owner: " << cpp_strerror(r)
+               << dendl;
+    // keep the log for a later open
+    close_file(false);
+    on_finish->complete(r);
+    return;
+  }
+
+  if (r == -ENOENT || m_owner_cookie.empty() ||
+      m_locker.entity != entity_name_t::CLIENT(m_owner_id) ||
+      m_locker.cookie != m_owner_cookie) {
+    lderr(cct) << "discarding the dirty entries in " << m_path << ": the "
+               << "image lock is no longer held by client." << m_owner_id
+               << dendl;
+    {
+      RWLock::WLocker map_locker(m_map_lock);
+      m_map.clear();
+      ++m_map_gen;
+    }
+    m_entries.clear();
+    r = format_file();
+    if (r < 0) {
+      close_file(false);
+      on_finish->complete(r);
+      return;
+    }
+  }
+
+  m_worker.create("rbd_pcache");
+  on_finish->complete(0);
+}
+
+template <typename I>
+void FileImageCache<I>::shut_down(Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << dendl;
+
+  flush(new FunctionContext([this, on_finish](int r) {
+      // the flush may complete on the worker thread
+      m_image_ctx.op_work_queue->queue(new FunctionContext(
+        [this, on_finish](int r) {
+          {
+            Mutex::Locker locker(m_lock);
+            m_stopping = true;
+            m_cond.Signal();
+          }
+          m_worker.join();
+
+          std::list<Context*> canceled;
+          {
+            Mutex::Locker locker(m_lock);
+            for (auto op : m_ops) {
+              if (op->on_finish != nullptr) {
+                canceled.push_back(op->on_finish);
+              }
+              delete op;
+            }
+            m_ops.clear();
+          }
+          for (auto ctx : canceled) {
+            ctx->complete(-ESHUTDOWN);
+          }
+
+          // keep the log around if it could not be drained so that it is
+          // replayed on the next open
+          close_file(r >= 0);
+          on_finish->complete(r);
+        }), r);
+    }));
+}
+
+template <typename I>
+void FileImageCache<I>::invalidate(Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << dendl;
+
+  queue_op(new Op(OP_INVALIDATE, on_finish));
+}
+
+template <typename I>
+void FileImageCache<I>::flush(Context *on_finish) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << dendl;
+
+  // write back the whole log and flush the image
+  queue_op(new Op(OP_FLUSH, on_finish));
+}
+
+template <typename I>
+int FileImageCache<I>::open_file() {
+  CephContext *cct = m_image_ctx.cct;
+
+  if (m_image_ctx.persistent_cache_path.empty()) {
+    lderr(cct) << "rbd_persistent_cache_path is not set" << dendl;
+    return -EINVAL;
+  }
+
+  m_path = m_image_ctx.persistent_cache_path + "/rbd-" +
+           stringify(m_image_ctx.md_ctx.get_id()) + "." +
+           (m_image_ctx.old_format ? m_image_ctx.name : m_image_ctx.id) +
+           ".cache";
+  ldout(cct, 10) << "path=" << m_path << dendl;
+
+  m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (m_fd < 0) {
+    int r = -errno;
+    lderr(cct) << "failed to open cache file " << m_path << ": "
+               << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  // another client on this host may have the same image open
+  if (::flock(m_fd, LOCK_EX | LOCK_NB) < 0) {
+    int r = -errno;
+    lderr(cct) << "failed to lock cache file " << m_path << ": "
+               << cpp_strerror(r) << dendl;
+    VOID_TEMP_FAILURE_RETRY(::close(m_fd));
+    m_fd = -1;
+    return r;
+  }
+
+  uint64_t replay_offset;
+  uint64_t replay_seq;
+  int r = read_superblock(&replay_offset, &replay_seq);
+  if (r == 0) {
+    replay(replay_offset, replay_seq);
+  } else {
+    if (r != -ENODATA) {
+      lderr(cct) << "discarding unreadable cache file " << m_path << ": "
+                 << cpp_strerror(r) << dendl;
+    }
+
+    r = format_file();
+    if (r < 0) {
+      close_file(false);
+      return r;
+    }
+  }
+  return 0;
+}
+
+template <typename I>
+int FileImageCache<I>::format_file() {
+  CephContext *cct = m_image_ctx.cct;
+
+  set_file_size(std::max(
+    MIN_FILE_SIZE, ROUND_UP_TO(m_image_ctx.persistent_cache_size,
+                               BLOCK_SIZE)));
+  std::random_device rd;
+  m_nonce = (static_cast<uint64_t>(rd()) << 32) | rd();
+  m_owner_id = 0;
+  m_owner_cookie.clear();
+  m_tail = SUPERBLOCK_SIZE;
+  m_next_seq = 1;
+  m_flushed_seq = 0;
+  m_last_dirty_seq = 0;
+
+  int r = 0;
+  if (::ftruncate(m_fd, 0) < 0 || ::ftruncate(m_fd, m_file_size) < 0) {
+    r = -errno;
+  } else {
+    r = write_superblock(m_tail, m_next_seq);
+  }
+  if (r < 0) {
+    lderr(cct) << "failed to format cache file " << m_path << ": "
+               << cpp_strerror(r) << dendl;
+    return r;
+  }
+  m_pending_seq = m_next_seq;
+  return 0;
+}
+
+template <typename I>
+void FileImageCache<I>::set_file_size(uint64_t file_size) {
+  m_file_size = file_size;
+  m_max_entry = std::min(MAX_ENTRY_SIZE,
+                         ((m_file_size - SUPERBLOCK_SIZE) / 8) &
+                           ~(BLOCK_SIZE - 1));
+  m_writeback_max = std::max<uint64_t>(
+    m_image_ctx.persistent_cache_writeback_max_bytes, m_max_entry);
+}
+
+template <typename I>
+void FileImageCache<I>::close_file(bool remove) {
+  if (m_fd < 0) {
+    return;
+  }
+
+  if (remove && ::unlink(m_path.c_str()) < 0) {
+    lderr(m_image_ctx.cct) << "failed to remove cache file " << m_path << ": "
+                           << cpp_strerror(-errno) << dendl;
+  }
+  VOID_TEMP_FAILURE_RETRY(::close(m_fd));
+  m_fd = -1;
+}
+
+template <typename I>
+int FileImageCache<I>::read_superblock(uint64_t *replay_offset,
+                                       uint64_t *replay_seq) {
+  struct stat st;
+  if (::fstat(m_fd, &st) < 0) {
+    return -errno;
+  }
+  if (st.st_size == 0) {
+    return -ENODATA;
+  }
+
+  bufferptr bp(buffer::create_page_aligned(SUPERBLOCK_SIZE));
+  int r = safe_pread_exact(m_fd, bp.c_str(), SUPERBLOCK_SIZE, 0);
+  if (r < 0) {
+    return r;
+  }
+  bufferlist bl;
+  bl.push_back(std::move(bp));
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t nonce;
+  uint64_t file_size;
+  uint64_t owner_id;
+  std::string owner_cookie;
+  uint32_t crc;
+  try {
+    bufferlist::iterator p = bl.begin();
+    ::decode(magic, p);
+    ::decode(version, p);
+    ::decode(nonce, p);
+    ::decode(file_size, p);
+    ::decode(*replay_offset, p);
+    ::decode(*replay_seq, p);
+    ::decode(owner_id, p);
+    ::decode(owner_cookie, p);
+    bufferlist header;
+    header.substr_of(bl, 0, p.get_off());
+    ::decode(crc, p);
+    if (header.crc32c(-1) != crc) {
+      return -EIO;
+    }
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  if (magic != SUPERBLOCK_MAGIC || version != FORMAT_VERSION ||
+      file_size > static_cast<uint64_t>(st.st_size) ||
+      file_size < SUPERBLOCK_SIZE + HEADER_SIZE) {
+    return -EINVAL;
+  }
+
+  m_nonce = nonce;
+  m_owner_id = owner_id;
+  m_owner_cookie = owner_cookie;
+  m_replay_offset = *replay_offset;
+  m_replay_seq = *replay_seq;
+  set_file_size(file_size);
+  return 0;
+}
+
+template <typename I>
+int FileImageCache<I>::write_superblock(uint64_t replay_offset,
+                                        uint64_t replay_seq) {
+  bufferlist bl;
+  ::encode(SUPERBLOCK_MAGIC, bl);
+  ::encode(FORMAT_VERSION, bl);
+  ::encode(m_nonce, bl);
+  ::encode(m_file_size, bl);
+  ::encode(replay_offset, bl);
+  ::encode(replay_seq, bl);
+  ::encode(m_owner_id, bl);
+  ::encode(m_owner_cookie, bl);
+  uint32_t crc = bl.crc32c(-1);
+  ::encode(crc, bl);
+  bl.append_zero(SUPERBLOCK_SIZE - bl.length());
+
+  int r = bl.write_fd(m_fd, 0);
+  if (r < 0) {
+    return r;
+  }
+  if (::fdatasync(m_fd) < 0) {
+    return -errno;
+  }
+  m_replay_offset = replay_offset;
+  m_replay_seq = replay_seq;
+  return 0;
+}
+
+template <typename I>
+int FileImageCache<I>::update_owner() {
+  std::string cookie;
+  {
+    RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+    if (m_image_ctx.exclusive_lock != nullptr) {
+      cookie = m_image_ctx.exclusive_lock->get_cookie();
+    }
+  }
+  uint64_t owner_id = m_image_ctx.md_ctx.get_instance_id();
+  if (cookie.empty() ||
+      (owner_id == m_owner_id && cookie == m_owner_cookie)) {
+    return 0;
+  }
+
+  // dirty entries are attributed to the lock owner that logged or last
+  // wrote them back; a replay checks that this owner still holds the lock
+  ldout(m_image_ctx.cct, 10) << "owner=client." << owner_id << ", "
+                             << "cookie=" << cookie << dendl;
+  m_owner_id = owner_id;
+  m_owner_cookie = cookie;
+  return write_superblock(m_replay_offset, m_replay_seq);
+}
+
+template <typename I>
+int FileImageCache<I>::read_entry(uint64_t offset, uint64_t seq,
+                                  LogEntry *entry) {
+  if (offset < SUPERBLOCK_SIZE || offset + HEADER_SIZE > m_file_size) {
+    return -EINVAL;
+  }
+
+  bufferptr bp(buffer::create_page_aligned(HEADER_SIZE));
+  int r = safe_pread_exact(m_fd, bp.c_str(), HEADER_SIZE, offset);
+  if (r < 0) {
+    return r;
+  }
+  bufferlist bl;
+  bl.push_back(std::move(bp));
+
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t nonce;
+  uint32_t data_crc;
+  uint32_t crc;
+  try {
+    bufferlist::iterator p = bl.begin();
+    ::decode(magic, p);
+    ::decode(flags, p);
+    ::decode(nonce, p);
+    ::decode(entry->seq, p);
+    ::decode(entry->image_offset, p);
+    ::decode(entry->length, p);
+    ::decode(data_crc, p);
+    bufferlist header;
+    header.substr_of(bl, 0, p.get_off());
+    ::decode(crc, p);
+    if (header.crc32c(-1) != crc) {
+      return -EIO;
+    }
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  if (magic != ENTRY_MAGIC || nonce != m_nonce || entry->seq != seq) {
+    return -ENOENT;
+  }
+
+  entry->log_offset = offset;
+  entry->log_length = HEADER_SIZE + ROUND_UP_TO(entry->length, BLOCK_SIZE);
+  entry->dirty = (flags & ENTRY_FLAG_DIRTY) != 0;
+  if (entry->log_length > m_file_size - offset) {
+    return -EINVAL;
+  }
+
+  // a torn entry belongs to a write that was never acked
+  bufferptr data(buffer::create_page_aligned(entry->length));
+  r = safe_pread_exact(m_fd, data.c_str(), entry->length,
+                       offset + HEADER_SIZE);
+  if (r < 0) {
+    return r;
+  }
+  bufferlist data_bl;
+  data_bl.push_back(std::move(data));
+  if (data_bl.crc32c(-1) != data_crc) {
+    return -EIO;
+  }
+  return 0;
+}
+
+template <typename I>
+void FileImageCache<I>::replay(uint64_t offset, uint64_t seq) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 10) << "offset=" << offset << ", seq=" << seq << dendl;
+
+  m_tail = offset;
+  m_next_seq = seq;
+  m_flushed_seq = seq - 1;
+  m_last_dirty_seq = m_flushed_seq;
+
+  uint64_t dirty = 0;
+  uint64_t scanned = 0;
+  RWLock::WLocker map_locker(m_map_lock);
+  while (scanned < m_file_size) {
+    LogEntry entry;
+    int r = read_entry(offset, m_next_seq, &entry);
+    if (r < 0 && offset != SUPERBLOCK_SIZE) {
+      // the log wraps when an entry doesn't fit at the end of the file
+      offset = SUPERBLOCK_SIZE;
+      r = read_entry(offset, m_next_seq, &entry);
+    }
+    if (r < 0) {
+      break;
+    }
+
+    // clean entries may be stale relative to writes that have already
+    // been reclaimed, so only the dirty ones are trusted
+    m_entries.push_back(entry);
+    if (entry.dirty) {
+      map_insert(entry.image_offset, entry.length,
+                 entry.log_offset + HEADER_SIZE, entry.seq);
+      m_last_dirty_seq = entry.seq;
+      dirty += entry.length;
+    }
+    offset = entry.log_offset + entry.log_length;
+    scanned += entry.log_length;
+    m_tail = offset;
+    ++m_next_seq;
+  }
+
+  m_pending_seq = m_next_seq;
+
+  if (!m_entries.empty()) {
+    ldout(cct, 1) << "recovered " << m_entries.size() << " log entries with "
+                  << dirty << " dirty bytes from " << m_path << dendl;
+  }
+}
+
+template <typename I>
+void FileImageCache<I>::split_extents(Extents &&image_extents, Op *op) {
+  for (auto &extent : image_extents) {
+    uint64_t offset = extent.first;
+    uint64_t remaining = extent.second;
+    while (remaining > 0) {
+      uint64_t len = std::min(remaining, m_max_entry);
+      op->extents.emplace_back(offset, len);
+      offset += len;
+      remaining -= len;
+    }
+  }
+}
+
+template <typename I>
+void FileImageCache<I>::queue_op(Op *op) {
+  {
+    Mutex::Locker locker(m_lock);
+    if (!m_stopping) {
+      m_ops.push_back(op);
+      m_cond.Signal();
+      return;
+    }
+  }
+
+  if (op->on_finish != nullptr) {
+    op->on_finish->complete(-ESHUTDOWN);
+  }
+  delete op;
+}
+
+template <typename I>
+void FileImageCache<I>::process() {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 10) << "start" << dendl;
+
+  m_lock.Lock();
+  while (!m_stopping) {
+    Completions completed;
+    bool progress = false;
+    if (m_writeback_done) {
+      finish_writeback();
+      progress = true;
+    }
+    progress |= append_ops(&completed);
+    progress |= start_barrier(&completed);
+    progress |= start_writeback();
+
+    if (!completed.empty()) {
+      m_lock.Unlock();
+      for (auto &c : completed) {
+        c.first->complete(c.second);
+      }
+      m_lock.Lock();
+      continue;
+    }
+
+    if (!progress) {
+      if (m_writeback_error < 0 && !m_writeback_inflight) {
+        m_cond.WaitInterval(m_lock, utime_t(1, 0));
+      } else {
+        m_cond.Wait(m_lock);
+      }
+    }
+  }
+  m_lock.Unlock();
+
+  ldout(cct, 10) << "finish" << dendl;
+}
+
+template <typename I>
+bool FileImageCache<I>::alloc_log(uint64_t length, uint64_t *offset) {
+  assert(m_lock.is_locked());
+
+  if (m_entries.empty()) {
+    *offset = (m_tail + length <= m_file_size ? m_tail : SUPERBLOCK_SIZE);
+    return true;
+  }
+
+  uint64_t head = m_entries.front().log_offset;
+  if (head < m_tail) {
+    if (m_tail + length <= m_file_size) {
+      *offset = m_tail;
+      return true;
+    }
+    if (SUPERBLOCK_SIZE + length <= head) {
+      *offset = SUPERBLOCK_SIZE;
+      return true;
+    }
+    return false;
+  }
+  if (m_tail + length <= head) {
+    *offset = m_tail;
+    return true;
+  }
+  return false;
+}
+
+template <typename I>
+bool FileImageCache<I>::reclaim_log() {
+  assert(m_lock.is_locked());
+
+  if (m_entries.empty() || !is_reclaimable(m_entries.front())) {
+    return false;
+  }
+
+  LogEntry &entry = m_entries.front();
+  {
+    RWLock::WLocker map_locker(m_map_lock);
+    map_remove(entry.image_offset, entry.length, entry.seq);
+    ++m_map_gen;
+  }
+  m_entries.pop_front();
+  return true;
+}
+
+template <typename I>
+bool FileImageCache<I>::append_ops(Completions *completed) {
+  assert(m_lock.is_locked());
+  if (m_ops.empty() || m_ops.front()->is_barrier()) {
+    return false;
+  }
+
+  CephContext *cct = m_image_ctx.cct;
+  uint64_t start_gen = m_map_gen;
+  size_t added = 0;
+  m_pending_seq = m_next_seq;
+
+  // the batch is contiguous in the file unless it wraps
+  std::vector<std::pair<uint64_t, bufferlist> > runs;
+  std::vector<Op*> logged;
+  Op *partial = nullptr;
+  uint64_t batch_bytes = 0;
+  bool batch_dirty = false;
+  bool full = false;
+  for (auto op : m_ops) {
+    if (op->is_barrier()) {
+      break;
+    }
+    if (op->type == OP_PROMOTE && op->gen != m_map_gen) {
+      // raced with a discard or reclaim; the data may be stale
+      op->next = op->extents.size();
+    }
+
+    while (op->next < op->extents.size()) {
+      auto &extent = op->extents[op->next];
+      uint64_t log_length = HEADER_SIZE + ROUND_UP_TO(extent.second,
+                                                      BLOCK_SIZE);
+      uint64_t log_offset;
+      if (batch_bytes > 0 && batch_bytes + log_length > MAX_APPEND_BYTES) {
+        full = true;
+        break;
+      }
+      while (!alloc_log(log_length, &log_offset)) {
+        if (!reclaim_log()) {
+          // wait for writeback to make room
+          full = true;
+          break;
+        }
+      }
+      if (full) {
+        break;
+      }
+
+      LogEntry entry;
+      entry.seq = m_next_seq++;
+      entry.image_offset = extent.first;
+      entry.length = extent.second;
+      entry.log_offset = log_offset;
+      entry.log_length = log_length;
+      entry.dirty = (op->type == OP_WRITE);
+
+      bufferlist data;
+      data.substr_of(op->bl, op->bl_off, extent.second);
+
+      bufferlist header;
+      ::encode(ENTRY_MAGIC, header);
+      ::encode(entry.dirty ? ENTRY_FLAG_DIRTY : 0, header);
+      ::encode(m_nonce, header);
+      ::encode(entry.seq, header);
+      ::encode(entry.image_offset, header);
+      ::encode(entry.length, header);
+      ::encode(data.crc32c(-1), header);
+      uint32_t crc = header.crc32c(-1);
+      ::encode(crc, header);
+      header.append_zero(HEADER_SIZE - header.length());
+
+      if (runs.empty() ||
+          runs.back().first + runs.back().second.length() != log_offset) {
+        runs.emplace_back(log_offset, bufferlist());
+      }
+      bufferlist &run = runs.back().second;
+      run.claim_append(header);
+      run.claim_append(data);
+      run.append_zero(log_length - HEADER_SIZE - extent.second);
+
+      m_entries.push_back(entry);
+      batch_dirty |= entry.dirty;
+      ++added;
+      m_tail = log_offset + log_length;
+      batch_bytes += log_length;
+      op->bl_off += extent.second;
+      ++op->next;
+      partial = op;
+    }
+    if (full) {
+      break;
+    }
+    logged.push_back(op);
+    partial = nullptr;
+  }
+
+  if (logged.empty() && partial == nullptr) {
+    m_pending_seq = m_next_seq;
+    return false;
+  }
+
+  ldout(cct, 20) << "appending " << added << " entries, " << batch_bytes << " bytes" << dendl;
+
+  int r = 0;
+  m_lock.Unlock();
+  if (batch_dirty) {
+    r = update_owner();
+  }
+  for (auto &run : runs) {
+    if (r < 0) {
+      break;
+    }
+    r = run.second.write_fd(m_fd, run.first);
+  }
+  if (r == 0 && !runs.empty() && ::fdatasync(m_fd) < 0) {
+    r = -errno;
+  }
+  m_lock.Lock();
+
+  if (r < 0) {
+    lderr(cct) << "failed to append to cache file: " << cpp_strerror(r)
+               << dendl;
+    // the failed entries may have reached the file, so their space and
+    // sequence numbers are not reused: a replay walks over them
+    m_entries.resize(m_entries.size() - added);
+    if (partial != nullptr) {
+      logged.push_back(partial);
+    }
+  } else {
+    RWLock::WLocker map_locker(m_map_lock);
+    for (size_t i = m_entries.size() - added; i < m_entries.size(); ++i) {
+      LogEntry &entry = m_entries[i];
+      uint64_t file_offset = entry.log_offset + HEADER_SIZE;
+      if (entry.dirty) {
+        map_insert(entry.image_offset, entry.length, file_offset, entry.seq);
+        m_last_dirty_seq = entry.seq;
+      } else if (m_map_gen == start_gen) {
+        map_fill(entry.image_offset, entry.length, file_offset, entry.seq);
+      }
+    }
+  }
+  m_pending_seq = m_next_seq;
+
+  for (auto op : logged) {
+    assert(m_ops.front() == op);
+    m_ops.pop_front();
+    if (op->on_finish != nullptr) {
+      completed->emplace_back(op->on_finish, r);
+    }
+    delete op;
+  }
+  return true;
+}
+
+template <typename I>
+bool FileImageCache<I>::start_barrier(Completions *completed) {
+  assert(m_lock.is_locked());
+  if (m_barrier != nullptr || m_ops.empty() || !m_ops.front()->is_barrier()) {
+    return false;
+  }
+
+  CephContext *cct = m_image_ctx.cct;
+  Op *op = m_ops.front();
+  if (m_writeback_error < 0 && !m_writeback_inflight) {
+    // report the writeback failure; the log is retried later
+    lderr(cct) << "failing barrier: " << cpp_strerror(m_writeback_error)
+               << dendl;
+    m_ops.pop_front();
+    completed->emplace_back(op->on_finish, m_writeback_error);
+    m_writeback_error = 0;
+    delete op;
+    return true;
+  }
+  if (m_writeback_inflight || m_last_dirty_seq > m_flushed_seq) {
+    // wait for the log to drain
+    return false;
+  }
+
+  ldout(cct, 20) << "type=" << op->type << dendl;
+  m_ops.pop_front();
+  m_barrier = op;
+
+  if (op->type == OP_DISCARD || op->type == OP_INVALIDATE) {
+    RWLock::WLocker map_locker(m_map_lock);
+    if (op->type == OP_DISCARD) {
+      map_remove(op->extents[0].first, op->extents[0].second);
+    } else {
+      m_map.clear();
+    }
+    ++m_map_gen;
+  }
+
+  m_lock.Unlock();
+  Context *ctx = new FunctionContext([this](int r) {
+      handle_barrier(r);
+    });
+  switch (op->type) {
+  case OP_DISCARD:
+    {
+      RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+      m_image_writeback.aio_discard(op->extents[0].first,
+                                    op->extents[0].second, ctx);
+    }
+    break;
+  case OP_FLUSH:
+    {
+      RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+      m_image_writeback.aio_flush(ctx);
+    }
+    break;
+  default:
+    ctx->complete(0);
+    break;
+  }
+  m_lock.Lock();
+  return true;
+}
+
+template <typename I>
+void FileImageCache<I>::handle_barrier(int r) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "r=" << r << dendl;
+
+  Op *op;
+  {
+    Mutex::Locker locker(m_lock);
+    assert(m_barrier != nullptr);
+    op = m_barrier;
+    m_barrier = nullptr;
+    m_cond.Signal();
+  }
+
+  op->on_finish->complete(r);
+  delete op;
+}
+
+template <typename I>
+bool FileImageCache<I>::start_writeback() {
+  assert(m_lock.is_locked());
+  if (m_writeback_inflight || m_last_dirty_seq <= m_flushed_seq) {
+    return false;
+  }
+  if (m_writeback_error < 0 && ceph_clock_now() < m_writeback_retry) {
+    return false;
+  }
+  CephContext *cct = m_image_ctx.cct;
+  if (cct->_conf->rbd_persistent_cache_debug_hold_writeback &&
+      (m_ops.empty() || !m_ops.front()->is_barrier())) {
+    return false;
+  }
+
+  // write back the oldest dirty entries in log order.  a request is
+  // cut short at the first entry that overlaps an earlier one so that
+  // the image sees overwrites in order.
+  auto p = std::upper_bound(
+    m_entries.begin(), m_entries.end(), m_flushed_seq,
+    [](uint64_t seq, const LogEntry &entry) {
+      return seq < entry.seq;
+    });
+  interval_set<uint64_t> batch;
+  std::vector<LogEntry> entries;
+  uint64_t bytes = 0;
+  for (; p != m_entries.end() && p->seq < m_pending_seq; ++p) {
+    if (!p->dirty) {
+      continue;
+    }
+    if (bytes > 0 && bytes + p->length > m_writeback_max) {
+      break;
+    }
+    if (batch.intersects(p->image_offset, p->length)) {
+      break;
+    }
+    batch.union_insert(p->image_offset, p->length);
+    entries.push_back(*p);
+    bytes += p->length;
+  }
+  if (entries.empty()) {
+    return false;
+  }
+
+  m_writeback_inflight = true;
+  m_writeback_seq = entries.back().seq;
+  m_lock.Unlock();
+
+  {
+    RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+    if (m_image_ctx.exclusive_lock != nullptr &&
+        !m_image_ctx.exclusive_lock->is_lock_owner()) {
+      // entries recovered from the log can be written back before any
+      // client write has acquired the lock
+      ldout(cct, 10) << "acquiring exclusive lock" << dendl;
+      m_image_ctx.exclusive_lock->acquire_lock(new FunctionContext(
+        [this](int r) {
+          handle_lock_acquired(r);
+        }));
+      m_lock.Lock();
+      return true;
+    }
+  }
+
+  // recovered entries now belong to this lock owner
+  int r = update_owner();
+  if (r < 0) {
+    lderr(cct) << "failed to update cache file superblock: "
+               << cpp_strerror(r) << dendl;
+    handle_writeback(r);
+    m_lock.Lock();
+    return true;
+  }
+
+  // dirty entries are never reclaimed, so they are safe to read unlocked
+  std::map<uint64_t, bufferlist> data;
+  for (auto &entry : entries) {
+    bufferptr bp(buffer::create_page_aligned(entry.length));
+    r = safe_pread_exact(m_fd, bp.c_str(), entry.length,
+                         entry.log_offset + HEADER_SIZE);
+    if (r < 0) {
+      break;
+    }
+    data[entry.image_offset].push_back(std::move(bp));
+  }
+  if (r < 0) {
+    lderr(cct) << "failed to read from cache file: " << cpp_strerror(r)
+               << dendl;
+    handle_writeback(r);
+    m_lock.Lock();
+    return true;
+  }
+
+  // coalesce adjacent extents
+  Extents image_extents;
+  bufferlist bl;
+  for (auto &it : data) {
+    if (!image_extents.empty() &&
+        image_extents.back().first + image_extents.back().second == it.first) {
+      image_extents.back().second += it.second.length();
+    } else {
+      image_extents.emplace_back(it.first, it.second.length());
+    }
+    bl.claim_append(it.second);
+  }
+
+  ldout(cct, 20) << "writing back " << entries.size() << " entries through "
+                 << "seq " << m_writeback_seq << " as " << image_extents
+                 << dendl;
+  {
+    RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+    m_image_writeback.aio_write(std::move(image_extents), std::move(bl), 0,
+                                new FunctionContext([this](int r) {
+        handle_writeback(r);
+      }));
+  }
+  m_lock.Lock();
+  return true;
+}
+
+template <typename I>
+void FileImageCache<I>::handle_lock_acquired(int r) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 10) << "r=" << r << dendl;
+
+  Mutex::Locker locker(m_lock);
+  assert(m_writeback_inflight);
+  m_writeback_inflight = false;
+  if (r < 0) {
+    lderr(cct) << "failed to acquire exclusive lock: " << cpp_strerror(r)
+               << dendl;
+    m_writeback_error = r;
+    m_writeback_retry = ceph_clock_now();
+    m_writeback_retry += 1.0;
+  }
+  m_cond.Signal();
+}
+
+template <typename I>
+void FileImageCache<I>::handle_writeback(int r) {
+  CephContext *cct = m_image_ctx.cct;
+  ldout(cct, 20) << "r=" << r << dendl;
+
+  Mutex::Locker locker(m_lock);
+  assert(m_writeback_inflight);
+  m_writeback_r = r;
+  m_writeback_done = true;
+  m_cond.Signal();
+}
+
+template <typename I>
+void FileImageCache<I>::finish_writeback() {
+  assert(m_lock.is_locked());
+  CephContext *cct = m_image_ctx.cct;
+
+  m_writeback_done = false;
+  int r = m_writeback_r;
+  if (r >= 0 && !m_writeback_flushing &&
+      m_image_ctx.object_cacher != nullptr) {
+    // the object cacher may have only buffered the data
+    m_writeback_flushing = true;
+    m_lock.Unlock();
+    {
+      RWLock::RLocker owner_locker(m_image_ctx.owner_lock);
+      m_image_writeback.aio_flush(new FunctionContext([this](int r) {
+          handle_writeback(r);
+        }));
+    }
+    m_lock.Lock();
+    return;
+  }
+  m_writeback_flushing = false;
+
+  if (r >= 0) {
+    // persist the new replay point before the written back entries can
+    // be reclaimed
+    uint64_t replay_offset = m_tail;
+    uint64_t replay_seq = m_next_seq;
+    auto p = std::upper_bound(
+      m_entries.begin(), m_entries.end(), m_writeback_seq,
+      [](uint64_t seq, const LogEntry &entry) {
+        return seq < entry.seq;
+      });
+    if (p != m_entries.end()) {
+      replay_offset = p->log_offset;
+      replay_seq = p->seq;
+    }
+
+    m_lock.Unlock();
+    r = write_superblock(replay_offset, replay_seq);
+    m_lock.Lock();
+  }
+
+  m_writeback_inflight = false;
+  if (r < 0) {
+    lderr(cct) << "failed to write back cache: " << cpp_strerror(r) << dendl;
+    m_writeback_error = r;
+    m_writeback_retry = ceph_clock_now();
+    m_writeback_retry += 1.0;
+    return;
+  }
+
+  m_writeback_error = 0;
+  m_flushed_seq = m_writeback_seq;
+}
+
+template <typename I>
+void FileImageCache<I>::map_insert(uint64_t offset, uint64_t length,
+                                   uint64_t file_offset, uint64_t seq) {
+  assert(m_map_lock.is_wlocked());
+  if (length == 0) {
+    return;
+  }
+  map_remove(offset, length);
+  m_map[offset] = MapExtent{length, file_offset, seq};
+}
+
+template <typename I>
+void FileImageCache<I>::map_fill(uint64_t offset, uint64_t length,
+                                 uint64_t file_offset, uint64_t seq) {
+  assert(m_map_lock.is_wlocked());
+
+  // only cover the holes; anything already mapped is newer
+  uint64_t pos = offset;
+  uint64_t end = offset + length;
+  auto p = m_map.lower_bound(pos);
+  if (p != m_map.begin()) {
+    auto q = std::prev(p);
+    if (q->first + q->second.length > pos) {
+      pos = std::min(end, q->first + q->second.length);
+    }
+  }
+  while (pos < end) {
+    uint64_t next = end;
+    if (p != m_map.end() && p->first < end) {
+      next = p->first;
+    }
+    if (next > pos) {
+      m_map[pos] = MapExtent{next - pos, file_offset + pos - offset, seq};
+    }
+    if (next == end) {
+      break;
+    }
+    pos = std::min(end, p->first + p->second.length);
+    ++p;
+  }
+}
+
+template <typename I>
+void FileImageCache<I>::map_remove(uint64_t offset, uint64_t length,
+                                   uint64_t seq) {
+  assert(m_map_lock.is_wlocked());
+
+  uint64_t end = offset + length;
+  auto p = m_map.lower_bound(offset);
+  if (p != m_map.begin()) {
+    auto q = std::prev(p);
+    if (q->first + q->second.length > offset) {
+      p = q;
+    }
+  }
+  while (p != m_map.end() && p->first < end) {
+    if (seq != 0 && p->second.seq != seq) {
+      ++p;
+      continue;
+    }
+
+    uint64_t start = p->first;
+    MapExtent extent = p->second;
+    p = m_map.erase(p);
+    if (start < offset) {
+      m_map[start] = MapExtent{offset - start, extent.file_offset, extent.seq};
+    }
+    if (start + extent.length > end) {
+      m_map[end] = MapExtent{start + extent.length - end,
+                             extent.file_offset + end - start, extent.seq};
+    }
+  }
+}
+
+} // namespace cache
+} // namespace librbd
+
+template class librbd::cache::FileImageCache<librbd::ImageCtx>;
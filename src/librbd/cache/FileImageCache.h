@@ -0,0 +1,212 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_LIBRBD_CACHE_FILE_IMAGE_CACHE
+#define CEPH_LIBRBD_CACHE_FILE_IMAGE_CACHE
+
+#include "ImageCache.h"
+#include "ImageWriteback.h"
+#include "include/buffer.h"
+#include "common/Cond.h"
+#include "common/Mutex.h"
+#include "common/RWLock.h"
+#include "common/Thread.h"
+#include "include/utime.h"
+#include "librbd/managed_lock/Types.h"
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+namespace librbd {
+
+struct ImageCtx;
+
+namespace cache {
+
+/**
+ * Persistent, write-back client-side image extent cache
+ *
+ * Writes are appended to a log kept in a local file (ideally on an SSD)
+ * and are acked as soon as the log is stable.  A worker thread
+ * group-commits concurrent writes with a single fdatasync and writes the
+ * log back to the image in order, coalescing adjacent extents.  Logged
+ * extents remain readable from the local file until their space is
+ * reclaimed and read misses are promoted into the log, so hot data is
+ * served locally.  If the client dies, the dirty part of the log is
+ * recovered and written back the next time the image is opened, provided
+ * the image's exclusive lock is still held by the client that logged it.
+ * Snapshots are always read from the image.
+ */
+template <typename ImageCtxT = librbd::ImageCtx>
+class FileImageCache : public ImageCache {
+public:
+  FileImageCache(ImageCtxT &image_ctx);
+  virtual ~FileImageCache();
+
+  /// client AIO methods
+  virtual void aio_read(Extents&& image_extents, ceph::bufferlist *bl,
+                        int fadvise_flags, Context *on_finish);
+  virtual void aio_write(Extents&& image_extents, ceph::bufferlist&& bl,
+                         int fadvise_flags, Context *on_finish);
+  virtual void aio_discard(uint64_t offset, uint64_t length,
+                           Context *on_finish);
+  virtual void aio_flush(Context *on_finish);
+
+  /// internal state methods
+  virtual void init(Context *on_finish);
+  virtual void shut_down(Context *on_finish);
+
+  virtual void invalidate(Context *on_finish);
+  virtual void flush(Context *on_finish);
+
+private:
+  enum OpType {
+    OP_WRITE,       ///< log dirty extents
+    OP_PROMOTE,     ///< log clean extents read from the image
+    OP_DISCARD,     ///< barrier: drain log, discard image extent
+    OP_FLUSH,       ///< barrier: drain log, flush image
+    OP_INVALIDATE,  ///< barrier: drain log, drop cached extents
+  };
+
+  struct Op {
+    OpType type;
+    Extents extents;      ///< split into pieces of at most m_max_entry
+    ceph::bufferlist bl;
+    size_t next = 0;      ///< next piece to log
+    uint64_t bl_off = 0;  ///< offset of the next piece within bl
+    uint64_t gen = 0;     ///< map generation a promotion was read at
+    Context *on_finish;
+
+    Op(OpType type, Context *on_finish) : type(type), on_finish(on_finish) {
+    }
+    bool is_barrier() const {
+      return type != OP_WRITE && type != OP_PROMOTE;
+    }
+  };
+
+  struct LogEntry {
+    uint64_t seq;
+    uint64_t image_offset;
+    uint64_t length;
+    uint64_t log_offset;  ///< offset of the entry header within the file
+    uint64_t log_length;  ///< header plus padded data
+    bool dirty;
+  };
+
+  /// cached image extent, keyed by image offset in m_map
+  struct MapExtent {
+    uint64_t length;
+    uint64_t file_offset;
+    uint64_t seq;
+  };
+
+  struct ReadRequest;
+
+  typedef std::list<std::pair<Context*, int> > Completions;
+
+  class Worker : public Thread {
+  public:
+    explicit Worker(FileImageCache *cache) : m_cache(cache) {
+    }
+  protected:
+    virtual void *entry() {
+      m_cache->process();
+      return nullptr;
+    }
+  private:
+    FileImageCache *m_cache;
+  };
+
+  ImageCtxT &m_image_ctx;
+  ImageWriteback<ImageCtxT> m_image_writeback;
+
+  std::string m_path;
+  int m_fd = -1;
+  uint64_t m_file_size = 0;
+  uint64_t m_nonce = 0;
+
+  // superblock state, only updated by init and the worker thread
+  uint64_t m_replay_offset = 0;
+  uint64_t m_replay_seq = 0;
+  uint64_t m_owner_id = 0;         ///< client that holds the dirty entries
+  std::string m_owner_cookie;      ///< ... and its exclusive lock cookie
+  managed_lock::Locker m_locker;   ///< image lock owner found by init
+  uint64_t m_max_entry = 0;      ///< largest single log entry payload
+  uint64_t m_writeback_max = 0;  ///< largest coalesced writeback request
+
+  Mutex m_lock;
+  Cond m_cond;
+  std::deque<Op*> m_ops;           ///< queued ops, not yet logged
+  std::deque<LogEntry> m_entries;  ///< log contents, oldest first
+  uint64_t m_tail = 0;             ///< next append offset
+  uint64_t m_next_seq = 1;
+  uint64_t m_pending_seq = 0;      ///< first seq of the batch being logged
+  uint64_t m_last_dirty_seq = 0;
+  uint64_t m_flushed_seq = 0;      ///< dirty entries <= this are written back
+
+  bool m_writeback_inflight = false;
+  bool m_writeback_done = false;
+  bool m_writeback_flushing = false;
+  int m_writeback_r = 0;
+  uint64_t m_writeback_seq = 0;    ///< last seq of the in-flight writeback
+  int m_writeback_error = 0;
+  utime_t m_writeback_retry;
+
+  Op *m_barrier = nullptr;         ///< barrier op in flight against the image
+  bool m_stopping = false;
+
+  RWLock m_map_lock;
+  std::map<uint64_t, MapExtent> m_map;
+  uint64_t m_map_gen = 0;          ///< bumped whenever extents are dropped
+
+  Worker m_worker;
+
+  int open_file();
+  int format_file();
+  void set_file_size(uint64_t file_size);
+  void close_file(bool remove);
+  int read_superblock(uint64_t *replay_offset, uint64_t *replay_seq);
+  int write_superblock(uint64_t replay_offset, uint64_t replay_seq);
+  int read_entry(uint64_t offset, uint64_t seq, LogEntry *entry);
+  void replay(uint64_t offset, uint64_t seq);
+  void handle_get_locker(int r, Context *on_finish);
+  int update_owner();
+
+  void queue_op(Op *op);
+  void split_extents(Extents &&image_extents, Op *op);
+
+  void process();
+  bool append_ops(Completions *completed);
+  bool start_barrier(Completions *completed);
+  void handle_barrier(int r);
+  bool start_writeback();
+  void handle_lock_acquired(int r);
+  void handle_writeback(int r);
+  void finish_writeback();
+
+  bool alloc_log(uint64_t length, uint64_t *offset);
+  bool reclaim_log();
+  bool is_reclaimable(const LogEntry &entry) const {
+    return (entry.seq < m_pending_seq &&
+            (!entry.dirty || entry.seq <= m_flushed_seq));
+  }
+
+  void map_insert(uint64_t offset, uint64_t length, uint64_t file_offset,
+                  uint64_t seq);
+  void map_fill(uint64_t offset, uint64_t length, uint64_t file_offset,
+                uint64_t seq);
+  void map_remove(uint64_t offset, uint64_t length, uint64_t seq = 0);
+  void map_lookup(const Extents &image_extents, ReadRequest *req);
+
+  bool is_head() const;
+  void handle_read(ReadRequest *req, int r);
+
+};
+
+} // namespace cache
+} // namespace librbd
+
+extern template class librbd::cache::FileImageCache<librbd::ImageCtx>;
+
+#endif // CEPH_LIBRBD_CACHE_FILE_IMAGE_CACHE
@@ -48,6 +48,9 @@ private:
    * FLUSH_READAHEAD
    *    |
    *    v
+   * SHUT_DOWN_IMAGE_CACHE (skip if disabled)
+   *    |
+   *    v
    * SHUTDOWN_CACHE
    *    |
    *    v
@@ -92,6 +95,9 @@ private:
   void send_flush_readahead();
   void handle_flush_readahead(int r);
 
+  void send_shut_down_image_cache();
+  void handle_shut_down_image_cache(int r);
+
   void send_shut_down_cache();
   void handle_shut_down_cache(int r);
 
@@ -7,6 +7,7 @@
 #include "cls/rbd/cls_rbd_client.h"
 #include "librbd/ImageCtx.h"
 #include "librbd/Utils.h"
+#include "librbd/cache/FileImageCache.h"
 #include "librbd/image/CloseRequest.h"
 #include "librbd/image/RefreshRequest.h"
 #include "librbd/image/SetSnapRequest.h"
@@ -449,8 +450,7 @@ Context *OpenRequest<I>::handle_refresh(int *result) {
 template <typename I>
 Context *OpenRequest<I>::send_set_snap(int *result) {
   if (m_image_ctx->snap_name.empty()) {
-    *result = 0;
-    return m_on_finish;
+    return send_init_image_cache(result);
   }
 
   CephContext *cct = m_image_ctx->cct;
@@ -476,6 +476,42 @@ Context *OpenRequest<I>::handle_set_snap(int *result) {
     return nullptr;
   }
 
+  return send_init_image_cache(result);
+}
+
+template <typename I>
+Context *OpenRequest<I>::send_init_image_cache(int *result) {
+  if (!m_image_ctx->persistent_cache || m_image_ctx->read_only ||
+      !m_image_ctx->snap_name.empty()) {
+    *result = 0;
+    return m_on_finish;
+  }
+
+  CephContext *cct = m_image_ctx->cct;
+  ldout(cct, 10) << this << " " << __func__ << dendl;
+
+  using klass = OpenRequest<I>;
+  m_image_cache = new cache::FileImageCache<I>(*m_image_ctx);
+  m_image_cache->init(
+    create_context_callback<klass, &klass::handle_init_image_cache>(this));
+  return nullptr;
+}
+
+template <typename I>
+Context *OpenRequest<I>::handle_init_image_cache(int *result) {
+  CephContext *cct = m_image_ctx->cct;
+  ldout(cct, 10) << __func__ << ": r=" << *result << dendl;
+
+  if (*result < 0) {
+    // the image is still usable without the cache
+    lderr(cct) << "failed to initialize persistent cache: "
+               << cpp_strerror(*result) << dendl;
+    delete m_image_cache;
+    *result = 0;
+  } else {
+    m_image_ctx->image_cache = m_image_cache;
+  }
+  m_image_cache = nullptr;
   return m_on_finish;
 }
 
@@ -14,6 +14,8 @@ namespace librbd {
 
 class ImageCtx;
 
+namespace cache { struct ImageCache; }
+
 namespace image {
 
 template <typename ImageCtxT = ImageCtx>
@@ -61,6 +63,9 @@ private:
    *                                             SET_SNAP (skip if no snap)
    *                                                |
    *                                                v
+   *                                             INIT_IMAGE_CACHE (skip if
+   *                                                |              disabled)
+   *                                                v
    *                                             <finish>
    *                                                ^
    *     (on error)                                 |
@@ -81,6 +86,8 @@ private:
   std::string m_last_metadata_key;
   std::map<std::string, bufferlist> m_metadata;
 
+  cache::ImageCache *m_image_cache = nullptr;
+
   void send_v1_detect_header();
   Context *handle_v1_detect_header(int *result);
 
@@ -114,6 +121,9 @@ private:
   Context *send_set_snap(int *result);
   Context *handle_set_snap(int *result);
 
+  Context *send_init_image_cache(int *result);
+  Context *handle_init_image_cache(int *result);
+
   void send_close_image(int error_result);
   Context *handle_close_image(int *result);
 
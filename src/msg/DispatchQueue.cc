@@ -29,11 +29,13 @@
 #define dout_prefix *_dout << "-- " << msgr->get_myaddr() << " "
 
 double DispatchQueue::get_max_age(utime_t now) const {
-  Mutex::Locker l(lock);
-  if (marrival.empty())
-    return 0;
-  else
-    return (now - marrival.begin()->first);
+  double age = 0;
+  for (auto s : shards) {
+    Mutex::Locker l(s->lock);
+    if (!s->marrival.empty())
+      age = std::max<double>(age, now - s->marrival.begin()->first);
+  }
+  return age;
 }
 
 uint64_t DispatchQueue::pre_dispatch(Message *m)
@@ -79,18 +81,18 @@ void DispatchQueue::fast_preprocess(Message *m)
 
 void DispatchQueue::enqueue(Message *m, int priority, uint64_t id)
 {
-
-  Mutex::Locker l(lock);
+  Shard *s = get_shard(m->get_connection().get());
+  Mutex::Locker l(s->lock);
   ldout(cct,20) << "queue " << m << " prio " << priority << dendl;
-  add_arrival(m);
+  s->add_arrival(m);
   if (priority >= CEPH_MSG_PRIO_LOW) {
-    mqueue.enqueue_strict(
+    s->mqueue.enqueue_strict(
         id, priority, QueueItem(m));
   } else {
-    mqueue.enqueue(
+    s->mqueue.enqueue(
         id, priority, m->get_cost(), QueueItem(m));
   }
-  cond.Signal();
+  s->cond.Signal();
 }
 
 void DispatchQueue::local_delivery(Message *m, int priority)
@@ -148,14 +150,15 @@ void DispatchQueue::dispatch_throttle_release(uint64_t msize)
  * end of the queue. If the queue is empty; it's removed.
  * The message is then delivered and the process starts again.
  */
-void DispatchQueue::entry()
+void DispatchQueue::entry(Shard *s)
 {
+  Mutex& lock = s->lock;
   lock.Lock();
   while (true) {
-    while (!mqueue.empty()) {
-      QueueItem qitem = mqueue.dequeue();
+    while (!s->mqueue.empty()) {
+      QueueItem qitem = s->mqueue.dequeue();
       if (!qitem.is_code())
-	remove_arrival(qitem.get_message());
+	s->remove_arrival(qitem.get_message());
       lock.Unlock();
 
       if (qitem.is_code()) {
@@ -205,38 +208,43 @@ void DispatchQueue::entry()
       break;
 
     // wait for something to be put on queue
-    cond.Wait(lock);
+    s->cond.Wait(lock);
   }
   lock.Unlock();
 }
 
 void DispatchQueue::discard_queue(uint64_t id) {
-  Mutex::Locker l(lock);
-  list<QueueItem> removed;
-  mqueue.remove_by_class(id, &removed);
-  for (list<QueueItem>::iterator i = removed.begin();
-       i != removed.end();
-       ++i) {
-    assert(!(i->is_code())); // We don't discard id 0, ever!
-    Message *m = i->get_message();
-    remove_arrival(m);
-    dispatch_throttle_release(m->get_dispatch_throttle_size());
-    m->put();
+  // we don't know the connection, so look in every shard
+  for (auto s : shards) {
+    Mutex::Locker l(s->lock);
+    list<QueueItem> removed;
+    s->mqueue.remove_by_class(id, &removed);
+    for (list<QueueItem>::iterator i = removed.begin();
+	 i != removed.end();
+	 ++i) {
+      assert(!(i->is_code())); // We don't discard id 0, ever!
+      Message *m = i->get_message();
+      s->remove_arrival(m);
+      dispatch_throttle_release(m->get_dispatch_throttle_size());
+      m->put();
+    }
   }
 }
 
 void DispatchQueue::start()
 {
   assert(!stop);
-  assert(!dispatch_thread.is_started());
-  dispatch_thread.create("ms_dispatch");
+  assert(!is_started());
+  for (auto s : shards)
+    s->dispatch_thread.create("ms_dispatch");
   local_delivery_thread.create("ms_local");
 }
 
 void DispatchQueue::wait()
 {
   local_delivery_thread.join();
-  dispatch_thread.join();
+  for (auto s : shards)
+    s->dispatch_thread.join();
 }
 
 void DispatchQueue::discard_local()
@@ -258,9 +266,11 @@ void DispatchQueue::shutdown()
   local_delivery_cond.Signal();
   local_delivery_lock.Unlock();
 
-  // stop my dispatch thread
-  lock.Lock();
+  // stop my dispatch threads
   stop = true;
-  cond.Signal();
-  lock.Unlock();
+  for (auto s : shards) {
+    s->lock.Lock();
+    s->cond.Signal();
+    s->lock.Unlock();
+  }
 }
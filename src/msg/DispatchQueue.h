@@ -17,8 +17,11 @@
 
 #include <atomic>
 #include <map>
+#include <vector>
 #include <boost/intrusive_ptr.hpp>
 #include "include/assert.h"
+#include "include/hash.h"
+#include "include/stringify.h"
 #include "include/xlist.h"
 #include "include/atomic.h"
 #include "common/Mutex.h"
@@ -36,6 +39,14 @@ struct Connection;
  * they want to be dispatched, carefully organized by Message priority
  * and permitted to deliver in a round-robin fashion.
  * See Messenger::dispatch_entry for details.
+ *
+ * With ms_dispatch_shards > 1 the queue is split into that many shards,
+ * each with its own lock, queue and dispatch thread.  A connection's
+ * messages and events always go to the same shard, so they are still
+ * delivered in order, but different connections no longer contend on
+ * one lock nor wait behind one thread.  The Dispatchers must then cope
+ * with concurrent ms_dispatch calls.  All shards share the dispatch
+ * throttler.
  */
 class DispatchQueue {
   class QueueItem {
@@ -64,45 +75,74 @@ class DispatchQueue {
     
   CephContext *cct;
   Messenger *msgr;
-  mutable Mutex lock;
-  Cond cond;
-
-  PrioritizedQueue<QueueItem, uint64_t> mqueue;
-
-  set<pair<double, Message*> > marrival;
-  map<Message *, set<pair<double, Message*> >::iterator> marrival_map;
-  void add_arrival(Message *m) {
-    marrival_map.insert(
-      make_pair(
-	m,
-	marrival.insert(make_pair(m->get_recv_stamp(), m)).first
-	)
-      );
-  }
-  void remove_arrival(Message *m) {
-    map<Message *, set<pair<double, Message*> >::iterator>::iterator i =
-      marrival_map.find(m);
-    assert(i != marrival_map.end());
-    marrival.erase(i->second);
-    marrival_map.erase(i);
+
+  struct Shard {
+    mutable Mutex lock;
+    Cond cond;
+
+    PrioritizedQueue<QueueItem, uint64_t> mqueue;
+
+    set<pair<double, Message*> > marrival;
+    map<Message *, set<pair<double, Message*> >::iterator> marrival_map;
+    void add_arrival(Message *m) {
+      marrival_map.insert(
+	make_pair(
+	  m,
+	  marrival.insert(make_pair(m->get_recv_stamp(), m)).first
+	  )
+	);
+    }
+    void remove_arrival(Message *m) {
+      map<Message *, set<pair<double, Message*> >::iterator>::iterator i =
+	marrival_map.find(m);
+      assert(i != marrival_map.end());
+      marrival.erase(i->second);
+      marrival_map.erase(i);
+    }
+
+    /**
+     * The DispatchThread runs dispatch_entry to empty out its shard.
+     */
+    class DispatchThread : public Thread {
+      DispatchQueue *dq;
+      Shard *shard;
+    public:
+      DispatchThread(DispatchQueue *dq, Shard *s) : dq(dq), shard(s) {}
+      void *entry() {
+	dq->entry(shard);
+	return 0;
+      }
+    } dispatch_thread;
+
+    Shard(DispatchQueue *dq, CephContext *cct, const string& name)
+      : lock(name),
+	mqueue(cct->_conf->ms_pq_max_tokens_per_priority,
+	       cct->_conf->ms_pq_min_cost),
+	dispatch_thread(dq, this) {}
+  };
+  vector<Shard*> shards;
+
+  Shard *get_shard(Connection *con) {
+    if (shards.size() == 1)
+      return shards[0];
+    return shards[rjhash64((uint64_t)(uintptr_t)con) % shards.size()];
   }
 
   std::atomic<uint64_t> next_id;
     
   enum { D_CONNECT = 1, D_ACCEPT, D_BAD_REMOTE_RESET, D_BAD_RESET, D_CONN_REFUSED, D_NUM_CODES };
 
-  /**
-   * The DispatchThread runs dispatch_entry to empty out the dispatch_queue.
-   */
-  class DispatchThread : public Thread {
-    DispatchQueue *dq;
-  public:
-    explicit DispatchThread(DispatchQueue *dq) : dq(dq) {}
-    void *entry() {
-      dq->entry();
-      return 0;
-    }
-  } dispatch_thread;
+  void queue_code(int code, Connection *con) {
+    Shard *s = get_shard(con);
+    Mutex::Locker l(s->lock);
+    if (stop)
+      return;
+    s->mqueue.enqueue_strict(
+      0,
+      CEPH_MSG_PRIO_HIGHEST,
+      QueueItem(code, con));
+    s->cond.Signal();
+  }
 
   Mutex local_delivery_lock;
   Cond local_delivery_cond;
@@ -126,15 +166,19 @@ class DispatchQueue {
   /// Throttle preventing us from building up a big backlog waiting for dispatch
   Throttle dispatch_throttler;
 
-  bool stop;
+  std::atomic<bool> stop;
   void local_delivery(Message *m, int priority);
   void run_local_delivery();
 
   double get_max_age(utime_t now) const;
 
   int get_queue_len() const {
-    Mutex::Locker l(lock);
-    return mqueue.length();
+    int len = 0;
+    for (auto s : shards) {
+      Mutex::Locker l(s->lock);
+      len += s->mqueue.length();
+    }
+    return len;
   }
 
   /**
@@ -145,54 +189,19 @@ class DispatchQueue {
   void dispatch_throttle_release(uint64_t msize);
 
   void queue_connect(Connection *con) {
-    Mutex::Locker l(lock);
-    if (stop)
-      return;
-    mqueue.enqueue_strict(
-      0,
-      CEPH_MSG_PRIO_HIGHEST,
-      QueueItem(D_CONNECT, con));
-    cond.Signal();
+    queue_code(D_CONNECT, con);
   }
   void queue_accept(Connection *con) {
-    Mutex::Locker l(lock);
-    if (stop)
-      return;
-    mqueue.enqueue_strict(
-      0,
-      CEPH_MSG_PRIO_HIGHEST,
-      QueueItem(D_ACCEPT, con));
-    cond.Signal();
+    queue_code(D_ACCEPT, con);
   }
   void queue_remote_reset(Connection *con) {
-    Mutex::Locker l(lock);
-    if (stop)
-      return;
-    mqueue.enqueue_strict(
-      0,
-      CEPH_MSG_PRIO_HIGHEST,
-      QueueItem(D_BAD_REMOTE_RESET, con));
-    cond.Signal();
+    queue_code(D_BAD_REMOTE_RESET, con);
   }
   void queue_reset(Connection *con) {
-    Mutex::Locker l(lock);
-    if (stop)
-      return;
-    mqueue.enqueue_strict(
-      0,
-      CEPH_MSG_PRIO_HIGHEST,
-      QueueItem(D_BAD_RESET, con));
-    cond.Signal();
+    queue_code(D_BAD_RESET, con);
   }
   void queue_refused(Connection *con) {
-    Mutex::Locker l(lock);
-    if (stop)
-      return;
-    mqueue.enqueue_strict(
-      0,
-      CEPH_MSG_PRIO_HIGHEST,
-      QueueItem(D_CONN_REFUSED, con));
-    cond.Signal();
+    queue_code(D_CONN_REFUSED, con);
   }
 
   bool can_fast_dispatch(Message *m) const;
@@ -205,28 +214,35 @@ class DispatchQueue {
     return next_id++;
   }
   void start();
-  void entry();
+  void entry(Shard *s);
   void wait();
   void shutdown();
-  bool is_started() const {return dispatch_thread.is_started();}
+  bool is_started() const {return shards[0]->dispatch_thread.is_started();}
 
   DispatchQueue(CephContext *cct, Messenger *msgr, string &name)
     : cct(cct), msgr(msgr),
-      lock("Messenger::DispatchQueue::lock" + name),
-      mqueue(cct->_conf->ms_pq_max_tokens_per_priority,
-	     cct->_conf->ms_pq_min_cost),
       next_id(1),
-      dispatch_thread(this),
       local_delivery_lock("Messenger::DispatchQueue::local_delivery_lock" + name),
       stop_local_delivery(false),
       local_delivery_thread(this),
       dispatch_throttler(cct, string("msgr_dispatch_throttler-") + name,
                          cct->_conf->ms_dispatch_throttle_bytes),
       stop(false)
-    {}
+    {
+      int num_shards = std::max<int>(cct->_conf->ms_dispatch_shards, 1);
+      for (int i = 0; i < num_shards; ++i) {
+	string lock_name = "Messenger::DispatchQueue::lock" + name;
+	if (num_shards > 1)
+	  lock_name += "." + stringify(i);
+	shards.push_back(new Shard(this, cct, lock_name));
+      }
+    }
   ~DispatchQueue() {
-    assert(mqueue.empty());
-    assert(marrival.empty());
+    for (auto s : shards) {
+      assert(s->mqueue.empty());
+      assert(s->marrival.empty());
+      delete s;
+    }
     assert(local_messages.empty());
   }
 };
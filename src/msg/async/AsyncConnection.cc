@@ -17,6 +17,8 @@
 #include <unistd.h>
 
 #include "include/Context.h"
+#include "include/ipaddr.h"
+#include "include/str_list.h"
 #include "common/errno.h"
 #include "AsyncMessenger.h"
 #include "AsyncConnection.h"
@@ -613,7 +615,12 @@ void AsyncConnection::process()
           if (data_len) {
             // get a buffer
             map<ceph_tid_t,pair<bufferlist,int> >::iterator p = rx_buffers.find(current_header.tid);
-            if (p != rx_buffers.end()) {
+            if (current_header.reserved & CEPH_MSG_HEADER_DATA_COMPRESSED) {
+              // the rx buffer is for the decompressed data, not the wire bytes
+              ldout(async_msgr->cct,20) << __func__ << " allocating compressed rx buffer len " << data_len << dendl;
+              data_buf.push_back(buffer::create(data_len));
+              data_blp = data_buf.begin();
+            } else if (p != rx_buffers.end()) {
               ldout(async_msgr->cct,10) << __func__ << " seleting rx buffer v " << p->second.second
                                   << " at offset " << data_off
                                   << " len " << p->second.first.length() << dendl;
@@ -696,6 +703,11 @@ void AsyncConnection::process()
 
           ldout(async_msgr->cct, 20) << __func__ << " got " << front.length() << " + " << middle.length()
                               << " + " << data.length() << " byte message" << dendl;
+          if (current_header.reserved & (CEPH_MSG_HEADER_FRONT_COMPRESSED |
+                                         CEPH_MSG_HEADER_DATA_COMPRESSED)) {
+            if (decompress_message() < 0)
+              goto fail;
+          }
           Message *message = decode_message(async_msgr->cct, async_msgr->crcflags, current_header, footer, front, middle, data);
           if (!message) {
             ldout(async_msgr->cct, 1) << __func__ << " decode message failed " << dendl;
@@ -715,6 +727,14 @@ void AsyncConnection::process()
               goto fail;
             }
           }
+          if (policy.throttler_bytes) {
+            // the message gives back its decompressed size when it is
+            // done, but only the wire size was taken from the throttler
+            uint64_t msg_size = message->get_payload().length() +
+              message->get_middle().length() + message->get_data().length();
+            if (msg_size > cur_msg_size)
+              policy.throttler_bytes->take(msg_size - cur_msg_size);
+          }
           message->set_byte_throttler(policy.throttler_bytes);
           message->set_message_throttler(policy.throttler_messages);
 
@@ -1039,6 +1059,7 @@ ssize_t AsyncConnection::_process_connection()
         connect_msg.flags = 0;
         if (policy.lossy)
           connect_msg.flags |= CEPH_MSG_CONNECT_LOSSY;  // this is fyi, actually, server decides!
+        connect_msg.flags |= get_compression_alg() << CEPH_MSG_CONNECT_COMPRESS_SHIFT;
         bl.append((char*)&connect_msg, sizeof(connect_msg));
         if (authorizer) {
           bl.append(authorizer->bl.c_str(), authorizer->bl.length());
@@ -1164,6 +1185,20 @@ ssize_t AsyncConnection::_process_connection()
         // hooray!
         peer_global_seq = connect_reply.global_seq;
         policy.lossy = connect_reply.flags & CEPH_MSG_CONNECT_LOSSY;
+        // the server either agrees to the algorithm we asked for or
+        // turns compression off
+        if (((connect_reply.flags ^ connect_msg.flags) & CEPH_MSG_CONNECT_COMPRESS_MASK) == 0) {
+          int alg = (connect_reply.flags & CEPH_MSG_CONNECT_COMPRESS_MASK) >> CEPH_MSG_CONNECT_COMPRESS_SHIFT;
+          if (set_compression(alg) < 0) {
+            // the peer will compress towards us, we can't talk to it
+            ldout(async_msgr->cct, 0) << __func__ << " peer agreed to compress with "
+                                      << Compressor::get_comp_alg_name(alg)
+                                      << " which we can't load" << dendl;
+            goto fail;
+          }
+        } else {
+          set_compression(0);
+        }
         state = STATE_OPEN;
         once_ready = true;
         connect_seq += 1;
@@ -1782,6 +1817,13 @@ ssize_t AsyncConnection::handle_connect_msg(ceph_msg_connect &connect, bufferlis
   reply.authorizer_len = authorizer_reply.length();
   if (policy.lossy)
     reply.flags = reply.flags | CEPH_MSG_CONNECT_LOSSY;
+  // agree to the compression the peer asked for if we would compress
+  // towards it as well and can load the algorithm
+  if (!(connect.flags & CEPH_MSG_CONNECT_COMPRESS_MASK) || !get_compression_alg() ||
+      set_compression((connect.flags & CEPH_MSG_CONNECT_COMPRESS_MASK) >> CEPH_MSG_CONNECT_COMPRESS_SHIFT) < 0)
+    set_compression(0);
+  if (compressor)
+    reply.flags = reply.flags | (connect.flags & CEPH_MSG_CONNECT_COMPRESS_MASK);
 
   set_features((uint64_t)reply.features & (uint64_t)connect.features);
   ldout(async_msgr->cct, 10) << __func__ << " accept features " << get_features() << dendl;
@@ -2186,6 +2228,8 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
     m->get();
   }
 
+  compress_message(m, bl);
+
   if (msgr->crcflags & MSG_CRC_HEADER)
     m->calc_header_crc();
 
@@ -2281,6 +2325,181 @@ ssize_t AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
   return rc;
 }
 
+/**
+ * Compression algorithm we want on a session with the current peer.
+ *
+ * @return a Compressor::CompressionAlgorithm, COMP_ALG_NONE if the peer
+ * is on one of the ms_compression_local_networks or the compressor for
+ * ms_compression_algorithm can't be loaded
+ */
+int AsyncConnection::get_compression_alg()
+{
+  CephContext *cct = async_msgr->cct;
+  boost::optional<Compressor::CompressionAlgorithm> alg =
+    Compressor::get_comp_alg_type(cct->_conf->ms_compression_algorithm);
+  if (!alg || *alg == Compressor::COMP_ALG_NONE)
+    return Compressor::COMP_ALG_NONE;
+
+  list<string> networks;
+  get_str_list(cct->_conf->ms_compression_local_networks, networks);
+  for (auto& n : networks) {
+    struct sockaddr_storage net;
+    unsigned prefix_len;
+    if (!parse_network(n.c_str(), (struct sockaddr*)&net, &prefix_len)) {
+      lderr(cct) << __func__ << " unable to parse network " << n << dendl;
+      continue;
+    }
+    if (network_contains((struct sockaddr*)&net, prefix_len,
+                         get_peer_addr().get_sockaddr())) {
+      ldout(cct, 10) << __func__ << " peer " << get_peer_addr()
+                     << " is local (" << n << "), not compressing" << dendl;
+      return Compressor::COMP_ALG_NONE;
+    }
+  }
+  // never advertise an algorithm we couldn't decompress ourselves
+  if (!Compressor::create(cct, *alg)) {
+    ldout(cct, 1) << __func__ << " unable to load compressor "
+                  << cct->_conf->ms_compression_algorithm
+                  << ", not compressing" << dendl;
+    return Compressor::COMP_ALG_NONE;
+  }
+  return *alg;
+}
+
+/**
+ * Set up the compressor negotiated for this session.
+ *
+ * @return 0 on success, -ENOENT if the compressor for alg can't be
+ * loaded, in which case the session is left without compression
+ */
+int AsyncConnection::set_compression(int alg)
+{
+  compressor.reset();
+  if (alg == Compressor::COMP_ALG_NONE)
+    return 0;
+  compressor = Compressor::create(async_msgr->cct, alg);
+  if (!compressor) {
+    ldout(async_msgr->cct, 1) << __func__ << " unable to load compressor "
+                              << Compressor::get_comp_alg_name(alg) << dendl;
+    return -ENOENT;
+  }
+  ldout(async_msgr->cct, 10) << __func__ << " compressing with "
+                             << compressor->get_type_name() << dendl;
+  return 0;
+}
+
+/**
+ * Replace front and/or data in the outgoing bl with their compressed
+ * form, when the session negotiated compression and they are at least
+ * ms_compression_min_size long and actually shrink.  The crcs in the
+ * footer keep covering the uncompressed bytes and m itself is left
+ * alone, so a resend on a session without compression re-encodes
+ * normally.
+ */
+void AsyncConnection::compress_message(Message *m, bufferlist& bl)
+{
+  ceph_msg_header& header = m->get_header();
+  header.reserved = header.reserved & ~(CEPH_MSG_HEADER_FRONT_COMPRESSED |
+                                         CEPH_MSG_HEADER_DATA_COMPRESSED);
+  if (!compressor)
+    return;
+
+  uint64_t min_size = async_msgr->cct->_conf->ms_compression_min_size;
+  bufferlist& payload = m->get_payload();
+  bufferlist& data = m->get_data();
+  if (payload.length() < min_size && data.length() < min_size)
+    return;
+
+  utime_t start = ceph_clock_now();
+  uint64_t in = 0, out = 0;
+  bufferlist front_out, data_out;
+  if (payload.length() >= min_size) {
+    in += payload.length();
+    if (compressor->compress(payload, front_out) == 0 &&
+        front_out.length() < payload.length()) {
+      header.reserved = header.reserved | CEPH_MSG_HEADER_FRONT_COMPRESSED;
+      header.front_len = front_out.length();
+      out += front_out.length();
+    } else {
+      out += payload.length();
+    }
+  }
+  if (data.length() >= min_size) {
+    in += data.length();
+    if (compressor->compress(data, data_out) == 0 &&
+        data_out.length() < data.length()) {
+      header.reserved = header.reserved | CEPH_MSG_HEADER_DATA_COMPRESSED;
+      header.data_len = data_out.length();
+      out += data_out.length();
+    } else {
+      out += data.length();
+    }
+  }
+  logger->tinc(l_msgr_compress_lat, ceph_clock_now() - start);
+  logger->inc(l_msgr_compress_in_bytes, in);
+  logger->inc(l_msgr_compress_out_bytes, out);
+
+  if (!(header.reserved & (CEPH_MSG_HEADER_FRONT_COMPRESSED |
+                           CEPH_MSG_HEADER_DATA_COMPRESSED)))
+    return;
+
+  ldout(async_msgr->cct, 20) << __func__ << " " << m << " front "
+                             << payload.length() << " -> " << header.front_len
+                             << " data " << data.length() << " -> "
+                             << header.data_len << dendl;
+  bl.clear();
+  if (header.reserved & CEPH_MSG_HEADER_FRONT_COMPRESSED)
+    bl.claim_append(front_out);
+  else
+    bl.append(payload);
+  bl.append(m->get_middle());
+  if (header.reserved & CEPH_MSG_HEADER_DATA_COMPRESSED)
+    bl.claim_append(data_out);
+  else
+    bl.append(data);
+}
+
+/**
+ * Undo compress_message on the message being received, so that the
+ * crcs can be checked and it can be decoded as usual.
+ */
+int AsyncConnection::decompress_message()
+{
+  if (!compressor) {
+    ldout(async_msgr->cct, 0) << __func__ << " got compressed message but"
+                              << " compression was not negotiated" << dendl;
+    return -EINVAL;
+  }
+
+  utime_t start = ceph_clock_now();
+  if (current_header.reserved & CEPH_MSG_HEADER_FRONT_COMPRESSED) {
+    bufferlist out;
+    int r = compressor->decompress(front, out);
+    if (r < 0) {
+      ldout(async_msgr->cct, 1) << __func__ << " failed to decompress front: "
+                                << cpp_strerror(r) << dendl;
+      return r;
+    }
+    front.swap(out);
+    current_header.front_len = front.length();
+  }
+  if (current_header.reserved & CEPH_MSG_HEADER_DATA_COMPRESSED) {
+    bufferlist out;
+    int r = compressor->decompress(data, out);
+    if (r < 0) {
+      ldout(async_msgr->cct, 1) << __func__ << " failed to decompress data: "
+                                << cpp_strerror(r) << dendl;
+      return r;
+    }
+    data.swap(out);
+    current_header.data_len = data.length();
+  }
+  current_header.reserved = current_header.reserved &
+    ~(CEPH_MSG_HEADER_FRONT_COMPRESSED | CEPH_MSG_HEADER_DATA_COMPRESSED);
+  logger->tinc(l_msgr_decompress_lat, ceph_clock_now() - start);
+  return 0;
+}
+
 void AsyncConnection::reset_recv_state()
 {
   // clean up state internal variables and states
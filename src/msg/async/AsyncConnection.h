@@ -29,6 +29,7 @@ using namespace std;
 #include "auth/AuthSessionHandler.h"
 #include "common/ceph_time.h"
 #include "common/perf_counters.h"
+#include "compressor/Compressor.h"
 #include "include/buffer.h"
 #include "msg/Connection.h"
 #include "msg/Messenger.h"
@@ -75,6 +76,10 @@ class AsyncConnection : public Connection {
   void handle_ack(uint64_t seq);
   void _append_keepalive_or_ack(bool ack=false, utime_t *t=NULL);
   ssize_t write_message(Message *m, bufferlist& bl, bool more);
+  int get_compression_alg();
+  int set_compression(int alg);
+  void compress_message(Message *m, bufferlist& bl);
+  int decompress_message();
   void inject_delay();
   ssize_t _reply_accept(char tag, ceph_msg_connect &connect, ceph_msg_connect_reply &reply,
                     bufferlist &authorizer_reply) {
@@ -370,6 +375,8 @@ class AsyncConnection : public Connection {
   Worker *worker;
   EventCenter *center;
   ceph::shared_ptr<AuthSessionHandler> session_security;
+  // on-wire compression negotiated for this session, if any
+  CompressorRef compressor;
 
  public:
   // used by eventcallback
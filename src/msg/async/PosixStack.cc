@@ -21,6 +21,12 @@
 #include <errno.h>
 
 #include <algorithm>
+#include <deque>
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define POSIX_STACK_ZEROCOPY
+#endif
 
 #include "PosixStack.h"
 
@@ -38,6 +44,7 @@
 #define dout_prefix *_dout << "PosixStack "
 
 class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
+  CephContext *cct;
   NetHandler &handler;
   int _fd;
   entity_addr_t sa;
@@ -47,10 +54,42 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   bool sigpipe_pending;
   bool sigpipe_unblock;
 #endif
+#ifdef POSIX_STACK_ZEROCOPY
+  /**
+   * MSG_ZEROCOPY transmit state
+   *
+   * The kernel numbers each zerocopy sendmsg(2) that queues data and
+   * reports on the socket error queue once it no longer references the
+   * pages.  Until then we hold a reference to the buffers sent.
+   */
+  struct zc_send_t {
+    uint32_t id;
+    bufferlist bl;
+    bool done = false;
+    zc_send_t(uint32_t i, bufferlist&& b) : id(i), bl(std::move(b)) {}
+  };
+  bool zerocopy = false;
+  uint64_t zerocopy_min_bytes = 0;
+  uint32_t zc_next_id = 0;
+  std::deque<zc_send_t> zc_pending;
+#endif
 
  public:
-  explicit PosixConnectedSocketImpl(NetHandler &h, const entity_addr_t &sa, int f, bool connected)
-      : handler(h), _fd(f), sa(sa), connected(connected) {}
+  explicit PosixConnectedSocketImpl(CephContext *c, NetHandler &h, const entity_addr_t &sa, int f, bool connected)
+      : cct(c), handler(h), _fd(f), sa(sa), connected(connected) {
+#ifdef POSIX_STACK_ZEROCOPY
+    if (cct->_conf->ms_async_zerocopy_send) {
+      int on = 1;
+      if (::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+        zerocopy = true;
+        zerocopy_min_bytes = cct->_conf->ms_async_zerocopy_min_bytes;
+      } else {
+        ldout(cct, 1) << __func__ << " SO_ZEROCOPY not supported, copying: "
+                      << cpp_strerror(errno) << dendl;
+      }
+    }
+#endif
+  }
 
   virtual int is_connected() override {
     if (connected)
@@ -72,6 +111,12 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   }
 
   virtual ssize_t read(char *buf, size_t len) override {
+#ifdef POSIX_STACK_ZEROCOPY
+    // completions raise EPOLLERR, which the event center reports as
+    // readable; drain them here or we would be woken up again and again
+    if (!zc_pending.empty())
+      reap_zerocopy();
+#endif
     ssize_t r = ::read(_fd, buf, len);
     if (r < 0)
       r = -errno;
@@ -184,7 +229,100 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
     return (ssize_t)sent;
   }
 
+#ifdef POSIX_STACK_ZEROCOPY
+  void reap_zerocopy() {
+    while (!zc_pending.empty()) {
+      char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (::recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        break;
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+           cm = CMSG_NXTHDR(&msg, cm)) {
+        if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+            !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+          continue;
+        struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+        if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+          continue;
+        // [ee_info, ee_data] are done; usually, but not always, in order
+        uint32_t lo = ee->ee_info, hi = ee->ee_data;
+        ldout(cct, 20) << __func__ << " sends " << lo << ".." << hi
+                       << (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ?
+                           " (copied)" : "") << dendl;
+        for (auto& z : zc_pending) {
+          if ((int32_t)(z.id - lo) >= 0 && (int32_t)(hi - z.id) >= 0) {
+            z.done = true;
+            z.bl.clear();
+          }
+        }
+      }
+      while (!zc_pending.empty() && zc_pending.front().done)
+        zc_pending.pop_front();
+    }
+  }
+
+  ssize_t send_zerocopy(bufferlist &bl, bool more) {
+    size_t sent_bytes = 0;
+    while (bl.length()) {
+      struct msghdr msg;
+      struct iovec msgvec[IOV_MAX];
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = msgvec;
+      unsigned msglen = 0;
+      for (auto pb = bl.buffers().begin();
+           pb != bl.buffers().end() && msg.msg_iovlen < IOV_MAX; ++pb) {
+        msgvec[msg.msg_iovlen].iov_base = (void*)(pb->c_str());
+        msgvec[msg.msg_iovlen].iov_len = pb->length();
+        msg.msg_iovlen++;
+        msglen += pb->length();
+      }
+      bool left = msglen < bl.length();
+      ssize_t r = ::sendmsg(_fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY |
+                            (left || more ? MSG_MORE : 0));
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        if (errno == ENOBUFS) {
+          // out of optmem for pinned pages; copy the rest this time
+          ldout(cct, 10) << __func__ << " ENOBUFS, falling back to copy"
+                         << dendl;
+          ssize_t c = send_copy(bl, more);
+          if (c < 0)
+            return c;
+          return sent_bytes + c;
+        }
+        return -errno;
+      }
+      // the kernel may read these pages until it tells us otherwise
+      bufferlist held;
+      bl.splice(0, r, &held);
+      zc_pending.emplace_back(zc_next_id++, std::move(held));
+      sent_bytes += r;
+      if (static_cast<unsigned>(r) < msglen)
+        break;
+    }
+    return static_cast<ssize_t>(sent_bytes);
+  }
+#endif
+
   virtual ssize_t send(bufferlist &bl, bool more) {
+#ifdef POSIX_STACK_ZEROCOPY
+    if (zerocopy) {
+      if (!zc_pending.empty())
+        reap_zerocopy();
+      if (bl.length() >= zerocopy_min_bytes)
+        return send_zerocopy(bl, more);
+    }
+#endif
+    return send_copy(bl, more);
+  }
+
+  ssize_t send_copy(bufferlist &bl, bool more) {
     size_t sent_bytes = 0;
     std::list<bufferptr>::const_iterator pb = bl.buffers().begin();
     uint64_t left_pbrs = bl.buffers().size();
@@ -234,6 +372,10 @@ class PosixConnectedSocketImpl final : public ConnectedSocketImpl {
   }
   virtual void close() {
     ::close(_fd);
+#ifdef POSIX_STACK_ZEROCOPY
+    // the kernel keeps its own page references past close
+    zc_pending.clear();
+#endif
   }
   virtual int fd() const override {
     return _fd;
@@ -280,7 +422,7 @@ int PosixServerSocketImpl::accept(ConnectedSocket *sock, const SocketOptions &op
   }
   handler.set_priority(sd, opt.priority);
 
-  std::unique_ptr<PosixConnectedSocketImpl> csi(new PosixConnectedSocketImpl(handler, *out, sd, true));
+  std::unique_ptr<PosixConnectedSocketImpl> csi(new PosixConnectedSocketImpl(w->cct, handler, *out, sd, true));
   *sock = ConnectedSocket(std::move(csi));
   if (out)
     out->set_sockaddr((sockaddr*)&ss);
@@ -351,7 +493,7 @@ int PosixWorker::connect(const entity_addr_t &addr, const SocketOptions &opts, C
 
   net.set_priority(sd, opts.priority);
   *socket = ConnectedSocket(
-      std::unique_ptr<PosixConnectedSocketImpl>(new PosixConnectedSocketImpl(net, addr, sd, !opts.nonblock)));
+      std::unique_ptr<PosixConnectedSocketImpl>(new PosixConnectedSocketImpl(cct, net, addr, sd, !opts.nonblock)));
   return 0;
 }
 
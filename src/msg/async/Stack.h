@@ -194,6 +194,10 @@ enum {
   l_msgr_send_bytes,
   l_msgr_created_connections,
   l_msgr_active_connections,
+  l_msgr_compress_in_bytes,
+  l_msgr_compress_out_bytes,
+  l_msgr_compress_lat,
+  l_msgr_decompress_lat,
   l_msgr_last,
 };
 
@@ -229,6 +233,10 @@ class Worker {
     plb.add_u64_counter(l_msgr_send_bytes, "msgr_send_bytes", "Network received bytes");
     plb.add_u64_counter(l_msgr_active_connections, "msgr_active_connections", "Active connection number");
     plb.add_u64_counter(l_msgr_created_connections, "msgr_created_connections", "Created connection number");
+    plb.add_u64_counter(l_msgr_compress_in_bytes, "msgr_compress_in_bytes", "Bytes offered to on-wire compression");
+    plb.add_u64_counter(l_msgr_compress_out_bytes, "msgr_compress_out_bytes", "Bytes sent for those offered to on-wire compression");
+    plb.add_time_avg(l_msgr_compress_lat, "msgr_compress_lat", "On-wire compression latency");
+    plb.add_time_avg(l_msgr_decompress_lat, "msgr_decompress_lat", "On-wire decompression latency");
 
     perf_logger = plb.create_perf_counters();
     cct->get_perfcounters_collection()->add(perf_logger);
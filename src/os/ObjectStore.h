@@ -1670,6 +1670,38 @@ public:
      return read(c->get_cid(), oid, offset, len, bl, op_flags, allow_eio);
    }
 
+  /**
+   * scrub_crc32c -- checksum a byte range of an object for deep scrub
+   *
+   * Updates *crc to the crc32c of the range, seeded with its value on
+   * entry, as if the range had been read and hashed.  The data is
+   * verified against whatever checksums the store keeps (a mismatch is
+   * -EIO) but need not be handed back; a store which keeps crc32c
+   * checksums can combine those rather than hash the data again.
+   *
+   * @param c collection for object
+   * @param oid oid of object
+   * @param offset location offset of first byte to be checksummed
+   * @param len number of bytes to be checksummed
+   * @param crc in: initial crc, out: crc including the range
+   * @param op_flags is CEPH_OSD_OP_FLAG_*
+   * @returns number of bytes checksummed (0 past the end of the object),
+   *          or negative error code on failure.
+   */
+  virtual int scrub_crc32c(
+    CollectionHandle &c,
+    const ghobject_t& oid,
+    uint64_t offset,
+    size_t len,
+    uint32_t *crc,
+    uint32_t op_flags = 0) {
+    bufferlist bl;
+    int r = read(c, oid, offset, len, bl, op_flags, true);
+    if (r > 0)
+      *crc = bl.crc32c(*crc);
+    return r;
+  }
+
   /**
    * fiemap -- get extent map of data of an object
    *
@@ -54,6 +54,12 @@ public:
 
   virtual uint64_t get_free() = 0;
 
+  /// 0.0 means all free space is contiguous, 1.0 means it is all in
+  /// alloc_unit sized pieces.  allocators that can't tell report 0.0.
+  virtual double get_fragmentation(uint64_t alloc_unit) {
+    return 0.0;
+  }
+
   virtual void shutdown() = 0;
   static Allocator *create(CephContext* cct, string type, int64_t size,
 			   int64_t block_size);
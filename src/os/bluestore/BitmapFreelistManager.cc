@@ -324,6 +324,69 @@ bool BitmapFreelistManager::enumerate_next(uint64_t *offset, uint64_t *length)
   return false;
 }
 
+void BitmapFreelistManager::enumerate_range(
+  uint64_t start, uint64_t end,
+  std::function<void(uint64_t offset, uint64_t length)> f)
+{
+  // work in whole keys; callers splitting the device get disjoint
+  // ranges as long as every boundary is rounded the same way
+  start &= key_mask;
+  end = end >= size ? size : (end & key_mask);
+  dout(10) << __func__ << std::hex << " 0x" << start << "~" << (end - start)
+	   << std::dec << dendl;
+  if (start >= end) {
+    return;
+  }
+
+  KeyValueDB::Iterator it = kvdb->get_iterator(bitmap_prefix);
+  string k;
+  make_offset_key(start, &k);
+  it->lower_bound(k);
+
+  uint64_t free_start = 0;
+  bool in_free = false;
+  for (uint64_t pos = start; pos < end; pos += bytes_per_key) {
+    uint64_t key_off = 0;
+    if (it->valid()) {
+      k = it->key();
+      _key_decode_u64(k.c_str(), &key_off);
+    }
+    if (!it->valid() || key_off != pos) {
+      // no key: every block in it is free
+      if (!in_free) {
+	free_start = pos;
+	in_free = true;
+      }
+      continue;
+    }
+    bufferlist bl = it->value();
+    int bit = 0;
+    while (bit >= 0) {
+      if (!in_free) {
+	bit = get_next_clear_bit(bl, bit);
+	if (bit >= 0) {
+	  free_start = _get_offset(pos, bit);
+	  in_free = true;
+	}
+      } else {
+	bit = get_next_set_bit(bl, bit);
+	if (bit >= 0) {
+	  uint64_t off = _get_offset(pos, bit);
+	  if (off >= end) {
+	    break;
+	  }
+	  f(free_start, off - free_start);
+	  in_free = false;
+	}
+      }
+    }
+    it->next();
+  }
+  if (in_free && free_start < end) {
+    f(free_start, end - free_start);
+  }
+}
+
 void BitmapFreelistManager::dump()
 {
   enumerate_reset();
@@ -60,6 +60,9 @@ public:
 
   void enumerate_reset() override;
   bool enumerate_next(uint64_t *offset, uint64_t *length) override;
+  void enumerate_range(
+    uint64_t start, uint64_t end,
+    std::function<void(uint64_t offset, uint64_t length)> f) override;
 
   void allocate(
     uint64_t offset, uint64_t length,
@@ -71,6 +74,9 @@ public:
   bool supports_parallel_transactions() override {
     return true;
   }
+  bool supports_parallel_enumerate() override {
+    return true;
+  }
 };
 
 #endif
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <thread>
 
 #include "BlueStore.h"
 #include "os/kv.h"
@@ -57,6 +58,7 @@ const string PREFIX_OMAP = "M";    // u64 + keyname -> value
 const string PREFIX_WAL = "L";     // id -> wal_transaction_t
 const string PREFIX_ALLOC = "B";   // u64 offset -> u64 length (freelist)
 const string PREFIX_SHARED_BLOB = "X"; // u64 offset -> shared_blob_t
+const string PREFIX_COMPRESSION_DICT = "D"; // u32 id -> compression_dict_t
 
 // write a label in the first block.  always use this size.  note that
 // bluefs makes a matching assumption about the location of its
@@ -265,6 +267,16 @@ static void get_coll_key_range(const coll_t& cid, int bits,
   }
 }
 
+// the pool a collection's blobs sample and use dictionaries for
+static int64_t get_coll_dict_pool(const coll_t& cid)
+{
+  spg_t pgid;
+  if (cid.is_pg(&pgid)) {
+    return pgid.pool();
+  }
+  return -1;
+}
+
 static void get_shared_blob_key(uint64_t sbid, string *key)
 {
   key->clear();
@@ -641,17 +653,25 @@ void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
   _audit("trim start");
 
   // buffers
-  while (buffer_size > buffer_max) {
-    auto i = buffer_lru.rbegin();
-    if (i == buffer_lru.rend()) {
-      // stop if buffer_lru is now empty
-      break;
-    }
+  if (buffer_size > buffer_max) {
+    std::lock_guard<boost::shared_mutex> l(buffer_lock);
+    while (buffer_size > buffer_max) {
+      auto i = buffer_lru.rbegin();
+      if (i == buffer_lru.rend()) {
+	// stop if buffer_lru is now empty
+	break;
+      }
 
-    Buffer *b = &*i;
-    assert(b->is_clean());
-    dout(20) << __func__ << " rm " << *b << dendl;
-    b->space->_rm_buffer(this, b);
+      Buffer *b = &*i;
+      assert(b->is_clean());
+      if (b->referenced.exchange(false)) {
+	dout(20) << __func__ << " referenced " << *b << dendl;
+	_touch_buffer(b);
+	continue;
+      }
+      dout(20) << __func__ << " rm " << *b << dendl;
+      b->space->_rm_buffer(this, b);
+    }
   }
 
   // onodes
@@ -666,6 +686,14 @@ void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
   int max_skipped = g_conf->bluestore_cache_trim_max_skip_pinned;
   while (num > 0) {
     Onode *o = &*p;
+    // lookup takes its ref under map_lock, so hold it while we decide
+    std::unique_lock<boost::shared_mutex> ml(o->c->onode_map.map_lock);
+    if (o->referenced.exchange(false) && p != onode_lru.begin()) {
+      dout(30) << __func__ << "  " << o->oid << " referenced" << dendl;
+      onode_lru.erase(p--);
+      onode_lru.push_front(*o);
+      continue;
+    }
     int refs = o->nref.load();
     if (refs > 1) {
       dout(20) << __func__ << "  " << o->oid << " has " << refs
@@ -692,6 +720,7 @@ void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
     }
     o->get();  // paranoia
     o->c->onode_map.onode_map.erase(o->oid);
+    ml.unlock();
     o->put();
     --num;
   }
@@ -830,6 +859,7 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
 
   // buffers
   if (buffer_bytes > buffer_max) {
+    std::lock_guard<boost::shared_mutex> l(buffer_lock);
     uint64_t kin = buffer_max * cct->_conf->bluestore_2q_cache_kin_ratio;
     uint64_t khot = buffer_max - kin;
 
@@ -866,6 +896,8 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
       Buffer *b = &*p;
       assert(b->is_clean());
       dout(20) << __func__ << " buffer_warm_in -> out " << *b << dendl;
+      // a hit in warm_in does not move it (see _touch_buffer)
+      b->referenced = false;
       assert(buffer_bytes >= b->length);
       buffer_bytes -= b->length;
       assert(buffer_list_bytes[BUFFER_WARM_IN] >= b->length);
@@ -898,6 +930,11 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
 
       Buffer *b = &*p;
       assert(b->is_clean());
+      if (b->referenced.exchange(false)) {
+	dout(20) << __func__ << " buffer_hot referenced " << *b << dendl;
+	_touch_buffer(b);
+	continue;
+      }
       dout(20) << __func__ << " buffer_hot rm " << *b << dendl;
       // adjust evict size before buffer goes invalid
       to_evict_bytes -= b->length;
@@ -932,6 +969,14 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
   int max_skipped = g_conf->bluestore_cache_trim_max_skip_pinned;
   while (num > 0) {
     Onode *o = &*p;
+    // lookup takes its ref under map_lock, so hold it while we decide
+    std::unique_lock<boost::shared_mutex> ml(o->c->onode_map.map_lock);
+    if (o->referenced.exchange(false) && p != onode_lru.begin()) {
+      dout(30) << __func__ << "  " << o->oid << " referenced" << dendl;
+      onode_lru.erase(p--);
+      onode_lru.push_front(*o);
+      continue;
+    }
     int refs = o->nref.load();
     if (refs > 1) {
       dout(20) << __func__ << "  " << o->oid << " has " << refs
@@ -958,6 +1003,7 @@ void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
     }
     o->get();  // paranoia
     o->c->onode_map.onode_map.erase(o->oid);
+    ml.unlock();
     o->put();
     --num;
   }
@@ -1092,7 +1138,7 @@ void BlueStore::BufferSpace::read(
   BlueStore::ready_regions_t& res,
   interval_set<uint32_t>& res_intervals)
 {
-  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  boost::shared_lock<boost::shared_mutex> l(cache->buffer_lock);
   res.clear();
   res_intervals.clear();
   uint32_t want_bytes = length;
@@ -1111,7 +1157,7 @@ void BlueStore::BufferSpace::read(
 	offset += l;
 	length -= l;
 	if (!b->is_writing()) {
-	  cache->_touch_buffer(b);
+	  b->touch();
 	}
 	continue;
       }
@@ -1124,7 +1170,7 @@ void BlueStore::BufferSpace::read(
 	length -= gap;
       }
       if (!b->is_writing()) {
-	cache->_touch_buffer(b);
+	b->touch();
       }
       if (b->length > length) {
 	res[offset].substr_of(b->data, 0, length);
@@ -1151,6 +1197,7 @@ void BlueStore::BufferSpace::read(
 void BlueStore::BufferSpace::finish_write(Cache* cache, uint64_t seq)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  std::lock_guard<boost::shared_mutex> bl(cache->buffer_lock);
 
   auto i = writing.begin();
   while (i != writing.end()) {
@@ -1182,6 +1229,7 @@ void BlueStore::BufferSpace::finish_write(Cache* cache, uint64_t seq)
 void BlueStore::BufferSpace::split(Cache* cache, size_t pos, BlueStore::BufferSpace &r)
 {
   std::lock_guard<std::recursive_mutex> lk(cache->lock);
+  std::lock_guard<boost::shared_mutex> bl(cache->buffer_lock);
   if (buffer_map.empty())
     return;
 
@@ -1237,6 +1285,7 @@ void BlueStore::BufferSpace::split(Cache* cache, size_t pos, BlueStore::BufferSp
 BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid, OnodeRef o)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  std::lock_guard<boost::shared_mutex> ml(map_lock);
   auto p = onode_map.find(oid);
   if (p != onode_map.end()) {
     ldout(cache->cct, 30) << __func__ << " " << oid << " " << o
@@ -1252,7 +1301,7 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid, OnodeRef o
 
 BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
 {
-  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  boost::shared_lock<boost::shared_mutex> l(map_lock);
   ldout(cache->cct, 30) << __func__ << dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
   if (p == onode_map.end()) {
@@ -1262,7 +1311,7 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   }
   ldout(cache->cct, 30) << __func__ << " " << oid << " hit " << p->second
 			<< dendl;
-  cache->_touch_onode(p->second);
+  p->second->touch();
   cache->logger->inc(l_bluestore_onode_hits);
   return p->second;
 }
@@ -1270,6 +1319,7 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
 void BlueStore::OnodeSpace::clear()
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  std::lock_guard<boost::shared_mutex> ml(map_lock);
   ldout(cache->cct, 10) << __func__ << dendl;
   for (auto &p : onode_map) {
     cache->_rm_onode(p.second);
@@ -1281,6 +1331,7 @@ void BlueStore::OnodeSpace::clear_pre_split(SharedBlobSet& sbset,
 					    uint32_t ps, int bits)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  std::lock_guard<boost::shared_mutex> ml(map_lock);
   ldout(cache->cct, 10) << __func__ << dendl;
 
   auto p = onode_map.begin();
@@ -1307,7 +1358,7 @@ void BlueStore::OnodeSpace::clear_pre_split(SharedBlobSet& sbset,
 
 bool BlueStore::OnodeSpace::empty()
 {
-  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  boost::shared_lock<boost::shared_mutex> l(map_lock);
   return onode_map.empty();
 }
 
@@ -1318,6 +1369,7 @@ void BlueStore::OnodeSpace::rename(
   const mempool::bluestore_meta_other::string& new_okey)
 {
   std::lock_guard<std::recursive_mutex> l(cache->lock);
+  std::lock_guard<boost::shared_mutex> ml(map_lock);
   ldout(cache->cct, 30) << __func__ << " " << old_oid << " -> " << new_oid
 			<< dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
@@ -1348,7 +1400,7 @@ void BlueStore::OnodeSpace::rename(
 
 bool BlueStore::OnodeSpace::map_any(std::function<bool(OnodeRef)> f)
 {
-  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  boost::shared_lock<boost::shared_mutex> l(map_lock);
   ldout(cache->cct, 20) << __func__ << dendl;
   for (auto& i : onode_map) {
     if (f(i.second)) {
@@ -2601,21 +2653,176 @@ void BlueStore::Collection::trim_cache()
     total_onodes = 2;
   }
   float bytes_per_onode = (float)total_bytes / (float)total_onodes;
-  size_t num_shards = store->cache_shards.size();
-  uint64_t shard_target = store->cct->_conf->bluestore_cache_size / num_shards;
+  uint64_t shard_target;
+  float meta_ratio;
+  store->get_cache_shard_target(&shard_target, &meta_ratio);
   ldout(store->cct, 30) << __func__
 			<< " total meta bytes " << total_bytes
 			<< ", total onodes " << total_onodes
 			<< ", bytes_per_onode " << bytes_per_onode
 	   << dendl;
-  cache->trim(shard_target, store->cct->_conf->bluestore_cache_meta_ratio,
-	      bytes_per_onode);
+  cache->trim(shard_target, meta_ratio, bytes_per_onode);
 
   store->_update_cache_logger();
 }
 
 // =======================================================
 
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore(" << store->path << ").mempool_thread "
+
+void BlueStore::get_cache_shard_target(uint64_t *bytes, float *meta_ratio)
+{
+  size_t num_shards = cache_shards.size();
+  uint64_t meta = cache_meta_target;
+  uint64_t data = cache_data_target;
+  if (cct->_conf->bluestore_cache_autotune && meta + data > 0) {
+    *bytes = (meta + data) / num_shards;
+    *meta_ratio = (double)meta / (double)(meta + data);
+  } else {
+    *bytes = cct->_conf->bluestore_cache_size / num_shards;
+    *meta_ratio = cct->_conf->bluestore_cache_meta_ratio;
+  }
+}
+
+void BlueStore::init_cache_targets(uint64_t total, int64_t kv_size,
+				   double meta_ratio, uint64_t *meta,
+				   uint64_t *data, uint64_t *kv)
+{
+  *kv = 0;
+  if (kv_size >= 0) {
+    *kv = MIN((uint64_t)kv_size, total / 2);
+  }
+  *meta = (total - *kv) * meta_ratio;
+  *data = total - *kv - *meta;
+}
+
+bool BlueStore::balance_cache_targets(cache_state_t *caches, unsigned num,
+				      uint64_t chunk, uint64_t min_bytes,
+				      cache_state_t **grow,
+				      cache_state_t **shrink)
+{
+  // grow the full cache missing the most, at the expense of the one
+  // missing the least.  a cache that is not filling its target (or saw
+  // no lookups) can give memory away for free.
+  *grow = *shrink = nullptr;
+  double shrink_need = 0;
+  for (unsigned i = 0; i < num; ++i) {
+    cache_state_t& c = caches[i];
+    bool full = c.used + chunk >= *c.target;
+    if (full && c.miss_ratio > 0 &&
+	(!*grow || c.miss_ratio > (*grow)->miss_ratio)) {
+      *grow = &c;
+    }
+  }
+  for (unsigned i = 0; i < num; ++i) {
+    cache_state_t& c = caches[i];
+    if (&c == *grow || *c.target < min_bytes + chunk) {
+      continue;
+    }
+    double need = c.used + chunk >= *c.target ? c.miss_ratio : -1.0;
+    if (!*shrink || need < shrink_need) {
+      *shrink = &c;
+      shrink_need = need;
+    }
+  }
+  if (!*grow || !*shrink || shrink_need >= (*grow)->miss_ratio) {
+    return false;
+  }
+  *(*shrink)->target -= chunk;
+  *(*grow)->target += chunk;
+  return true;
+}
+
+void BlueStore::MempoolThread::_init_cache_targets()
+{
+  CephContext *cct = store->cct;
+  int64_t kv_size = -1;
+  if (store->db->get_cache_usage() >= 0) {
+    kv_size = cct->_conf->rocksdb_cache_size;
+  }
+  init_cache_targets(cct->_conf->bluestore_cache_size, kv_size,
+		     cct->_conf->bluestore_cache_meta_ratio,
+		     &store->cache_meta_target, &store->cache_data_target,
+		     &store->cache_kv_target);
+  if (kv_size >= 0) {
+    store->db->set_cache_size(store->cache_kv_target);
+  }
+  dout(10) << __func__ << " meta " << store->cache_meta_target
+	   << " data " << store->cache_data_target
+	   << " kv " << store->cache_kv_target << dendl;
+}
+
+void BlueStore::MempoolThread::_balance_cache()
+{
+  CephContext *cct = store->cct;
+  PerfCounters *logger = store->logger;
+  uint64_t total = cct->_conf->bluestore_cache_size;
+  if (store->cache_meta_target + store->cache_data_target +
+      store->cache_kv_target != total) {
+    _init_cache_targets();
+  }
+
+  auto miss_ratio = [](uint64_t hits, uint64_t misses,
+		       uint64_t *last_hits, uint64_t *last_misses) {
+    // the counters can be reset under us
+    uint64_t h = hits >= *last_hits ? hits - *last_hits : hits;
+    uint64_t m = misses >= *last_misses ? misses - *last_misses : misses;
+    *last_hits = hits;
+    *last_misses = misses;
+    return h + m ? (double)m / (double)(h + m) : -1.0;
+  };
+
+  uint64_t onodes = 0, extents = 0, blobs = 0, buffers = 0, buffer_bytes = 0;
+  for (auto c : store->cache_shards) {
+    c->add_stats(&onodes, &extents, &blobs, &buffers, &buffer_bytes);
+  }
+  cache_state_t caches[3] = {
+    { "meta", &store->cache_meta_target, store->mempool_bytes,
+      miss_ratio(logger->get(l_bluestore_onode_hits),
+		 logger->get(l_bluestore_onode_misses),
+		 &last_onode_hits, &last_onode_misses) },
+    { "data", &store->cache_data_target, buffer_bytes,
+      miss_ratio(logger->get(l_bluestore_buffer_hit_bytes),
+		 logger->get(l_bluestore_buffer_miss_bytes),
+		 &last_buffer_hits, &last_buffer_misses) },
+    { "kv", &store->cache_kv_target, 0, -1.0 },
+  };
+  // the kv cache only takes part if we can tell how well it is doing;
+  // otherwise it keeps its initial size
+  unsigned num = 2;
+  uint64_t kv_hits, kv_misses;
+  int64_t kv_used = store->db->get_cache_usage();
+  if (kv_used >= 0 &&
+      store->db->get_cache_hits_misses(&kv_hits, &kv_misses) == 0) {
+    caches[2].used = kv_used;
+    caches[2].miss_ratio = miss_ratio(kv_hits, kv_misses,
+				      &last_kv_hits, &last_kv_misses);
+    num = 3;
+  }
+  for (unsigned i = 0; i < num; ++i) {
+    dout(20) << __func__ << " " << caches[i].name
+	     << " target " << *caches[i].target
+	     << " used " << caches[i].used
+	     << " miss_ratio " << caches[i].miss_ratio << dendl;
+  }
+
+  uint64_t chunk = cct->_conf->bluestore_cache_autotune_chunk_size;
+  uint64_t min_bytes = total * cct->_conf->bluestore_cache_autotune_min_ratio;
+  cache_state_t *grow, *shrink;
+  if (balance_cache_targets(caches, num, chunk, min_bytes, &grow, &shrink)) {
+    dout(10) << __func__ << " moving " << chunk << " bytes from "
+	     << shrink->name << " to " << grow->name << dendl;
+    logger->inc(l_bluestore_cache_rebalance);
+    if (num == 3) {
+      store->db->set_cache_size(store->cache_kv_target);
+    }
+  }
+  logger->set(l_bluestore_cache_meta_target, store->cache_meta_target);
+  logger->set(l_bluestore_cache_data_target, store->cache_data_target);
+  logger->set(l_bluestore_cache_kv_target, store->cache_kv_target);
+}
+
 void *BlueStore::MempoolThread::entry()
 {
   Mutex::Locker l(lock);
@@ -2624,6 +2831,17 @@ void *BlueStore::MempoolThread::entry()
       mempool::bluestore_meta_onode::allocated_bytes();
     store->mempool_onodes = mempool::bluestore_meta_onode::allocated_items();
     ++store->mempool_seq;
+    if (store->cct->_conf->bluestore_cache_autotune) {
+      utime_t now = ceph_clock_now();
+      if (last_balance == utime_t()) {
+	_init_cache_targets();
+	last_balance = now;
+      } else if ((double)(now - last_balance) >=
+		 store->cct->_conf->bluestore_cache_autotune_interval) {
+	_balance_cache();
+	last_balance = now;
+      }
+    }
     utime_t wait;
     wait += store->cct->_conf->bluestore_cache_trim_interval;
     cond.WaitInterval(lock, wait);
@@ -2673,13 +2891,17 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
 	     cct->_conf->bluestore_wal_thread_timeout,
 	     cct->_conf->bluestore_wal_thread_suicide_timeout,
 	     &wal_tp),
+    wal_batch_thread(this),
     m_finisher_num(1),
+    kv_batch_thread(this),
     kv_sync_thread(this),
+    kv_finalize_thread(this),
     kv_stop(false),
     logger(NULL),
     debug_read_error_lock("BlueStore::debug_read_error_lock"),
     csum_type(Checksummer::CSUM_CRC32C),
     sync_wal_apply(cct->_conf->bluestore_sync_wal_apply),
+    comp_dict_thread(this),
     mempool_thread(this)
 {
   _init_logger();
@@ -2729,8 +2951,11 @@ BlueStore::BlueStore(CephContext *cct,
 	     cct->_conf->bluestore_wal_thread_timeout,
 	     cct->_conf->bluestore_wal_thread_suicide_timeout,
 	     &wal_tp),
+    wal_batch_thread(this),
     m_finisher_num(1),
+    kv_batch_thread(this),
     kv_sync_thread(this),
+    kv_finalize_thread(this),
     kv_stop(false),
     logger(NULL),
     debug_read_error_lock("BlueStore::debug_read_error_lock"),
@@ -2738,6 +2963,7 @@ BlueStore::BlueStore(CephContext *cct,
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(ctz(_min_alloc_size)),
     sync_wal_apply(cct->_conf->bluestore_sync_wal_apply),
+    comp_dict_thread(this),
     mempool_thread(this)
 {
   _init_logger();
@@ -2877,12 +3103,22 @@ void BlueStore::_init_logger()
     "Average done state latency");
   b.add_time_avg(l_bluestore_commit_lat, "commit_lat",
     "Average commit latency");
+  b.add_time_avg(l_bluestore_kv_batch_lat, "kv_batch_lat",
+    "Average time to flush the device and submit a kv batch");
+  b.add_time_avg(l_bluestore_kv_sync_lat, "kv_sync_lat",
+    "Average time to sync a kv batch");
+  b.add_time_avg(l_bluestore_kv_final_lat, "kv_final_lat",
+    "Average time to complete the txcs of a kv batch");
+  b.add_u64_avg(l_bluestore_kv_batch_txc, "kv_batch_txc",
+    "Average number of txcs in a kv batch");
   b.add_time_avg(l_bluestore_compress_lat, "compress_lat",
     "Average compress latency");
   b.add_time_avg(l_bluestore_decompress_lat, "decompress_lat",
     "Average decompress latency");
   b.add_time_avg(l_bluestore_csum_lat, "csum_lat",
     "Average checksum latency");
+  b.add_u64_counter(l_bluestore_scrub_csum_bytes, "scrub_csum_bytes",
+    "Bytes deep scrubbed using stored checksums");
   b.add_u64(l_bluestore_compress_success_count, "compress_success_count",
     "Sum for beneficial compress ops");
   b.add_u64(l_bluestore_compress_rejected_count, "compress_rejected_count",
@@ -2924,6 +3160,14 @@ void BlueStore::_init_logger()
     "Sum for bytes of read hit in the cache");
   b.add_u64(l_bluestore_buffer_miss_bytes, "bluestore_buffer_miss_bytes",
     "Sum for bytes of read missed in the cache");
+  b.add_u64(l_bluestore_cache_meta_target, "bluestore_cache_meta_target",
+	    "Cache bytes for onodes (bluestore_cache_autotune)");
+  b.add_u64(l_bluestore_cache_data_target, "bluestore_cache_data_target",
+	    "Cache bytes for buffers (bluestore_cache_autotune)");
+  b.add_u64(l_bluestore_cache_kv_target, "bluestore_cache_kv_target",
+	    "Cache bytes for the kv store (bluestore_cache_autotune)");
+  b.add_u64(l_bluestore_cache_rebalance, "bluestore_cache_rebalance",
+	    "Times cache bytes were moved between onodes, buffers and kv");
 
   b.add_u64(l_bluestore_write_big, "bluestore_write_big",
 	    "Large min_alloc_size-aligned writes into fresh blobs");
@@ -3162,6 +3406,15 @@ int BlueStore::_open_bdev(bool create)
   assert(block_size == 1u << block_size_order);
 
   _set_alloc_sizes();
+
+  if (cct->_conf->bluestore_wal_batch_window > 0) {
+    wal_batch_window = cct->_conf->bluestore_wal_batch_window;
+  } else if (bdev->is_rotational()) {
+    wal_batch_window = cct->_conf->bluestore_wal_batch_window_hdd;
+  } else {
+    wal_batch_window = cct->_conf->bluestore_wal_batch_window_ssd;
+  }
+  dout(10) << __func__ << " wal_batch_window " << wal_batch_window << dendl;
   return 0;
 
  fail_close:
@@ -3289,12 +3542,41 @@ int BlueStore::_open_alloc()
   uint64_t num = 0, bytes = 0;
 
   // initialize from freelist
-  fm->enumerate_reset();
-  uint64_t offset, length;
-  while (fm->enumerate_next(&offset, &length)) {
-    alloc->init_add_free(offset, length);
-    ++num;
-    bytes += length;
+  int threads = cct->_conf->bluestore_freelist_load_threads;
+  if (threads > 1 && fm->supports_parallel_enumerate()) {
+    // decoding the freelist is what takes the time; scan slices of the
+    // device concurrently and feed the allocator from this thread
+    uint64_t size = bdev->get_size();
+    uint64_t slice = ROUND_UP_TO(size / threads + 1, min_min_alloc_size);
+    vector<vector<pair<uint64_t,uint64_t>>> found(threads);
+    vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+      uint64_t start = slice * i;
+      uint64_t end = std::min(size, start + slice);
+      auto *out = &found[i];
+      workers.emplace_back([this, start, end, out]() {
+	  fm->enumerate_range(start, end, [out](uint64_t o, uint64_t l) {
+	      out->emplace_back(o, l);
+	    });
+	});
+    }
+    for (int i = 0; i < threads; ++i) {
+      workers[i].join();
+      for (auto& e : found[i]) {
+	alloc->init_add_free(e.first, e.second);
+	++num;
+	bytes += e.second;
+      }
+      found[i].clear();
+    }
+  } else {
+    fm->enumerate_reset();
+    uint64_t offset, length;
+    while (fm->enumerate_next(&offset, &length)) {
+      alloc->init_add_free(offset, length);
+      ++num;
+      bytes += length;
+    }
   }
   dout(10) << __func__ << " loaded " << pretty_si_t(bytes)
 	   << " in " << num << " extents"
@@ -4255,7 +4537,7 @@ int BlueStore::mount()
     f->start();
   }
   wal_tp.start();
-  kv_sync_thread.create("bstore_kv_sync");
+  _kv_start();
 
   r = _wal_replay();
   if (r < 0)
@@ -4392,6 +4674,238 @@ int BlueStore::_fsck_check_extents(
   return errors;
 }
 
+void BlueStore::_fsck_walk_objects(
+  bool deep,
+  fsck_walk_t *w,
+  std::mutex *lock,
+  boost::dynamic_bitset<> &used_blocks,
+  map<uint64_t,fsck_sb_info_t> &sb_info)
+{
+  dout(10) << __func__ << " " << pretty_binary_string(w->start)
+	   << " to " << pretty_binary_string(w->end) << dendl;
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OBJ);
+  if (!it) {
+    return;
+  }
+  CollectionRef c;
+  spg_t pgid;
+  list<string> expecting_shards;
+  for (it->lower_bound(w->start);
+       it->valid() && (w->end.empty() || it->key() < w->end);
+       it->next()) {
+    dout(30) << " key " << pretty_binary_string(it->key()) << dendl;
+    if (is_extent_shard_key(it->key())) {
+      while (!expecting_shards.empty() &&
+	     expecting_shards.front() < it->key()) {
+	derr << __func__ << " missing shard key "
+	     << pretty_binary_string(expecting_shards.front())
+	     << dendl;
+	++w->errors;
+	expecting_shards.pop_front();
+      }
+      if (!expecting_shards.empty() &&
+	  expecting_shards.front() == it->key()) {
+	// all good
+	expecting_shards.pop_front();
+	continue;
+      }
+
+      uint32_t offset;
+      string okey;
+      get_key_extent_shard(it->key(), &okey, &offset);
+      derr << __func__ << " stray shard 0x" << std::hex << offset << std::dec
+	   << dendl;
+      if (expecting_shards.empty()) {
+	derr << __func__ << pretty_binary_string(it->key())
+	     << " is unexpected" << dendl;
+	++w->errors;
+	continue;
+      }
+      while (expecting_shards.front() > it->key()) {
+	derr << __func__ << "   saw " << pretty_binary_string(it->key())
+	     << dendl;
+	derr << __func__ << "   exp "
+	     << pretty_binary_string(expecting_shards.front()) << dendl;
+	++w->errors;
+	expecting_shards.pop_front();
+	if (expecting_shards.empty()) {
+	  break;
+	}
+      }
+      continue;
+    }
+
+    ghobject_t oid;
+    int r = get_key_object(it->key(), &oid);
+    if (r < 0) {
+      derr << __func__ << "  bad object key "
+	   << pretty_binary_string(it->key()) << dendl;
+      ++w->errors;
+      continue;
+    }
+    if (!c ||
+	oid.shard_id != pgid.shard ||
+	oid.hobj.pool != (int64_t)pgid.pool() ||
+	!c->contains(oid)) {
+      c = nullptr;
+      for (ceph::unordered_map<coll_t, CollectionRef>::iterator p =
+	     coll_map.begin();
+	   p != coll_map.end();
+	   ++p) {
+	if (p->second->contains(oid)) {
+	  c = p->second;
+	  break;
+	}
+      }
+      if (!c) {
+	derr << __func__ << "  stray object " << oid
+	     << " not owned by any collection" << dendl;
+	++w->errors;
+	continue;
+      }
+      c->cid.is_pg(&pgid);
+      dout(20) << __func__ << "  collection " << c->cid << dendl;
+    }
+
+    if (!expecting_shards.empty()) {
+      for (auto &k : expecting_shards) {
+	derr << __func__ << " missing shard key "
+	     << pretty_binary_string(k) << dendl;
+      }
+      ++w->errors;
+      expecting_shards.clear();
+    }
+
+    dout(10) << __func__ << "  " << oid << dendl;
+    RWLock::RLocker l(c->lock);
+    OnodeRef o = c->get_onode(oid, false);
+    _dump_onode(o, 30);
+    if (o->onode.nid) {
+      if (o->onode.nid > nid_max) {
+	derr << __func__ << " " << oid << " nid " << o->onode.nid
+	     << " > nid_max " << nid_max << dendl;
+	++w->errors;
+      }
+      if (w->used_nids.count(o->onode.nid)) {
+	derr << __func__ << " " << oid << " nid " << o->onode.nid
+	     << " already in use" << dendl;
+	++w->errors;
+	continue; // go for next object
+      }
+      w->used_nids.insert(o->onode.nid);
+    }
+    ++w->num_objects;
+    w->num_spanning_blobs += o->extent_map.spanning_blob_map.size();
+    o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
+    // shards
+    if (!o->extent_map.shards.empty()) {
+      ++w->num_sharded_objects;
+      w->num_object_shards += o->extent_map.shards.size();
+    }
+    for (auto& s : o->extent_map.shards) {
+      dout(20) << __func__ << "    shard " << *s.shard_info << dendl;
+      expecting_shards.push_back(string());
+      get_extent_shard_key(o->key, s.offset, &expecting_shards.back());
+    }
+    // lextents
+    uint64_t pos = 0;
+    map<BlobRef,bluestore_extent_ref_map_t> ref_map;
+    for (auto& l : o->extent_map.extent_map) {
+      dout(20) << __func__ << "    " << l << dendl;
+      if (l.logical_offset < pos) {
+	derr << __func__ << " " << oid << " lextent at 0x"
+	     << std::hex << l.logical_offset
+	     << " overlaps with the previous, which ends at 0x" << pos
+	     << std::dec << dendl;
+	++w->errors;
+      }
+      if (o->extent_map.spans_shard(l.logical_offset, l.length)) {
+	derr << __func__ << " " << oid << " lextent at 0x"
+	     << std::hex << l.logical_offset << "~" << l.length
+	     << " spans a shard boundary"
+	     << std::dec << dendl;
+	++w->errors;
+      }
+      pos = l.logical_offset + l.length;
+      w->expected_statfs.stored += l.length;
+      assert(l.blob);
+      ref_map[l.blob].get(l.blob_offset, l.length);
+      ++w->num_extents;
+    }
+    for (auto &i : ref_map) {
+      ++w->num_blobs;
+      if (i.first->get_ref_map() != i.second) {
+	derr << __func__ << " " << oid << " blob " << *i.first
+	     << " doesn't match expected ref_map " << i.second << dendl;
+	++w->errors;
+      }
+      const bluestore_blob_t& blob = i.first->get_blob();
+      if (blob.is_compressed()) {
+	w->expected_statfs.compressed += blob.compressed_length;
+	for (auto& r : i.first->get_ref_map().ref_map) {
+	  w->expected_statfs.compressed_original +=
+	    r.second.refs * r.second.length;
+	}
+      }
+      if (blob.is_shared()) {
+	if (i.first->shared_blob->sbid > blobid_max) {
+	  derr << __func__ << " " << oid << " blob " << blob
+	       << " sbid " << i.first->shared_blob->sbid << " > blobid_max "
+	       << blobid_max << dendl;
+	  ++w->errors;
+	} else if (i.first->shared_blob->sbid == 0) {
+	  derr << __func__ << " " << oid << " blob " << blob
+	       << " marked as shared but has uninitialized sbid"
+	       << dendl;
+	  ++w->errors;
+	}
+	std::lock_guard<std::mutex> l(*lock);
+	fsck_sb_info_t& sbi = sb_info[i.first->shared_blob->sbid];
+	sbi.sb = i.first->shared_blob;
+	sbi.oids.push_back(oid);
+	sbi.compressed = blob.is_compressed();
+	for (auto e : blob.extents) {
+	  if (e.is_valid()) {
+	    sbi.ref_map.get(e.offset, e.length);
+	  }
+	}
+      } else {
+	std::lock_guard<std::mutex> l(*lock);
+	w->errors += _fsck_check_extents(oid, blob.extents,
+					 blob.is_compressed(),
+					 used_blocks,
+					 w->expected_statfs);
+      }
+    }
+    if (deep) {
+      bufferlist bl;
+      int r = _do_read(c.get(), o, 0, o->onode.size, bl, 0);
+      if (r < 0) {
+	++w->errors;
+	derr << __func__ << " " << oid << " error during read: "
+	     << cpp_strerror(r) << dendl;
+      }
+    }
+    // omap
+    if (o->onode.has_omap()) {
+      if (w->used_omap_head.count(o->onode.nid)) {
+	derr << __func__ << " " << oid << " omap_head " << o->onode.nid
+	     << " already in use" << dendl;
+	++w->errors;
+      } else {
+	w->used_omap_head.insert(o->onode.nid);
+      }
+    }
+  }
+  if (!expecting_shards.empty()) {
+    for (auto &k : expecting_shards) {
+      derr << __func__ << " missing shard key "
+	   << pretty_binary_string(k) << dendl;
+    }
+    ++w->errors;
+  }
+}
+
 int BlueStore::fsck(bool deep)
 {
   dout(1) << __func__ << (deep ? " (deep)" : " (shallow)") << " start" << dendl;
@@ -4402,13 +4916,7 @@ int BlueStore::fsck(bool deep)
   set<uint64_t> used_sbids;
   KeyValueDB::Iterator it;
   store_statfs_t expected_statfs, actual_statfs;
-  struct sb_info_t {
-    list<ghobject_t> oids;
-    SharedBlobRef sb;
-    bluestore_extent_ref_map_t ref_map;
-    bool compressed;
-  };
-  map<uint64_t,sb_info_t> sb_info;
+  map<uint64_t,fsck_sb_info_t> sb_info;
 
   uint64_t num_objects = 0;
   uint64_t num_extents = 0;
@@ -4493,213 +5001,69 @@ int BlueStore::fsck(bool deep)
 
   // walk PREFIX_OBJ
   dout(1) << __func__ << " walking object keyspace" << dendl;
-  it = db->get_iterator(PREFIX_OBJ);
-  if (it) {
-    CollectionRef c;
-    spg_t pgid;
-    list<string> expecting_shards;
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      dout(30) << " key " << pretty_binary_string(it->key()) << dendl;
-      if (is_extent_shard_key(it->key())) {
-	while (!expecting_shards.empty() &&
-	       expecting_shards.front() < it->key()) {
-	  derr << __func__ << " missing shard key "
-	       << pretty_binary_string(expecting_shards.front())
-	       << dendl;
-	  ++errors;
-	  expecting_shards.pop_front();
-	}
-	if (!expecting_shards.empty() &&
-	    expecting_shards.front() == it->key()) {
-	  // all good
-	  expecting_shards.pop_front();
-	  continue;
-	}
-
-        uint32_t offset;
-        string okey;
-        get_key_extent_shard(it->key(), &okey, &offset);
-        derr << __func__ << " stray shard 0x" << std::hex << offset << std::dec
-             << dendl;
-        if (expecting_shards.empty()) {
-          derr << __func__ << pretty_binary_string(it->key())
-               << " is unexpected" << dendl;
-          ++errors;
-          continue;
-        }
-	while (expecting_shards.front() > it->key()) {
-	  derr << __func__ << "   saw " << pretty_binary_string(it->key())
-	       << dendl;
-	  derr << __func__ << "   exp "
-	       << pretty_binary_string(expecting_shards.front()) << dendl;
-	  ++errors;
-	  expecting_shards.pop_front();
-	  if (expecting_shards.empty()) {
-	    break;
-	  }
-	}
-	continue;
-      }
-
-      ghobject_t oid;
-      int r = get_key_object(it->key(), &oid);
-      if (r < 0) {
-        derr << __func__ << "  bad object key "
-             << pretty_binary_string(it->key()) << dendl;
-	++errors;
-	continue;
-      }
-      if (!c ||
-	  oid.shard_id != pgid.shard ||
-	  oid.hobj.pool != (int64_t)pgid.pool() ||
-	  !c->contains(oid)) {
-	c = nullptr;
-	for (ceph::unordered_map<coll_t, CollectionRef>::iterator p =
-	       coll_map.begin();
-	     p != coll_map.end();
-	     ++p) {
-	  if (p->second->contains(oid)) {
-	    c = p->second;
-	    break;
-	  }
-	}
-	if (!c) {
-          derr << __func__ << "  stray object " << oid
-               << " not owned by any collection" << dendl;
-	  ++errors;
-	  continue;
-	}
-	c->cid.is_pg(&pgid);
-	dout(20) << __func__ << "  collection " << c->cid << dendl;
+  {
+    // slice the keyspace at collection boundaries so that an object and
+    // its extent shard keys always land in the same slice
+    vector<string> bounds;
+    for (auto& p : coll_map) {
+      string temp_start, temp_end, start, end;
+      get_coll_key_range(p.first, p.second->cnode.bits,
+			 &temp_start, &temp_end, &start, &end);
+      bounds.push_back(start);
+      if (temp_start != start) {
+	bounds.push_back(temp_start);
+      }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    unsigned threads = std::max(1, cct->_conf->bluestore_fsck_threads);
+    threads = std::min<size_t>(threads, bounds.size() + 1);
+    vector<fsck_walk_t> walks(threads);
+    for (unsigned i = 1; i < threads; ++i) {
+      walks[i].start = bounds[i * bounds.size() / threads];
+      walks[i - 1].end = walks[i].start;
+    }
+
+    std::mutex lock;
+    if (threads == 1) {
+      _fsck_walk_objects(deep, &walks[0], &lock, used_blocks, sb_info);
+    } else {
+      dout(10) << __func__ << " using " << threads << " threads" << dendl;
+      vector<std::thread> workers;
+      for (auto& w : walks) {
+	fsck_walk_t *pw = &w;
+	workers.emplace_back([&, pw]() {
+	    _fsck_walk_objects(deep, pw, &lock, used_blocks, sb_info);
+	  });
       }
-
-      if (!expecting_shards.empty()) {
-	for (auto &k : expecting_shards) {
-	  derr << __func__ << " missing shard key "
-	       << pretty_binary_string(k) << dendl;
-	}
-	++errors;
-	expecting_shards.clear();
+      for (auto& t : workers) {
+	t.join();
       }
+    }
 
-      dout(10) << __func__ << "  " << oid << dendl;
-      RWLock::RLocker l(c->lock);
-      OnodeRef o = c->get_onode(oid, false);
-      _dump_onode(o, 30);
-      if (o->onode.nid) {
-	if (o->onode.nid > nid_max) {
-	  derr << __func__ << " " << oid << " nid " << o->onode.nid
-	       << " > nid_max " << nid_max << dendl;
-	  ++errors;
-	}
-	if (used_nids.count(o->onode.nid)) {
-	  derr << __func__ << " " << oid << " nid " << o->onode.nid
-	       << " already in use" << dendl;
-	  ++errors;
-	  continue; // go for next object
-	}
-	used_nids.insert(o->onode.nid);
-      }
-      ++num_objects;
-      num_spanning_blobs += o->extent_map.spanning_blob_map.size();
-      o->extent_map.fault_range(db, 0, OBJECT_MAX_SIZE);
-      // shards
-      if (!o->extent_map.shards.empty()) {
-	++num_sharded_objects;
-	num_object_shards += o->extent_map.shards.size();
-      }
-      for (auto& s : o->extent_map.shards) {
-	dout(20) << __func__ << "    shard " << *s.shard_info << dendl;
-	expecting_shards.push_back(string());
-	get_extent_shard_key(o->key, s.offset, &expecting_shards.back());
-      }
-      // lextents
-      uint64_t pos = 0;
-      map<BlobRef,bluestore_extent_ref_map_t> ref_map;
-      for (auto& l : o->extent_map.extent_map) {
-	dout(20) << __func__ << "    " << l << dendl;
-	if (l.logical_offset < pos) {
-	  derr << __func__ << " " << oid << " lextent at 0x"
-	       << std::hex << l.logical_offset
-	       << " overlaps with the previous, which ends at 0x" << pos
-	       << std::dec << dendl;
-	  ++errors;
-	}
-	if (o->extent_map.spans_shard(l.logical_offset, l.length)) {
-	  derr << __func__ << " " << oid << " lextent at 0x"
-	       << std::hex << l.logical_offset << "~" << l.length
-	       << " spans a shard boundary"
-	       << std::dec << dendl;
-	  ++errors;
-	}
-	pos = l.logical_offset + l.length;
-	expected_statfs.stored += l.length;
-	assert(l.blob);
-	ref_map[l.blob].get(l.blob_offset, l.length);
-	++num_extents;
-      }
-      for (auto &i : ref_map) {
-	++num_blobs;
-	if (i.first->get_ref_map() != i.second) {
-	  derr << __func__ << " " << oid << " blob " << *i.first
-	       << " doesn't match expected ref_map " << i.second << dendl;
-	  ++errors;
-	}
-	const bluestore_blob_t& blob = i.first->get_blob();
-	if (blob.is_compressed()) {
-	  expected_statfs.compressed += blob.compressed_length;
-	  for (auto& r : i.first->get_ref_map().ref_map) {
-	    expected_statfs.compressed_original +=
-	      r.second.refs * r.second.length;
-	  }
-	}
-	if (blob.is_shared()) {
-	  if (i.first->shared_blob->sbid > blobid_max) {
-	    derr << __func__ << " " << oid << " blob " << blob
-		 << " sbid " << i.first->shared_blob->sbid << " > blobid_max "
-		 << blobid_max << dendl;
-	    ++errors;
-	  } else if (i.first->shared_blob->sbid == 0) {
-            derr << __func__ << " " << oid << " blob " << blob
-                 << " marked as shared but has uninitialized sbid"
-                 << dendl;
-            ++errors;
-          }
-	  sb_info_t& sbi = sb_info[i.first->shared_blob->sbid];
-	  sbi.sb = i.first->shared_blob;
-	  sbi.oids.push_back(oid);
-	  sbi.compressed = blob.is_compressed();
-	  for (auto e : blob.extents) {
-	    if (e.is_valid()) {
-	      sbi.ref_map.get(e.offset, e.length);
-	    }
-	  }
-	} else {
-	  errors += _fsck_check_extents(oid, blob.extents,
-					blob.is_compressed(),
-					used_blocks,
-					expected_statfs);
-        }
-      }
-      if (deep) {
-	bufferlist bl;
-	int r = _do_read(c.get(), o, 0, o->onode.size, bl, 0);
-	if (r < 0) {
+    // nids and omap heads are only checked for uniqueness within each
+    // slice; finish the job here
+    for (auto& w : walks) {
+      errors += w.errors;
+      for (auto nid : w.used_nids) {
+	if (!used_nids.insert(nid).second) {
+	  derr << __func__ << " nid " << nid << " already in use" << dendl;
 	  ++errors;
-	  derr << __func__ << " " << oid << " error during read: "
-	       << cpp_strerror(r) << dendl;
 	}
       }
-      // omap
-      if (o->onode.has_omap()) {
-	if (used_omap_head.count(o->onode.nid)) {
-	  derr << __func__ << " " << oid << " omap_head " << o->onode.nid
-	       << " already in use" << dendl;
+      for (auto head : w.used_omap_head) {
+	if (!used_omap_head.insert(head).second) {
+	  derr << __func__ << " omap_head " << head << " already in use"
+	       << dendl;
 	  ++errors;
-	} else {
-	  used_omap_head.insert(o->onode.nid);
 	}
       }
+      expected_statfs.add(w.expected_statfs);
+      num_objects += w.num_objects;
+      num_extents += w.num_extents;
+      num_blobs += w.num_blobs;
+      num_spanning_blobs += w.num_spanning_blobs;
+      num_sharded_objects += w.num_sharded_objects;
+      num_object_shards += w.num_object_shards;
     }
   }
   dout(1) << __func__ << " checking shared_blobs" << dendl;
@@ -4721,7 +5085,7 @@ int BlueStore::fsck(bool deep)
 	++errors;
       } else {
 	++num_shared_blobs;
-	sb_info_t& sbi = p->second;
+	fsck_sb_info_t& sbi = p->second;
 	bluestore_shared_blob_t shared_blob;
 	bufferlist bl = it->value();
 	bufferlist::iterator blp = bl.begin();
@@ -4770,6 +5134,23 @@ int BlueStore::fsck(bool deep)
     }
   }
 
+  dout(1) << __func__ << " checking compression dictionaries" << dendl;
+  {
+    set<int64_t> pools;
+    for (auto& p : coll_map) {
+      pools.insert(get_coll_dict_pool(p.first));
+    }
+    std::lock_guard<std::mutex> l(comp_dict_lock);
+    for (auto& p : comp_dicts) {
+      if (pools.count(p.second.d.pool) == 0) {
+	derr << __func__ << " compression dictionary " << p.first
+	     << " for pool " << p.second.d.pool
+	     << " is not referenced by any collection" << dendl;
+	++errors;
+      }
+    }
+  }
+
   dout(1) << __func__ << " checking wal events" << dendl;
   it = db->get_iterator(PREFIX_WAL);
   if (it) {
@@ -4885,10 +5266,9 @@ void BlueStore::_sync()
   bdev->flush();
 
   std::unique_lock<std::mutex> l(kv_lock);
-  while (!kv_committing.empty() ||
-	 !kv_queue.empty()) {
+  while (kv_batches || !kv_queue.empty()) {
     dout(20) << " waiting for kv to commit" << dendl;
-    kv_sync_cond.wait(l);
+    kv_drain_cond.wait(l);
   }
 
   dout(10) << __func__ << " done" << dendl;
@@ -5410,42 +5790,224 @@ int BlueStore::_do_read(
   return r;
 }
 
-int BlueStore::_verify_csum(OnodeRef& o,
-			    const bluestore_blob_t* blob, uint64_t blob_xoffset,
-			    const bufferlist& bl,
-			    uint64_t logical_offset) const
+int BlueStore::scrub_crc32c(
+  CollectionHandle &c_,
+  const ghobject_t& oid,
+  uint64_t offset,
+  size_t length,
+  uint32_t *crc,
+  uint32_t op_flags)
 {
-  int bad;
-  uint64_t bad_csum;
-  utime_t start = ceph_clock_now();
-  int r = blob->verify_csum(blob_xoffset, bl, &bad, &bad_csum);
-  if (r < 0) {
-    if (r == -1) {
-      PExtentVector pex;
-      int r = blob->map(
-	bad,
-	blob->get_csum_chunk_size(),
-	[&](uint64_t offset, uint64_t length) {
-	  pex.emplace_back(bluestore_pextent_t(offset, length));
-          return 0;
-	});
-      assert(r == 0);
-      derr << __func__ << " bad "
-	   << Checksummer::get_csum_type_string(blob->csum_type)
-	   << "/0x" << std::hex << blob->get_csum_chunk_size()
-	   << " checksum at blob offset 0x" << bad
-	   << ", got 0x" << bad_csum << ", expected 0x"
-	   << blob->get_csum_item(bad / blob->get_csum_chunk_size()) << std::dec
-	   << ", device location " << pex
-	   << ", object " << o->oid
-	   << ", logical extent 0x" << std::hex
-	   << (logical_offset + bad - blob_xoffset) << "~"
-	   << blob->get_csum_chunk_size() << std::dec
+  Collection *c = static_cast<Collection *>(c_.get());
+  const coll_t &cid = c->get_cid();
+  dout(15) << __func__ << " " << cid << " " << oid
+	   << " 0x" << std::hex << offset << "~" << length << std::dec
 	   << dendl;
-    } else {
-      derr << __func__ << " failed with exit code: " << cpp_strerror(r) << dendl;
-    }
-  }
+  if (!c->exists)
+    return -ENOENT;
+
+  int r;
+  {
+    RWLock::RLocker l(c->lock);
+
+    OnodeRef o = c->get_onode(oid, false);
+    if (!o || !o->exists) {
+      r = -ENOENT;
+      goto out;
+    }
+    r = _do_scrub_crc32c(c, o, offset, length, crc, op_flags);
+  }
+
+ out:
+  c->trim_cache();
+  if (r >= 0 && _debug_data_eio(oid)) {
+    r = -EIO;
+    derr << __func__ << " " << c->cid << " " << oid << " INJECT EIO" << dendl;
+  }
+  dout(10) << __func__ << " " << cid << " " << oid
+	   << " 0x" << std::hex << offset << "~" << length << std::dec
+	   << " = " << r << dendl;
+  return r;
+}
+
+int BlueStore::_do_scrub_crc32c(
+  Collection *c,
+  OnodeRef o,
+  uint64_t offset,
+  size_t length,
+  uint32_t *crc,
+  uint32_t op_flags)
+{
+  if (offset >= o->onode.size) {
+    return 0;
+  }
+  if (offset + length > o->onode.size) {
+    length = o->onode.size - offset;
+  }
+
+  o->flush();
+  o->extent_map.fault_range(db, offset, length);
+
+  uint64_t pos = offset;
+  uint64_t end = offset + length;
+  auto lp = o->extent_map.seek_lextent(offset);
+  while (pos < end) {
+    if (lp == o->extent_map.extent_map.end() || pos < lp->logical_offset) {
+      // holes read back as zeros
+      uint64_t hole = end - pos;
+      if (lp != o->extent_map.extent_map.end()) {
+	hole = std::min<uint64_t>(hole, lp->logical_offset - pos);
+      }
+      *crc = ceph_crc32c(*crc, NULL, hole);
+      pos += hole;
+      continue;
+    }
+    uint64_t l_off = pos - lp->logical_offset;
+    uint64_t b_off = l_off + lp->blob_offset;
+    uint64_t b_len = std::min<uint64_t>(end - pos, lp->length - l_off);
+    int r = _scrub_crc32c_blob(c, o, lp->blob, pos, b_off, b_len, crc,
+			       op_flags);
+    if (r < 0) {
+      return r;
+    }
+    pos += b_len;
+    ++lp;
+  }
+  return length;
+}
+
+int BlueStore::_scrub_crc32c_blob(
+  Collection *c,
+  OnodeRef o,
+  BlobRef bptr,
+  uint64_t logical_offset,
+  uint64_t b_off,
+  uint64_t b_len,
+  uint32_t *crc,
+  uint32_t op_flags)
+{
+  const bluestore_blob_t& blob = bptr->get_blob();
+
+  // cached data may be newer than what is on disk (deferred writes), and
+  // only plain crc32c checksums can be combined: read and hash the rest
+  ready_regions_t cache_res;
+  interval_set<uint32_t> cache_interval;
+  bptr->shared_blob->bc.read(bptr->shared_blob->get_cache(), b_off, b_len,
+			     cache_res, cache_interval);
+  if (!cache_res.empty() ||
+      blob.is_compressed() ||
+      blob.csum_type != Checksummer::CSUM_CRC32C) {
+    bufferlist bl;
+    int r = _do_read(c, o, logical_offset, b_len, bl, op_flags);
+    if (r < 0) {
+      return r;
+    }
+    *crc = bl.crc32c(*crc);
+    return 0;
+  }
+
+  uint64_t chunk_size = blob.get_chunk_size(block_size);
+  uint64_t r_off = b_off - b_off % chunk_size;
+  uint64_t r_len = b_off + b_len - r_off;
+  if (r_len % chunk_size) {
+    r_len += chunk_size - r_len % chunk_size;
+  }
+  dout(20) << __func__ << "  blob " << *bptr << std::hex
+	   << " 0x" << logical_offset << ": 0x" << b_off << "~" << b_len
+	   << " reading 0x" << r_off << "~" << r_len << std::dec << dendl;
+
+  IOContext ioc(cct, NULL);
+  bufferlist bl;
+  int r = blob.map(r_off, r_len,
+		   [&](uint64_t offset, uint64_t length) {
+      bufferlist t;
+      int r = bdev->read(offset, length, &t, &ioc, false);
+      if (r < 0)
+	return r;
+      bl.claim_append(t);
+      return 0;
+    });
+  if (r < 0) {
+    return r;
+  }
+  if (_verify_csum(o, &blob, r_off, bl, logical_offset) < 0) {
+    return -EIO;
+  }
+
+  // the data matches the stored checksums, crc32c(-1, chunk), so fold
+  // those in for whole chunks and only hash partial ones
+  uint64_t csum_chunk = blob.get_csum_chunk_size();
+  ceph_crc32c_shift shift = _get_csum_shift(blob.csum_chunk_order);
+  uint64_t pos = b_off;
+  uint64_t end = b_off + b_len;
+  uint64_t combined = 0;
+  while (pos < end) {
+    uint64_t cstart = pos - pos % csum_chunk;
+    uint64_t cend = cstart + csum_chunk;
+    if (pos == cstart && cend <= end) {
+      uint32_t stored = blob.get_csum_item(cstart / csum_chunk);
+      *crc = stored ^ ceph_crc32c_shift_apply(&shift, *crc ^ 0xffffffff);
+      combined += csum_chunk;
+      pos = cend;
+    } else {
+      uint64_t l = std::min(cend, end) - pos;
+      bufferlist t;
+      t.substr_of(bl, pos - r_off, l);
+      *crc = t.crc32c(*crc);
+      pos += l;
+    }
+  }
+  logger->inc(l_bluestore_scrub_csum_bytes, combined);
+  return 0;
+}
+
+ceph_crc32c_shift BlueStore::_get_csum_shift(uint8_t csum_chunk_order)
+{
+  std::lock_guard<std::mutex> l(csum_shift_lock);
+  auto p = csum_shift.find(csum_chunk_order);
+  if (p == csum_shift.end()) {
+    p = csum_shift.emplace(csum_chunk_order, ceph_crc32c_shift()).first;
+    ceph_crc32c_shift_init(&p->second, 1u << csum_chunk_order);
+  }
+  return p->second;
+}
+
+int BlueStore::_verify_csum(OnodeRef& o,
+			    const bluestore_blob_t* blob, uint64_t blob_xoffset,
+			    const bufferlist& bl,
+			    uint64_t logical_offset) const
+{
+  int bad;
+  uint64_t bad_csum;
+  utime_t start = ceph_clock_now();
+  int r = blob->verify_csum(blob_xoffset, bl, &bad, &bad_csum);
+  if (r < 0) {
+    if (r == -1) {
+      PExtentVector pex;
+      int r = blob->map(
+	bad,
+	blob->get_csum_chunk_size(),
+	[&](uint64_t offset, uint64_t length) {
+	  pex.emplace_back(bluestore_pextent_t(offset, length));
+          return 0;
+	});
+      assert(r == 0);
+      derr << __func__ << " bad "
+	   << Checksummer::get_csum_type_string(blob->csum_type)
+	   << "/0x" << std::hex << blob->get_csum_chunk_size()
+	   << " checksum at blob offset 0x" << bad
+	   << ", got 0x" << bad_csum << ", expected 0x"
+	   << blob->get_csum_item(bad / blob->get_csum_chunk_size()) << std::dec
+	   << ", device location " << pex
+	   << ", object " << o->oid
+	   << ", logical extent 0x" << std::hex
+	   << (logical_offset + bad - blob_xoffset) << "~"
+	   << blob->get_csum_chunk_size() << std::dec
+	   << dendl;
+    } else {
+      derr << __func__ << " failed with exit code: " << cpp_strerror(r) << dendl;
+    }
+  }
   logger->tinc(l_bluestore_csum_lat, ceph_clock_now() - start);
   return r;
 }
@@ -5463,13 +6025,26 @@ int BlueStore::_decompress(bufferlist& source, bufferlist* result)
     cp = Compressor::create(cct, alg);
   }
 
+  Compressor::DictionaryRef dict;
+  if (cp && chdr.dict_id) {
+    dict = _get_compression_dict(chdr.dict_id, cp);
+  }
+
   if (!cp.get()) {
     // if compressor isn't available - error, because cannot return
     // decompressed data?
     derr << __func__ << " can't load decompressor " << alg << dendl;
     r = -EIO;
+  } else if (chdr.dict_id && !dict) {
+    derr << __func__ << " can't load compression dictionary "
+	 << chdr.dict_id << dendl;
+    r = -EIO;
   } else {
-    r = cp->decompress(i, chdr.length, *result);
+    if (dict) {
+      r = cp->decompress_with_dict(i, chdr.length, *result, *dict);
+    } else {
+      r = cp->decompress(i, chdr.length, *result);
+    }
     if (r < 0) {
       derr << __func__ << " decompression failed with exit code " << r << dendl;
       r = -EIO;
@@ -5479,6 +6054,247 @@ int BlueStore::_decompress(bufferlist& source, bufferlist* result)
   return r;
 }
 
+Compressor::DictionaryRef BlueStore::_get_compression_dict(
+  uint32_t id, CompressorRef c)
+{
+  std::lock_guard<std::mutex> l(comp_dict_lock);
+  auto p = comp_dicts.find(id);
+  if (p == comp_dicts.end() || p->second.d.type != c->get_type()) {
+    return Compressor::DictionaryRef();
+  }
+  if (!p->second.ref) {
+    p->second.ref = c->load_dictionary(p->second.d.data);
+  }
+  return p->second.ref;
+}
+
+uint32_t BlueStore::_choose_compression_dict(
+  TransContext *txc, int64_t pool, CompressorRef c, const bufferlist& data,
+  Compressor::DictionaryRef *ref)
+{
+  size_t dict_size = cct->_conf->bluestore_compression_dict_size;
+  if (!dict_size) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> l(comp_dict_lock);
+  PoolCompressionDict& pd = comp_pool_dicts[pool];
+  if (pd.id) {
+    CompressionDict& cd = comp_dicts[pd.id];
+    if (cd.d.type == c->get_type()) {
+      if (!cd.ref) {
+	cd.ref = c->load_dictionary(cd.d.data);
+      }
+      *ref = cd.ref;
+      return cd.ref ? pd.id : 0;
+    }
+  }
+
+  if (pd.trained_id &&
+      comp_dicts[pd.trained_id].d.type == c->get_type()) {
+    // a freshly trained dictionary goes to disk with the first txc to
+    // want it, and only that txc's blobs may refer to it until it has
+    // committed; see _compression_dict_committed().
+    CompressionDict& cd = comp_dicts[pd.trained_id];
+    if (!pd.committing) {
+      string key;
+      _key_encode_u32(pd.trained_id, &key);
+      bufferlist bl;
+      ::encode(cd.d, bl);
+      txc->t->set(PREFIX_COMPRESSION_DICT, key, bl);
+      txc->new_comp_dicts.push_back(pd.trained_id);
+      pd.committing = txc;
+      dout(10) << __func__ << " pool " << pool << " " << c->get_type_name()
+	       << " dictionary " << pd.trained_id << " 0x" << std::hex
+	       << cd.d.data.length() << std::dec << " committing with "
+	       << txc << dendl;
+    }
+    if (pd.committing != txc) {
+      return 0;
+    }
+    *ref = cd.ref;
+    return pd.trained_id;
+  }
+
+  // no dictionary for this algorithm yet: keep (bounded) copies of the
+  // pool's data, and have comp_dict_thread train one once there are
+  // enough.
+  if (pd.sample_type != c->get_type()) {
+    _reset_pool_compression_dict(pd);
+    pd.sample_type = c->get_type();
+    pd.untrainable = false;
+  }
+  if (pd.untrainable || pd.training) {
+    return 0;
+  }
+  uint64_t max_bytes = cct->_conf->bluestore_compression_dict_sample_bytes;
+  uint64_t len = MIN(data.length(),
+		     max_bytes > comp_dict_sample_bytes ?
+		     max_bytes - comp_dict_sample_bytes : 0);
+  if (len) {
+    pd.samples.emplace_back(len);
+    data.copy(0, len, pd.samples.back().data());
+    pd.sample_bytes += len;
+    comp_dict_sample_bytes += len;
+  }
+  if (pd.samples.empty() ||
+      (pd.samples.size() < cct->_conf->bluestore_compression_dict_samples &&
+       comp_dict_sample_bytes < max_bytes)) {
+    return 0;
+  }
+  dout(10) << __func__ << " pool " << pool << " " << c->get_type_name()
+	   << " " << pd.samples.size() << " samples 0x" << std::hex
+	   << pd.sample_bytes << std::dec << ", queueing for training" << dendl;
+  pd.training = true;
+  comp_dict_queue.push_back(pool);
+  comp_dict_cond.notify_all();
+  return 0;
+}
+
+void BlueStore::_reset_pool_compression_dict(PoolCompressionDict& pd)
+{
+  // samples comp_dict_thread has taken are accounted for by it
+  assert(comp_dict_sample_bytes >= pd.sample_bytes);
+  comp_dict_sample_bytes -= pd.sample_bytes;
+  pd.sample_bytes = 0;
+  pd.samples.clear();
+  pd.training = false;
+  if (pd.trained_id && !pd.committing) {
+    // nothing refers to it, and it never made it to disk
+    comp_dicts.erase(pd.trained_id);
+  }
+  pd.trained_id = 0;
+  pd.committing = nullptr;
+}
+
+void BlueStore::_compression_dict_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(comp_dict_lock);
+  while (true) {
+    if (comp_dict_stop)
+      break;
+    if (comp_dict_queue.empty()) {
+      comp_dict_cond.wait(l);
+      continue;
+    }
+    int64_t pool = comp_dict_queue.front();
+    comp_dict_queue.pop_front();
+    auto p = comp_pool_dicts.find(pool);
+    if (p == comp_pool_dicts.end() || !p->second.training) {
+      continue;
+    }
+    PoolCompressionDict& pd = p->second;
+    uint8_t type = pd.sample_type;
+    vector<comp_dict_sample_t> samples;
+    samples.swap(pd.samples);
+    uint64_t sample_bytes = pd.sample_bytes;
+    pd.sample_bytes = 0;
+    size_t dict_size = cct->_conf->bluestore_compression_dict_size;
+    l.unlock();
+
+    CompressionDict cd;
+    cd.d.pool = pool;
+    cd.d.type = type;
+    int r = -EINVAL;
+    CompressorRef c = Compressor::create(cct, type);
+    if (c && dict_size) {
+      vector<bufferlist> bls(samples.size());
+      for (unsigned i = 0; i < samples.size(); ++i) {
+	bls[i].append(buffer::create_static(samples[i].size(),
+					    samples[i].data()));
+      }
+      r = c->train_dictionary(bls, dict_size, &cd.d.data);
+      if (r >= 0) {
+	cd.ref = c->load_dictionary(cd.d.data);
+	if (!cd.ref) {
+	  r = -EINVAL;
+	}
+      }
+    }
+    samples.clear();
+
+    l.lock();
+    assert(comp_dict_sample_bytes >= sample_bytes);
+    comp_dict_sample_bytes -= sample_bytes;
+    p = comp_pool_dicts.find(pool);
+    if (p == comp_pool_dicts.end() || !p->second.training ||
+	p->second.sample_type != type) {
+      dout(20) << __func__ << " pool " << pool << " went away or changed, "
+	       << "dropping its dictionary" << dendl;
+      continue;
+    }
+    p->second.training = false;
+    if (r < 0) {
+      dout(10) << __func__ << " pool " << pool << " "
+	       << Compressor::get_comp_alg_name(type)
+	       << " can't train a dictionary: " << cpp_strerror(r) << dendl;
+      p->second.untrainable = true;
+      continue;
+    }
+    uint32_t id = ++comp_dict_max;
+    dout(10) << __func__ << " pool " << pool << " "
+	     << Compressor::get_comp_alg_name(type)
+	     << " trained dictionary " << id << " 0x" << std::hex
+	     << cd.d.data.length() << std::dec << dendl;
+    comp_dicts[id] = cd;
+    p->second.trained_id = id;
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_compression_dict_committed(TransContext *txc)
+{
+  std::lock_guard<std::mutex> l(comp_dict_lock);
+  for (auto id : txc->new_comp_dicts) {
+    auto p = comp_dicts.find(id);
+    if (p == comp_dicts.end()) {
+      continue;  // its pool went away meanwhile
+    }
+    auto q = comp_pool_dicts.find(p->second.d.pool);
+    if (q == comp_pool_dicts.end() || q->second.committing != txc) {
+      continue;
+    }
+    dout(10) << __func__ << " pool " << q->first << " dictionary " << id
+	     << " committed" << dendl;
+    q->second.id = id;
+    q->second.trained_id = 0;
+    q->second.committing = nullptr;
+  }
+}
+
+void BlueStore::_remove_compression_dicts(TransContext *txc, const coll_t& cid)
+{
+  int64_t pool = get_coll_dict_pool(cid);
+  {
+    RWLock::RLocker l(coll_lock);
+    for (auto& p : coll_map) {
+      if (get_coll_dict_pool(p.first) == pool) {
+	return;  // the pool is still in use
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> l(comp_dict_lock);
+  auto p = comp_pool_dicts.find(pool);
+  if (p != comp_pool_dicts.end()) {
+    _reset_pool_compression_dict(p->second);
+    comp_pool_dicts.erase(p);
+  }
+  for (auto q = comp_dicts.begin(); q != comp_dicts.end(); ) {
+    if (q->second.d.pool != pool) {
+      ++q;
+      continue;
+    }
+    dout(10) << __func__ << " pool " << pool << " dictionary " << q->first
+	     << dendl;
+    string key;
+    _key_encode_u32(q->first, &key);
+    txc->t->rmkey(PREFIX_COMPRESSION_DICT, key);
+    comp_dicts.erase(q++);
+  }
+}
+
 int BlueStore::fiemap(
   const coll_t& cid,
   const ghobject_t& oid,
@@ -6364,6 +7180,36 @@ int BlueStore::_open_super_meta()
     dout(10) << __func__ << " bluefs_extents 0x" << std::hex << bluefs_extents
 	     << std::dec << dendl;
   }
+
+  // compression dictionaries
+  {
+    std::lock_guard<std::mutex> l(comp_dict_lock);
+    comp_dicts.clear();
+    comp_pool_dicts.clear();
+    comp_dict_max = 0;
+    KeyValueDB::Iterator it = db->get_iterator(PREFIX_COMPRESSION_DICT);
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      uint32_t id;
+      _key_decode_u32(it->key().c_str(), &id);
+      CompressionDict& cd = comp_dicts[id];
+      bufferlist bl = it->value();
+      bufferlist::iterator p = bl.begin();
+      try {
+	::decode(cd.d, p);
+      } catch (buffer::error& e) {
+	derr << __func__ << " failed to decode compression dictionary "
+	     << id << dendl;
+	return -EIO;
+      }
+      // later dictionaries supersede earlier ones
+      comp_pool_dicts[cd.d.pool].id = id;
+      comp_dict_max = MAX(comp_dict_max, id);
+      dout(10) << __func__ << " compression dictionary " << id
+	       << " pool " << cd.d.pool << " "
+	       << Compressor::get_comp_alg_name(cd.d.type)
+	       << " 0x" << std::hex << cd.d.data.length() << std::dec << dendl;
+    }
+  }
   return 0;
 }
 
@@ -6499,7 +7345,9 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       txc->log_state_latency(logger, l_bluestore_state_kv_done_lat);
       if (txc->wal_txn) {
 	txc->state = TransContext::STATE_WAL_QUEUED;
-	if (sync_wal_apply) {
+	if (wal_batch_window > 0) {
+	  _wal_queue(txc);
+	} else if (sync_wal_apply) {
 	  _wal_apply(txc);
 	} else {
 	  wal_wq.queue(txc);
@@ -6698,6 +7546,9 @@ void BlueStore::_txc_finish_kv(TransContext *txc)
   if (!txc->oncommits.empty()) {
     finishers[n]->queue(txc->oncommits);
   }
+  if (!txc->new_comp_dicts.empty()) {
+    _compression_dict_committed(txc);
+  }
   op_queue_release_throttle(txc);
 }
 
@@ -6831,6 +7682,26 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 
 void BlueStore::_txc_release_alloc(TransContext *txc)
 {
+  if (wal_batch_window > 0 && !txc->released.empty()) {
+    // An earlier txc's wal writes may still be waiting in this
+    // sequencer's batch.  If they cover what we free, handing it to the
+    // allocator now would let another write land there first and then be
+    // overwritten by the stale batch; hold it until the batch is done.
+    std::lock_guard<std::mutex> l(wal_batch_lock);
+    OpSequencer *osr = txc->osr.get();
+    WALBatch *b = osr->wal_pending ? osr->wal_pending : osr->wal_running;
+    if (b) {
+      dout(20) << __func__ << " txc " << txc << " holding 0x" << std::hex
+	       << txc->released << std::dec << " for wal batch " << b << dendl;
+      for (auto p = txc->released.begin(); p != txc->released.end(); ++p) {
+	b->released.insert(p.get_start(), p.get_len());
+      }
+      txc->allocated.clear();
+      txc->released.clear();
+      return;
+    }
+  }
+
   // update allocator with full released set
   if (!cct->_conf->bluestore_debug_no_reuse_blocks) {
     for (interval_set<uint64_t>::iterator p = txc->released.begin();
@@ -6844,63 +7715,69 @@ void BlueStore::_txc_release_alloc(TransContext *txc)
   txc->released.clear();
 }
 
-void BlueStore::_kv_sync_thread()
+void BlueStore::_kv_batch_thread()
 {
   dout(10) << __func__ << " start" << dendl;
   std::unique_lock<std::mutex> l(kv_lock);
   while (true) {
-    assert(kv_committing.empty());
     if (kv_queue.empty() && wal_cleanup_queue.empty()) {
-      if (kv_stop)
+      if (kv_stop && _kv_idle())
 	break;
       dout(20) << __func__ << " sleep" << dendl;
-      kv_sync_cond.notify_all();
+      if (!kv_batches)
+	kv_drain_cond.notify_all();
       kv_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
+    } else if (!kv_sync_queue.empty()) {
+      // let more txcs pile up while the previous batch is syncing
+      dout(20) << __func__ << " waiting for kv_sync_thread" << dendl;
+      kv_cond.wait(l);
     } else {
+      KVBatch *b = new KVBatch;
       deque<TransContext*> kv_submitting;
-      deque<TransContext*> wal_cleaning;
       dout(20) << __func__ << " committing " << kv_queue.size()
 	       << " submitting " << kv_queue_unsubmitted.size()
 	       << " cleaning " << wal_cleanup_queue.size() << dendl;
-      kv_committing.swap(kv_queue);
+      b->committing.swap(kv_queue);
       kv_submitting.swap(kv_queue_unsubmitted);
-      wal_cleaning.swap(wal_cleanup_queue);
+      b->wal_cleaning.swap(wal_cleanup_queue);
+      ++kv_batches;
       utime_t start = ceph_clock_now();
       l.unlock();
 
-      dout(30) << __func__ << " committing txc " << kv_committing << dendl;
+      dout(30) << __func__ << " committing txc " << b->committing << dendl;
       dout(30) << __func__ << " submitting txc " << kv_submitting << dendl;
-      dout(30) << __func__ << " wal_cleaning txc " << wal_cleaning << dendl;
+      dout(30) << __func__ << " wal_cleaning txc " << b->wal_cleaning << dendl;
 
       // flush/barrier on block device
       bdev->flush();
 
       // we will use one final transaction to force a sync
-      KeyValueDB::Transaction synct = db->get_transaction();
+      b->synct = db->get_transaction();
 
       // increase {nid,blobid}_max?  note that this covers both the
       // case where we are approaching the max and the case we passed
       // it.  in either case, we increase the max in the earlier txn
-      // we submit.
-      uint64_t new_nid_max = 0, new_blobid_max = 0;
+      // we submit.  the new max only takes effect once kv_sync_thread
+      // has made it stable, so a later batch may bump it again.
       if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
 	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+	  kv_submitting.empty() ? b->synct : kv_submitting.front()->t;
+	b->new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
 	bufferlist bl;
-	::encode(new_nid_max, bl);
+	::encode(b->new_nid_max, bl);
 	t->set(PREFIX_SUPER, "nid_max", bl);
-	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
+	dout(10) << __func__ << " new_nid_max " << b->new_nid_max << dendl;
       }
       if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
 	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+	  kv_submitting.empty() ? b->synct : kv_submitting.front()->t;
+	b->new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
 	bufferlist bl;
-	::encode(new_blobid_max, bl);
+	::encode(b->new_blobid_max, bl);
 	t->set(PREFIX_SUPER, "blobid_max", bl);
-	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
+	dout(10) << __func__ << " new_blobid_max " << b->new_blobid_max
+		 << dendl;
       }
       for (auto txc : kv_submitting) {
 	assert(txc->state == TransContext::STATE_KV_QUEUED);
@@ -6911,92 +7788,156 @@ void BlueStore::_kv_sync_thread()
 	--txc->osr->kv_committing_serially;
 	txc->state = TransContext::STATE_KV_SUBMITTED;
       }
-      for (auto txc : kv_committing) {
+      for (auto txc : b->committing) {
 	if (txc->had_ios) {
 	  --txc->osr->txc_with_unstable_io;
 	}
       }
 
-      PExtentVector bluefs_gift_extents;
-      if (bluefs) {
-	int r = _balance_bluefs_freespace(&bluefs_gift_extents);
-	assert(r >= 0);
-	if (r > 0) {
-	  for (auto& p : bluefs_gift_extents) {
-	    bluefs_extents.insert(p.offset, p.length);
-	  }
-	  bufferlist bl;
-	  ::encode(bluefs_extents, bl);
-	  dout(10) << __func__ << " bluefs_extents now 0x" << std::hex
-		   << bluefs_extents << std::dec << dendl;
-	  synct->set(PREFIX_SUPER, "bluefs_extents", bl);
-	}
-      }
-
       // cleanup sync wal keys
-      for (std::deque<TransContext *>::iterator it = wal_cleaning.begin();
-	    it != wal_cleaning.end();
-	    ++it) {
-	bluestore_wal_transaction_t& wt =*(*it)->wal_txn;
+      for (auto txc : b->wal_cleaning) {
+	bluestore_wal_transaction_t& wt = *txc->wal_txn;
 	// kv metadata updates
-	_txc_finalize_kv(*it, synct);
+	_txc_finalize_kv(txc, b->synct);
 	// cleanup the wal
 	string key;
 	get_wal_key(wt.seq, &key);
-	synct->rm_single_key(PREFIX_WAL, key);
+	b->synct->rm_single_key(PREFIX_WAL, key);
       }
 
-      // submit synct synchronously (block and wait for it to commit)
-      int r = db->submit_transaction_sync(synct);
-      assert(r == 0);
+      logger->tinc(l_bluestore_kv_batch_lat, ceph_clock_now() - start);
+      logger->inc(l_bluestore_kv_batch_txc,
+		  b->committing.size() + b->wal_cleaning.size());
 
-      if (new_nid_max) {
-	nid_max = new_nid_max;
-	dout(10) << __func__ << " nid_max now " << nid_max << dendl;
-      }
-      if (new_blobid_max) {
-	blobid_max = new_blobid_max;
-	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
-      }
+      l.lock();
+      kv_sync_queue.push_back(b);
+      kv_sync_cond.notify_one();
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
 
-      utime_t finish = ceph_clock_now();
-      utime_t dur = finish - start;
-      dout(20) << __func__ << " committed " << kv_committing.size()
-	       << " cleaned " << wal_cleaning.size()
-	       << " in " << dur << dendl;
-      while (!kv_committing.empty()) {
-	TransContext *txc = kv_committing.front();
-	assert(txc->state == TransContext::STATE_KV_SUBMITTED);
-	_txc_release_alloc(txc);
-	_txc_state_proc(txc);
-	kv_committing.pop_front();
-      }
-      while (!wal_cleaning.empty()) {
-	TransContext *txc = wal_cleaning.front();
-	_txc_release_alloc(txc);
-	_txc_state_proc(txc);
-	wal_cleaning.pop_front();
+void BlueStore::_kv_sync_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(kv_lock);
+  while (true) {
+    if (kv_sync_queue.empty()) {
+      if (kv_stop && _kv_idle())
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_sync_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+      continue;
+    }
+    KVBatch *b = kv_sync_queue.front();
+    kv_sync_queue.pop_front();
+    kv_cond.notify_one();
+    utime_t start = ceph_clock_now();
+    l.unlock();
+
+    if (bluefs) {
+      int r = _balance_bluefs_freespace(&b->bluefs_gift_extents);
+      assert(r >= 0);
+      if (r > 0) {
+	for (auto& p : b->bluefs_gift_extents) {
+	  bluefs_extents.insert(p.offset, p.length);
+	}
+	bufferlist bl;
+	::encode(bluefs_extents, bl);
+	dout(10) << __func__ << " bluefs_extents now 0x" << std::hex
+		 << bluefs_extents << std::dec << dendl;
+	b->synct->set(PREFIX_SUPER, "bluefs_extents", bl);
       }
+    }
 
-      // this is as good a place as any ...
-      _reap_collections();
+    // submit synct synchronously (block and wait for it to commit)
+    int r = db->submit_transaction_sync(b->synct);
+    assert(r == 0);
 
-      if (bluefs) {
-	if (!bluefs_gift_extents.empty()) {
-	  _commit_bluefs_freespace(bluefs_gift_extents);
-	}
-	for (auto p = bluefs_extents_reclaiming.begin();
-	     p != bluefs_extents_reclaiming.end();
-	     ++p) {
-	  dout(20) << __func__ << " releasing old bluefs 0x" << std::hex
-		   << p.get_start() << "~" << p.get_len() << std::dec
-		   << dendl;
-	  alloc->release(p.get_start(), p.get_len());
-	}
-	bluefs_extents_reclaiming.clear();
+    if (b->new_nid_max) {
+      nid_max = b->new_nid_max;
+      dout(10) << __func__ << " nid_max now " << nid_max << dendl;
+    }
+    if (b->new_blobid_max) {
+      blobid_max = b->new_blobid_max;
+      dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+    }
+
+    if (bluefs) {
+      if (!b->bluefs_gift_extents.empty()) {
+	_commit_bluefs_freespace(b->bluefs_gift_extents);
+      }
+      for (auto p = bluefs_extents_reclaiming.begin();
+	   p != bluefs_extents_reclaiming.end();
+	   ++p) {
+	dout(20) << __func__ << " releasing old bluefs 0x" << std::hex
+		 << p.get_start() << "~" << p.get_len() << std::dec
+		 << dendl;
+	alloc->release(p.get_start(), p.get_len());
       }
+      bluefs_extents_reclaiming.clear();
+    }
 
-      l.lock();
+    utime_t dur = ceph_clock_now() - start;
+    logger->tinc(l_bluestore_kv_sync_lat, dur);
+    dout(20) << __func__ << " committed " << b->committing.size()
+	     << " cleaned " << b->wal_cleaning.size()
+	     << " in " << dur << dendl;
+
+    l.lock();
+    kv_finalize_queue.push_back(b);
+    kv_finalize_cond.notify_one();
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_kv_finalize_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(kv_lock);
+  while (true) {
+    if (kv_finalize_queue.empty()) {
+      if (kv_stop && _kv_idle())
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_finalize_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+      continue;
+    }
+    KVBatch *b = kv_finalize_queue.front();
+    kv_finalize_queue.pop_front();
+    utime_t start = ceph_clock_now();
+    l.unlock();
+
+    while (!b->committing.empty()) {
+      TransContext *txc = b->committing.front();
+      assert(txc->state == TransContext::STATE_KV_SUBMITTED);
+      _txc_release_alloc(txc);
+      _txc_state_proc(txc);
+      b->committing.pop_front();
+    }
+    while (!b->wal_cleaning.empty()) {
+      TransContext *txc = b->wal_cleaning.front();
+      _txc_release_alloc(txc);
+      _txc_state_proc(txc);
+      b->wal_cleaning.pop_front();
+    }
+    delete b;
+
+    // this is as good a place as any ...
+    _reap_collections();
+
+    logger->tinc(l_bluestore_kv_final_lat, ceph_clock_now() - start);
+
+    l.lock();
+    --kv_batches;
+    if (!kv_batches) {
+      kv_drain_cond.notify_all();
+      if (kv_stop) {
+	kv_cond.notify_all();
+	kv_sync_cond.notify_all();
+      }
     }
   }
   dout(10) << __func__ << " finish" << dendl;
@@ -7085,6 +8026,184 @@ int BlueStore::_do_wal_op(TransContext *txc, bluestore_wal_op_t& wo)
   return 0;
 }
 
+void BlueStore::WALBatch::write(uint64_t offset, bufferlist& bl)
+{
+  uint64_t start = offset;
+  uint64_t end = offset + bl.length();
+  bufferlist merged;
+
+  // keep the head of an extent we overlap or directly follow
+  auto p = iomap.lower_bound(offset);
+  if (p != iomap.begin()) {
+    auto q = std::prev(p);
+    if (q->first + q->second.length() >= offset) {
+      start = q->first;
+      merged.substr_of(q->second, 0, offset - q->first);
+      p = q;
+    }
+  }
+  merged.append(bl);
+
+  // drop what we cover, keeping the tail of the last extent we overlap
+  // or directly precede
+  while (p != iomap.end() && p->first <= end) {
+    uint64_t pend = p->first + p->second.length();
+    if (pend > end) {
+      bufferlist tail;
+      tail.substr_of(p->second, end - p->first, pend - end);
+      merged.claim_append(tail);
+      end = pend;
+    }
+    bytes -= p->second.length();
+    iomap.erase(p++);
+  }
+
+  bytes += merged.length();
+  iomap[start].claim(merged);
+}
+
+void BlueStore::_wal_queue(TransContext *txc)
+{
+  bluestore_wal_transaction_t& wt = *txc->wal_txn;
+  OpSequencer *osr = txc->osr.get();
+  dout(20) << __func__ << " txc " << txc << " seq " << wt.seq
+	   << " osr " << osr << dendl;
+
+  std::lock_guard<std::mutex> l(wal_batch_lock);
+  WALBatch *b = osr->wal_pending;
+  if (!b) {
+    b = osr->wal_pending = new WALBatch(cct, osr);
+    wal_batch_queue.push_back(osr);
+    wal_batch_cond.notify_one();
+  }
+  for (auto& wo : wt.ops) {
+    assert(wo.op == bluestore_wal_op_t::OP_WRITE);
+    bufferlist::iterator p = wo.data.begin();
+    for (auto& e : wo.extents) {
+      bufferlist bl;
+      p.copy(e.length, bl);
+      b->write(e.offset, bl);
+    }
+  }
+  b->txcs.push_back(txc);
+  if (b->bytes >= cct->_conf->bluestore_wal_batch_max_bytes) {
+    // full; no point waiting out the window
+    wal_batch_cond.notify_one();
+  }
+}
+
+void BlueStore::_wal_batch_submit(WALBatch *b)
+{
+  dout(20) << __func__ << " osr " << b->osr << " " << b->txcs.size()
+	   << " txcs, " << b->iomap.size() << " ios, " << b->bytes
+	   << " bytes" << dendl;
+  for (auto txc : b->txcs) {
+    txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat);
+    txc->state = TransContext::STATE_WAL_APPLYING;
+  }
+  logger->inc(l_bluestore_wal_write_ops, b->iomap.size());
+  logger->inc(l_bluestore_wal_write_bytes, b->bytes);
+  for (auto& p : b->iomap) {
+    if (!g_conf->bluestore_debug_omit_block_device_write) {
+      int r = bdev->aio_write(p.first, p.second, &b->ioc, false);
+      assert(r == 0);
+    }
+  }
+  for (auto txc : b->txcs) {
+    txc->log_state_latency(logger, l_bluestore_state_wal_applying_lat);
+    txc->state = TransContext::STATE_WAL_AIO_WAIT;
+  }
+  if (b->ioc.has_pending_aios()) {
+    bdev->aio_submit(&b->ioc);
+  } else {
+    _wal_batch_finish(b);
+  }
+}
+
+void BlueStore::_wal_batch_finish(WALBatch *b)
+{
+  dout(20) << __func__ << " osr " << b->osr << " " << b->txcs.size()
+	   << " txcs" << dendl;
+  for (auto txc : b->txcs) {
+    txc->log_state_latency(logger, l_bluestore_state_wal_aio_wait_lat);
+    _wal_finish(txc);
+  }
+  {
+    std::lock_guard<std::mutex> l(wal_batch_lock);
+    assert(b->osr->wal_running == b);
+    // space freed by later txcs while we were queued; our writes are on
+    // disk now, and earlier batches finished before we were submitted
+    if (!b->released.empty()) {
+      dout(20) << __func__ << " releasing held 0x" << std::hex
+	       << b->released << std::dec << dendl;
+      if (!cct->_conf->bluestore_debug_no_reuse_blocks) {
+	for (auto p = b->released.begin(); p != b->released.end(); ++p) {
+	  alloc->release(p.get_start(), p.get_len());
+	}
+      }
+    }
+    b->osr->wal_running = nullptr;
+    --wal_batches_running;
+    // the sequencer's next batch may be waiting on us
+    wal_batch_cond.notify_one();
+  }
+  delete b;
+}
+
+void BlueStore::_wal_batch_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(wal_batch_lock);
+  while (true) {
+    // take every batch that is due (full, or waited out the window) and
+    // whose sequencer has nothing in flight
+    utime_t now = ceph_clock_now();
+    utime_t next;
+    vector<WALBatch*> ready;
+    for (auto p = wal_batch_queue.begin(); p != wal_batch_queue.end(); ) {
+      OpSequencer *osr = *p;
+      WALBatch *b = osr->wal_pending;
+      utime_t due = b->start;
+      due += wal_batch_window;
+      if (!wal_batch_stop && due > now &&
+	  b->bytes < cct->_conf->bluestore_wal_batch_max_bytes) {
+	if (next == utime_t() || due < next) {
+	  next = due;
+	}
+	++p;
+      } else if (osr->wal_running) {
+	++p;
+      } else {
+	osr->wal_pending = nullptr;
+	osr->wal_running = b;
+	++wal_batches_running;
+	ready.push_back(b);
+	p = wal_batch_queue.erase(p);
+      }
+    }
+    if (!ready.empty()) {
+      l.unlock();
+      for (auto b : ready) {
+	_wal_batch_submit(b);
+      }
+      l.lock();
+      continue;
+    }
+    if (wal_batch_stop && wal_batch_queue.empty() && !wal_batches_running) {
+      break;
+    }
+    if (next != utime_t()) {
+      dout(30) << __func__ << " sleep until " << next << dendl;
+      wal_batch_cond.wait_for(
+	l, std::chrono::microseconds((next - now).to_nsec() / 1000 + 1));
+    } else {
+      dout(30) << __func__ << " sleep" << dendl;
+      wal_batch_cond.wait(l);
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
 int BlueStore::_wal_replay()
 {
   dout(10) << __func__ << " start" << dendl;
@@ -7995,7 +9114,9 @@ int BlueStore::_do_alloc_write(
   uint64_t hint = 0;
   CompressorRef c;
   double crr = 0;
+  int64_t pool = -1;
   if (wctx->compress) {
+    pool = get_coll_dict_pool(coll->cid);
     c = select_option(
       "compression_algorithm",
       compressor,
@@ -8061,7 +9182,13 @@ int BlueStore::_do_alloc_write(
       // FIXME: memory alignment here is bad
       bufferlist t;
 
-      r = c->compress(*l, t);
+      Compressor::DictionaryRef dict;
+      chdr.dict_id = _choose_compression_dict(txc, pool, c, *l, &dict);
+      if (dict) {
+	r = c->compress_with_dict(*l, t, *dict);
+      } else {
+	r = c->compress(*l, t);
+      }
       assert(r == 0);
 
       chdr.length = t.length();
@@ -9224,6 +10351,9 @@ int BlueStore::_remove_collection(TransContext *txc, const coll_t &cid,
       }
     }
   }
+  if (r == 0) {
+    _remove_compression_dicts(txc, cid);
+  }
 
  out:
   dout(10) << __func__ << " " << cid << " = " << r << dendl;
@@ -28,6 +28,7 @@
 #include <boost/intrusive/set.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/dynamic_bitset.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include "include/assert.h"
 #include "include/unordered_map.h"
@@ -62,6 +63,10 @@ enum {
   l_bluestore_state_finishing_lat,
   l_bluestore_state_done_lat,
   l_bluestore_commit_lat,
+  l_bluestore_kv_batch_lat,
+  l_bluestore_kv_sync_lat,
+  l_bluestore_kv_final_lat,
+  l_bluestore_kv_batch_txc,
   l_bluestore_compress_lat,
   l_bluestore_decompress_lat,
   l_bluestore_csum_lat,
@@ -85,6 +90,10 @@ enum {
   l_bluestore_buffer_bytes,
   l_bluestore_buffer_hit_bytes,
   l_bluestore_buffer_miss_bytes,
+  l_bluestore_cache_meta_target,
+  l_bluestore_cache_data_target,
+  l_bluestore_cache_kv_target,
+  l_bluestore_cache_rebalance,
   l_bluestore_write_big,
   l_bluestore_write_big_bytes,
   l_bluestore_write_big_blobs,
@@ -104,6 +113,7 @@ enum {
   l_bluestore_onode_reshard,
   l_bluestore_blob_split,
   l_bluestore_extent_compress,
+  l_bluestore_scrub_csum_bytes,
   l_bluestore_last
 };
 
@@ -163,6 +173,9 @@ public:
     uint32_t offset, length;
     bufferlist data;
 
+    /// read since the cache last looked at us; see Cache::_trim
+    std::atomic<bool> referenced = {false};
+
     boost::intrusive::list_member_hook<> lru_item;
     boost::intrusive::list_member_hook<> state_item;
 
@@ -188,6 +201,13 @@ public:
       return offset + length;
     }
 
+    void touch() {
+      // avoid dirtying the cache line if we are already marked
+      if (!referenced.load(std::memory_order_relaxed)) {
+	referenced.store(true, std::memory_order_relaxed);
+      }
+    }
+
     void truncate(uint32_t newlen) {
       assert(newlen < length);
       if (data.length()) {
@@ -267,18 +287,22 @@ public:
       return i;
     }
 
-    // must be called under protection of the Cache lock
+    // must be called under protection of the Cache lock.  unlike the
+    // other _ methods this does not need buffer_lock: nobody else can be
+    // reading a BufferSpace whose SharedBlob is going away.
     void _clear(Cache* cache);
 
     // return value is the highest cache_private of a trimmed buffer, or 0.
     int discard(Cache* cache, uint32_t offset, uint32_t length) {
       std::lock_guard<std::recursive_mutex> l(cache->lock);
+      std::lock_guard<boost::shared_mutex> bl(cache->buffer_lock);
       return _discard(cache, offset, length);
     }
     int _discard(Cache* cache, uint32_t offset, uint32_t length);
 
     void write(Cache* cache, uint64_t seq, uint32_t offset, bufferlist& bl, unsigned flags) {
       std::lock_guard<std::recursive_mutex> l(cache->lock);
+      std::lock_guard<boost::shared_mutex> wl(cache->buffer_lock);
       Buffer *b = new Buffer(this, Buffer::STATE_WRITING, seq, offset, bl,
 			     flags);
       b->cache_private = _discard(cache, offset, bl.length());
@@ -287,11 +311,13 @@ public:
     void finish_write(Cache* cache, uint64_t seq);
     void did_read(Cache* cache, uint32_t offset, bufferlist& bl) {
       std::lock_guard<std::recursive_mutex> l(cache->lock);
+      std::lock_guard<boost::shared_mutex> wl(cache->buffer_lock);
       Buffer *b = new Buffer(this, Buffer::STATE_CLEAN, 0, offset, bl);
       b->cache_private = _discard(cache, offset, bl.length());
       _add_buffer(cache, b, 1, nullptr);
     }
 
+    /// look up cached data; takes buffer_lock shared, not Cache::lock
     void read(Cache* cache, uint32_t offset, uint32_t length,
 	      BlueStore::ready_regions_t& res,
 	      interval_set<uint32_t>& res_intervals);
@@ -782,6 +808,9 @@ public:
     bluestore_onode_t onode;  ///< metadata stored as value in kv store
     bool exists;              ///< true if object logically exists
 
+    /// looked up since the cache last looked at us; see Cache::_trim
+    std::atomic<bool> referenced = {false};
+
     ExtentMap extent_map;
 
     std::atomic<int> flushing_count = {0};
@@ -800,6 +829,11 @@ public:
     }
 
     void flush();
+    void touch() {
+      if (!referenced.load(std::memory_order_relaxed)) {
+	referenced.store(true, std::memory_order_relaxed);
+      }
+    }
     void get() {
       ++nref;
     }
@@ -812,10 +846,20 @@ public:
 
 
   /// a cache (shard) of onodes and buffers
+  ///
+  /// Lookups do not move items in the lru themselves.  OnodeSpace::lookup
+  /// and BufferSpace::read only set the item's referenced flag, and
+  /// _trim gives a referenced item a second chance (moving it back to
+  /// the front) instead of evicting it.  That keeps the hit path off
+  /// the shard lock: onode lookups only take their OnodeSpace's map_lock
+  /// and buffer reads buffer_lock, both shared.
   struct Cache {
     CephContext* cct;
     PerfCounters *logger;
     std::recursive_mutex lock;          ///< protect lru and other structures
+    /// held shared by BufferSpace::read, and exclusive (after lock) by
+    /// anything modifying a BufferSpace's buffer_map or its buffers
+    boost::shared_mutex buffer_lock;
 
     std::atomic<uint64_t> num_extents = {0};
     std::atomic<uint64_t> num_blobs = {0};
@@ -1055,6 +1099,10 @@ public:
   struct OnodeSpace {
     Cache *cache;
 
+    /// held shared by lookups, and exclusive (after cache->lock) by
+    /// anything modifying onode_map
+    boost::shared_mutex map_lock;
+
     /// forward lookups
     mempool::bluestore_meta_other::unordered_map<ghobject_t,OnodeRef> onode_map;
 
@@ -1160,7 +1208,13 @@ public:
   class OpSequencer;
   typedef boost::intrusive_ptr<OpSequencer> OpSequencerRef;
 
-  struct TransContext {
+  /// owner of an IOContext whose aios complete via aio_cb
+  struct AioContext {
+    virtual void aio_finish(BlueStore *store) = 0;
+    virtual ~AioContext() {}
+  };
+
+  struct TransContext : public AioContext {
     typedef enum {
       STATE_PREPARE,
       STATE_AIO_WAIT,
@@ -1247,6 +1301,7 @@ public:
     Context *onreadable_sync;         ///< signal on readable
     list<Context*> oncommits;  ///< more commit completions
     list<CollectionRef> removed_collections; ///< colls we removed
+    vector<uint32_t> new_comp_dicts; ///< compression dicts we commit
 
     boost::intrusive::list_member_hook<> wal_queue_item;
     bluestore_wal_transaction_t *wal_txn; ///< wal transaction (if any)
@@ -1325,10 +1380,14 @@ public:
 	onreadable(NULL),
 	onreadable_sync(NULL),
 	wal_txn(NULL),
-	ioc(cct, this),
+	ioc(cct, static_cast<AioContext*>(this)),
 	start(ceph_clock_now()) {
         last_stamp = start;
     }
+    void aio_finish(BlueStore *store) override {
+      store->_txc_state_proc(this);
+    }
+
     ~TransContext() {
       delete wal_txn;
     }
@@ -1350,6 +1409,8 @@ public:
     }
   };
 
+  struct WALBatch;
+
   class OpSequencer : public Sequencer_impl {
   public:
     std::mutex qlock;
@@ -1376,6 +1437,10 @@ public:
 
     std::mutex wal_apply_mutex;
 
+    // with wal batching; protected by BlueStore::wal_batch_lock
+    WALBatch *wal_pending = nullptr;  ///< collecting wal writes
+    WALBatch *wal_running = nullptr;  ///< merged wal writes in flight
+
     uint64_t last_seq = 0;
 
     std::atomic_int txc_with_unstable_io = {0};  ///< num txcs with unstable io
@@ -1439,6 +1504,40 @@ public:
     }
   };
 
+  /**
+   * wal writes of one sequencer's txcs, merged into few large ios
+   *
+   * The ops of each txc are applied to iomap in commit order, so a later
+   * write to the same blocks replaces the earlier one, and adjacent
+   * writes are joined.  Only one batch per sequencer is in flight at a
+   * time, so merged ios never race an older write to the same blocks.
+   * Space that later txcs of the sequencer free while the batch waits or
+   * runs is held in released and only returned to the allocator once
+   * the batch completes.
+   */
+  struct WALBatch : public AioContext {
+    OpSequencer *osr;
+    map<uint64_t, bufferlist> iomap;  ///< device offset -> data, disjoint
+    uint64_t bytes = 0;               ///< total length of iomap
+    deque<TransContext*> txcs;        ///< in commit order
+    utime_t start;                    ///< first txc queued
+    IOContext ioc;
+    interval_set<uint64_t> released;  ///< freed after us; protected by
+                                      ///< BlueStore::wal_batch_lock
+
+    WALBatch(CephContext *cct, OpSequencer *o)
+      : osr(o),
+	start(ceph_clock_now()),
+	ioc(cct, static_cast<AioContext*>(this)) {}
+
+    /// add a write, replacing whatever overlaps it
+    void write(uint64_t offset, bufferlist& bl);
+
+    void aio_finish(BlueStore *store) override {
+      store->_wal_batch_finish(this);
+    }
+  };
+
   class WALWQ : public ThreadPool::WorkQueue<TransContext> {
     // We need to order WAL items within each Sequencer.  To do that,
     // queue each txc under osr, and queue the osr's here.  When we
@@ -1506,6 +1605,28 @@ public:
     }
   };
 
+  /// txcs committed to the kv store by a single synchronous transaction
+  struct KVBatch {
+    deque<TransContext*> committing;    ///< kv updates made stable
+    deque<TransContext*> wal_cleaning;  ///< wal keys removed by synct
+    KeyValueDB::Transaction synct;      ///< final txn, submitted sync
+    uint64_t new_nid_max = 0;
+    uint64_t new_blobid_max = 0;
+    PExtentVector bluefs_gift_extents;
+  };
+
+  // the kv commit path is a pipeline: the batch thread forms a batch
+  // and submits its transactions, the sync thread makes it stable and
+  // the finalize thread completes its txcs.  each can work on a
+  // different batch.
+  struct KVBatchThread : public Thread {
+    BlueStore *store;
+    explicit KVBatchThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_kv_batch_thread();
+      return NULL;
+    }
+  };
   struct KVSyncThread : public Thread {
     BlueStore *store;
     explicit KVSyncThread(BlueStore *s) : store(s) {}
@@ -1514,6 +1635,30 @@ public:
       return NULL;
     }
   };
+  struct KVFinalizeThread : public Thread {
+    BlueStore *store;
+    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_kv_finalize_thread();
+      return NULL;
+    }
+  };
+  struct WALBatchThread : public Thread {
+    BlueStore *store;
+    explicit WALBatchThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_wal_batch_thread();
+      return NULL;
+    }
+  };
+  struct CompressionDictThread : public Thread {
+    BlueStore *store;
+    explicit CompressionDictThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_compression_dict_thread();
+      return NULL;
+    }
+  };
 
   struct DBHistogram {
     struct value_dist {
@@ -1538,6 +1683,23 @@ public:
     void dump(Formatter *f);
   };
 
+  // cache autotuning, as done by the mempool thread
+  struct cache_state_t {
+    const char *name;
+    uint64_t *target;
+    uint64_t used;
+    double miss_ratio;  ///< since the last pass; < 0 if there were no lookups
+  };
+  /// static split of total bytes; kv_size < 0 if the kv cache can't be sized
+  static void init_cache_targets(uint64_t total, int64_t kv_size,
+				 double meta_ratio, uint64_t *meta,
+				 uint64_t *data, uint64_t *kv);
+  /// move chunk bytes from one of caches[0..num) to another, if worth it
+  static bool balance_cache_targets(cache_state_t *caches, unsigned num,
+				    uint64_t chunk, uint64_t min_bytes,
+				    cache_state_t **grow,
+				    cache_state_t **shrink);
+
   // --------------------------------------------------------
   // members
 private:
@@ -1574,17 +1736,32 @@ private:
   ThreadPool wal_tp;
   WALWQ wal_wq;
 
+  double wal_batch_window = 0; ///< seconds to collect wal writes; 0 = off
+  WALBatchThread wal_batch_thread;
+  std::mutex wal_batch_lock;
+  std::condition_variable wal_batch_cond;
+  bool wal_batch_stop = false;
+  list<OpSequencer*> wal_batch_queue;  ///< sequencers with a pending batch
+  unsigned wal_batches_running = 0;
+
   int m_finisher_num;
   vector<Finisher*> finishers;
 
+  KVBatchThread kv_batch_thread;
   KVSyncThread kv_sync_thread;
+  KVFinalizeThread kv_finalize_thread;
   std::mutex kv_lock;
-  std::condition_variable kv_cond, kv_sync_cond;
+  std::condition_variable kv_cond;           ///< wakes kv_batch_thread
+  std::condition_variable kv_sync_cond;      ///< wakes kv_sync_thread
+  std::condition_variable kv_finalize_cond;  ///< wakes kv_finalize_thread
+  std::condition_variable kv_drain_cond;     ///< kv pipeline went idle
   bool kv_stop;
   deque<TransContext*> kv_queue;             ///< ready, already submitted
   deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
-  deque<TransContext*> kv_committing;        ///< currently syncing
   deque<TransContext*> wal_cleanup_queue;    ///< wal done, ready for cleanup
+  deque<KVBatch*> kv_sync_queue;             ///< submitted, need sync
+  deque<KVBatch*> kv_finalize_queue;         ///< stable, need completion
+  unsigned kv_batches = 0;                   ///< formed, not yet finalized
 
   PerfCounters *logger;
 
@@ -1614,6 +1791,43 @@ private:
   std::atomic<uint64_t> comp_min_blob_size = {0};
   std::atomic<uint64_t> comp_max_blob_size = {0};
 
+  // trained compression dictionaries
+  struct CompressionDict {
+    bluestore_compression_dict_t d;
+    Compressor::DictionaryRef ref;   ///< prepared for d.type, on first use
+  };
+  typedef mempool::bluestore_meta_other::vector<char> comp_dict_sample_t;
+  struct PoolCompressionDict {
+    uint32_t id = 0;                 ///< dictionary new blobs use, 0 for none
+    uint8_t sample_type = Compressor::COMP_ALG_NONE; ///< samples are for
+    vector<comp_dict_sample_t> samples;  ///< copies, for the trainer
+    uint64_t sample_bytes = 0;
+    bool training = false;           ///< queued for comp_dict_thread
+    bool untrainable = false;        ///< sample_type can't train one
+    uint32_t trained_id = 0;         ///< trained, but not yet committed
+    TransContext *committing = nullptr; ///< txc committing trained_id
+  };
+  std::mutex comp_dict_lock;
+  map<uint32_t, CompressionDict> comp_dicts;  ///< by id
+  map<int64_t, PoolCompressionDict> comp_pool_dicts;
+  uint32_t comp_dict_max = 0;
+  uint64_t comp_dict_sample_bytes = 0; ///< over all pools' samples
+
+  CompressionDictThread comp_dict_thread;
+  std::condition_variable comp_dict_cond;
+  bool comp_dict_stop = false;
+  deque<int64_t> comp_dict_queue;   ///< pools with samples to train on
+
+  Compressor::DictionaryRef _get_compression_dict(
+    uint32_t id, CompressorRef c);
+  uint32_t _choose_compression_dict(
+    TransContext *txc, int64_t pool, CompressorRef c, const bufferlist& data,
+    Compressor::DictionaryRef *ref);
+  void _compression_dict_thread();
+  void _compression_dict_committed(TransContext *txc);
+  void _remove_compression_dicts(TransContext *txc, const coll_t& cid);
+  void _reset_pool_compression_dict(PoolCompressionDict& pd);
+
   // cache trim control
 
   // note that these update in a racy way, but we don't *really* care if
@@ -1629,11 +1843,29 @@ private:
     *onodes = mempool_onodes;
   }
 
+  // with bluestore_cache_autotune, the mempool thread splits
+  // bluestore_cache_size between these three; same caveats as above.
+  uint64_t cache_meta_target = 0;  ///< onodes, all shards
+  uint64_t cache_data_target = 0;  ///< buffers, all shards
+  uint64_t cache_kv_target = 0;    ///< kv block cache
+
+  /// per-shard target bytes and meta ratio for Cache::trim
+  void get_cache_shard_target(uint64_t *bytes, float *meta_ratio);
+
   struct MempoolThread : public Thread {
     BlueStore *store;
     Cond cond;
     Mutex lock;
     bool stop = false;
+
+    // hit/miss counts as of the last rebalance
+    uint64_t last_onode_hits = 0, last_onode_misses = 0;
+    uint64_t last_buffer_hits = 0, last_buffer_misses = 0;
+    uint64_t last_kv_hits = 0, last_kv_misses = 0;
+    utime_t last_balance;
+
+    void _init_cache_targets();
+    void _balance_cache();
   public:
     explicit MempoolThread(BlueStore *s)
       : store(s),
@@ -1714,7 +1946,7 @@ private:
   void _txc_aio_submit(TransContext *txc);
 public:
   void _txc_aio_finish(void *p) {
-    _txc_state_proc(static_cast<TransContext*>(p));
+    static_cast<AioContext*>(p)->aio_finish(this);
   }
 private:
   void _txc_finish_io(TransContext *txc);
@@ -1725,14 +1957,59 @@ private:
 
   void _osr_reap_done(OpSequencer *osr);
 
+  void _kv_start() {
+    kv_batch_thread.create("bstore_kv_batch");
+    kv_sync_thread.create("bstore_kv_sync");
+    kv_finalize_thread.create("bstore_kv_final");
+    if (wal_batch_window > 0) {
+      wal_batch_thread.create("bstore_wal_batch");
+    }
+    comp_dict_thread.create("bstore_comp_dict");
+  }
+  bool _kv_idle() const {
+    return kv_queue.empty() && wal_cleanup_queue.empty() && !kv_batches;
+  }
+  void _kv_batch_thread();
   void _kv_sync_thread();
+  void _kv_finalize_thread();
   void _kv_stop() {
+    {
+      std::lock_guard<std::mutex> l(comp_dict_lock);
+      comp_dict_stop = true;
+      comp_dict_cond.notify_all();
+    }
+    comp_dict_thread.join();
+    {
+      // anything sampled or trained but not committed is simply redone
+      std::lock_guard<std::mutex> l(comp_dict_lock);
+      comp_dict_stop = false;
+      comp_dict_queue.clear();
+      for (auto& p : comp_pool_dicts) {
+	_reset_pool_compression_dict(p.second);
+      }
+    }
+    // the wal batches still complete txcs into the kv threads; flush
+    // them out first
+    if (wal_batch_thread.is_started()) {
+      {
+	std::lock_guard<std::mutex> l(wal_batch_lock);
+	wal_batch_stop = true;
+	wal_batch_cond.notify_all();
+      }
+      wal_batch_thread.join();
+      std::lock_guard<std::mutex> l(wal_batch_lock);
+      wal_batch_stop = false;
+    }
     {
       std::lock_guard<std::mutex> l(kv_lock);
       kv_stop = true;
       kv_cond.notify_all();
+      kv_sync_cond.notify_all();
+      kv_finalize_cond.notify_all();
     }
+    kv_batch_thread.join();
     kv_sync_thread.join();
+    kv_finalize_thread.join();
     {
       std::lock_guard<std::mutex> l(kv_lock);
       kv_stop = false;
@@ -1743,14 +2020,47 @@ private:
   int _wal_apply(TransContext *txc);
   int _wal_finish(TransContext *txc);
   int _do_wal_op(TransContext *txc, bluestore_wal_op_t& wo);
+  void _wal_queue(TransContext *txc);
+  void _wal_batch_submit(WALBatch *b);
+  void _wal_batch_finish(WALBatch *b);
+  void _wal_batch_thread();
   int _wal_replay();
 
+  struct fsck_sb_info_t {
+    list<ghobject_t> oids;
+    SharedBlobRef sb;
+    bluestore_extent_ref_map_t ref_map;
+    bool compressed;
+  };
+
+  /// one fsck worker's slice of the object keyspace and its findings
+  struct fsck_walk_t {
+    string start, end;   ///< [start, end) in PREFIX_OBJ; empty end = no limit
+    int errors = 0;
+    set<uint64_t> used_nids;
+    set<uint64_t> used_omap_head;
+    store_statfs_t expected_statfs;
+    uint64_t num_objects = 0;
+    uint64_t num_extents = 0;
+    uint64_t num_blobs = 0;
+    uint64_t num_spanning_blobs = 0;
+    uint64_t num_sharded_objects = 0;
+    uint64_t num_object_shards = 0;
+  };
+
   int _fsck_check_extents(
     const ghobject_t& oid,
     const PExtentVector& extents,
     bool compressed,
     boost::dynamic_bitset<> &used_blocks,
     store_statfs_t& expected_statfs);
+  /// used_blocks and sb_info are shared between workers, under lock
+  void _fsck_walk_objects(
+    bool deep,
+    fsck_walk_t *w,
+    std::mutex *lock,
+    boost::dynamic_bitset<> &used_blocks,
+    map<uint64_t,fsck_sb_info_t> &sb_info);
 
   void _buffer_cache_write(
     TransContext *txc,
@@ -1858,6 +2168,36 @@ public:
     bufferlist& bl,
     uint32_t op_flags = 0);
 
+  int scrub_crc32c(
+    CollectionHandle &c,
+    const ghobject_t& oid,
+    uint64_t offset,
+    size_t len,
+    uint32_t *crc,
+    uint32_t op_flags = 0) override;
+private:
+  int _do_scrub_crc32c(
+    Collection *c,
+    OnodeRef o,
+    uint64_t offset,
+    size_t len,
+    uint32_t *crc,
+    uint32_t op_flags);
+  int _scrub_crc32c_blob(
+    Collection *c,
+    OnodeRef o,
+    BlobRef b,
+    uint64_t logical_offset,
+    uint64_t b_off,
+    uint64_t b_len,
+    uint32_t *crc,
+    uint32_t op_flags);
+
+  std::mutex csum_shift_lock;
+  map<uint8_t, ceph_crc32c_shift> csum_shift;  ///< by csum_chunk_order
+  ceph_crc32c_shift _get_csum_shift(uint8_t csum_chunk_order);
+public:
+
   int fiemap(const coll_t& cid, const ghobject_t& oid,
 	     uint64_t offset, size_t len, bufferlist& bl) override;
   int fiemap(CollectionHandle &c, const ghobject_t& oid,
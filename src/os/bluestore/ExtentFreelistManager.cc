@@ -111,6 +111,18 @@ bool ExtentFreelistManager::enumerate_next(uint64_t *offset, uint64_t *length)
   return true;
 }
 
+void ExtentFreelistManager::enumerate_range(
+  uint64_t start, uint64_t end,
+  std::function<void(uint64_t offset, uint64_t length)> f)
+{
+  std::lock_guard<std::mutex> l(lock);
+  for (auto p = kv_free.lower_bound(start);
+       p != kv_free.end() && p->first < end;
+       ++p) {
+    f(p->first, p->second);
+  }
+}
+
 void ExtentFreelistManager::_dump()
 {
   dout(30) << __func__ << " " << total_free
@@ -46,6 +46,9 @@ public:
 
   void enumerate_reset() override;
   bool enumerate_next(uint64_t *offset, uint64_t *length) override;
+  void enumerate_range(
+    uint64_t start, uint64_t end,
+    std::function<void(uint64_t offset, uint64_t length)> f) override;
 
   void allocate(
     uint64_t offset, uint64_t length,
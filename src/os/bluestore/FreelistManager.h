@@ -4,6 +4,7 @@
 #ifndef CEPH_OS_BLUESTORE_FREELISTMANAGER_H
 #define CEPH_OS_BLUESTORE_FREELISTMANAGER_H
 
+#include <functional>
 #include <string>
 #include <map>
 #include <mutex>
@@ -34,6 +35,21 @@ public:
   virtual void enumerate_reset() = 0;
   virtual bool enumerate_next(uint64_t *offset, uint64_t *length) = 0;
 
+  /**
+   * call f for the free space in [start, end)
+   *
+   * Unlike enumerate_next this keeps no state, so several disjoint
+   * ranges may be walked concurrently if supports_parallel_enumerate().
+   * An extent may be cut at a range boundary or run past it, but a set
+   * of disjoint ranges covering the device reports each free byte once.
+   */
+  virtual void enumerate_range(
+    uint64_t start, uint64_t end,
+    std::function<void(uint64_t offset, uint64_t length)> f) = 0;
+  virtual bool supports_parallel_enumerate() {
+    return false;
+  }
+
   virtual void allocate(
     uint64_t offset, uint64_t length,
     KeyValueDB::Transaction txn) = 0;
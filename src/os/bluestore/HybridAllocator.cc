@@ -0,0 +1,650 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "HybridAllocator.h"
+#include "bluestore_types.h"
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "hybridalloc "
+
+/// how many extents past the hint we look at before falling back to best-fit
+static const unsigned MAX_HINT_SEARCH = 64;
+
+/// return the effective length of the extent if we align to alloc_unit
+static uint64_t aligned_len(uint64_t start, uint64_t len, uint64_t alloc_unit,
+			    uint64_t *pskew)
+{
+  uint64_t skew = start % alloc_unit;
+  if (skew)
+    skew = alloc_unit - skew;
+  *pskew = skew;
+  if (skew > len)
+    return 0;
+  else
+    return len - skew;
+}
+
+HybridAllocator::HybridAllocator(CephContext* cct, int64_t device_size,
+				 int64_t block_size)
+  : cct(cct),
+    device_size(device_size),
+    block_size(block_size),
+    num_free(0),
+    num_reserved(0),
+    bitmap_free(0),
+    last_alloc(0)
+{
+  assert(block_size > 0);
+  range_count_cap = MAX(1ull, cct->_conf->bluestore_hybrid_alloc_mem_cap /
+			sizeof(range_seg_t));
+  uint64_t num_blocks = device_size / block_size;
+  uint64_t num_chunks = DIV_ROUND_UP(num_blocks, BITS_PER_CHUNK);
+  bitmap_chunks.resize(num_chunks);
+  bitmap_chunk_free.resize(num_chunks, 0);
+  dout(10) << __func__ << " size 0x" << std::hex << device_size
+	   << " block_size 0x" << block_size << std::dec
+	   << " range_count_cap " << range_count_cap << dendl;
+}
+
+HybridAllocator::~HybridAllocator()
+{
+  shutdown();
+}
+
+// range tree
+
+void HybridAllocator::_tree_insert(uint64_t start, uint64_t end)
+{
+  assert(start < end);
+  auto n = range_tree.upper_bound(start, range_seg_t::by_offset());
+  range_seg_t *next = n != range_tree.end() ? &*n : nullptr;
+  range_seg_t *prev = nullptr;
+  if (n != range_tree.begin()) {
+    auto p = n;
+    --p;
+    prev = &*p;
+  }
+  if (prev && prev->end > start) {
+    derr << __func__ << " 0x" << std::hex << start << "~" << (end - start)
+	 << " overlaps free 0x" << prev->start << "~" << prev->length()
+	 << std::dec << dendl;
+    assert(0 == "freeing free extent");
+  }
+  if (next && next->start < end) {
+    derr << __func__ << " 0x" << std::hex << start << "~" << (end - start)
+	 << " overlaps free 0x" << next->start << "~" << next->length()
+	 << std::dec << dendl;
+    assert(0 == "freeing free extent");
+  }
+
+  bool merge_before = prev && prev->end == start;
+  bool merge_after = next && next->start == end;
+  if (merge_before && merge_after) {
+    range_size_tree.erase(range_size_tree.iterator_to(*prev));
+    range_size_tree.erase(range_size_tree.iterator_to(*next));
+    range_tree.erase(range_tree.iterator_to(*next));
+    prev->end = next->end;
+    delete next;
+    range_size_tree.insert(*prev);
+  } else if (merge_before) {
+    range_size_tree.erase(range_size_tree.iterator_to(*prev));
+    prev->end = end;
+    range_size_tree.insert(*prev);
+  } else if (merge_after) {
+    // moving start down to 'start' keeps the offset order intact
+    range_size_tree.erase(range_size_tree.iterator_to(*next));
+    next->start = start;
+    range_size_tree.insert(*next);
+  } else {
+    range_seg_t *rs = new range_seg_t(start, end);
+    range_tree.insert(n, *rs);
+    range_size_tree.insert(*rs);
+  }
+}
+
+void HybridAllocator::_tree_remove(range_seg_t *rs,
+				   uint64_t start, uint64_t end)
+{
+  assert(rs->start <= start);
+  assert(end <= rs->end);
+  bool left_over = rs->start < start;
+  bool right_over = end < rs->end;
+  range_size_tree.erase(range_size_tree.iterator_to(*rs));
+  if (left_over && right_over) {
+    range_seg_t *tail = new range_seg_t(end, rs->end);
+    rs->end = start;
+    range_tree.insert(*tail);
+    range_size_tree.insert(*tail);
+    range_size_tree.insert(*rs);
+  } else if (left_over) {
+    rs->end = start;
+    range_size_tree.insert(*rs);
+  } else if (right_over) {
+    rs->start = end;
+    range_size_tree.insert(*rs);
+  } else {
+    range_tree.erase(range_tree.iterator_to(*rs));
+    delete rs;
+  }
+}
+
+HybridAllocator::range_seg_t *HybridAllocator::_tree_find_first(
+  uint64_t want, uint64_t alloc_unit, uint64_t hint, uint64_t *poffset)
+{
+  uint64_t skew;
+
+  // first-fit from the hint (wrapping around), to keep related data
+  // close together
+  if (hint) {
+    auto p = range_tree.lower_bound(hint, range_seg_t::by_offset());
+    if (p != range_tree.begin()) {
+      auto q = p;
+      --q;
+      if (q->end > hint)
+	p = q;
+    }
+    for (unsigned n = 0;
+	 n < MAX_HINT_SEARCH && n < range_tree.size();
+	 ++n, ++p) {
+      if (p == range_tree.end())
+	p = range_tree.begin();
+      uint64_t start = p->start;
+      if (n == 0 && start < hint && hint < p->end)
+	start = hint;
+      if (aligned_len(start, p->end - start, alloc_unit, &skew) >= want) {
+	*poffset = start + skew;
+	return &*p;
+      }
+    }
+  }
+
+  // best-fit
+  for (auto p = range_size_tree.lower_bound(want, range_seg_t::by_size());
+       p != range_size_tree.end();
+       ++p) {
+    if (aligned_len(p->start, p->length(), alloc_unit, &skew) >= want) {
+      *poffset = p->start + skew;
+      return &*p;
+    }
+  }
+  return nullptr;
+}
+
+void HybridAllocator::_spill()
+{
+  if (range_tree.size() <= range_count_cap)
+    return;
+  dout(20) << __func__ << " " << range_tree.size() << " extents > cap "
+	   << range_count_cap << dendl;
+  auto p = range_size_tree.begin();
+  while (range_tree.size() > range_count_cap &&
+	 p != range_size_tree.end()) {
+    range_seg_t *rs = &*p;
+    ++p;
+    if (rs->start % block_size || rs->end % block_size)
+      continue;  // can't be represented in the bitmap
+    uint64_t start = rs->start;
+    uint64_t len = rs->length();
+    range_size_tree.erase(range_size_tree.iterator_to(*rs));
+    range_tree.erase(range_tree.iterator_to(*rs));
+    delete rs;
+    dout(30) << __func__ << " 0x" << std::hex << start << "~" << len
+	     << std::dec << dendl;
+    _bitmap_set(start, len);
+  }
+}
+
+// bitmap
+
+uint64_t HybridAllocator::_bitmap_find_next(uint64_t pos, uint64_t end,
+					    bool v) const
+{
+  while (pos < end) {
+    uint64_t c = pos / BITS_PER_CHUNK;
+    uint64_t cend = MIN(end, (c + 1) * BITS_PER_CHUNK);
+    const uint64_t *words = bitmap_chunks[c].get();
+    if (!words || bitmap_chunk_free[c] == 0) {
+      // all clear
+      if (!v)
+	return pos;
+      pos = cend;
+      continue;
+    }
+    if (v == false && bitmap_chunk_free[c] == BITS_PER_CHUNK) {
+      // all set
+      pos = cend;
+      continue;
+    }
+    while (pos < cend) {
+      uint64_t bit = pos % BITS_PER_CHUNK;
+      uint64_t w = words[bit / 64];
+      if (!v)
+	w = ~w;
+      w &= ~0ull << (bit % 64);
+      if (w) {
+	uint64_t r = pos - (bit % 64) + ctzll(w);
+	return MIN(r, end);
+      }
+      pos += 64 - (bit % 64);
+    }
+  }
+  return end;
+}
+
+void HybridAllocator::_bitmap_set(uint64_t offset, uint64_t length)
+{
+  assert(offset % block_size == 0);
+  assert(length % block_size == 0);
+  uint64_t b = offset / block_size;
+  uint64_t e = b + length / block_size;
+  assert(e <= bitmap_chunks.size() * BITS_PER_CHUNK);
+  while (b < e) {
+    uint64_t c = b / BITS_PER_CHUNK;
+    uint64_t cend = MIN(e, (c + 1) * BITS_PER_CHUNK);
+    if (!bitmap_chunks[c]) {
+      bitmap_chunks[c].reset(new uint64_t[WORDS_PER_CHUNK]());
+    }
+    uint64_t *words = bitmap_chunks[c].get();
+    bitmap_chunk_free[c] += cend - b;
+    while (b < cend) {
+      uint64_t bit = b % BITS_PER_CHUNK;
+      uint64_t n = MIN(64 - bit % 64, cend - b);
+      uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << (bit % 64);
+      assert((words[bit / 64] & mask) == 0);
+      words[bit / 64] |= mask;
+      b += n;
+    }
+  }
+  bitmap_free += length;
+}
+
+void HybridAllocator::_bitmap_clear(uint64_t offset, uint64_t length)
+{
+  assert(offset % block_size == 0);
+  assert(length % block_size == 0);
+  uint64_t b = offset / block_size;
+  uint64_t e = b + length / block_size;
+  while (b < e) {
+    uint64_t c = b / BITS_PER_CHUNK;
+    uint64_t cend = MIN(e, (c + 1) * BITS_PER_CHUNK);
+    uint64_t *words = bitmap_chunks[c].get();
+    assert(words);
+    assert(bitmap_chunk_free[c] >= cend - b);
+    bitmap_chunk_free[c] -= cend - b;
+    while (b < cend) {
+      uint64_t bit = b % BITS_PER_CHUNK;
+      uint64_t n = MIN(64 - bit % 64, cend - b);
+      uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << (bit % 64);
+      assert((words[bit / 64] & mask) == mask);
+      words[bit / 64] &= ~mask;
+      b += n;
+    }
+    if (bitmap_chunk_free[c] == 0) {
+      bitmap_chunks[c].reset();
+    }
+  }
+  assert(bitmap_free >= length);
+  bitmap_free -= length;
+}
+
+bool HybridAllocator::_bitmap_find(
+  uint64_t want, uint64_t alloc_unit, uint64_t hint, bool partial,
+  uint64_t *offset, uint64_t *length) const
+{
+  uint64_t num_blocks = device_size / block_size;
+  uint64_t hint_block = MIN(hint / block_size, num_blocks);
+  uint64_t ranges[2][2] = {
+    { hint_block, num_blocks },
+    { 0, hint_block }
+  };
+  for (auto& r : ranges) {
+    uint64_t pos = r[0];
+    while (pos < r[1]) {
+      pos = _bitmap_find_next(pos, r[1], true);
+      if (pos >= r[1])
+	break;
+      uint64_t run_end = _bitmap_find_next(pos, num_blocks, false);
+      uint64_t skew;
+      uint64_t len = aligned_len(pos * block_size, (run_end - pos) * block_size,
+				 alloc_unit, &skew);
+      if (len >= want) {
+	*offset = pos * block_size + skew;
+	*length = want;
+	return true;
+      }
+      if (partial && len >= alloc_unit) {
+	*offset = pos * block_size + skew;
+	*length = len - len % alloc_unit;
+	return true;
+      }
+      pos = run_end;
+    }
+  }
+  return false;
+}
+
+uint64_t HybridAllocator::_bitmap_count_extents() const
+{
+  uint64_t num_blocks = device_size / block_size;
+  uint64_t n = 0;
+  uint64_t pos = 0;
+  while (pos < num_blocks) {
+    pos = _bitmap_find_next(pos, num_blocks, true);
+    if (pos >= num_blocks)
+      break;
+    ++n;
+    pos = _bitmap_find_next(pos, num_blocks, false);
+  }
+  return n;
+}
+
+// Allocator
+
+int HybridAllocator::reserve(uint64_t need)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " need 0x" << std::hex << need
+	   << " num_free 0x" << num_free
+	   << " num_reserved 0x" << num_reserved << std::dec << dendl;
+  if ((int64_t)need > num_free - num_reserved)
+    return -ENOSPC;
+  num_reserved += need;
+  return 0;
+}
+
+void HybridAllocator::unreserve(uint64_t unused)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " unused 0x" << std::hex << unused
+	   << " num_free 0x" << num_free
+	   << " num_reserved 0x" << num_reserved << std::dec << dendl;
+  assert(num_reserved >= (int64_t)unused);
+  num_reserved -= unused;
+}
+
+int64_t HybridAllocator::allocate_int(
+  uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+  uint64_t *offset, uint32_t *length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " want_size 0x" << std::hex << want_size
+	   << " alloc_unit 0x" << alloc_unit
+	   << " hint 0x" << hint << std::dec
+	   << dendl;
+  uint64_t want = MAX(alloc_unit, want_size);
+  uint64_t off = 0, len = 0, skew;
+  range_seg_t *rs;
+
+  if (!hint)
+    hint = last_alloc;
+
+  // whole extent from the tree, then from the bitmap
+  rs = _tree_find_first(want, alloc_unit, hint, &off);
+  if (rs) {
+    len = want;
+    _tree_remove(rs, off, off + len);
+    goto found;
+  }
+  if (bitmap_free &&
+      _bitmap_find(want, alloc_unit, hint, false, &off, &len)) {
+    _bitmap_clear(off, len);
+    goto found;
+  }
+
+  // partial extent: the largest one we have, then whatever the bitmap has
+  if (!range_size_tree.empty()) {
+    rs = &*range_size_tree.rbegin();
+    uint64_t al = aligned_len(rs->start, rs->length(), alloc_unit, &skew);
+    if (al >= alloc_unit) {
+      off = rs->start + skew;
+      len = al - al % alloc_unit;
+      _tree_remove(rs, off, off + len);
+      goto found;
+    }
+  }
+  if (bitmap_free &&
+      _bitmap_find(want, alloc_unit, hint, true, &off, &len)) {
+    _bitmap_clear(off, len);
+    goto found;
+  }
+
+  return -ENOSPC;
+
+ found:
+  if (cct->_conf->bluestore_debug_small_allocations) {
+    uint64_t max =
+      alloc_unit * (rand() % cct->_conf->bluestore_debug_small_allocations);
+    if (max && len > max) {
+      dout(10) << __func__ << " shortening allocation of 0x" << std::hex
+	       << len << " -> 0x"
+	       << max << " due to debug_small_allocations" << std::dec << dendl;
+      _tree_insert(off + max, off + len);
+      _spill();
+      len = max;
+    }
+  }
+  dout(30) << __func__ << " got 0x" << std::hex << off << "~" << len
+	   << std::dec << dendl;
+  *offset = off;
+  *length = len;
+  num_free -= len;
+  num_reserved -= len;
+  assert(num_free >= 0);
+  assert(num_reserved >= 0);
+  last_alloc = off + len;
+  return 0;
+}
+
+int64_t HybridAllocator::allocate(
+  uint64_t want_size,
+  uint64_t alloc_unit,
+  uint64_t max_alloc_size,
+  int64_t hint,
+  mempool::bluestore_alloc::vector<AllocExtent> *extents)
+{
+  uint64_t allocated_size = 0;
+  uint64_t offset = 0;
+  uint32_t length = 0;
+  int res = 0;
+
+  if (max_alloc_size == 0) {
+    max_alloc_size = want_size;
+  }
+
+  ExtentList block_list = ExtentList(extents, 1, max_alloc_size);
+
+  while (allocated_size < want_size) {
+    res = allocate_int(MIN(max_alloc_size, (want_size - allocated_size)),
+       alloc_unit, hint, &offset, &length);
+    if (res != 0) {
+      /*
+       * Allocation failed.
+       */
+      break;
+    }
+    block_list.add_extents(offset, length);
+    allocated_size += length;
+    hint = offset + length;
+  }
+
+  if (allocated_size == 0) {
+    return -ENOSPC;
+  }
+  return allocated_size;
+}
+
+void HybridAllocator::_assert_not_free(uint64_t offset,
+				       uint64_t length) const
+{
+  uint64_t end = offset + length;
+  if (end > device_size) {
+    derr << __func__ << " 0x" << std::hex << offset << "~" << length
+	 << " is beyond the device size 0x" << device_size << std::dec
+	 << dendl;
+    assert(0 == "freeing extent beyond the device");
+  }
+
+  auto n = range_tree.upper_bound(offset, range_seg_t::by_offset());
+  if (n != range_tree.begin()) {
+    auto p = n;
+    --p;
+    if (p->end > offset) {
+      n = p;
+    }
+  }
+  if (n != range_tree.end() && n->start < end) {
+    derr << __func__ << " 0x" << std::hex << offset << "~" << length
+	 << " overlaps free 0x" << n->start << "~" << n->length()
+	 << std::dec << dendl;
+    assert(0 == "freeing free extent");
+  }
+
+  if (bitmap_free) {
+    // the bitmap only holds whole blocks; any block we touch must not
+    // be free
+    uint64_t b = offset / block_size;
+    uint64_t e = MIN((end + block_size - 1) / block_size,
+		     device_size / block_size);
+    uint64_t pos = _bitmap_find_next(b, e, true);
+    if (pos < e) {
+      derr << __func__ << " 0x" << std::hex << offset << "~" << length
+	   << " overlaps free block 0x" << pos * block_size << "~"
+	   << block_size << " in the bitmap" << std::dec << dendl;
+      assert(0 == "freeing free extent");
+    }
+  }
+}
+
+void HybridAllocator::_add_free(uint64_t offset, uint64_t length)
+{
+  _assert_not_free(offset, length);
+  num_free += length;
+  if (bitmap_free &&
+      offset % block_size == 0 && length % block_size == 0) {
+    // keep free space that borders spilled extents in the bitmap so that
+    // it coalesces there instead of fragmenting across both structures
+    uint64_t b = offset / block_size;
+    uint64_t e = b + length / block_size;
+    uint64_t num_blocks = device_size / block_size;
+    if ((b > 0 && _bitmap_find_next(b - 1, b, true) == b - 1) ||
+	(e < num_blocks && _bitmap_find_next(e, e + 1, true) == e)) {
+      _bitmap_set(offset, length);
+      return;
+    }
+  }
+  _tree_insert(offset, offset + length);
+  _spill();
+}
+
+int HybridAllocator::release(
+  uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " 0x" << std::hex << offset << "~" << length
+	   << std::dec << dendl;
+  _add_free(offset, length);
+  return 0;
+}
+
+uint64_t HybridAllocator::get_free()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return num_free;
+}
+
+double HybridAllocator::get_fragmentation(uint64_t alloc_unit)
+{
+  std::lock_guard<std::mutex> l(lock);
+  uint64_t free_blocks = num_free / alloc_unit;
+  if (free_blocks <= 1)
+    return 0.0;
+  uint64_t extents = range_tree.size() + _bitmap_count_extents();
+  return MIN(1.0, (double)(extents - 1) / (free_blocks - 1));
+}
+
+void HybridAllocator::get_extent_counts(uint64_t *tree, uint64_t *bitmap)
+{
+  std::lock_guard<std::mutex> l(lock);
+  *tree = range_tree.size();
+  *bitmap = _bitmap_count_extents();
+}
+
+void HybridAllocator::dump()
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(0) << __func__ << " tree: " << range_tree.size() << " extents" << dendl;
+  for (auto& rs : range_tree) {
+    dout(0) << __func__ << "  0x" << std::hex << rs.start << "~"
+	    << rs.length() << std::dec << dendl;
+  }
+  dout(0) << __func__ << " bitmap: 0x" << std::hex << bitmap_free << std::dec
+	  << " bytes free" << dendl;
+  uint64_t num_blocks = device_size / block_size;
+  uint64_t pos = 0;
+  while (pos < num_blocks) {
+    pos = _bitmap_find_next(pos, num_blocks, true);
+    if (pos >= num_blocks)
+      break;
+    uint64_t end = _bitmap_find_next(pos, num_blocks, false);
+    dout(0) << __func__ << "  0x" << std::hex << pos * block_size << "~"
+	    << (end - pos) * block_size << std::dec << dendl;
+    pos = end;
+  }
+}
+
+void HybridAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " 0x" << std::hex << offset << "~" << length
+	   << std::dec << dendl;
+  _add_free(offset, length);
+}
+
+void HybridAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " 0x" << std::hex << offset << "~" << length
+	   << std::dec << dendl;
+  uint64_t pos = offset;
+  uint64_t end = offset + length;
+  while (pos < end) {
+    auto p = range_tree.upper_bound(pos, range_seg_t::by_offset());
+    if (p != range_tree.begin()) {
+      auto q = p;
+      --q;
+      if (q->end > pos) {
+	uint64_t e = MIN(end, q->end);
+	_tree_remove(&*q, pos, e);
+	pos = e;
+	continue;
+      }
+    }
+    // not in the tree; everything up to the next tree extent was spilled
+    uint64_t e = end;
+    if (p != range_tree.end())
+      e = MIN(e, p->start);
+    dout(20) << __func__ << " bitmap rm 0x" << std::hex << pos << "~"
+	     << (e - pos) << std::dec << dendl;
+    _bitmap_clear(pos, e - pos);
+    pos = e;
+  }
+  num_free -= length;
+  assert(num_free >= 0);
+}
+
+void HybridAllocator::shutdown()
+{
+  dout(1) << __func__ << dendl;
+  std::lock_guard<std::mutex> l(lock);
+  range_size_tree.clear();
+  range_tree.clear_and_dispose([](range_seg_t *p) { delete p; });
+  for (auto& c : bitmap_chunks) {
+    c.reset();
+  }
+  std::fill(bitmap_chunk_free.begin(), bitmap_chunk_free.end(), 0);
+  bitmap_free = 0;
+  num_free = 0;
+}
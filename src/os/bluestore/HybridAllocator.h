@@ -0,0 +1,156 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_HYBRIDALLOCATOR_H
+#define CEPH_OS_BLUESTORE_HYBRIDALLOCATOR_H
+
+#include <memory>
+#include <mutex>
+
+#include <boost/intrusive/avl_set.hpp>
+
+#include "Allocator.h"
+#include "os/bluestore/bluestore_types.h"
+
+/**
+ * HybridAllocator
+ *
+ * Free extents live in a range tree indexed both by offset (for
+ * merging and hinted first-fit) and by size (for best-fit), so every
+ * operation is O(log n) in the number of free extents.  When the tree
+ * grows past bluestore_hybrid_alloc_mem_cap bytes (i.e., the device is
+ * badly fragmented) the smallest extents are spilled into a compact
+ * bitmap, one bit per block, whose chunks are only allocated for the
+ * regions of the device that actually hold spilled extents.
+ */
+class HybridAllocator : public Allocator {
+  struct range_seg_t {
+    uint64_t start;  ///< starting offset of this segment
+    uint64_t end;    ///< ending offset (non-inclusive)
+
+    boost::intrusive::avl_set_member_hook<> offset_hook;
+    boost::intrusive::avl_set_member_hook<> size_hook;
+
+    range_seg_t(uint64_t s, uint64_t e) : start(s), end(e) {}
+
+    uint64_t length() const {
+      return end - start;
+    }
+
+    struct by_offset {
+      bool operator()(const range_seg_t& l, const range_seg_t& r) const {
+	return l.start < r.start;
+      }
+      bool operator()(uint64_t k, const range_seg_t& s) const {
+	return k < s.start;
+      }
+      bool operator()(const range_seg_t& s, uint64_t k) const {
+	return s.start < k;
+      }
+    };
+    struct by_size {
+      bool operator()(const range_seg_t& l, const range_seg_t& r) const {
+	if (l.length() != r.length())
+	  return l.length() < r.length();
+	return l.start < r.start;
+      }
+      bool operator()(uint64_t k, const range_seg_t& s) const {
+	return k < s.length();
+      }
+      bool operator()(const range_seg_t& s, uint64_t k) const {
+	return s.length() < k;
+      }
+    };
+  };
+
+  typedef boost::intrusive::avl_set<
+    range_seg_t,
+    boost::intrusive::compare<range_seg_t::by_offset>,
+    boost::intrusive::member_hook<
+      range_seg_t,
+      boost::intrusive::avl_set_member_hook<>,
+      &range_seg_t::offset_hook> > range_tree_t;
+  typedef boost::intrusive::avl_set<
+    range_seg_t,
+    boost::intrusive::compare<range_seg_t::by_size>,
+    boost::intrusive::member_hook<
+      range_seg_t,
+      boost::intrusive::avl_set_member_hook<>,
+      &range_seg_t::size_hook> > range_size_tree_t;
+
+  CephContext* cct;
+  std::mutex lock;
+
+  uint64_t device_size;
+  uint64_t block_size;  ///< bitmap granularity
+
+  int64_t num_free;     ///< total bytes in tree and bitmap
+  int64_t num_reserved; ///< reserved bytes
+
+  range_tree_t range_tree;            ///< free extents by offset
+  range_size_tree_t range_size_tree;  ///< same extents by length
+
+  /// max number of tree entries before we spill to the bitmap
+  uint64_t range_count_cap;
+
+  // spilled extents: one bit per block, set == free
+  static const uint64_t BITS_PER_CHUNK = 1ull << 20;  // 128KB per chunk
+  static const uint64_t WORDS_PER_CHUNK = BITS_PER_CHUNK / 64;
+  vector<std::unique_ptr<uint64_t[]>> bitmap_chunks;
+  vector<uint64_t> bitmap_chunk_free;  ///< free bits per chunk
+  uint64_t bitmap_free;                ///< free bytes in the bitmap
+
+  uint64_t last_alloc;
+
+  // range tree
+  void _tree_insert(uint64_t start, uint64_t end);
+  void _tree_remove(range_seg_t *rs, uint64_t start, uint64_t end);
+  range_seg_t *_tree_find_first(uint64_t want, uint64_t alloc_unit,
+				uint64_t hint, uint64_t *poffset);
+  void _spill();
+
+  // bitmap
+  uint64_t _bitmap_find_next(uint64_t pos, uint64_t end, bool v) const;
+  void _bitmap_set(uint64_t offset, uint64_t length);
+  void _bitmap_clear(uint64_t offset, uint64_t length);
+  bool _bitmap_find(uint64_t want, uint64_t alloc_unit, uint64_t hint,
+		    bool partial, uint64_t *offset, uint64_t *length) const;
+  uint64_t _bitmap_count_extents() const;
+
+  /// complain loudly about releasing space that is already free
+  void _assert_not_free(uint64_t offset, uint64_t length) const;
+  void _add_free(uint64_t offset, uint64_t length);
+
+public:
+  HybridAllocator(CephContext* cct, int64_t device_size, int64_t block_size);
+  ~HybridAllocator();
+
+  int reserve(uint64_t need) override;
+  void unreserve(uint64_t unused) override;
+
+  int64_t allocate(
+    uint64_t want_size, uint64_t alloc_unit, uint64_t max_alloc_size,
+    int64_t hint, mempool::bluestore_alloc::vector<AllocExtent> *extents) override;
+
+  int64_t allocate_int(
+    uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+    uint64_t *offset, uint32_t *length);
+
+  int release(
+    uint64_t offset, uint64_t length) override;
+
+  uint64_t get_free() override;
+  double get_fragmentation(uint64_t alloc_unit) override;
+
+  /// number of free extents held in the range tree and the bitmap
+  void get_extent_counts(uint64_t *tree, uint64_t *bitmap);
+
+  void dump() override;
+
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+
+  void shutdown() override;
+};
+
+#endif
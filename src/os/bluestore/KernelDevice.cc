@@ -39,11 +39,9 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv)
     fs(NULL), aio(false), dio(false),
     debug_lock("KernelDevice::debug_lock"),
     flush_lock("KernelDevice::flush_lock"),
-    aio_queue(cct->_conf->bdev_aio_max_queue_depth),
     aio_callback(cb),
     aio_callback_priv(cbpriv),
     aio_stop(false),
-    aio_thread(this),
     injecting_crash(0)
 {
 }
@@ -216,12 +214,49 @@ int KernelDevice::_aio_start()
 {
   if (aio) {
     dout(10) << __func__ << dendl;
-    int r = aio_queue.init();
-    if (r < 0) {
-      derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
-      return r;
+    unsigned num_queues = 1;
+    bool ioring = false;
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (cct->_conf->bdev_ioring) {
+      if (FS::ioring_queue_t::supported()) {
+	ioring = true;
+	num_queues = std::max(1, cct->_conf->bdev_ioring_queues);
+      } else {
+	derr << __func__ << " bdev_ioring is set but io_uring is not"
+	     << " supported by this kernel; falling back to libaio" << dendl;
+      }
+    }
+#else
+    if (cct->_conf->bdev_ioring) {
+      derr << __func__ << " bdev_ioring is set but this build lacks"
+	   << " io_uring support; falling back to libaio" << dendl;
+    }
+#endif
+    for (unsigned i = 0; i < num_queues; ++i) {
+      FS::io_queue_t *q;
+#if defined(HAVE_LINUX_IO_URING_H)
+      if (ioring)
+	q = new FS::ioring_queue_t(cct->_conf->bdev_aio_max_queue_depth,
+				   { fd_direct });
+      else
+#endif
+	q = new FS::aio_queue_t(cct->_conf->bdev_aio_max_queue_depth);
+      int r = q->init();
+      if (r < 0) {
+	derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+	delete q;
+	_aio_stop();
+	return r;
+      }
+      io_queues.push_back(q);
+    }
+    dout(1) << __func__ << " using " << (ioring ? "io_uring" : "libaio")
+	    << " with " << io_queues.size() << " queue(s)" << dendl;
+    for (unsigned i = 0; i < io_queues.size(); ++i) {
+      AioCompletionThread *t = new AioCompletionThread(this, i);
+      t->create("bstore_aio");
+      aio_threads.push_back(t);
     }
-    aio_thread.create("bstore_aio");
   }
   return 0;
 }
@@ -231,22 +266,42 @@ void KernelDevice::_aio_stop()
   if (aio) {
     dout(10) << __func__ << dendl;
     aio_stop = true;
-    aio_thread.join();
+    for (auto t : aio_threads) {
+      t->join();
+      delete t;
+    }
+    aio_threads.clear();
     aio_stop = false;
-    aio_queue.shutdown();
+    for (auto q : io_queues) {
+      q->shutdown();
+      delete q;
+    }
+    io_queues.clear();
   }
 }
 
-void KernelDevice::_aio_thread()
+unsigned KernelDevice::_choose_io_queue(IOContext *ioc)
 {
-  dout(10) << __func__ << " start" << dendl;
+  // IOContexts without a completion callback belong to synchronous
+  // waiters (BlueFS) that may hand them to queue_reap_ioc() right after
+  // waking up.  Only queue 0's thread reaps, so keep those on queue 0
+  // to be sure no other completion thread still references them.
+  if (io_queues.size() == 1 || !ioc->priv)
+    return 0;
+  return next_io_queue++ % io_queues.size();
+}
+
+void KernelDevice::_aio_thread(unsigned queue)
+{
+  dout(10) << __func__ << " start queue " << queue << dendl;
+  FS::io_queue_t *q = io_queues[queue];
   int inject_crash_count = 0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
     int max = 16;
     FS::aio_t *aio[max];
-    int r = aio_queue.get_next_completed(cct->_conf->bdev_aio_poll_ms,
-					 aio, max);
+    int r = q->get_next_completed(cct->_conf->bdev_aio_poll_ms,
+				  aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
     }
@@ -297,7 +352,9 @@ void KernelDevice::_aio_thread()
 	}
       }
     }
-    reap_ioc();
+    if (queue == 0) {
+      reap_ioc();
+    }
     if (cct->_conf->bdev_inject_crash) {
       ++inject_crash_count;
       if (inject_crash_count * cct->_conf->bdev_aio_poll_ms / 1000 >
@@ -309,8 +366,10 @@ void KernelDevice::_aio_thread()
       }
     }
   }
-  reap_ioc();
-  dout(10) << __func__ << " end" << dendl;
+  if (queue == 0) {
+    reap_ioc();
+  }
+  dout(10) << __func__ << " end queue " << queue << dendl;
 }
 
 void KernelDevice::_aio_log_start(
@@ -390,8 +449,7 @@ void KernelDevice::aio_submit(IOContext *ioc)
   ioc->num_pending -= pending;
   assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
 
-  bool done = false;
-  while (!done) {
+  for (; p != e; ++p) {
     FS::aio_t& aio = *p;
     aio.priv = static_cast<void*>(ioc);
     dout(20) << __func__ << "  aio " << &aio << " fd " << aio.fd
@@ -400,29 +458,24 @@ void KernelDevice::aio_submit(IOContext *ioc)
     for (vector<iovec>::iterator q = aio.iov.begin(); q != aio.iov.end(); ++q)
       dout(30) << __func__ << "   iov " << (void*)q->iov_base
 	       << " len " << q->iov_len << dendl;
-
-    // be careful: as soon as we submit aio we race with completion.
-    // since we are holding a ref take care not to dereference txc at
-    // all after that point.
-    list<FS::aio_t>::iterator cur = p;
-    ++p;
-    done = (p == e);
-
-    // do not dereference txc (or it's contents) after we submit (if
-    // done == true and we don't loop)
-    int retries = 0;
     if (cct->_conf->bdev_debug_aio) {
       std::lock_guard<std::mutex> l(debug_queue_lock);
-      debug_aio_link(*cur);
-    }
-    int r = aio_queue.submit(*cur, &retries);
-    if (retries)
-      derr << __func__ << " retries " << retries << dendl;
-    if (r) {
-      derr << " aio submit got " << cpp_strerror(r) << dendl;
-      assert(r == 0);
+      debug_aio_link(aio);
     }
   }
+
+  // be careful: as soon as we submit aio we race with completion.
+  // since we are holding a ref take care not to dereference txc (or
+  // ioc) at all after the batch is handed off.
+  FS::io_queue_t *q = io_queues[_choose_io_queue(ioc)];
+  int retries = 0;
+  int r = q->submit_batch(ioc->running_aios.begin(), e, &retries);
+  if (retries)
+    derr << __func__ << " retries " << retries << dendl;
+  if (r) {
+    derr << " aio submit got " << cpp_strerror(r) << dendl;
+    assert(r == 0);
+  }
 }
 
 int KernelDevice::aio_write(
@@ -36,23 +36,28 @@ class KernelDevice : public BlockDevice {
   Mutex flush_lock;
   atomic_t io_since_flush;
 
-  FS::aio_queue_t aio_queue;
+  /// libaio queue, or one io_uring per completion thread
+  vector<FS::io_queue_t*> io_queues;
+  std::atomic<unsigned> next_io_queue = {0};
   aio_callback_t aio_callback;
   void *aio_callback_priv;
   bool aio_stop;
 
   struct AioCompletionThread : public Thread {
     KernelDevice *bdev;
-    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    unsigned queue;
+    AioCompletionThread(KernelDevice *b, unsigned q) : bdev(b), queue(q) {}
     void *entry() {
-      bdev->_aio_thread();
+      bdev->_aio_thread(queue);
       return NULL;
     }
-  } aio_thread;
+  };
+  vector<AioCompletionThread*> aio_threads;
 
   std::atomic_int injecting_crash;
 
-  void _aio_thread();
+  void _aio_thread(unsigned queue);
+  unsigned _choose_io_queue(IOContext *ioc);
   int _aio_start();
   void _aio_stop();
 
@@ -256,6 +256,19 @@ uint64_t StupidAllocator::get_free()
   return num_free;
 }
 
+double StupidAllocator::get_fragmentation(uint64_t alloc_unit)
+{
+  std::lock_guard<std::mutex> l(lock);
+  uint64_t free_blocks = num_free / alloc_unit;
+  if (free_blocks <= 1)
+    return 0.0;
+  uint64_t intervals = 0;
+  for (unsigned bin = 0; bin < free.size(); ++bin) {
+    intervals += free[bin].num_intervals();
+  }
+  return MIN(1.0, (double)(intervals - 1) / (free_blocks - 1));
+}
+
 void StupidAllocator::dump()
 {
   std::lock_guard<std::mutex> l(lock);
@@ -43,6 +43,7 @@ public:
     uint64_t offset, uint64_t length);
 
   uint64_t get_free();
+  double get_fragmentation(uint64_t alloc_unit) override;
 
   void dump() override;
 
@@ -637,6 +637,7 @@ void bluestore_compression_header_t::dump(Formatter *f) const
 {
   f->dump_unsigned("type", type);
   f->dump_unsigned("length", length);
+  f->dump_unsigned("dict_id", dict_id);
 }
 
 void bluestore_compression_header_t::generate_test_instances(
@@ -645,4 +646,24 @@ void bluestore_compression_header_t::generate_test_instances(
   o.push_back(new bluestore_compression_header_t);
   o.push_back(new bluestore_compression_header_t(1));
   o.back()->length = 1234;
+  o.back()->dict_id = 2;
+}
+
+// bluestore_compression_dict_t
+
+void bluestore_compression_dict_t::dump(Formatter *f) const
+{
+  f->dump_int("pool", pool);
+  f->dump_unsigned("type", type);
+  f->dump_unsigned("length", data.length());
+}
+
+void bluestore_compression_dict_t::generate_test_instances(
+  list<bluestore_compression_dict_t*>& o)
+{
+  o.push_back(new bluestore_compression_dict_t);
+  o.push_back(new bluestore_compression_dict_t);
+  o.back()->pool = 3;
+  o.back()->type = Compressor::COMP_ALG_ZSTD;
+  o.back()->data.append("dictionary");
 }
@@ -785,15 +785,19 @@ WRITE_CLASS_DENC(bluestore_wal_transaction_t)
 struct bluestore_compression_header_t {
   uint8_t type = Compressor::COMP_ALG_NONE;
   uint32_t length = 0;
+  uint32_t dict_id = 0;   ///< trained dictionary used, 0 for none
 
   bluestore_compression_header_t() {}
   bluestore_compression_header_t(uint8_t _type)
     : type(_type) {}
 
   DENC(bluestore_compression_header_t, v, p) {
-    DENC_START(1, 1, p);
+    DENC_START(2, 1, p);
     denc(v.type, p);
     denc(v.length, p);
+    if (struct_v >= 2) {
+      denc(v.dict_id, p);
+    }
     DENC_FINISH(p);
   }
   void dump(Formatter *f) const;
@@ -801,5 +805,23 @@ struct bluestore_compression_header_t {
 };
 WRITE_CLASS_DENC(bluestore_compression_header_t)
 
+/// a trained compression dictionary, referenced by id from blob headers
+struct bluestore_compression_dict_t {
+  int64_t pool = -1;   ///< pool whose data it was trained on
+  uint8_t type = Compressor::COMP_ALG_NONE;
+  bufferlist data;     ///< raw dictionary, meaningful to type only
+
+  DENC(bluestore_compression_dict_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.pool, p);
+    denc(v.type, p);
+    denc(v.data, p);
+    DENC_FINISH(p);
+  }
+  void dump(Formatter *f) const;
+  static void generate_test_instances(list<bluestore_compression_dict_t*>& o);
+};
+WRITE_CLASS_DENC(bluestore_compression_dict_t)
+
 
 #endif
@@ -209,6 +209,21 @@ int FS::aio_queue_t::submit(aio_t &aio, int *retries)
   return 0;
 }
 
+int FS::aio_queue_t::submit_batch(aio_iter begin, aio_iter end, int *retries)
+{
+  aio_iter p = begin;
+  while (p != end) {
+    // grab the next position before we submit; once the last aio is
+    // submitted it (and its container) may be completed and freed.
+    aio_iter cur = p++;
+    int r = submit(*cur, retries);
+    if (r < 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
 int FS::aio_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
 {
   io_event event[max];
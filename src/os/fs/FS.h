@@ -23,6 +23,7 @@
 # include <libaio.h>
 #endif
 
+#include <memory>
 #include <string>
 
 #include "include/types.h"
@@ -78,9 +79,16 @@ public:
       length = len;
       bufferptr p = buffer::create_page_aligned(length);
       io_prep_pread(&iocb, fd, p.c_str(), length, offset);
+      iov.resize(1);
+      iov[0].iov_base = p.c_str();
+      iov[0].iov_len = length;
       bl.append(std::move(p));
     }
 
+    bool is_read() const {
+      return iocb.aio_lio_opcode == IO_CMD_PREAD;
+    }
+
     int get_return_value() {
       return rval;
     }
@@ -93,7 +101,20 @@ public:
       boost::intrusive::list_member_hook<>,
       &aio_t::queue_item> > aio_list_t;
 
-  struct aio_queue_t {
+  typedef list<aio_t>::iterator aio_iter;
+
+  /// interface shared by the kernel async io backends
+  struct io_queue_t {
+    virtual ~io_queue_t() {}
+
+    virtual int init() = 0;
+    virtual void shutdown() = 0;
+    /// submit [begin, end); the aios may complete before we return
+    virtual int submit_batch(aio_iter begin, aio_iter end, int *retries) = 0;
+    virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+  };
+
+  struct aio_queue_t : public io_queue_t {
     int max_iodepth;
     io_context_t ctx;
 
@@ -102,15 +123,15 @@ public:
       : max_iodepth(max_iodepth),
 	ctx(0) {
     }
-    ~aio_queue_t() {
+    ~aio_queue_t() override {
       assert(ctx == 0);
     }
 
-    int init() {
+    int init() override {
       assert(ctx == 0);
       return io_setup(max_iodepth, &ctx);
     }
-    void shutdown() {
+    void shutdown() override {
       if (ctx) {
 	int r = io_destroy(ctx);
 	assert(r == 0);
@@ -119,9 +140,40 @@ public:
     }
 
     int submit(aio_t &aio, int *retries);
-    int get_next_completed(int timeout_ms, aio_t **paio, int max);
+    int submit_batch(aio_iter begin, aio_iter end, int *retries) override;
+    int get_next_completed(int timeout_ms, aio_t **paio, int max) override;
+  };
+
+#if defined(HAVE_LINUX_IO_URING_H)
+  struct ioring_data;
+
+  /**
+   * io_uring based queue
+   *
+   * Each queue owns one submission/completion ring pair.  The files
+   * it is constructed with are registered with the ring so that submissions
+   * against them skip the per-io fget/fput, and completions are
+   * signalled through an eventfd so that the reaper can wait with a
+   * timeout like it does with io_getevents.
+   */
+  struct ioring_queue_t : public io_queue_t {
+    unsigned iodepth;
+    vector<int> fds;  ///< files to register
+    std::unique_ptr<ioring_data> d;
+
+    ioring_queue_t(unsigned iodepth, const vector<int>& fds);
+    ~ioring_queue_t() override;
+
+    /// true if the running kernel lets us set up a ring
+    static bool supported();
+
+    int init() override;
+    void shutdown() override;
+    int submit_batch(aio_iter begin, aio_iter end, int *retries) override;
+    int get_next_completed(int timeout_ms, aio_t **paio, int max) override;
   };
 #endif
+#endif
 };
 
 #endif
@@ -0,0 +1,353 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "FS.h"
+
+#if defined(HAVE_LIBAIO) && defined(HAVE_LINUX_IO_URING_H)
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+/*
+ * We talk to the kernel directly rather than through liburing; the
+ * only things we need are ring setup, sqe/cqe ring manipulation and
+ * file/eventfd registration.
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  int r = syscall(__NR_io_uring_setup, entries, p);
+  return r < 0 ? -errno : r;
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+  int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		  NULL, 0);
+  return r < 0 ? -errno : r;
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+				 unsigned nr_args)
+{
+  int r = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+  return r < 0 ? -errno : r;
+}
+
+template <typename T>
+static inline T load_acquire(const T *p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+static inline void store_release(T *p, T v)
+{
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+struct FS::ioring_data {
+  int ring_fd = -1;
+  int event_fd = -1;
+
+  // mmap'ed regions
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  struct io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+
+  // submission ring
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  unsigned *sq_array = nullptr;
+
+  // completion ring
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  unsigned cq_entries = 0;
+  struct io_uring_cqe *cqes = nullptr;
+
+  /// registered files, indexed by their fixed file slot
+  vector<int> fixed_fds;
+
+  /// serializes submitters; there is a single reaper per ring
+  std::mutex sq_lock;
+
+  /// submitted but not yet reaped.  capped at cq_entries so that the
+  /// completion ring can never overflow.
+  std::atomic<unsigned> inflight = {0};
+
+  int fixed_slot(int fd) const {
+    auto p = std::find(fixed_fds.begin(), fixed_fds.end(), fd);
+    if (p == fixed_fds.end())
+      return -1;
+    return p - fixed_fds.begin();
+  }
+};
+
+FS::ioring_queue_t::ioring_queue_t(unsigned iodepth, const vector<int>& fds)
+  : iodepth(iodepth), fds(fds)
+{
+}
+
+FS::ioring_queue_t::~ioring_queue_t()
+{
+  assert(!d);
+}
+
+bool FS::ioring_queue_t::supported()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = sys_io_uring_setup(16, &p);
+  if (fd < 0)
+    return false;
+  ::close(fd);
+  return true;
+}
+
+int FS::ioring_queue_t::init()
+{
+  assert(!d);
+  std::unique_ptr<ioring_data> n(new ioring_data);
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int r = sys_io_uring_setup(iodepth, &p);
+  if (r < 0)
+    return r;
+  n->ring_fd = r;
+
+  n->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  n->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    n->sq_ring_size = n->cq_ring_size =
+      std::max(n->sq_ring_size, n->cq_ring_size);
+  }
+  n->sq_ring = ::mmap(0, n->sq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, n->ring_fd,
+		      IORING_OFF_SQ_RING);
+  if (n->sq_ring == MAP_FAILED) {
+    n->sq_ring = nullptr;
+    r = -errno;
+    goto out;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    n->cq_ring = n->sq_ring;
+  } else {
+    n->cq_ring = ::mmap(0, n->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, n->ring_fd,
+			IORING_OFF_CQ_RING);
+    if (n->cq_ring == MAP_FAILED) {
+      n->cq_ring = nullptr;
+      r = -errno;
+      goto out;
+    }
+  }
+  n->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  n->sqes = static_cast<struct io_uring_sqe*>(
+    ::mmap(0, n->sqes_size, PROT_READ | PROT_WRITE,
+	   MAP_SHARED | MAP_POPULATE, n->ring_fd, IORING_OFF_SQES));
+  if (n->sqes == MAP_FAILED) {
+    n->sqes = nullptr;
+    r = -errno;
+    goto out;
+  }
+
+  {
+    char *sq = static_cast<char*>(n->sq_ring);
+    n->sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    n->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    n->sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    n->sq_entries = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+    n->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+    char *cq = static_cast<char*>(n->cq_ring);
+    n->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    n->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    n->cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    n->cq_entries = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_entries);
+    n->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+  }
+
+  n->event_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (n->event_fd < 0) {
+    r = -errno;
+    goto out;
+  }
+  r = sys_io_uring_register(n->ring_fd, IORING_REGISTER_EVENTFD,
+			    &n->event_fd, 1);
+  if (r < 0)
+    goto out;
+
+  if (!fds.empty()) {
+    r = sys_io_uring_register(n->ring_fd, IORING_REGISTER_FILES,
+			      &fds[0], fds.size());
+    if (r < 0)
+      goto out;
+    n->fixed_fds = fds;
+  }
+
+  d = std::move(n);
+  return 0;
+
+ out:
+  d = std::move(n);
+  shutdown();
+  return r;
+}
+
+void FS::ioring_queue_t::shutdown()
+{
+  if (!d)
+    return;
+  if (d->sqes)
+    ::munmap(d->sqes, d->sqes_size);
+  if (d->cq_ring && d->cq_ring != d->sq_ring)
+    ::munmap(d->cq_ring, d->cq_ring_size);
+  if (d->sq_ring)
+    ::munmap(d->sq_ring, d->sq_ring_size);
+  if (d->event_fd >= 0)
+    ::close(d->event_fd);
+  if (d->ring_fd >= 0)
+    ::close(d->ring_fd);
+  d.reset();
+}
+
+int FS::ioring_queue_t::submit_batch(aio_iter begin, aio_iter end,
+				     int *retries)
+{
+  // same backoff as aio_queue_t::submit: max sleep is ~16 seconds
+  int attempts = 16;
+  int delay = 125;
+
+  std::lock_guard<std::mutex> l(d->sq_lock);
+  aio_iter p = begin;
+  while (p != end) {
+    unsigned tail = *d->sq_tail;
+    unsigned head = load_acquire(d->sq_head);
+    unsigned queued = 0;
+    while (p != end && tail - head < d->sq_entries &&
+	   d->inflight.load() + queued < d->cq_entries) {
+      // take the next position before handing this aio to the kernel
+      aio_t& aio = *p++;
+      unsigned idx = tail & d->sq_mask;
+      struct io_uring_sqe *sqe = &d->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = aio.is_read() ? IORING_OP_READV : IORING_OP_WRITEV;
+      int slot = d->fixed_slot(aio.fd);
+      if (slot >= 0) {
+	sqe->fd = slot;
+	sqe->flags |= IOSQE_FIXED_FILE;
+      } else {
+	sqe->fd = aio.fd;
+      }
+      sqe->addr = (unsigned long)&aio.iov[0];
+      sqe->len = aio.iov.size();
+      sqe->off = aio.offset;
+      sqe->user_data = (unsigned long)&aio;
+      d->sq_array[idx] = idx;
+      ++tail;
+      ++queued;
+    }
+    store_release(d->sq_tail, tail);
+    // account before entering the kernel; the reaper may see these
+    // complete before io_uring_enter returns.
+    d->inflight += queued;
+
+    while (queued) {
+      int r = sys_io_uring_enter(d->ring_fd, queued, 0, 0);
+      if (r == -EINTR)
+	continue;
+      if ((r == -EAGAIN || r == -EBUSY) && attempts-- > 0) {
+	usleep(delay);
+	delay *= 2;
+	(*retries)++;
+	continue;
+      }
+      if (r < 0) {
+	// take back what the kernel didn't consume, so that a later
+	// submit doesn't pick up sqes for aios we failed
+	store_release(d->sq_tail, tail - queued);
+	d->inflight -= queued;
+	return r;
+      }
+      queued -= r;
+    }
+
+    if (p != end &&
+	d->inflight.load() >= d->cq_entries) {
+      // completion ring is full; wait for the reaper to catch up
+      if (attempts-- <= 0)
+	return -EAGAIN;
+      usleep(delay);
+      delay *= 2;
+      (*retries)++;
+    }
+  }
+  return 0;
+}
+
+int FS::ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio,
+					   int max)
+{
+  for (int pass = 0; pass < 2; ++pass) {
+    unsigned head = *d->cq_head;
+    unsigned tail = load_acquire(d->cq_tail);
+    int n = 0;
+    while (head != tail && n < max) {
+      struct io_uring_cqe *cqe = &d->cqes[head & d->cq_mask];
+      aio_t *aio = (aio_t *)(unsigned long)cqe->user_data;
+      aio->rval = cqe->res;
+      paio[n++] = aio;
+      ++head;
+    }
+    if (n) {
+      store_release(d->cq_head, head);
+      d->inflight -= n;
+      return n;
+    }
+    if (pass)
+      break;
+
+    struct pollfd pfd;
+    pfd.fd = d->event_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int r = ::poll(&pfd, 1, timeout_ms);
+    if (r < 0)
+      return errno == EINTR ? 0 : -errno;
+    if (r == 0)
+      return 0;
+    uint64_t v;
+    r = ::read(d->event_fd, &v, sizeof(v));
+    if (r < 0 && errno != EAGAIN)
+      return -errno;
+  }
+  return 0;
+}
+
+#endif
@@ -156,6 +156,7 @@ ostream &operator<<(ostream &lhs, const ECBackend::Op &rhs)
       << " pending_commit=" << rhs.pending_commit
       << " plan.to_read=" << rhs.plan.to_read
       << " plan.will_write=" << rhs.plan.will_write
+      << " parity_delta=" << rhs.parity_delta
       << ")";
   return lhs;
 }
@@ -1328,9 +1329,9 @@ void ECBackend::on_change()
 
   completed_to = eversion_t();
   committed_to = eversion_t();
-  pipeline_state.clear();
+  token_states.clear();
+  tokens_waiting.clear();
   waiting_reads.clear();
-  waiting_state.clear();
   waiting_commit.clear();
   for (auto &&op: tid_to_op_map) {
     cache.release_write_pin(op.second.pin);
@@ -1425,9 +1426,7 @@ void ECBackend::submit_transaction(
 }
 
 void ECBackend::call_write_ordered(std::function<void(void)> &&cb) {
-  if (!waiting_state.empty()) {
-    waiting_state.back().on_write.emplace_back(std::move(cb));
-  } else if (!waiting_reads.empty()) {
+  if (!waiting_reads.empty()) {
     waiting_reads.back().on_write.emplace_back(std::move(cb));
   } else {
     // Nothing earlier in the pipeline, just call it
@@ -1717,36 +1716,212 @@ void ECBackend::start_rmw(Op *op, PGTransactionUPtr &&t)
 
   dout(10) << __func__ << ": " << *op << dendl;
 
-  waiting_state.push_back(*op);
+  waiting_reads.push_back(*op);
+  uint32_t token = get_ordering_token(*op);
+  token_states[token].waiting_state.push_back(op);
+  tokens_waiting.insert(token);
   check_ops();
 }
 
-bool ECBackend::try_state_to_reads()
+/**
+ * A small overwrite of an existing object can be written as a parity
+ * delta: rather than reading the rest of the stripes to re-encode them,
+ * the primary reads the old data chunks being replaced and the coding
+ * chunks, and writes the new data chunks and the coding chunks updated
+ * with the difference between old and new data.  That moves
+ * 2 * (touched + m) chunks per stripe rather than reading up to k and
+ * writing k + m.
+ *
+ * Only ops writing a single object within its current size qualify,
+ * and only when the plugin supports it, every shard has the object and
+ * no earlier write on the object is still in flight (the chunks read
+ * must be the ones the delta applies to).
+ */
+bool ECBackend::try_parity_delta(Op *op, const token_state_t &ts)
 {
-  if (waiting_state.empty())
+  if (!cct->_conf->osd_ec_parity_delta_write ||
+      !ec_impl->supports_parity_delta() ||
+      ts.in_progress > 0 ||
+      op->invalidates_cache() ||
+      op->log_entries.empty() ||
+      op->plan.will_write.size() != 1 ||
+      op->plan.overwrites.size() != 1)
+    return false;
+  const hobject_t &hoid = op->plan.overwrites.begin()->first;
+  if (hoid.is_temp() || !op->plan.will_write.count(hoid))
+    return false;
+  if (!get_parent()->get_backfill_shards().empty())
     return false;
 
-  Op *op = &(waiting_state.front());
-  if (op->requires_rmw() && pipeline_state.cache_invalid()) {
-    assert(get_parent()->get_pool().is_hacky_ecoverwrites());
-    dout(20) << __func__ << ": blocking " << *op
-	     << " because it requires an rmw and the cache is invalid "
-	     << pipeline_state
-	     << dendl;
+  map<shard_id_t, pg_shard_t> shards;
+  for (auto &&i: get_parent()->get_acting_shards()) {
+    if (get_parent()->get_shard_missing(i).is_missing(hoid))
+      return false;
+    shards[i.shard] = i;
+  }
+  if (shards.size() != ec_impl->get_chunk_count())
+    return false;
+
+  const vector<int> &mapping = ec_impl->get_chunk_mapping();
+  unsigned k = ec_impl->get_data_chunk_count();
+  unsigned m = ec_impl->get_chunk_count() - k;
+  set<int> data;
+  auto touched = ECTransaction::get_touched_data_chunks(
+    sinfo, op->plan.overwrites.begin()->second);
+  for (auto &&stripe: touched) {
+    for (auto i: stripe.second) {
+      data.insert(mapping.size() > i ? mapping[i] : i);
+    }
+  }
+  // the same shards are read for every stripe
+  if (2 * (data.size() + m) >= 2 * k + m) {
+    dout(20) << __func__ << ": " << hoid << " touches data chunks " << data
+	     << " of " << k << ", not worth a delta" << dendl;
     return false;
   }
 
-  if (op->invalidates_cache()) {
-    dout(20) << __func__ << ": invalidating cache after this op"
-	     << dendl;
-    pipeline_state.invalidate();
-    op->using_cache = false;
+  op->delta_shards.clear();
+  for (unsigned i = 0; i < ec_impl->get_chunk_count(); ++i) {
+    if (i >= k || data.count(mapping.size() > i ? mapping[i] : i))
+      op->delta_shards.insert(
+	shards[shard_id_t(mapping.size() > i ? mapping[i] : i)]);
+  }
+  op->parity_delta = true;
+  return true;
+}
+
+struct OnParityDeltaRead :
+  public GenContext<pair<RecoveryMessages*, ECBackend::read_result_t& > &> {
+  ECBackend *ec;
+  ECBackend::Op *op;
+  OnParityDeltaRead(ECBackend *ec, ECBackend::Op *op) : ec(ec), op(op) {}
+  void finish(pair<RecoveryMessages *, ECBackend::read_result_t &> &in) {
+    ec->finish_parity_delta_read(op, in.second);
+  }
+};
+
+void ECBackend::start_parity_delta_read(Op *op)
+{
+  assert(op->parity_delta);
+  const hobject_t &hoid = op->plan.overwrites.begin()->first;
+  list<boost::tuple<uint64_t, uint64_t, uint32_t> > to_read;
+  const extent_set &stripes = op->plan.will_write[hoid];
+  for (auto extent = stripes.begin(); extent != stripes.end(); ++extent) {
+    to_read.push_back(
+      boost::make_tuple(extent.get_start(), extent.get_len(), 0));
+  }
+  map<hobject_t, read_request_t, hobject_t::BitwiseComparator> for_read_op;
+  for_read_op.insert(
+    make_pair(
+      hoid,
+      read_request_t(
+	to_read,
+	op->delta_shards,
+	false,
+	new OnParityDeltaRead(this, op))));
+  // for_recovery: done once every shard in need has replied, there is
+  // nothing to decode
+  start_read_op(
+    CEPH_MSG_PRIO_DEFAULT,
+    for_read_op,
+    op->client_op,
+    false,
+    true);
+}
+
+void ECBackend::finish_parity_delta_read(Op *op, read_result_t &res)
+{
+  const hobject_t &hoid = op->plan.overwrites.begin()->first;
+  bool complete = res.r == 0 && res.errors.empty();
+  for (auto &&extent: res.returned) {
+    if (extent.get<2>().size() != op->delta_shards.size()) {
+      complete = false;
+      break;
+    }
+  }
+  if (!complete) {
+    dout(10) << __func__ << ": " << hoid << " read failed, r=" << res.r
+	     << " errors=" << res.errors
+	     << ", falling back to rmw" << dendl;
+    op->parity_delta = false;
+    op->delta_shards.clear();
+    op->remote_read = op->plan.to_read;
+    start_remote_read(op);
   } else {
-    op->using_cache = pipeline_state.caching_enabled();
+    auto &chunks = op->delta_read_result[hoid];
+    for (auto &&extent: res.returned) {
+      uint64_t off = sinfo.aligned_logical_offset_to_chunk_offset(
+	extent.get<0>());
+      uint64_t len = sinfo.aligned_logical_offset_to_chunk_offset(
+	extent.get<1>());
+      for (auto &&shard: extent.get<2>()) {
+	assert(shard.second.length() == len);
+	chunks[shard.first.shard].insert(off, len, shard.second);
+      }
+    }
+    dout(20) << __func__ << ": " << *op << dendl;
   }
+  check_ops();
+}
 
-  waiting_state.pop_front();
-  waiting_reads.push_back(*op);
+void ECBackend::start_remote_read(Op *op)
+{
+  if (!op->remote_read.empty()) {
+    assert(get_parent()->get_pool().is_hacky_ecoverwrites());
+    objects_read_async_no_cache(
+      op->remote_read,
+      [this, op](hobject_t::bitwisemap<pair<int, extent_map> > &&results) {
+	for (auto &&i: results) {
+	  op->remote_read_result.emplace(i.first, i.second.second);
+	}
+	check_ops();
+      });
+  }
+}
+
+bool ECBackend::try_state_to_reads()
+{
+  Op *op = nullptr;
+  for (auto t = tokens_waiting.begin(); t != tokens_waiting.end(); ++t) {
+    token_state_t &ts = token_states[*t];
+    assert(!ts.waiting_state.empty());
+    Op *front = ts.waiting_state.front();
+    if (front->requires_rmw() && ts.pipeline_state.cache_invalid()) {
+      assert(get_parent()->get_pool().is_hacky_ecoverwrites());
+      dout(20) << __func__ << ": blocking " << *front
+	       << " because it requires an rmw and the cache is invalid "
+	       << ts.pipeline_state
+	       << dendl;
+      continue;
+    }
+
+    op = front;
+    if (try_parity_delta(op, ts)) {
+      // the delta doesn't go through the cache, so later rmws on the
+      // object must not use what the cache holds until it's done
+      dout(20) << __func__ << ": parity delta, invalidating cache after "
+	       << "this op" << dendl;
+      ts.pipeline_state.invalidate();
+      op->using_cache = false;
+    } else if (op->invalidates_cache()) {
+      dout(20) << __func__ << ": invalidating cache after this op"
+	       << dendl;
+      ts.pipeline_state.invalidate();
+      op->using_cache = false;
+    } else {
+      op->using_cache = ts.pipeline_state.caching_enabled();
+    }
+
+    ts.waiting_state.pop_front();
+    if (ts.waiting_state.empty()) {
+      tokens_waiting.erase(t);
+    }
+    ++ts.in_progress;
+    op->started = true;
+    break;
+  }
+  if (!op)
+    return false;
 
   if (op->using_cache) {
     cache.open_write_pin(op->pin);
@@ -1775,22 +1950,16 @@ bool ECBackend::try_state_to_reads()
 	op->pending_read[hpair.first] = std::move(pending_read);
       }
     }
-  } else {
+  } else if (!op->parity_delta) {
     op->remote_read = op->plan.to_read;
   }
 
   dout(10) << __func__ << ": " << *op << dendl;
 
-  if (!op->remote_read.empty()) {
-    assert(get_parent()->get_pool().is_hacky_ecoverwrites());
-    objects_read_async_no_cache(
-      op->remote_read,
-      [this, op](hobject_t::bitwisemap<pair<int, extent_map> > &&results) {
-	for (auto &&i: results) {
-	  op->remote_read_result.emplace(i.first, i.second.second);
-	}
-	check_ops();
-      });
+  if (op->parity_delta) {
+    start_parity_delta_read(op);
+  } else {
+    start_remote_read(op);
   }
 
   return true;
@@ -1801,7 +1970,7 @@ bool ECBackend::try_reads_to_commit()
   if (waiting_reads.empty())
     return false;
   Op *op = &(waiting_reads.front());
-  if (op->read_in_progress())
+  if (!op->started || op->read_in_progress())
     return false;
   waiting_reads.pop_front();
   waiting_commit.push_back(*op);
@@ -1843,6 +2012,7 @@ bool ECBackend::try_reads_to_commit()
       !get_osdmap()->test_flag(CEPH_OSDMAP_REQUIRE_KRAKEN),
       sinfo,
       op->remote_read_result,
+      op->delta_read_result,
       op->log_entries,
       &written,
       &trans,
@@ -1870,7 +2040,8 @@ bool ECBackend::try_reads_to_commit()
     written_set[i.first] = i.second.get_interval_set();
   }
   dout(20) << __func__ << ": written_set: " << written_set << dendl;
-  assert(written_set == op->plan.will_write);
+  // a parity delta only writes the chunks touched
+  assert(op->parity_delta || written_set == op->plan.will_write);
 
   if (op->using_cache) {
     for (auto &&hpair: written) {
@@ -1973,6 +2144,8 @@ bool ECBackend::try_finish_rmw()
       nop->roll_forward_to = op->version;
       nop->tid = tid;
       nop->reqid = op->reqid;
+      nop->started = true;
+      ++token_states[get_ordering_token(*nop)].in_progress;
       waiting_reads.push_back(*nop);
     }
   }
@@ -1980,15 +2153,21 @@ bool ECBackend::try_finish_rmw()
   if (op->using_cache) {
     cache.release_write_pin(op->pin);
   }
-  tid_to_op_map.erase(op->tid);
 
-  if (waiting_reads.empty() &&
-      waiting_commit.empty()) {
-    pipeline_state.clear();
+  auto t = token_states.find(get_ordering_token(*op));
+  assert(t != token_states.end());
+  assert(t->second.in_progress > 0);
+  if (--t->second.in_progress == 0) {
+    t->second.pipeline_state.clear();
     dout(20) << __func__ << ": clearing pipeline_state "
-	     << pipeline_state
+	     << t->second.pipeline_state
+	     << " for token " << t->first
 	     << dendl;
+    if (t->second.waiting_state.empty()) {
+      token_states.erase(t);
+    }
   }
+  tid_to_op_map.erase(op->tid);
   return true;
 }
 
@@ -2322,30 +2501,36 @@ void ECBackend::be_deep_scrub(
   if (stride % sinfo.get_chunk_size())
     stride += sinfo.get_chunk_size() - (stride % sinfo.get_chunk_size());
   uint64_t pos = 0;
+  bool checksum_only = cct->_conf->osd_deep_scrub_checksum_only;
+  uint32_t crc = -1;
 
   uint32_t fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL | CEPH_OSD_OP_FLAG_FADVISE_DONTNEED;
 
   while (true) {
     bufferlist bl;
     handle.reset_tp_timeout();
-    r = store->read(
-      ch,
-      ghobject_t(
-	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-      pos,
-      stride, bl,
-      fadvise_flags, true);
+    ghobject_t goid(
+      poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard);
+    if (checksum_only) {
+      r = store->scrub_crc32c(ch, goid, pos, stride, &crc, fadvise_flags);
+    } else {
+      r = store->read(ch, goid, pos, stride, bl, fadvise_flags, true);
+    }
     if (r < 0)
       break;
-    if (bl.length() % sinfo.get_chunk_size()) {
+    get_parent()->scrub_io_charge(r);
+    if (r % sinfo.get_chunk_size()) {
       r = -EIO;
       break;
     }
     pos += r;
-    h << bl;
+    if (!checksum_only)
+      h << bl;
     if ((unsigned)r < stride)
       break;
   }
+  if (checksum_only)
+    h = bufferhash(crc);
 
   if (r == -EIO) {
     dout(0) << "_scan_list  " << poid << " got "
@@ -469,12 +469,22 @@ public:
     // must be true if requires_rmw(), must be false if invalidates_cache()
     bool using_cache = false;
 
+    /// left its token's waiting_state; reads (if any) have been issued
+    bool started = false;
+
     /// In progress read state;
     hobject_t::bitwisemap<extent_set> pending_read; // subset already being read
     hobject_t::bitwisemap<extent_set> remote_read;  // subset we must read
     hobject_t::bitwisemap<extent_map> remote_read_result;
+
+    /// written as a parity delta, see try_parity_delta
+    bool parity_delta = false;
+    set<pg_shard_t> delta_shards;  // shards read and written
+    hobject_t::bitwisemap<map<int, extent_map> > delta_read_result;
+
     bool read_in_progress() const {
-      return !remote_read.empty() && remote_read_result.empty();
+      return (!remote_read.empty() && remote_read_result.empty()) ||
+	(parity_delta && delta_read_result.empty());
     }
 
     /// In progress write state
@@ -502,29 +512,28 @@ public:
   };
   using op_list = boost::intrusive::list<Op>;
   friend ostream &operator<<(ostream &lhs, const Op &rhs);
+  friend struct OnParityDeltaRead;
 
   ExtentCache cache;
   map<ceph_tid_t, Op> tid_to_op_map; /// Owns Op structure
 
   /**
    * We model the possible rmw states as a set of waitlists.
-   * All writes at this time complete in order, so a write blocked
-   * at waiting_state blocks all writes behind it as well (same for
-   * other states).
    *
-   * Future work: We can break this up into a per-object pipeline
-   * (almost).  First, provide an ordering token to submit_transaction
-   * and require that all operations within a single transaction take
-   * place on a subset of hobject_t space partitioned by that token
-   * (the hashid seem about right to me -- even works for temp objects
-   * if you recall that a temp object created for object head foo will
-   * only ever be referenced by other transactions on foo and aren't
-   * reused).  Next, factor this part into a class and maintain one per
-   * ordering token.  Next, fixup PrimaryLogPG's repop queue to be
-   * partitioned by ordering token.  Finally, refactor the op pipeline
-   * so that the log entries passed into submit_tranaction aren't
-   * versioned.  We can't assign versions to them until we actually
-   * submit the operation.  That's probably going to be the hard part.
+   * The rmw pipeline state is kept per ordering token, the hashid of
+   * the object written: all operations within a single transaction
+   * take place on objects sharing it (even temp objects, since a temp
+   * object created for object head foo will only ever be referenced by
+   * other transactions on foo and isn't reused).  A write blocked in
+   * its token's waiting_state only blocks later writes on that token;
+   * writes on other tokens go on to issue their reads.
+   *
+   * The log entries passed into submit_transaction are already
+   * versioned, though, so writes are still committed (and hence
+   * completed) in submission order: waiting_reads holds every write
+   * not yet committed, in order, whether or not it has started.
+   * Committing out of order would need versions assigned at commit
+   * time and PrimaryLogPG's repop queue partitioned by token.
    */
   class pipeline_state_t {
     enum {
@@ -545,15 +554,29 @@ public:
       pipeline_state = CACHE_VALID;
     }
     friend ostream &operator<<(ostream &lhs, const pipeline_state_t &rhs);
-  } pipeline_state;
+  };
+
 
+  struct token_state_t {
+    pipeline_state_t pipeline_state;
+    list<Op*> waiting_state;   /// writes waiting on pipeline_state
+    unsigned in_progress = 0;  /// writes started but not finished
+  };
+  map<uint32_t, token_state_t> token_states;
+  set<uint32_t> tokens_waiting; /// tokens with a non-empty waiting_state
+  static uint32_t get_ordering_token(const Op &op) {
+    return op.hoid.get_hash();
+  }
 
-  op_list waiting_state;        /// writes waiting on pipe_state
   op_list waiting_reads;        /// writes waiting on partial stripe reads
   op_list waiting_commit;       /// writes waiting on initial commit
   eversion_t completed_to;
   eversion_t committed_to;
   void start_rmw(Op *op, PGTransactionUPtr &&t);
+  bool try_parity_delta(Op *op, const token_state_t &ts);
+  void start_parity_delta_read(Op *op);
+  void finish_parity_delta_read(Op *op, read_result_t &res);
+  void start_remote_read(Op *op);
   bool try_state_to_reads();
   bool try_reads_to_commit();
   bool try_finish_rmw();
@@ -82,6 +82,115 @@ void encode_and_write(
   }
 }
 
+static bufferptr get_chunk(
+  const extent_map &chunks,
+  uint64_t offset,
+  uint64_t length) {
+  extent_map chunk = chunks.intersect(offset, length);
+  assert(chunk.ext_count() == 1);
+  assert(chunk.begin().get_off() == offset);
+  assert(chunk.begin().get_len() == length);
+  bufferptr bp = buffer::create_page_aligned(length);
+  chunk.begin().get_val().copy(0, length, bp.c_str());
+  return bp;
+}
+
+void delta_and_write(
+  pg_t pgid,
+  const hobject_t &oid,
+  const ECUtil::stripe_info_t &sinfo,
+  ErasureCodeInterfaceRef &ecimpl,
+  const extent_map &to_write,
+  const map<int, extent_map> &old_chunks,
+  uint32_t flags,
+  map<shard_id_t, ObjectStore::Transaction> *transactions,
+  DoutPrefixProvider *dpp) {
+  const uint64_t chunk_size = sinfo.get_chunk_size();
+  const vector<int> &mapping = ecimpl->get_chunk_mapping();
+  const unsigned int k = ecimpl->get_data_chunk_count();
+  set<int> coding;
+  for (unsigned int i = 0; i < ecimpl->get_chunk_count(); ++i)
+    coding.insert(i);
+  for (unsigned int i = 0; i < k; ++i)
+    coding.erase(mapping.size() > i ? mapping[i] : i);
+
+  auto write_chunk = [&](int shard, uint64_t offset, bufferptr &bp) {
+    auto iter = transactions->find(shard_id_t(shard));
+    assert(iter != transactions->end());
+    bufferlist bl;
+    bl.append(bp);
+    iter->second.write(
+      coll_t(spg_t(pgid, iter->first)),
+      ghobject_t(oid, ghobject_t::NO_GEN, iter->first),
+      offset,
+      bl.length(),
+      bl,
+      flags);
+  };
+
+  auto touched = ECTransaction::get_touched_data_chunks(
+    sinfo, to_write.get_interval_set());
+  for (auto &&stripe: touched) {
+    uint64_t chunk_offset =
+      sinfo.aligned_logical_offset_to_chunk_offset(stripe.first);
+    ldpp_dout(dpp, 20) << __func__ << ": " << oid
+		       << " stripe " << stripe.first
+		       << " data chunks " << stripe.second
+		       << dendl;
+
+    map<int, bufferptr> deltas;
+    for (auto &&i: stripe.second) {
+      int shard = mapping.size() > i ? mapping[i] : i;
+      auto old_iter = old_chunks.find(shard);
+      assert(old_iter != old_chunks.end());
+      bufferptr old_data = get_chunk(
+	old_iter->second, chunk_offset, chunk_size);
+      bufferptr new_data(old_data.c_str(), chunk_size);
+      uint64_t logical_offset = stripe.first + i * chunk_size;
+      extent_map updates = to_write.intersect(logical_offset, chunk_size);
+      for (auto &&update: updates) {
+	update.get_val().copy(
+	  0, update.get_len(),
+	  new_data.c_str() + update.get_off() - logical_offset);
+      }
+      int r = ecimpl->encode_delta(old_data, new_data, &old_data);
+      assert(r == 0);
+      deltas[shard] = old_data;
+      write_chunk(shard, chunk_offset, new_data);
+    }
+
+    map<int, bufferptr> parity;
+    for (auto &&shard: coding) {
+      auto old_iter = old_chunks.find(shard);
+      assert(old_iter != old_chunks.end());
+      parity[shard] = get_chunk(old_iter->second, chunk_offset, chunk_size);
+    }
+    int r = ecimpl->apply_delta(deltas, &parity);
+    assert(r == 0);
+    for (auto &&i: parity) {
+      write_chunk(i.first, chunk_offset, i.second);
+    }
+  }
+}
+
+map<uint64_t, set<unsigned int> > ECTransaction::get_touched_data_chunks(
+  const ECUtil::stripe_info_t &sinfo,
+  const extent_set &extents) {
+  map<uint64_t, set<unsigned int> > touched;
+  const uint64_t chunk_size = sinfo.get_chunk_size();
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  for (auto extent = extents.begin(); extent != extents.end(); ++extent) {
+    uint64_t end = extent.get_start() + extent.get_len();
+    for (uint64_t off = extent.get_start() / chunk_size * chunk_size;
+	 off < end;
+	 off += chunk_size) {
+      touched[off / stripe_width * stripe_width].insert(
+	(off % stripe_width) / chunk_size);
+    }
+  }
+  return touched;
+}
+
 bool ECTransaction::requires_overwrite(
   uint64_t prev_size,
   const PGTransaction::ObjectOperation &op) {
@@ -102,6 +211,7 @@ void ECTransaction::generate_transactions(
   bool legacy_log_entries,
   const ECUtil::stripe_info_t &sinfo,
   const hobject_t::bitwisemap<extent_map> &partial_extents,
+  const hobject_t::bitwisemap<map<int, extent_map> > &delta_reads,
   vector<pg_log_entry_t> &entries,
   hobject_t::bitwisemap<extent_map> *written_map,
   map<shard_id_t, ObjectStore::Transaction> *transactions,
@@ -541,6 +651,66 @@ void ECTransaction::generate_transactions(
       for (unsigned i = 0; i < ecimpl->get_chunk_count(); ++i) {
 	want.insert(i);
       }
+      auto save_rollback_extent = [&](uint64_t off, uint64_t len) {
+	uint64_t restore_from = sinfo.aligned_logical_offset_to_chunk_offset(
+	  off);
+	uint64_t restore_len = sinfo.aligned_logical_offset_to_chunk_offset(
+	  len);
+	ldpp_dout(dpp, 20) << __func__ << ": overwriting "
+			   << restore_from << "~" << restore_len
+			   << dendl;
+	if (rollback_extents.empty()) {
+	  for (auto &&st : *transactions) {
+	    st.second.touch(
+	      coll_t(spg_t(pgid, st.first)),
+	      ghobject_t(oid, entry->version.version, st.first));
+	  }
+	}
+	rollback_extents.emplace_back(make_pair(restore_from, restore_len));
+	for (auto &&st : *transactions) {
+	  st.second.clone_range(
+	    coll_t(spg_t(pgid, st.first)),
+	    ghobject_t(oid, ghobject_t::NO_GEN, st.first),
+	    ghobject_t(oid, entry->version.version, st.first),
+	    restore_from,
+	    restore_len,
+	    restore_from);
+	}
+      };
+
+      auto diter = delta_reads.find(oid);
+      if (diter != delta_reads.end()) {
+	/* We read the old content of the chunks written and of the
+	 * coding chunks rather than whole stripes, so to_write holds
+	 * the updates as they came.  Every shard still saves the whole
+	 * stripes for rollback (a clone), but only the shards written
+	 * get new data. */
+	assert(to_write.get_interval_set().range_end() <= append_after);
+	auto witer = plan.will_write.find(oid);
+	assert(witer != plan.will_write.end());
+	if (entry) {
+	  for (auto extent = witer->second.begin();
+	       extent != witer->second.end();
+	       ++extent) {
+	    save_rollback_extent(extent.get_start(), extent.get_len());
+	  }
+	}
+	ldpp_dout(dpp, 20) << __func__ << ": parity delta: "
+			   << to_write
+			   << dendl;
+	delta_and_write(
+	  pgid,
+	  oid,
+	  sinfo,
+	  ecimpl,
+	  to_write,
+	  diter->second,
+	  fadvise_flags,
+	  transactions,
+	  dpp);
+	to_write.clear();
+      }
+
       auto to_overwrite = to_write.intersect(0, append_after);
       ldpp_dout(dpp, 20) << __func__ << ": to_overwrite: "
 			 << to_overwrite
@@ -550,30 +720,7 @@ void ECTransaction::generate_transactions(
 	assert(sinfo.logical_offset_is_stripe_aligned(extent.get_off()));
 	assert(sinfo.logical_offset_is_stripe_aligned(extent.get_len()));
 	if (entry) {
-	  uint64_t restore_from = sinfo.aligned_logical_offset_to_chunk_offset(
-	    extent.get_off());
-	  uint64_t restore_len = sinfo.aligned_logical_offset_to_chunk_offset(
-	    extent.get_len());
-	  ldpp_dout(dpp, 20) << __func__ << ": overwriting "
-			     << restore_from << "~" << restore_len
-			     << dendl;
-	  if (rollback_extents.empty()) {
-	    for (auto &&st : *transactions) {
-	      st.second.touch(
-		coll_t(spg_t(pgid, st.first)),
-		ghobject_t(oid, entry->version.version, st.first));
-	    }
-	  }
-	  rollback_extents.emplace_back(make_pair(restore_from, restore_len));
-	  for (auto &&st : *transactions) {
-	    st.second.clone_range(
-	      coll_t(spg_t(pgid, st.first)),
-	      ghobject_t(oid, ghobject_t::NO_GEN, st.first),
-	      ghobject_t(oid, entry->version.version, st.first),
-	      restore_from,
-	      restore_len,
-	      restore_from);
-	  }
+	  save_rollback_extent(extent.get_off(), extent.get_len());
 	}
 	encode_and_write(
 	  pgid,
@@ -29,6 +29,11 @@ namespace ECTransaction {
     hobject_t::bitwisemap<extent_set> to_read;
     hobject_t::bitwisemap<extent_set> will_write; // superset of to_read
 
+    /* objects whose writes only replace existing bytes (no truncate,
+     * create, clone, rename or growth), with the bytes replaced: these
+     * may be written as a parity delta, see ECBackend */
+    hobject_t::bitwisemap<extent_set> overwrites;
+
     hobject_t::bitwisemap<ECUtil::HashInfoRef> hash_infos;
   };
 
@@ -68,6 +73,7 @@ namespace ECTransaction {
 	  plan.hash_infos[source] = shinfo;
 	}
 
+	const uint64_t prev_size = projected_size;
 	auto &will_write = plan.will_write[i.first];
 	if (i.second.truncate &&
 	    i.second.truncate->first < projected_size) {
@@ -145,6 +151,13 @@ namespace ECTransaction {
 	  }
 	}
 
+	if (i.second.is_none() &&
+	    !i.second.truncate &&
+	    !raw_write_set.empty() &&
+	    raw_write_set.range_end() <= prev_size) {
+	  plan.overwrites[i.first] = raw_write_set;
+	}
+
 	if (i.second.truncate &&
 	    i.second.truncate->second > projected_size) {
 	  uint64_t truncating_to =
@@ -176,6 +189,15 @@ namespace ECTransaction {
     return plan;
   }
 
+  /// map the logical offset of each stripe touched by **extents** to
+  /// the positions (0 to k - 1) of the data chunks touched in it
+  map<uint64_t, set<unsigned int> > get_touched_data_chunks(
+    const ECUtil::stripe_info_t &sinfo,
+    const extent_set &extents);
+
+  /* delta_reads holds, for the objects of plan.overwrites to be written
+   * as a parity delta, the chunks of the stripes of plan.will_write
+   * read from each shard involved, keyed by chunk offset */
   void generate_transactions(
     WritePlan &plan,
     ErasureCodeInterfaceRef &ecimpl,
@@ -183,6 +205,7 @@ namespace ECTransaction {
     bool legacy_log_entries,
     const ECUtil::stripe_info_t &sinfo,
     const hobject_t::bitwisemap<extent_map> &partial_extents,
+    const hobject_t::bitwisemap<map<int, extent_map> > &delta_reads,
     vector<pg_log_entry_t> &entries,
     hobject_t::bitwisemap<extent_map> *written,
     map<shard_id_t, ObjectStore::Transaction> *transactions,
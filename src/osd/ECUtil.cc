@@ -1,9 +1,53 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 
 #include <errno.h>
+#include <algorithm>
 #include "include/encoding.h"
 #include "ECUtil.h"
 
+// Lay the shards out as encode_stripes() and decode_stripes() expect
+// them: one contiguous, page aligned buffer per chunk index, holding the
+// chunk of every stripe back to back.  Shards we were given are only
+// copied if they are fragmented or misaligned.
+static void prepare_stripes(
+  ErasureCodeInterfaceRef &ec_impl,
+  uint64_t shard_size,
+  map<int, bufferlist> *chunks) {
+  for (unsigned i = 0; i < ec_impl->get_chunk_count(); ++i) {
+    bufferlist &bl = (*chunks)[i];
+    if (bl.length() == 0) {
+      bl.push_back(buffer::create_page_aligned(shard_size));
+    } else if (!bl.is_contiguous() || !bl.is_page_aligned()) {
+      bufferptr bp = buffer::create_page_aligned(shard_size);
+      bl.rebuild(bp);
+    }
+    assert(bl.length() == shard_size);
+  }
+}
+
+static int decode_shards(
+  const ECUtil::stripe_info_t &sinfo,
+  ErasureCodeInterfaceRef &ec_impl,
+  map<int, bufferlist> &to_decode,
+  const set<int> &need,
+  map<int, bufferlist> *chunks) {
+  uint64_t total_data_size = to_decode.begin()->second.length();
+  set<int> available;
+  for (map<int, bufferlist>::iterator i = to_decode.begin();
+       i != to_decode.end();
+       ++i) {
+    assert(i->second.length() == total_data_size);
+    available.insert(i->first);
+  }
+  *chunks = to_decode;
+  if (includes(available.begin(), available.end(),
+	       need.begin(), need.end()))
+    return 0;
+  prepare_stripes(ec_impl, total_data_size, chunks);
+  return ec_impl->decode_stripes(need, available, sinfo.get_chunk_size(),
+				 chunks);
+}
+
 int ECUtil::decode(
   const stripe_info_t &sinfo,
   ErasureCodeInterfaceRef &ec_impl,
@@ -17,28 +61,29 @@ int ECUtil::decode(
   assert(out);
   assert(out->length() == 0);
 
-  for (map<int, bufferlist>::iterator i = to_decode.begin();
-       i != to_decode.end();
-       ++i) {
-    assert(i->second.length() == total_data_size);
-  }
-
   if (total_data_size == 0)
     return 0;
 
+  const vector<int> &mapping = ec_impl->get_chunk_mapping();
+  unsigned int k = ec_impl->get_data_chunk_count();
+  set<int> need;
+  for (unsigned int i = 0; i < k; ++i)
+    need.insert(mapping.size() > i ? mapping[i] : i);
+
+  map<int, bufferlist> chunks;
+  int r = decode_shards(sinfo, ec_impl, to_decode, need, &chunks);
+  assert(r == 0);
+
   for (uint64_t i = 0; i < total_data_size; i += sinfo.get_chunk_size()) {
-    map<int, bufferlist> chunks;
-    for (map<int, bufferlist>::iterator j = to_decode.begin();
-	 j != to_decode.end();
-	 ++j) {
-      chunks[j->first].substr_of(j->second, i, sinfo.get_chunk_size());
+    for (unsigned int j = 0; j < k; ++j) {
+      bufferlist bl;
+      bl.substr_of(chunks[mapping.size() > j ? mapping[j] : j],
+		   i, sinfo.get_chunk_size());
+      out->claim_append(bl);
     }
-    bufferlist bl;
-    int r = ec_impl->decode_concat(chunks, &bl);
-    assert(bl.length() == sinfo.get_stripe_width());
-    assert(r == 0);
-    out->claim_append(bl);
   }
+  assert(out->length() ==
+	 sinfo.aligned_chunk_offset_to_logical_offset(total_data_size));
   return 0;
 }
 
@@ -52,12 +97,6 @@ int ECUtil::decode(
   uint64_t total_data_size = to_decode.begin()->second.length();
   assert(total_data_size % sinfo.get_chunk_size() == 0);
 
-  for (map<int, bufferlist>::iterator i = to_decode.begin();
-       i != to_decode.end();
-       ++i) {
-    assert(i->second.length() == total_data_size);
-  }
-
   if (total_data_size == 0)
     return 0;
 
@@ -70,27 +109,15 @@ int ECUtil::decode(
     need.insert(i->first);
   }
 
-  for (uint64_t i = 0; i < total_data_size; i += sinfo.get_chunk_size()) {
-    map<int, bufferlist> chunks;
-    for (map<int, bufferlist>::iterator j = to_decode.begin();
-	 j != to_decode.end();
-	 ++j) {
-      chunks[j->first].substr_of(j->second, i, sinfo.get_chunk_size());
-    }
-    map<int, bufferlist> out_bls;
-    int r = ec_impl->decode(need, chunks, &out_bls);
-    assert(r == 0);
-    for (map<int, bufferlist*>::iterator j = out.begin();
-	 j != out.end();
-	 ++j) {
-      assert(out_bls.count(j->first));
-      assert(out_bls[j->first].length() == sinfo.get_chunk_size());
-      j->second->claim_append(out_bls[j->first]);
-    }
-  }
+  map<int, bufferlist> chunks;
+  int r = decode_shards(sinfo, ec_impl, to_decode, need, &chunks);
+  assert(r == 0);
+
   for (map<int, bufferlist*>::iterator i = out.begin();
        i != out.end();
        ++i) {
+    assert(chunks.count(i->first));
+    i->second->claim_append(chunks[i->first]);
     assert(i->second->length() == total_data_size);
   }
   return 0;
@@ -112,19 +139,33 @@ int ECUtil::encode(
   if (logical_size == 0)
     return 0;
 
-  for (uint64_t i = 0; i < logical_size; i += sinfo.get_stripe_width()) {
-    map<int, bufferlist> encoded;
-    bufferlist buf;
-    buf.substr_of(in, i, sinfo.get_stripe_width());
-    int r = ec_impl->encode(want, buf, &encoded);
-    assert(r == 0);
-    for (map<int, bufferlist>::iterator i = encoded.begin();
-	 i != encoded.end();
-	 ++i) {
-      assert(i->second.length() == sinfo.get_chunk_size());
-      (*out)[i->first].claim_append(i->second);
+  uint64_t chunk_size = sinfo.get_chunk_size();
+  uint64_t shard_size = sinfo.logical_to_next_chunk_offset(logical_size);
+  const vector<int> &mapping = ec_impl->get_chunk_mapping();
+  unsigned int k = ec_impl->get_data_chunk_count();
+
+  // scatter the data into its shards once, then encode all the stripes
+  // in place
+  map<int, bufferlist> chunks;
+  prepare_stripes(ec_impl, shard_size, &chunks);
+  bufferlist::iterator p = in.begin();
+  for (uint64_t i = 0; i < shard_size; i += chunk_size) {
+    for (unsigned int j = 0; j < k; ++j) {
+      int shard = mapping.size() > j ? mapping[j] : j;
+      p.copy(chunk_size, chunks[shard].c_str() + i);
     }
   }
+  int r = ec_impl->encode_stripes(want, chunk_size, &chunks);
+  assert(r == 0);
+
+  for (map<int, bufferlist>::iterator i = chunks.begin();
+       i != chunks.end();
+       ++i) {
+    if (want.count(i->first) == 0)
+      continue;
+    assert(i->second.length() == shard_size);
+    (*out)[i->first].claim_append(i->second);
+  }
 
   for (map<int, bufferlist>::iterator i = out->begin();
        i != out->end();
@@ -13,8 +13,10 @@
  */
 #include "acconfig.h"
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <thread>
 #include <errno.h>
 #include <sys/stat.h>
 #include <signal.h>
@@ -234,6 +236,8 @@ OSDService::OSDService(OSD *osd) :
   peer_map_epoch_lock("OSDService::peer_map_epoch_lock"),
   sched_scrub_lock("OSDService::sched_scrub_lock"), scrubs_pending(0),
   scrubs_active(0),
+  scrub_budget_lock("OSDService::scrub_budget_lock"),
+  scrub_budget_bytes(0),
   agent_lock("OSDService::agent_lock"),
   agent_valid_iterator(false),
   agent_ops(0),
@@ -1121,6 +1125,40 @@ void OSDService::dec_scrubs_active()
   sched_scrub_lock.Unlock();
 }
 
+double OSDService::_scrub_io_refill(uint64_t rate)
+{
+  assert(scrub_budget_lock.is_locked());
+  // token bucket holding up to one second's worth of bytes; may go
+  // negative when scrubs read more than the budget allows
+  utime_t now = ceph_clock_now();
+  if (scrub_budget_stamp != utime_t()) {
+    scrub_budget_bytes += (double)(now - scrub_budget_stamp) * rate;
+  }
+  scrub_budget_bytes = MIN(scrub_budget_bytes, (double)rate);
+  scrub_budget_stamp = now;
+  return scrub_budget_bytes;
+}
+
+void OSDService::scrub_io_charge(uint64_t bytes)
+{
+  uint64_t rate = cct->_conf->osd_deep_scrub_max_bytes_per_sec;
+  if (!rate)
+    return;
+  Mutex::Locker l(scrub_budget_lock);
+  _scrub_io_refill(rate);
+  scrub_budget_bytes -= bytes;
+}
+
+double OSDService::get_scrub_io_wait()
+{
+  uint64_t rate = cct->_conf->osd_deep_scrub_max_bytes_per_sec;
+  if (!rate)
+    return 0;
+  Mutex::Locker l(scrub_budget_lock);
+  double avail = _scrub_io_refill(rate);
+  return avail < 0 ? -avail / rate : 0;
+}
+
 void OSDService::retrieve_epochs(epoch_t *_boot_epoch, epoch_t *_up_epoch,
                                  epoch_t *_bind_epoch) const
 {
@@ -2640,8 +2678,22 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_pg_biginfo, "osd_pg_biginfo",
 			  "PG updated its biginfo attr");
 
+  osd_plb.add_u64(l_osd_boot_pgs, "boot_pgs", "PGs loaded at boot");
+  osd_plb.add_time(l_osd_boot_load_pgs_lat, "boot_load_pgs_latency",
+		   "Time spent loading PGs at boot");
+  osd_plb.add_time(l_osd_boot_read_pgs_lat, "boot_read_pgs_latency",
+		   "Time spent reading PG info and logs at boot");
+  osd_plb.add_time(l_osd_boot_past_intervals_lat,
+		   "boot_past_intervals_latency",
+		   "Time spent building past intervals at boot");
+
   logger = osd_plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
+
+  logger->set(l_osd_boot_pgs, boot_pgs_loaded);
+  logger->tset(l_osd_boot_load_pgs_lat, boot_load_pgs_lat);
+  logger->tset(l_osd_boot_read_pgs_lat, boot_read_pgs_lat);
+  logger->tset(l_osd_boot_past_intervals_lat, boot_past_intervals_lat);
 }
 
 void OSD::create_recoverystate_perf()
@@ -3314,6 +3366,7 @@ void OSD::load_pgs()
     RWLock::RLocker l(pg_map_lock);
     assert(pg_map.empty());
   }
+  utime_t start = ceph_clock_now();
 
   vector<coll_t> ls;
   int r = store->list_collections(ls);
@@ -3323,6 +3376,9 @@ void OSD::load_pgs()
 
   bool has_upgraded = false;
 
+  // open the pgs first.  reading their info and log is the slow part and
+  // is done below on several threads.
+  vector<pair<PG*, bufferlist> > loaded;
   for (vector<coll_t>::iterator it = ls.begin();
        it != ls.end();
        ++it) {
@@ -3380,9 +3436,46 @@ void OSD::load_pgs()
     // there can be no waiters here, so we don't call wake_pg_waiters
 
     pg->ch = store->open_collection(pg->coll);
+    loaded.push_back(make_pair(pg, bufferlist()));
+    loaded.back().second.claim(bl);
+    pg->unlock();
+  }
+
+  // read pg state, log.  each thread decodes one pg log at a time, so
+  // this needs no more memory than a serial load would, per thread.
+  utime_t read_start = ceph_clock_now();
+  unsigned threads = std::max(1, cct->_conf->osd_load_pgs_threads);
+  threads = std::min<size_t>(threads, loaded.size());
+  std::atomic<size_t> next = {0};
+  auto read_pgs = [&]() {
+    for (size_t i = next++; i < loaded.size(); i = next++) {
+      PG *pg = loaded[i].first;
+      pg->lock();
+      pg->read_state(store, loaded[i].second);
+      loaded[i].second.clear();
+      pg->unlock();
+    }
+  };
+  if (threads > 1) {
+    vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i) {
+      workers.emplace_back(read_pgs);
+    }
+    read_pgs();
+    for (auto& t : workers) {
+      t.join();
+    }
+  } else {
+    read_pgs();
+  }
+  boot_read_pgs_lat = ceph_clock_now() - read_start;
+  dout(10) << __func__ << " read " << loaded.size() << " pgs in "
+	   << boot_read_pgs_lat << " using " << threads << " threads" << dendl;
 
-    // read pg state, log
-    pg->read_state(store, bl);
+  for (auto& p : loaded) {
+    PG *pg = p.first;
+    spg_t pgid = pg->pg_id;
+    pg->lock();
 
     if (pg->must_upgrade()) {
       if (!pg->can_upgrade()) {
@@ -3434,6 +3527,7 @@ void OSD::load_pgs()
     RWLock::RLocker l(pg_map_lock);
     dout(0) << "load_pgs opened " << pg_map.size() << " pgs" << dendl;
   }
+  boot_pgs_loaded = loaded.size();
 
   // clean up old infos object?
   if (has_upgraded && store->exists(coll_t::meta(), OSD::make_infos_oid())) {
@@ -3448,7 +3542,10 @@ void OSD::load_pgs()
     }
   }
 
+  utime_t pi_start = ceph_clock_now();
   build_past_intervals_parallel();
+  boot_past_intervals_lat = ceph_clock_now() - pi_start;
+  boot_load_pgs_lat = ceph_clock_now() - start;
 }
 
 
@@ -6907,6 +7004,7 @@ void OSD::handle_osd_map(MOSDMap *m)
     if (p != m->maps.end()) {
       dout(10) << "handle_osd_map  got full map for epoch " << e << dendl;
       OSDMap *o = new OSDMap;
+      o->set_pg_mapping_threads(cct->_conf->osd_map_pg_mapping_threads);
       bufferlist& bl = p->second;
 
       o->decode(bl);
@@ -6929,11 +7027,19 @@ void OSD::handle_osd_map(MOSDMap *m)
       pin_map_inc_bl(e, bl);
 
       OSDMap *o = new OSDMap;
+      o->set_pg_mapping_threads(cct->_conf->osd_map_pg_mapping_threads);
       if (e > 1) {
 	bufferlist obl;
         bool got = get_map_bl(e - 1, obl);
         assert(got);
 	o->decode(obl);
+
+	// update the previous epoch's pg mapping instead of building
+	// this one's from scratch
+	OSDMapRef prev = pinned_maps.empty() ? osdmap : pinned_maps.back();
+	if (cct->_conf->osd_map_pg_mapping_threads > 0 &&
+	    prev && prev->get_epoch() == e - 1)
+	  o->inherit_pg_mapping(*prev);
       }
 
       OSDMap::Incremental inc;
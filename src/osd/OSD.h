@@ -51,6 +51,7 @@ using namespace std;
 #include "common/sharedptr_registry.hpp"
 #include "common/WeightedPriorityQueue.h"
 #include "common/PrioritizedQueue.h"
+#include "osd/mClockOpClassQueue.h"
 #include "messages/MOSDOp.h"
 #include "include/Spinlock.h"
 #include "common/EventTrace.h"
@@ -161,6 +162,11 @@ enum {
   l_osd_pg_fastinfo,
   l_osd_pg_biginfo,
 
+  l_osd_boot_pgs,
+  l_osd_boot_load_pgs_lat,
+  l_osd_boot_read_pgs_lat,
+  l_osd_boot_past_intervals_lat,
+
   l_osd_last,
 };
 
@@ -379,6 +385,22 @@ class PGQueueable {
     void operator()(const PGScrub &op);
     void operator()(const PGRecovery &op);
   };
+  struct OpTypeVis : public boost::static_visitor<osd_op_type_t> {
+    osd_op_type_t operator()(const OpRequestRef &op) const {
+      if (op->get_req()->get_type() == CEPH_MSG_OSD_OP)
+	return osd_op_type_t::client_op;
+      return osd_op_type_t::osd_subop;
+    }
+    osd_op_type_t operator()(const PGSnapTrim &op) const {
+      return osd_op_type_t::bg_snaptrim;
+    }
+    osd_op_type_t operator()(const PGScrub &op) const {
+      return osd_op_type_t::bg_scrub;
+    }
+    osd_op_type_t operator()(const PGRecovery &op) const {
+      return osd_op_type_t::bg_recovery;
+    }
+  };
 public:
   // cppcheck-suppress noExplicitConstructor
   PGQueueable(OpRequestRef op)
@@ -418,6 +440,9 @@ public:
   int get_cost() const { return cost; }
   utime_t get_start_time() const { return start_time; }
   entity_inst_t get_owner() const { return owner; }
+  osd_op_type_t get_op_type() const {
+    return boost::apply_visitor(OpTypeVis(), qvariant);
+  }
 };
 
 class OSDService {
@@ -629,6 +654,12 @@ private:
   int scrubs_pending;
   int scrubs_active;
 
+  // -- deep scrub io budget --
+  Mutex scrub_budget_lock;
+  utime_t scrub_budget_stamp;
+  double scrub_budget_bytes;   ///< may go negative: bytes owed
+  double _scrub_io_refill(uint64_t rate);
+
 public:
   struct ScrubJob {
     CephContext* cct;
@@ -707,6 +738,10 @@ public:
   void inc_scrubs_active(bool reserved);
   void dec_scrubs_pending();
   void dec_scrubs_active();
+  /// charge bytes read by deep scrub against the OSD-wide budget
+  void scrub_io_charge(uint64_t bytes);
+  /// seconds until the budget is back in credit
+  double get_scrub_io_wait();
 
   void reply_op_error(OpRequestRef op, int err);
   void reply_op_error(OpRequestRef op, int err, eversion_t v, version_t uv);
@@ -1749,7 +1784,8 @@ private:
   // -- op queue --
   enum io_queue {
     prioritized,
-    weightedpriority};
+    weightedpriority,
+    mclock_opclass};
   const io_queue op_queue;
   const unsigned int op_prio_cutoff;
 
@@ -1778,6 +1814,13 @@ private:
 		<PrioritizedQueue< pair<PGRef, PGQueueable>, entity_inst_t>>(
 		  new PrioritizedQueue< pair<PGRef, PGQueueable>, entity_inst_t>(
 		    max_tok_per_prio, min_cost));
+	    } else if (opqueue == mclock_opclass) {
+	      pqueue = std::unique_ptr
+		<mClockOpClassQueue< pair<PGRef, PGQueueable>, entity_inst_t>>(
+		  new mClockOpClassQueue< pair<PGRef, PGQueueable>, entity_inst_t>(
+		    cct, [](const pair<PGRef, PGQueueable>& item) {
+		      return item.second.get_op_type();
+		    }));
 	    }
 	  }
     };
@@ -2089,6 +2132,9 @@ protected:
   
   void load_pgs();
   void build_past_intervals_parallel();
+  // boot timings, for the perf counters (which are created after load_pgs)
+  unsigned boot_pgs_loaded = 0;
+  utime_t boot_load_pgs_lat, boot_read_pgs_lat, boot_past_intervals_lat;
 
   /// project pg history from from to now
   bool project_pg_history(
@@ -2416,9 +2462,17 @@ protected:
   io_queue get_io_queue() const {
     if (cct->_conf->osd_op_queue == "debug_random") {
       srand(time(NULL));
-      return (rand() % 2 < 1) ? prioritized : weightedpriority;
+      unsigned which = rand() % 3;
+      if (which == 0) {
+	return prioritized;
+      } else if (which == 1) {
+	return weightedpriority;
+      }
+      return mclock_opclass;
     } else if (cct->_conf->osd_op_queue == "wpq") {
       return weightedpriority;
+    } else if (cct->_conf->osd_op_queue == "mclock_opclass") {
+      return mclock_opclass;
     } else {
       return prioritized;
     }
@@ -910,6 +910,7 @@ void OSDMap::get_blacklist(list<pair<entity_addr_t,utime_t> > *bl) const
 
 void OSDMap::set_max_osd(int m)
 {
+  pg_mapping.reset();
   int o = max_osd;
   max_osd = m;
   osd_state.resize(m);
@@ -1269,6 +1270,15 @@ int OSDMap::apply_incremental(const Incremental &inc)
   
   assert(inc.epoch == epoch+1);
 
+  // if we have a pg mapping, note which pgs this remaps before we apply
+  // it; we need the old weights and states for that
+  ceph::shared_ptr<const PGMapping> prev_mapping = pg_mapping.take();
+  bool remap_all = true;
+  set<int64_t> remap_pools;
+  set<int> remap_osds, reup_osds;
+  if (prev_mapping && prev_mapping->epoch == epoch)
+    remap_all = _get_remapped(inc, &remap_pools, &remap_osds, &reup_osds);
+
   epoch++;
   modified = inc.modified;
 
@@ -1465,9 +1475,135 @@ int OSDMap::apply_incremental(const Incremental &inc)
 
   calc_num_osds();
   _calc_up_osd_features();
+
+  if (!remap_all)
+    pg_mapping.reset(_update_pg_mapping(*prev_mapping, inc, remap_pools,
+					remap_osds, reup_osds));
   return 0;
 }
 
+bool OSDMap::_get_remapped(const Incremental& inc,
+			   set<int64_t> *remap_pools,
+			   set<int> *remap_osds,
+			   set<int> *reup_osds) const
+{
+  if (inc.fullmap.length() || inc.crush.length() || inc.new_max_osd >= 0)
+    return true;
+
+  for (auto& p : inc.new_pools) {
+    const pg_pool_t *old = get_pg_pool(p.first);
+    const pg_pool_t& pool = p.second;
+    if (!old ||
+	old->get_pg_num() != pool.get_pg_num() ||
+	old->get_pgp_num() != pool.get_pgp_num() ||
+	old->get_size() != pool.get_size() ||
+	old->get_type() != pool.get_type() ||
+	old->get_crush_ruleset() != pool.get_crush_ruleset() ||
+	old->has_flag(pg_pool_t::FLAG_HASHPSPOOL) !=
+	  pool.has_flag(pg_pool_t::FLAG_HASHPSPOOL))
+      remap_pools->insert(p.first);
+  }
+  for (auto pool : inc.old_pools)
+    remap_pools->insert(pool);
+
+  for (auto& p : inc.new_weight) {
+    // a lower weight only rejects the osd from pgs it is mapped to now,
+    // but a higher one may let crush pick it for any pg
+    if (p.second > osd_weight[p.first])
+      return true;
+    if (p.second < osd_weight[p.first])
+      remap_osds->insert(p.first);
+  }
+  for (auto& p : inc.new_primary_affinity)
+    reup_osds->insert(p.first);
+  for (auto& p : inc.new_state) {
+    int s = p.second ? p.second : CEPH_OSD_UP;
+    if (s & CEPH_OSD_EXISTS)
+      return true;
+    if (s & CEPH_OSD_UP)
+      reup_osds->insert(p.first);
+  }
+  for (auto& p : inc.new_up_client) {
+    if (!exists(p.first))
+      return true;
+    reup_osds->insert(p.first);
+  }
+  return false;
+}
+
+ceph::shared_ptr<const OSDMap::PGMapping> OSDMap::_update_pg_mapping(
+  const PGMapping& prev, const Incremental& inc,
+  const set<int64_t>& remap_pools, const set<int>& remap_osds,
+  const set<int>& reup_osds) const
+{
+  unsigned nthreads;
+  {
+    std::lock_guard<std::mutex> l(pg_mapping.lock);
+    nthreads = pg_mapping.nthreads;
+  }
+
+  // pgs whose pg_temp or primary_temp changed, or whose pg_temp has an
+  // osd which went up or down
+  map<int64_t, set<ps_t> > retemp;
+  for (auto& p : inc.new_pg_temp)
+    retemp[p.first.pool()].insert(p.first.ps());
+  for (auto& p : inc.new_primary_temp)
+    retemp[p.first.pool()].insert(p.first.ps());
+  if (!remap_osds.empty() || !reup_osds.empty()) {
+    for (auto& p : *pg_temp) {
+      for (auto osd : p.second) {
+	if (remap_osds.count(osd) || reup_osds.count(osd)) {
+	  retemp[p.first.pool()].insert(p.first.ps());
+	  break;
+	}
+      }
+    }
+  }
+
+  ceph::shared_ptr<PGMapping> m = std::make_shared<PGMapping>();
+  m->epoch = epoch;
+  for (auto& p : pools) {
+    int64_t poolid = p.first;
+    auto q = prev.pools.find(poolid);
+    if (q == prev.pools.end() || remap_pools.count(poolid)) {
+      auto pm = std::make_shared<PGMapping::Pool>();
+      _build_pool_mapping(poolid, p.second, nthreads, pm.get());
+      m->pools[poolid] = pm;
+      continue;
+    }
+
+    // only copy the pool's table if one of its pgs changes
+    const PGMapping::Pool& old = *q->second;
+    ceph::shared_ptr<PGMapping::Pool> pm;
+    auto rt = retemp.find(poolid);
+    for (ps_t ps = 0; ps < old.raw.get_num_pgs(); ++ps) {
+      bool remap_raw = false;
+      bool remap = rt != retemp.end() && rt->second.count(ps);
+      if (!remap_osds.empty() || !reup_osds.empty()) {
+	const int32_t *row = &old.raw.osds[(size_t)ps * old.raw.size];
+	for (unsigned i = 0; i < old.raw.lens[ps]; ++i) {
+	  if (remap_osds.count(row[i])) {
+	    remap_raw = true;
+	    break;
+	  }
+	  if (reup_osds.count(row[i]))
+	    remap = true;
+	}
+      }
+      if (!remap_raw && !remap)
+	continue;
+      if (!pm)
+	pm = std::make_shared<PGMapping::Pool>(old);
+      _map_pg(poolid, p.second, ps, remap_raw, pm.get());
+    }
+    if (pm)
+      m->pools[poolid] = pm;
+    else
+      m->pools[poolid] = q->second;
+  }
+  return m;
+}
+
 // mapping
 int OSDMap::object_locator_to_pg(
 	const object_t& oid,
@@ -1702,6 +1838,10 @@ void OSDMap::pg_to_raw_up(pg_t pg, vector<int> *up, int *primary) const
 void OSDMap::_pg_to_up_acting_osds(const pg_t& pg, vector<int> *up, int *up_primary,
                                    vector<int> *acting, int *acting_primary) const
 {
+  ceph::shared_ptr<const PGMapping> m = _get_pg_mapping();
+  if (m && m->get(pg, up, up_primary, acting, acting_primary))
+    return;
+
   const pg_pool_t *pool = get_pg_pool(pg.pool());
   if (!pool) {
     if (up)
@@ -1744,6 +1884,178 @@ void OSDMap::_pg_to_up_acting_osds(const pg_t& pg, vector<int> *up, int *up_prim
     *acting_primary = _acting_primary;
 }
 
+int OSDMap::pool_to_raw_osds(int64_t poolid, PoolRawMapping *m,
+			     unsigned nthreads) const
+{
+  const pg_pool_t *pool = get_pg_pool(poolid);
+  if (!pool)
+    return -ENOENT;
+  unsigned pg_num = pool->get_pg_num();
+  unsigned size = pool->get_size();
+  m->size = size;
+  m->osds.assign((size_t)pg_num * size, CRUSH_ITEM_NONE);
+  m->lens.assign(pg_num, 0);
+  m->primaries.assign(pg_num, -1);
+
+  int ruleno = crush->find_rule(pool->get_crush_ruleset(), pool->get_type(),
+				size);
+  if (ruleno < 0)
+    return 0;
+  vector<int> pps(pg_num);
+  for (unsigned ps = 0; ps < pg_num; ++ps)
+    pps[ps] = pool->raw_pg_to_pps(pg_t(ps, poolid));
+  vector<int> out, lens;
+  crush->do_rule_batch(ruleno, pps, size, osd_weight, &out, &lens, nthreads);
+
+  vector<int> osds;
+  for (unsigned ps = 0; ps < pg_num; ++ps) {
+    const int *row = &out[(size_t)ps * size];
+    osds.assign(row, row + std::max(lens[ps], 0));
+    _remove_nonexistent_osds(*pool, osds);
+    int32_t *dst = &m->osds[(size_t)ps * size];
+    for (unsigned i = 0; i < osds.size(); ++i) {
+      dst[i] = osds[i];
+      if (m->primaries[ps] < 0 && osds[i] != CRUSH_ITEM_NONE)
+	m->primaries[ps] = osds[i];
+    }
+    m->lens[ps] = osds.size();
+  }
+  return 0;
+}
+
+void OSDMap::pg_raw_to_up_acting_osds(pg_t pg, const vector<int>& raw,
+				      int raw_primary,
+				      vector<int> *up, int *up_primary,
+				      vector<int> *acting,
+				      int *acting_primary) const
+{
+  const pg_pool_t *pool = get_pg_pool(pg.pool());
+  if (!pool) {
+    up->clear();
+    *up_primary = -1;
+    acting->clear();
+    *acting_primary = -1;
+    return;
+  }
+  _get_temp_osds(*pool, pg, acting, acting_primary);
+  *up_primary = raw_primary;
+  _raw_to_up_osds(*pool, raw, up, up_primary);
+  _apply_primary_affinity(pool->raw_pg_to_pps(pg), *pool, up, up_primary);
+  if (acting->empty()) {
+    *acting = *up;
+    if (*acting_primary == -1)
+      *acting_primary = *up_primary;
+  }
+}
+
+bool OSDMap::PGMapping::get(const pg_t& pg, vector<int> *up, int *up_primary,
+			    vector<int> *acting, int *acting_primary) const
+{
+  auto p = pools.find(pg.pool());
+  if (p == pools.end() || pg.preferred() >= 0)
+    return false;
+  const Pool& m = *p->second;
+  ps_t ps = pg.ps();
+  if (ps >= m.up_len.size())
+    return false;
+
+  const int32_t *row = &m.up[(size_t)ps * m.raw.size];
+  auto a = m.acting.find(ps);
+  if (up)
+    up->assign(row, row + m.up_len[ps]);
+  if (up_primary)
+    *up_primary = m.up_primary[ps];
+  if (acting) {
+    if (a != m.acting.end())
+      *acting = a->second.first;
+    else
+      acting->assign(row, row + m.up_len[ps]);
+  }
+  if (acting_primary)
+    *acting_primary = a != m.acting.end() ? a->second.second : m.up_primary[ps];
+  return true;
+}
+
+void OSDMap::_map_pg(int64_t poolid, const pg_pool_t& pool, ps_t ps,
+		     bool remap_raw, PGMapping::Pool *m) const
+{
+  pg_t pg(ps, poolid);
+  vector<int> raw, up, acting;
+  int raw_primary, up_primary, acting_primary;
+  if (remap_raw) {
+    _pg_to_raw_osds(pool, pg, &raw, &raw_primary, NULL);
+    m->raw.set(ps, raw, raw_primary);
+  } else {
+    m->raw.get(ps, &raw, &raw_primary);
+  }
+  pg_raw_to_up_acting_osds(pg, raw, raw_primary, &up, &up_primary,
+			   &acting, &acting_primary);
+
+  int32_t *row = &m->up[(size_t)ps * m->raw.size];
+  std::copy(up.begin(), up.end(), row);
+  std::fill(row + up.size(), row + m->raw.size, CRUSH_ITEM_NONE);
+  m->up_len[ps] = up.size();
+  m->up_primary[ps] = up_primary;
+  if (acting != up || acting_primary != up_primary)
+    m->acting[ps] = make_pair(acting, acting_primary);
+  else
+    m->acting.erase(ps);
+}
+
+void OSDMap::_build_pool_mapping(int64_t poolid, const pg_pool_t& pool,
+				 unsigned nthreads,
+				 PGMapping::Pool *m) const
+{
+  pool_to_raw_osds(poolid, &m->raw, nthreads);
+  unsigned n = m->raw.get_num_pgs();
+  m->up.assign((size_t)n * m->raw.size, CRUSH_ITEM_NONE);
+  m->up_len.assign(n, 0);
+  m->up_primary.assign(n, -1);
+  m->acting.clear();
+  for (ps_t ps = 0; ps < n; ++ps)
+    _map_pg(poolid, pool, ps, false, m);
+}
+
+ceph::shared_ptr<const OSDMap::PGMapping> OSDMap::_build_pg_mapping(
+  unsigned nthreads) const
+{
+  ceph::shared_ptr<PGMapping> m = std::make_shared<PGMapping>();
+  m->epoch = epoch;
+  for (auto& p : pools) {
+    auto pm = std::make_shared<PGMapping::Pool>();
+    _build_pool_mapping(p.first, p.second, nthreads, pm.get());
+    m->pools[p.first] = pm;
+  }
+  return m;
+}
+
+ceph::shared_ptr<const OSDMap::PGMapping> OSDMap::_get_pg_mapping() const
+{
+  std::lock_guard<std::mutex> l(pg_mapping.lock);
+  if (!pg_mapping.nthreads)
+    return ceph::shared_ptr<const PGMapping>();
+  if (!pg_mapping.mapping || pg_mapping.mapping->epoch != epoch)
+    pg_mapping.mapping = _build_pg_mapping(pg_mapping.nthreads);
+  return pg_mapping.mapping;
+}
+
+void OSDMap::set_pg_mapping_threads(unsigned nthreads)
+{
+  std::lock_guard<std::mutex> l(pg_mapping.lock);
+  pg_mapping.nthreads = nthreads;
+  if (!nthreads)
+    pg_mapping.mapping.reset();
+}
+
+void OSDMap::inherit_pg_mapping(const OSDMap& prev)
+{
+  assert(prev.get_epoch() == epoch);
+  ceph::shared_ptr<const PGMapping> m = prev._get_pg_mapping();
+  std::lock_guard<std::mutex> l(pg_mapping.lock);
+  if (pg_mapping.nthreads && m)
+    pg_mapping.mapping = m;
+}
+
 int OSDMap::calc_pg_rank(int osd, const vector<int>& acting, int nrep)
 {
   if (!nrep)
@@ -2106,6 +2418,8 @@ void OSDMap::decode_classic(bufferlist::iterator& p)
 
 void OSDMap::decode(bufferlist::iterator& bl)
 {
+  pg_mapping.reset();
+
   /**
    * Older encodings of the OSDMap had a single struct_v which
    * covered the whole encoding, and was prior to our modern
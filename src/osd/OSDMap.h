@@ -33,6 +33,7 @@
 #include <list>
 #include <set>
 #include <map>
+#include <mutex>
 #include "include/memory.h"
 using namespace std;
 
@@ -246,6 +247,43 @@ private:
   mutable bool crc_defined;
   mutable uint32_t crc;
 
+  struct PGMapping;
+  /// precomputed pg mapping, if enabled; see set_pg_mapping_threads()
+  struct pg_mapping_ref_t {
+    mutable std::mutex lock;
+    unsigned nthreads = 0;  ///< threads to build with; 0 if disabled
+    ceph::shared_ptr<const PGMapping> mapping;
+
+    pg_mapping_ref_t() {}
+    pg_mapping_ref_t(const pg_mapping_ref_t& o) {
+      *this = o;
+    }
+    pg_mapping_ref_t& operator=(const pg_mapping_ref_t& o) {
+      if (this != &o) {
+	std::unique_lock<std::mutex> l(o.lock);
+	unsigned n = o.nthreads;
+	auto m = o.mapping;
+	l.unlock();
+	std::lock_guard<std::mutex> l2(lock);
+	nthreads = n;
+	mapping = m;
+      }
+      return *this;
+    }
+    ceph::shared_ptr<const PGMapping> take() {
+      std::lock_guard<std::mutex> l(lock);
+      ceph::shared_ptr<const PGMapping> m;
+      m.swap(mapping);
+      return m;
+    }
+    void reset(ceph::shared_ptr<const PGMapping> m =
+	       ceph::shared_ptr<const PGMapping>()) {
+      std::lock_guard<std::mutex> l(lock);
+      mapping = m;
+    }
+  };
+  mutable pg_mapping_ref_t pg_mapping;
+
   void _calc_up_osd_features();
 
  public:
@@ -361,10 +399,12 @@ public:
   void set_state(int o, unsigned s) {
     assert(o < max_osd);
     osd_state[o] = s;
+    pg_mapping.reset();
   }
   void set_weight(int o, unsigned w) {
     assert(o < max_osd);
     osd_weight[o] = w;
+    pg_mapping.reset();
     if (w)
       osd_state[o] |= CEPH_OSD_EXISTS;
   }
@@ -383,6 +423,7 @@ public:
       osd_primary_affinity.reset(new vector<__u32>(max_osd,
 						   CEPH_OSD_DEFAULT_PRIMARY_AFFINITY));
     (*osd_primary_affinity)[o] = w;
+    pg_mapping.reset();
   }
   unsigned get_primary_affinity(int o) const {
     assert(o < max_osd);
@@ -685,6 +726,112 @@ public:
     int up_primary, acting_primary;
     pg_to_up_acting_osds(pg, &up, &up_primary, &acting, &acting_primary);
   }
+
+  /**
+   * raw CRUSH mapping of every PG in a pool, as a flat table
+   *
+   * Row ps holds the raw osds of pg ps (as pg_to_raw_osds would return
+   * them) in its first lens[ps] entries; the rest of the row is padded
+   * with CRUSH_ITEM_NONE.
+   */
+  struct PoolRawMapping {
+    unsigned size = 0;          ///< entries per row (pool size)
+    vector<int32_t> osds;       ///< pg_num rows of size entries
+    vector<uint8_t> lens;       ///< number of raw osds of each pg
+    vector<int32_t> primaries;  ///< raw primary of each pg, or -1
+
+    unsigned get_num_pgs() const {
+      return lens.size();
+    }
+    void get(ps_t ps, vector<int> *raw, int *primary) const {
+      const int32_t *row = &osds[(size_t)ps * size];
+      raw->assign(row, row + lens[ps]);
+      *primary = primaries[ps];
+    }
+    void set(ps_t ps, const vector<int>& raw, int primary) {
+      assert(raw.size() <= size);
+      int32_t *row = &osds[(size_t)ps * size];
+      std::copy(raw.begin(), raw.end(), row);
+      std::fill(row + raw.size(), row + size, CRUSH_ITEM_NONE);
+      lens[ps] = raw.size();
+      primaries[ps] = primary;
+    }
+  };
+  /**
+   * map all PGs of a pool in one pass
+   *
+   * Much cheaper than calling pg_to_raw_osds for each PG as the CRUSH
+   * workspace is set up only once per thread.  With nthreads > 1 the
+   * PGs are split across that many threads.
+   * @return 0, or -ENOENT if the pool does not exist
+   */
+  int pool_to_raw_osds(int64_t pool, PoolRawMapping *m,
+		       unsigned nthreads = 1) const;
+  /**
+   * the up and acting sets of a PG whose raw mapping is already known
+   * (e.g. from pool_to_raw_osds); the same as pg_to_up_acting_osds
+   * otherwise.  Each of the out pointers must be non-NULL.
+   */
+  void pg_raw_to_up_acting_osds(pg_t pg, const vector<int>& raw,
+				int raw_primary,
+				vector<int> *up, int *up_primary,
+				vector<int> *acting,
+				int *acting_primary) const;
+
+private:
+  /**
+   * raw, up and acting mapping of every pg in the map
+   *
+   * Immutable once built.  apply_incremental() derives the next epoch's
+   * mapping from this one, sharing the pools whose pgs are not affected.
+   */
+  struct PGMapping {
+    struct Pool {
+      PoolRawMapping raw;
+      vector<int32_t> up;          ///< rows of raw.size entries
+      vector<uint8_t> up_len;
+      vector<int32_t> up_primary;
+      /// acting set and primary of pgs where they differ from up
+      map<ps_t, pair<vector<int>, int> > acting;
+    };
+    epoch_t epoch = 0;
+    map<int64_t, ceph::shared_ptr<const Pool> > pools;
+
+    bool get(const pg_t& pg, vector<int> *up, int *up_primary,
+	     vector<int> *acting, int *acting_primary) const;
+  };
+
+  ceph::shared_ptr<const PGMapping> _get_pg_mapping() const;
+  ceph::shared_ptr<const PGMapping> _build_pg_mapping(unsigned nthreads) const;
+  void _build_pool_mapping(int64_t poolid, const pg_pool_t& pool,
+			   unsigned nthreads, PGMapping::Pool *m) const;
+  void _map_pg(int64_t poolid, const pg_pool_t& pool, ps_t ps, bool remap_raw,
+	       PGMapping::Pool *m) const;
+  bool _get_remapped(const Incremental& inc, set<int64_t> *remap_pools,
+		     set<int> *remap_osds, set<int> *reup_osds) const;
+  ceph::shared_ptr<const PGMapping> _update_pg_mapping(
+    const PGMapping& prev, const Incremental& inc,
+    const set<int64_t>& remap_pools, const set<int>& remap_osds,
+    const set<int>& reup_osds) const;
+
+public:
+  /**
+   * keep a precomputed mapping of every pg
+   *
+   * The mapping is computed (split across nthreads threads) the first time
+   * a pg is looked up, and apply_incremental() then only recomputes the
+   * pgs the incremental affects.  A map with the mapping enabled must
+   * only be changed through apply_incremental() and decode(); changes
+   * made through crush or get_pools() are not noticed.
+   * @param nthreads threads to compute the mapping with, 0 to disable
+   */
+  void set_pg_mapping_threads(unsigned nthreads);
+  /**
+   * start from prev's pg mapping (computing it if need be), prev being
+   * the same epoch as this map.  Used when a map is decoded from scratch
+   * only to have the next incremental applied to it.
+   */
+  void inherit_pg_mapping(const OSDMap& prev);
   bool pg_is_ec(pg_t pg) const {
     map<int64_t, pg_pool_t>::const_iterator i = pools.find(pg.pool());
     assert(i != pools.end());
@@ -3979,6 +3979,23 @@ void PG::scrub(epoch_t queued, ThreadPool::TPHandle &handle)
     lock();
     dout(20) << __func__ << " slept for " << t << dendl;
   }
+  if (scrubber.state == PG::Scrubber::NEW_CHUNK ||
+      scrubber.state == PG::Scrubber::INACTIVE) {
+    // pay off what deep scrubs on this osd have read over
+    // osd_deep_scrub_max_bytes_per_sec before starting another chunk
+    double wait = osd->get_scrub_io_wait();
+    if (wait > 0) {
+      dout(20) << __func__ << " over deep scrub budget, sleeping " << wait
+	       << dendl;
+      unlock();
+      utime_t t;
+      t.set_from_double(wait);
+      handle.suspend_tp_timeout();
+      t.sleep();
+      handle.reset_tp_timeout();
+      lock();
+    }
+  }
   if (pg_has_reset_since(queued)) {
     return;
   }
@@ -259,6 +259,9 @@ typedef ceph::shared_ptr<const OSDMap> OSDMapRef;
 
      virtual PerfCounters *get_logger() = 0;
 
+     /// Charge bytes read by deep scrub against the OSD-wide budget
+     virtual void scrub_io_charge(uint64_t bytes) = 0;
+
      virtual ceph_tid_t get_tid() = 0;
 
      virtual LogClientTemp clog_error() = 0;
@@ -449,6 +449,9 @@ public:
   }
 
   PerfCounters *get_logger() override;
+  void scrub_io_charge(uint64_t bytes) override {
+    osd->scrub_io_charge(bytes);
+  }
 
   ceph_tid_t get_tid() override { return osd->get_tid(); }
 
@@ -746,20 +746,29 @@ void ReplicatedBackend::be_deep_scrub(
   bufferlist bl, hdrbl;
   int r;
   __u64 pos = 0;
+  uint64_t stride = cct->_conf->osd_deep_scrub_stride;
+  bool checksum_only = cct->_conf->osd_deep_scrub_checksum_only;
+  uint32_t crc = seed;
 
   uint32_t fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL | CEPH_OSD_OP_FLAG_FADVISE_DONTNEED;
 
   while (true) {
     handle.reset_tp_timeout();
-    r = store->read(
-	  ch,
-	  ghobject_t(
-	    poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-	  pos,
-	  cct->_conf->osd_deep_scrub_stride, bl,
-	  fadvise_flags, true);
+    ghobject_t goid(
+      poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard);
+    if (checksum_only) {
+      // same crc32c as hashing the data, without handing it back to us
+      r = store->scrub_crc32c(ch, goid, pos, stride, &crc, fadvise_flags);
+      if (r <= 0)
+	break;
+      get_parent()->scrub_io_charge(r);
+      pos += r;
+      continue;
+    }
+    r = store->read(ch, goid, pos, stride, bl, fadvise_flags, true);
     if (r <= 0)
       break;
+    get_parent()->scrub_io_charge(r);
 
     h << bl;
     pos += bl.length();
@@ -771,7 +780,7 @@ void ReplicatedBackend::be_deep_scrub(
     o.read_error = true;
     return;
   }
-  o.digest = h.digest();
+  o.digest = checksum_only ? crc : h.digest();
   o.digest_present = true;
 
   bl.clear();
@@ -0,0 +1,154 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSD_MCLOCK_OP_CLASS_QUEUE_H
+#define CEPH_OSD_MCLOCK_OP_CLASS_QUEUE_H
+
+#include <ostream>
+
+#include "common/config.h"
+#include "common/mClockPriorityQueue.h"
+
+/// classes of work the OSD op queue schedules against each other
+enum class osd_op_type_t {
+  client_op,
+  osd_subop,
+  bg_snaptrim,
+  bg_recovery,
+  bg_scrub,
+};
+
+inline std::ostream& operator<<(std::ostream& out, const osd_op_type_t& t)
+{
+  switch (t) {
+  case osd_op_type_t::client_op: return out << "client_op";
+  case osd_op_type_t::osd_subop: return out << "osd_subop";
+  case osd_op_type_t::bg_snaptrim: return out << "bg_snaptrim";
+  case osd_op_type_t::bg_recovery: return out << "bg_recovery";
+  case osd_op_type_t::bg_scrub: return out << "bg_scrub";
+  }
+  return out << "unknown";
+}
+
+/**
+ * OpQueue scheduling OSD work by op class with mClock
+ *
+ * Rather than by client, items are tagged by the class of work they
+ * represent (see osd_op_type_t), each with the reservation, weight and
+ * limit from the osd_op_queue_mclock_* options, so that e.g. recovery
+ * and scrub are guaranteed some throughput without starving client I/O.
+ * The original class K is kept with each item for remove_by_class.
+ */
+template <typename T, typename K>
+class mClockOpClassQueue : public OpQueue<T, K>
+{
+public:
+  typedef std::function<osd_op_type_t(const T&)> OpTypeFunc;
+
+private:
+  typedef std::pair<K, T> Request;
+
+  mClockClientInfo client_op_info;
+  mClockClientInfo osd_subop_info;
+  mClockClientInfo snaptrim_info;
+  mClockClientInfo recovery_info;
+  mClockClientInfo scrub_info;
+
+  OpTypeFunc get_op_type;
+  mClockQueue<Request, osd_op_type_t> queue;
+
+  mClockClientInfo get_info(const osd_op_type_t& t) const {
+    switch (t) {
+    case osd_op_type_t::client_op: return client_op_info;
+    case osd_op_type_t::osd_subop: return osd_subop_info;
+    case osd_op_type_t::bg_snaptrim: return snaptrim_info;
+    case osd_op_type_t::bg_recovery: return recovery_info;
+    case osd_op_type_t::bg_scrub: return scrub_info;
+    }
+    assert(0 == "unknown op type");
+    return mClockClientInfo();
+  }
+
+public:
+  mClockOpClassQueue(CephContext *cct, OpTypeFunc op_type_f)
+    : client_op_info(cct->_conf->osd_op_queue_mclock_client_op_res,
+		     cct->_conf->osd_op_queue_mclock_client_op_wgt,
+		     cct->_conf->osd_op_queue_mclock_client_op_lim),
+      osd_subop_info(cct->_conf->osd_op_queue_mclock_osd_subop_res,
+		     cct->_conf->osd_op_queue_mclock_osd_subop_wgt,
+		     cct->_conf->osd_op_queue_mclock_osd_subop_lim),
+      snaptrim_info(cct->_conf->osd_op_queue_mclock_snap_res,
+		    cct->_conf->osd_op_queue_mclock_snap_wgt,
+		    cct->_conf->osd_op_queue_mclock_snap_lim),
+      recovery_info(cct->_conf->osd_op_queue_mclock_recov_res,
+		    cct->_conf->osd_op_queue_mclock_recov_wgt,
+		    cct->_conf->osd_op_queue_mclock_recov_lim),
+      scrub_info(cct->_conf->osd_op_queue_mclock_scrub_res,
+		 cct->_conf->osd_op_queue_mclock_scrub_wgt,
+		 cct->_conf->osd_op_queue_mclock_scrub_lim),
+      get_op_type(op_type_f),
+      queue(std::bind(&mClockOpClassQueue::get_info, this,
+		      std::placeholders::_1)) {}
+
+  unsigned length() const override final {
+    return queue.length();
+  }
+
+  void remove_by_filter(std::function<bool (T)> f) override final {
+    queue.remove_by_filter([&f](Request r) {
+	return f(r.second);
+      });
+  }
+
+  void remove_by_class(K cl, std::list<T> *out) override final {
+    queue.remove_by_filter([&cl, out](Request r) {
+	if (r.first == cl) {
+	  if (out) {
+	    out->push_back(r.second);
+	  }
+	  return true;
+	}
+	return false;
+      });
+  }
+
+  void enqueue_strict(K cl, unsigned priority, T item) override final {
+    queue.enqueue_strict(get_op_type(item), priority, Request(cl, item));
+  }
+
+  void enqueue_strict_front(K cl, unsigned priority, T item) override final {
+    queue.enqueue_strict_front(get_op_type(item), priority, Request(cl, item));
+  }
+
+  void enqueue(K cl, unsigned priority, unsigned cost, T item) override final {
+    queue.enqueue(get_op_type(item), priority, cost, Request(cl, item));
+  }
+
+  void enqueue_front(K cl, unsigned priority, unsigned cost,
+		     T item) override final {
+    queue.enqueue_front(get_op_type(item), priority, cost, Request(cl, item));
+  }
+
+  bool empty() const override final {
+    return queue.empty();
+  }
+
+  T dequeue() override final {
+    return queue.dequeue().second;
+  }
+
+  void dump(ceph::Formatter *f) const override final {
+    queue.dump(f);
+  }
+};
+
+#endif
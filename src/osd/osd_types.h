@@ -5081,6 +5081,14 @@ struct store_statfs_t
   void reset() {
     *this = store_statfs_t();
   }
+  /// accumulate usage (not capacity) from o
+  void add(const store_statfs_t& o) {
+    allocated += o.allocated;
+    stored += o.stored;
+    compressed += o.compressed;
+    compressed_allocated += o.compressed_allocated;
+    compressed_original += o.compressed_original;
+  }
   bool operator ==(const store_statfs_t& other) const;
   void dump(Formatter *f) const;
 };
@@ -238,6 +238,8 @@ void Objecter::init()
 {
   assert(!initialized.read());
 
+  osdmap->set_pg_mapping_threads(cct->_conf->osd_map_pg_mapping_threads);
+
   if (!logger) {
     PerfCountersBuilder pcb(cct, "objecter", l_osdc_first, l_osdc_last);
 
@@ -399,6 +401,7 @@ void Objecter::start(const OSDMap* o)
   start_tick();
   if (o) {
     osdmap->deepish_copy_from(*o);
+    osdmap->set_pg_mapping_threads(cct->_conf->osd_map_pg_mapping_threads);
   } else if (osdmap->get_epoch() == 0) {
     _maybe_request_map();
   }
@@ -411,6 +414,7 @@ void Objecter::shutdown()
   unique_lock wl(rwlock);
 
   initialized.set(0);
+  _invalidate_submit_state();
 
   cct->_conf->remove_observer(this);
 
@@ -1164,6 +1168,9 @@ void Objecter::handle_osd_map(MOSDMap *m)
 		  << m->get_first() << "," << m->get_last()
 		  << "] > " << osdmap->get_epoch() << dendl;
 
+    // before we scan the sessions' ops; see SubmitState
+    _invalidate_submit_state();
+
     if (osdmap->get_epoch()) {
       bool skipped_map = false;
       // we want incrementals
@@ -1686,6 +1693,8 @@ int Objecter::_get_session(int osd, OSDSession **session, shunique_lock& sul)
   if (!sul.owns_lock()) {
     return -EAGAIN;
   }
+  // publish it with the next SubmitState
+  _invalidate_submit_state();
   OSDSession *s = new OSDSession(cct, osd);
   osd_sessions[osd] = s;
   s->con = messenger->get_connection(osdmap->get_inst(osd));
@@ -1739,6 +1748,7 @@ void Objecter::close_session(OSDSession *s)
   // rwlock is locked unique
 
   ldout(cct, 10) << "close_session for osd." << s->osd << dendl;
+  _invalidate_submit_state();
   if (s->con) {
     s->con->mark_down();
     logger->inc(l_osdc_osd_session_close);
@@ -2156,7 +2166,8 @@ void Objecter::resend_mon_ops()
 
 void Objecter::op_submit(Op *op, ceph_tid_t *ptid, int *ctx_budget)
 {
-  shunique_lock rl(rwlock, ceph::acquire_shared);
+  // rwlock is only taken if _op_submit_fast() can't submit op
+  shunique_lock rl(rwlock, std::defer_lock);
   ceph_tid_t tid = 0;
   if (!ptid)
     ptid = &tid;
@@ -2184,18 +2195,149 @@ void Objecter::_op_submit_with_budget(Op *op, shunique_lock& sul,
     }
   }
 
-  if (osd_timeout > timespan(0)) {
-    if (op->tid == 0)
-      op->tid = last_tid.inc();
-    auto tid = op->tid;
-    op->ontimeout = timer.add_event(osd_timeout,
-				    [this, tid]() {
-				      op_cancel(tid, -ETIMEDOUT); });
+  if (!sul) {
+    if (_op_submit_fast(op, ptid))
+      return;
+    sul.lock_shared();
+    _publish_submit_state();
   }
-
   _op_submit(op, sul, ptid);
 }
 
+Objecter::SubmitState::~SubmitState()
+{
+  for (auto& p : sessions) {
+    p.second->put();
+  }
+}
+
+void Objecter::_invalidate_submit_state()
+{
+  // rwlock is locked unique
+  submit_gen = 0;
+  std::atomic_store(&submit_state, std::shared_ptr<const SubmitState>());
+}
+
+void Objecter::_publish_submit_state()
+{
+  // rwlock is locked
+  if (submit_gen || !osdmap->get_epoch() || !initialized.read() ||
+      !cct->_conf->objecter_fast_submit)
+    return;
+
+  std::lock_guard<std::mutex> l(submit_state_lock);
+  if (submit_gen)
+    return;
+  if (!osdmap_copy || osdmap_copy->get_epoch() != osdmap->get_epoch()) {
+    OSDMap *m = new OSDMap;
+    m->deepish_copy_from(*osdmap);
+    osdmap_copy.reset(m);
+  }
+  auto st = std::make_shared<SubmitState>(++last_submit_gen, osdmap_copy);
+  for (auto& p : osd_sessions) {
+    p.second->get();
+    st->sessions.insert(p);
+  }
+  ldout(cct, 10) << __func__ << " gen " << st->gen << " epoch "
+		 << osdmap_copy->get_epoch() << " " << st->sessions.size()
+		 << " sessions" << dendl;
+  std::atomic_store(&submit_state, std::shared_ptr<const SubmitState>(st));
+  submit_gen = st->gen;
+}
+
+Objecter::OSDSession *Objecter::_get_published_session(int osd)
+{
+  if (!submit_gen || !cct->_conf->objecter_fast_submit)
+    return nullptr;
+  auto st = std::atomic_load(&submit_state);
+  if (!st)
+    return nullptr;
+  auto p = st->sessions.find(osd);
+  if (p == st->sessions.end())
+    return nullptr;
+  get_session(p->second);
+  return p->second;
+}
+
+/**
+ * submit op without rwlock, through the published SubmitState
+ *
+ * Ops which are paused, homeless or in a pool we don't know of, or
+ * which go to an osd we have no session with yet, are left to
+ * _op_submit().
+ *
+ * @return true if op was submitted, false if it must go through
+ *         _op_submit() (op->target may have been updated)
+ */
+bool Objecter::_op_submit_fast(Op *op, ceph_tid_t *ptid)
+{
+  if (!submit_gen || !cct->_conf->objecter_fast_submit)
+    return false;
+  auto st = std::atomic_load(&submit_state);
+  if (!st)
+    return false;
+
+  const OSDMap &map = *st->osdmap;
+  if (_calc_target(map, &op->target) == RECALC_OP_TARGET_POOL_DNE ||
+      op->target.osd < 0 ||
+      target_should_be_paused(map, &op->target))
+    return false;
+  auto p = st->sessions.find(op->target.osd);
+  if (p == st->sessions.end())
+    return false;
+  OSDSession *s = p->second;
+
+  OSDSession::unique_lock sl(s->lock);
+  if (submit_gen != st->gen) {
+    // raced with a map or session change; it may already have scanned
+    // this session
+    ldout(cct, 10) << __func__ << " gen " << st->gen << " is stale"
+		   << dendl;
+    return false;
+  }
+
+  _send_op_account(op);
+  MOSDOp *m = _prepare_osd_op(op, map.get_epoch());
+  if (op->tid == 0)
+    op->tid = last_tid.inc();
+
+  ldout(cct, 10) << __func__ << " oid " << op->target.base_oid
+		 << " '" << op->target.base_oloc << "' '"
+		 << op->target.target_oloc << "' " << op->ops << " tid "
+		 << op->tid << " osd." << s->osd << " gen " << st->gen
+		 << dendl;
+
+  _session_op_assign(s, op);
+  _op_arm_timeout(op);
+  _send_op(op, m);
+
+  // op may be freed by the reply once we drop the session lock
+  *ptid = op->tid;
+  sl.unlock();
+
+  ldout(cct, 5) << num_in_flight.read() << " in flight" << dendl;
+  return true;
+}
+
+/**
+ * arm osd_timeout for a newly submitted op
+ *
+ * Only once op is in its session's ops, so that a timeout which fires
+ * right away, e.g. while _op_submit() waits for the rwlock behind
+ * handle_osd_map(), finds the op to cancel.  Before _send_op(), which
+ * only posts an rx buffer for ops without a timeout.
+ */
+void Objecter::_op_arm_timeout(Op *op)
+{
+  // op->session->lock is locked
+  if (osd_timeout <= timespan(0))
+    return;
+  auto tid = op->tid;
+  op->ontimeout = timer.add_event(osd_timeout,
+				  [this, tid]() {
+				    op_cancel(tid, -ETIMEDOUT); });
+}
+
 void Objecter::_send_op_account(Op *op)
 {
   inflight_ops.inc();
@@ -2363,6 +2505,7 @@ void Objecter::_op_submit(Op *op, shunique_lock& sul, ceph_tid_t *ptid)
 		 << dendl;
 
   _session_op_assign(s, op);
+  _op_arm_timeout(op);
 
   if (need_send) {
     _send_op(op, m);
@@ -2541,14 +2684,20 @@ bool Objecter::is_pg_changed(
 
 bool Objecter::target_should_be_paused(op_target_t *t)
 {
-  const pg_pool_t *pi = osdmap->get_pg_pool(t->base_oloc.pool);
-  bool pauserd = osdmap->test_flag(CEPH_OSDMAP_PAUSERD);
-  bool pausewr = osdmap->test_flag(CEPH_OSDMAP_PAUSEWR) ||
-    _osdmap_full_flag() || _osdmap_pool_full(*pi);
+  return target_should_be_paused(*osdmap, t);
+}
+
+bool Objecter::target_should_be_paused(const OSDMap &map, op_target_t *t)
+{
+  const pg_pool_t *pi = map.get_pg_pool(t->base_oloc.pool);
+  bool pauserd = map.test_flag(CEPH_OSDMAP_PAUSERD);
+  bool pausewr = map.test_flag(CEPH_OSDMAP_PAUSEWR) ||
+    (map.test_flag(CEPH_OSDMAP_FULL) && honor_osdmap_full) ||
+    _osdmap_pool_full(*pi);
 
   return (t->flags & CEPH_OSD_FLAG_READ && pauserd) ||
     (t->flags & CEPH_OSD_FLAG_WRITE && pausewr) ||
-    (osdmap->get_epoch() < epoch_barrier);
+    (map.get_epoch() < epoch_barrier);
 }
 
 /**
@@ -2645,11 +2794,16 @@ int64_t Objecter::get_object_pg_hash_position(int64_t pool, const string& key,
 int Objecter::_calc_target(op_target_t *t, bool any_change)
 {
   // rwlock is locked
+  return _calc_target(*osdmap, t, any_change);
+}
 
+int Objecter::_calc_target(const OSDMap &map, op_target_t *t, bool any_change)
+{
+  // map is osdmap (rwlock is locked) or a published copy of it
   bool is_read = t->flags & CEPH_OSD_FLAG_READ;
   bool is_write = t->flags & CEPH_OSD_FLAG_WRITE;
 
-  const pg_pool_t *pi = osdmap->get_pg_pool(t->base_oloc.pool);
+  const pg_pool_t *pi = map.get_pg_pool(t->base_oloc.pool);
   if (!pi) {
     t->osd = -1;
     return RECALC_OP_TARGET_POOL_DNE;
@@ -2657,7 +2811,7 @@ int Objecter::_calc_target(op_target_t *t, bool any_change)
 
   bool force_resend = false;
   bool need_check_tiering = false;
-  if (osdmap->get_epoch() == pi->last_force_op_resend) {
+  if (map.get_epoch() == pi->last_force_op_resend) {
     if (t->last_force_resend < pi->last_force_op_resend) {
       t->last_force_resend = pi->last_force_op_resend;
       force_resend = true;
@@ -2686,22 +2840,22 @@ int Objecter::_calc_target(op_target_t *t, bool any_change)
   if (t->precalc_pgid) {
     assert(t->base_oid.name.empty()); // make sure this is a listing op
     ldout(cct, 10) << __func__ << " have " << t->base_pgid << " pool "
-		   << osdmap->have_pg_pool(t->base_pgid.pool()) << dendl;
-    if (!osdmap->have_pg_pool(t->base_pgid.pool())) {
+		   << map.have_pg_pool(t->base_pgid.pool()) << dendl;
+    if (!map.have_pg_pool(t->base_pgid.pool())) {
       t->osd = -1;
       return RECALC_OP_TARGET_POOL_DNE;
     }
-    if (osdmap->test_flag(CEPH_OSDMAP_SORTBITWISE)) {
+    if (map.test_flag(CEPH_OSDMAP_SORTBITWISE)) {
       // if the SORTBITWISE flag is set, we know all OSDs are running
       // jewel+.
       pgid = t->base_pgid;
     } else {
       // legacy behavior.  pre-jewel OSDs will fail if we send a
       // full-hash pgid value.
-      pgid = osdmap->raw_pg_to_pg(t->base_pgid);
+      pgid = map.raw_pg_to_pg(t->base_pgid);
     }
   } else {
-    int ret = osdmap->object_locator_to_pg(t->target_oid, t->target_oloc,
+    int ret = map.object_locator_to_pg(t->target_oid, t->target_oloc,
 					   pgid);
     if (ret == -ENOENT) {
       t->osd = -1;
@@ -2714,9 +2868,9 @@ int Objecter::_calc_target(op_target_t *t, bool any_change)
   unsigned pg_num = pi->get_pg_num();
   int up_primary, acting_primary;
   vector<int> up, acting;
-  osdmap->pg_to_up_acting_osds(pgid, &up, &up_primary,
+  map.pg_to_up_acting_osds(pgid, &up, &up_primary,
 			       &acting, &acting_primary);
-  bool sort_bitwise = osdmap->test_flag(CEPH_OSDMAP_SORTBITWISE);
+  bool sort_bitwise = map.test_flag(CEPH_OSDMAP_SORTBITWISE);
   unsigned prev_seed = ceph_stable_mod(pgid.ps(), t->pg_num, t->pg_num_mask);
   if (any_change && pg_interval_t::is_new_interval(
 	t->acting_primary,
@@ -2741,7 +2895,7 @@ int Objecter::_calc_target(op_target_t *t, bool any_change)
 
   bool need_resend = false;
 
-  bool paused = target_should_be_paused(t);
+  bool paused = target_should_be_paused(map, t);
   if (!paused && paused != t->paused) {
     t->paused = false;
     need_resend = true;
@@ -2784,7 +2938,7 @@ int Objecter::_calc_target(op_target_t *t, bool any_change)
 	int best = -1;
 	int best_locality = 0;
 	for (unsigned i = 0; i < acting.size(); ++i) {
-	  int locality = osdmap->crush->get_common_ancestor_distance(
+	  int locality = map.crush->get_common_ancestor_distance(
 		 cct, acting[i], crush_location);
 	  ldout(cct, 20) << __func__ << " localize: rank " << i
 			 << " osd." << acting[i]
@@ -3008,7 +3162,11 @@ void Objecter::finish_op(OSDSession *session, ceph_tid_t tid)
 MOSDOp *Objecter::_prepare_osd_op(Op *op)
 {
   // rwlock is locked
+  return _prepare_osd_op(op, osdmap->get_epoch());
+}
 
+MOSDOp *Objecter::_prepare_osd_op(Op *op, epoch_t epoch)
+{
   int flags = op->target.flags;
   flags |= CEPH_OSD_FLAG_KNOWN_REDIR;
   if (op->onfinish)
@@ -3023,7 +3181,7 @@ MOSDOp *Objecter::_prepare_osd_op(Op *op)
   MOSDOp *m = new MOSDOp(client_inc.read(), op->tid,
 			 op->target.target_oid, op->target.target_oloc,
 			 op->target.pgid,
-			 osdmap->get_epoch(),
+			 epoch,
 			 flags, op->features);
 
   m->set_snapid(op->snapid);
@@ -3054,7 +3212,7 @@ MOSDOp *Objecter::_prepare_osd_op(Op *op)
 
 void Objecter::_send_op(Op *op, MOSDOp *m)
 {
-  // rwlock is locked
+  // rwlock is locked, unless m is given (see _op_submit_fast)
   // op->session->lock is locked
 
   if (!m) {
@@ -3114,25 +3272,29 @@ void Objecter::_throttle_op(Op *op,
 			    shunique_lock& sul,
 			    int op_budget)
 {
-  assert(sul && sul.mutex() == &rwlock);
+  // rwlock may not be locked (see op_submit)
+  assert(sul.mutex() == &rwlock);
+  bool locked = bool(sul);
   bool locked_for_write = sul.owns_lock();
 
   if (!op_budget)
     op_budget = calc_op_budget(op);
   if (!op_throttle_bytes.get_or_fail(op_budget)) { //couldn't take right now
-    sul.unlock();
+    if (locked)
+      sul.unlock();
     op_throttle_bytes.get(op_budget);
     if (locked_for_write)
       sul.lock();
-    else
+    else if (locked)
       sul.lock_shared();
   }
   if (!op_throttle_ops.get_or_fail(1)) { //couldn't take right now
-    sul.unlock();
+    if (locked)
+      sul.unlock();
     op_throttle_ops.get(1);
     if (locked_for_write)
       sul.lock();
-    else
+    else if (locked)
       sul.lock_shared();
   }
 }
@@ -3153,29 +3315,53 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 {
   ldout(cct, 10) << "in handle_osd_op_reply" << dendl;
 
+  // try without rwlock first
+  shunique_lock sul(rwlock, std::defer_lock);
+  if (!_handle_osd_op_reply(m, sul)) {
+    sul.lock_shared();
+    bool handled = _handle_osd_op_reply(m, sul);
+    assert(handled);
+  }
+}
+
+/**
+ * @return false, having done nothing, if rwlock isn't locked and we
+ *         need it
+ */
+bool Objecter::_handle_osd_op_reply(MOSDOpReply *m, shunique_lock& sul)
+{
   // get pio
   ceph_tid_t tid = m->get_tid();
 
   int osd_num = (int)m->get_source().num();
 
-  shunique_lock sul(rwlock, ceph::acquire_shared);
-  if (!initialized.read()) {
-    m->put();
-    return;
-  }
+  OSDSession *s = NULL;
+  if (!sul) {
+    // resubmitting the op needs rwlock
+    if (m->is_redirect_reply() || retry_writes_after_first_reply)
+      return false;
+    s = _get_published_session(osd_num);
+    if (!s)
+      return false;
+  } else {
+    if (!initialized.read()) {
+      m->put();
+      return true;
+    }
 
-  map<int, OSDSession *>::iterator siter = osd_sessions.find(osd_num);
-  if (siter == osd_sessions.end()) {
-    ldout(cct, 7) << "handle_osd_op_reply " << tid
-		  << (m->is_ondisk() ? " ondisk":(m->is_onnvram() ?
-						  " onnvram":" ack"))
-		  << " ... unknown osd" << dendl;
-    m->put();
-    return;
-  }
+    map<int, OSDSession *>::iterator siter = osd_sessions.find(osd_num);
+    if (siter == osd_sessions.end()) {
+      ldout(cct, 7) << "handle_osd_op_reply " << tid
+		    << (m->is_ondisk() ? " ondisk":(m->is_onnvram() ?
+						    " onnvram":" ack"))
+		    << " ... unknown osd" << dendl;
+      m->put();
+      return true;
+    }
 
-  OSDSession *s = siter->second;
-  get_session(s);
+    s = siter->second;
+    get_session(s);
+  }
 
   OSDSession::unique_lock sl(s->lock);
 
@@ -3188,7 +3374,7 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     sl.unlock();
     put_session(s);
     m->put();
-    return;
+    return true;
   }
 
   ldout(cct, 7) << "handle_osd_op_reply " << tid
@@ -3213,7 +3399,7 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 
     _op_submit(op, sul, NULL);
     m->put();
-    return;
+    return true;
   }
 
   if (m->get_retry_attempt() >= 0) {
@@ -3226,7 +3412,7 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
       m->put();
       sl.unlock();
       put_session(s);
-      return;
+      return true;
     }
   } else {
     // we don't know the request attempt because the server is old, so
@@ -3254,10 +3440,16 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     op->target.flags |= CEPH_OSD_FLAG_REDIRECTED;
     _op_submit(op, sul, NULL);
     m->put();
-    return;
+    return true;
   }
 
   if (rc == -EAGAIN) {
+    if (!sul) {
+      // _send_op() needs rwlock
+      sl.unlock();
+      put_session(s);
+      return false;
+    }
     ldout(cct, 7) << " got -EAGAIN, resubmitting" << dendl;
 
     // new tid
@@ -3268,10 +3460,11 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     sl.unlock();
     put_session(s);
     m->put();
-    return;
+    return true;
   }
 
-  sul.unlock();
+  if (sul)
+    sul.unlock();
 
   if (op->objver)
     *op->objver = m->get_user_version();
@@ -3355,6 +3548,7 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
 
   m->put();
   put_session(s);
+  return true;
 }
 
 
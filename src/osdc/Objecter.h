@@ -15,6 +15,7 @@
 #ifndef CEPH_OBJECTER_H
 #define CEPH_OBJECTER_H
 
+#include <atomic>
 #include <condition_variable>
 #include <list>
 #include <map>
@@ -1143,7 +1144,7 @@ private:
   atomic_t num_in_flight;
   atomic_t global_op_flags; // flags which are applied to each IO op
   bool keep_balanced_budget;
-  bool honor_osdmap_full;
+  std::atomic<bool> honor_osdmap_full;
 
 public:
   void maybe_request_map();
@@ -1808,6 +1809,37 @@ public:
   };
   map<int,OSDSession*> osd_sessions;
 
+  /**
+   * what op_submit needs to target and send an op without rwlock: an
+   * immutable copy of the osdmap and the open sessions.
+   *
+   * Anything changing the map or closing sessions (with rwlock held
+   * unique) invalidates it before looking at the sessions' ops, and the
+   * next op submitted with rwlock held publishes a new one.  An op
+   * submitted through it is only assigned to its session if, with the
+   * session locked, it is still current; see _op_submit_fast().
+   */
+  struct SubmitState {
+    const uint64_t gen;
+    const std::shared_ptr<const OSDMap> osdmap;
+    map<int,OSDSession*> sessions;  ///< each holds a ref
+    SubmitState(uint64_t g, std::shared_ptr<const OSDMap> m)
+      : gen(g), osdmap(m) {}
+    ~SubmitState();
+  };
+  /// only accessed through std::atomic_load/std::atomic_store
+  std::shared_ptr<const SubmitState> submit_state;
+  /// gen of submit_state, 0 while invalid
+  std::atomic<uint64_t> submit_gen = {0};
+  std::mutex submit_state_lock;  ///< serializes publishing
+  uint64_t last_submit_gen = 0;  ///< submit_state_lock
+  std::shared_ptr<const OSDMap> osdmap_copy;  ///< submit_state_lock
+
+  void _invalidate_submit_state();
+  void _publish_submit_state();
+  OSDSession *_get_published_session(int osd);
+  bool _op_submit_fast(Op *op, ceph_tid_t *ptid);
+
   bool osdmap_full_flag() const;
   bool osdmap_pool_full(const int64_t pool_id) const;
 
@@ -1846,8 +1878,10 @@ public:
   ceph::timespan osd_timeout;
 
   MOSDOp *_prepare_osd_op(Op *op);
+  MOSDOp *_prepare_osd_op(Op *op, epoch_t epoch);
   void _send_op(Op *op, MOSDOp *m = NULL);
   void _send_op_account(Op *op);
+  void _op_arm_timeout(Op *op);
   void _cancel_linger_op(Op *op);
   void finish_op(OSDSession *session, ceph_tid_t tid);
   void _finish_op(Op *op, int r);
@@ -1868,8 +1902,11 @@ public:
   bool _osdmap_has_pool_full() const;
 
   bool target_should_be_paused(op_target_t *op);
+  bool target_should_be_paused(const OSDMap &map, op_target_t *op);
   int _calc_target(op_target_t *t,
 		   bool any_change = false);
+  int _calc_target(const OSDMap &map, op_target_t *t,
+		   bool any_change = false);
   int _map_session(op_target_t *op, OSDSession **s,
 		   shunique_lock& lc);
 
@@ -1937,7 +1974,7 @@ private:
   int calc_op_budget(Op *op);
   void _throttle_op(Op *op, shunique_lock& sul, int op_size = 0);
   int _take_op_budget(Op *op, shunique_lock& sul) {
-    assert(sul && sul.mutex() == &rwlock);
+    assert(sul.mutex() == &rwlock);
     int op_budget = calc_op_budget(op);
     if (keep_balanced_budget) {
       _throttle_op(op, sul, op_budget);
@@ -2074,6 +2111,9 @@ private:
   }
 
   void handle_osd_op_reply(class MOSDOpReply *m);
+private:
+  bool _handle_osd_op_reply(class MOSDOpReply *m, shunique_lock& sul);
+public:
   void handle_watch_notify(class MWatchNotify *m);
   void handle_osd_map(class MOSDMap *m);
   void wait_for_osd_map();
@@ -2962,7 +3002,7 @@ public:
   void blacklist_self(bool set);
 
 private:
-  epoch_t epoch_barrier;
+  std::atomic<epoch_t> epoch_barrier;
   bool retry_writes_after_first_reply;
 public:
   void set_epoch_barrier(epoch_t epoch);
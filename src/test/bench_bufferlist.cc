@@ -0,0 +1,120 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * bufferptr/bufferlist allocation microbenchmark.
+ *
+ * Each thread repeatedly builds a small message-like bufferlist (a
+ * header plus a data buffer of the given size), or allocates buffers on
+ * one thread and frees them on another as messenger and OSD threads do.
+ * Run with CEPH_BUFFER_NO_SLAB=1 to compare against the plain allocator.
+ *
+ *   ceph_bench_bufferlist [threads] [iterations] [size...]
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "include/buffer.h"
+
+using namespace std::chrono;
+
+static uint64_t build(unsigned iterations, unsigned size)
+{
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < iterations; ++i) {
+    bufferlist bl;
+    bl.append(buffer::create(128));
+    bl.append(buffer::create_page_aligned(size));
+    bl.append("footer", 6);
+    sum += bl.length();
+  }
+  return sum;
+}
+
+static void bench_local(unsigned threads, unsigned iterations, unsigned size)
+{
+  std::atomic<uint64_t> sum = {0};
+  auto t0 = high_resolution_clock::now();
+  std::vector<std::thread> ts;
+  for (unsigned i = 0; i < threads; ++i) {
+    ts.emplace_back([&] { sum += build(iterations, size); });
+  }
+  for (auto& t : ts) {
+    t.join();
+  }
+  auto us = duration_cast<microseconds>(high_resolution_clock::now() - t0).count();
+  uint64_t ops = (uint64_t)threads * iterations;
+  std::cout << "local size " << size << ": " << ops << " in " << us << "us ("
+	    << (ops * 1000000ull / (us + 1)) << " ops/s) checksum " << sum
+	    << std::endl;
+}
+
+static void bench_handoff(unsigned threads, unsigned iterations, unsigned size)
+{
+  // each producer hands its buffers to a consumer thread which frees them
+  auto t0 = high_resolution_clock::now();
+  std::vector<std::thread> ts;
+  for (unsigned i = 0; i < threads; ++i) {
+    ts.emplace_back([=] {
+	std::mutex lock;
+	std::deque<bufferptr> q;
+	bool done = false;
+	std::thread consumer([&] {
+	    while (true) {
+	      std::deque<bufferptr> got;
+	      {
+		std::lock_guard<std::mutex> l(lock);
+		got.swap(q);
+		if (got.empty() && done)
+		  break;
+	      }
+	      got.clear();
+	    }
+	  });
+	for (unsigned j = 0; j < iterations; ++j) {
+	  bufferptr bp(buffer::create_page_aligned(size));
+	  std::lock_guard<std::mutex> l(lock);
+	  q.push_back(std::move(bp));
+	}
+	{
+	  std::lock_guard<std::mutex> l(lock);
+	  done = true;
+	}
+	consumer.join();
+      });
+  }
+  for (auto& t : ts) {
+    t.join();
+  }
+  auto us = duration_cast<microseconds>(high_resolution_clock::now() - t0).count();
+  uint64_t ops = (uint64_t)threads * iterations;
+  std::cout << "handoff size " << size << ": " << ops << " in " << us << "us ("
+	    << (ops * 1000000ull / (us + 1)) << " ops/s)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned threads = argc > 1 ? atoi(argv[1]) : 4;
+  unsigned iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+  std::vector<unsigned> sizes;
+  for (int i = 3; i < argc; ++i) {
+    sizes.push_back(atoi(argv[i]));
+  }
+  if (sizes.empty()) {
+    sizes = { 4096, 8192, 65536, 12288 };
+  }
+
+  std::cout << threads << " threads, " << iterations << " iterations"
+	    << (getenv("CEPH_BUFFER_NO_SLAB") ? ", no slab cache" : "")
+	    << std::endl;
+  for (auto size : sizes) {
+    bench_local(threads, iterations, size);
+    bench_handoff(threads, iterations, size);
+  }
+  return 0;
+}
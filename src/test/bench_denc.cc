@@ -0,0 +1,158 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Encoding microbenchmark.
+ *
+ * Times encode+decode round trips of hot OSD structures, both through
+ * the legacy element-by-element encode()/decode() and through denc
+ * (which copies vectors of integers in bulk).
+ * Structures which only have a legacy encoding (pg_log_entry_t,
+ * object_info_t) are timed as a baseline.
+ *
+ *   ceph_bench_denc [iterations]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <functional>
+
+#include "include/denc.h"
+#include "os/bluestore/bluestore_types.h"
+#include "osd/osd_types.h"
+
+using namespace std::chrono;
+
+static void bench(const char *name, unsigned iterations,
+		  std::function<void(bufferlist&)> enc,
+		  std::function<void(bufferlist&)> dec)
+{
+  uint64_t bytes = 0;
+  auto t0 = high_resolution_clock::now();
+  for (unsigned i = 0; i < iterations; ++i) {
+    bufferlist bl;
+    enc(bl);
+    bytes += bl.length();
+    dec(bl);
+  }
+  auto ns = duration_cast<nanoseconds>(high_resolution_clock::now() - t0).count();
+  std::cout << name << ": " << (ns / iterations) << " ns/op, "
+	    << (bytes * 1000 / (ns + 1)) << " MB/s" << std::endl;
+}
+
+// the pre-denc encoding of a container: a count, then each element
+template<typename T>
+static void legacy_encode(const std::vector<T>& v, bufferlist& bl)
+{
+  ::encode((uint32_t)v.size(), bl);
+  for (auto& e : v) {
+    ::encode(e, bl);
+  }
+}
+
+template<typename K, typename V>
+static void legacy_encode(const std::map<K,V>& m, bufferlist& bl)
+{
+  ::encode((uint32_t)m.size(), bl);
+  for (auto& e : m) {
+    ::encode(e.first, bl);
+    ::encode(e.second, bl);
+  }
+}
+
+template<typename T>
+static void legacy_decode(std::vector<T>& v, bufferlist& bl)
+{
+  auto p = bl.begin();
+  uint32_t n;
+  ::decode(n, p);
+  v.resize(n);
+  for (auto& e : v) {
+    ::decode(e, p);
+  }
+}
+
+template<typename K, typename V>
+static void legacy_decode(std::map<K,V>& m, bufferlist& bl)
+{
+  auto p = bl.begin();
+  uint32_t n;
+  ::decode(n, p);
+  m.clear();
+  while (n--) {
+    K k;
+    ::decode(k, p);
+    ::decode(m[k], p);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  unsigned iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+  {
+    std::vector<uint64_t> v(512), out;
+    for (unsigned i = 0; i < v.size(); ++i) {
+      v[i] = i * 4096;
+    }
+    bench("vector<uint64_t> legacy", iterations,
+	  [&](bufferlist& bl) { legacy_encode(v, bl); },
+	  [&](bufferlist& bl) { legacy_decode(out, bl); });
+    bench("vector<uint64_t> denc", iterations,
+	  [&](bufferlist& bl) { ::encode(v, bl); },
+	  [&](bufferlist& bl) { ::decode(out, bl); });
+  }
+
+  {
+    // what interval_set<uint64_t> encodes
+    std::map<uint64_t,uint64_t> m, out;
+    for (unsigned i = 0; i < 128; ++i) {
+      m[i * 65536] = 4096;
+    }
+    bench("map<uint64_t,uint64_t> legacy", iterations,
+	  [&](bufferlist& bl) { legacy_encode(m, bl); },
+	  [&](bufferlist& bl) { legacy_decode(out, bl); });
+    bench("map<uint64_t,uint64_t> denc", iterations,
+	  [&](bufferlist& bl) { ::encode(m, bl); },
+	  [&](bufferlist& bl) { ::decode(out, bl); });
+  }
+
+  {
+    std::vector<bluestore_pextent_t> v, out;
+    for (unsigned i = 0; i < 64; ++i) {
+      v.push_back(bluestore_pextent_t(i * 0x100000, 0x10000));
+    }
+    bench("vector<bluestore_pextent_t> denc", iterations,
+	  [&](bufferlist& bl) { ::encode(v, bl); },
+	  [&](bufferlist& bl) { ::decode(out, bl); });
+  }
+
+  {
+    list<pg_log_entry_t*> o;
+    pg_log_entry_t::generate_test_instances(o);
+    pg_log_entry_t& e = *o.back();
+    pg_log_entry_t out;
+    bench("pg_log_entry_t legacy", iterations,
+	  [&](bufferlist& bl) { e.encode_with_checksum(bl); },
+	  [&](bufferlist& bl) {
+	    auto p = bl.begin();
+	    out.decode_with_checksum(p);
+	  });
+    for (auto p : o) {
+      delete p;
+    }
+  }
+
+  {
+    list<object_info_t*> o;
+    object_info_t::generate_test_instances(o);
+    object_info_t& oi = *o.back();
+    object_info_t out;
+    bench("object_info_t legacy", iterations,
+	  [&](bufferlist& bl) { ::encode(oi, bl, CEPH_FEATURES_SUPPORTED_DEFAULT); },
+	  [&](bufferlist& bl) { ::decode(out, bl); });
+    for (auto p : o) {
+      delete p;
+    }
+  }
+  return 0;
+}
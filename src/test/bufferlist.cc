@@ -23,6 +23,7 @@
 #include <limits.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <thread>
 
 #include "include/buffer.h"
 #include "include/utime.h"
@@ -246,6 +247,30 @@ TEST(BufferRaw, ostream) {
   EXPECT_GT(stream.str().size(), stream.str().find("len 1 nref 1)"));
 }
 
+TEST(BufferRaw, slab) {
+  if (get_env_bool("CEPH_BUFFER_NO_SLAB"))
+    return;
+  // run in a new thread so that we start with an empty slab cache
+  std::thread([] {
+      char *p;
+      {
+	bufferptr bp(buffer::create_page_aligned(4096));
+	p = bp.c_str();
+      }
+      // a freed buffer of a cached size is reused by its thread...
+      bufferptr bp(buffer::create(4096));
+      EXPECT_EQ(p, bp.c_str());
+      EXPECT_EQ(0u, (uintptr_t)bp.c_str() & ~CEPH_PAGE_MASK);
+      // ...also when another thread freed it
+      std::thread([&bp] { bp = bufferptr(); }).join();
+      bufferptr bp2(buffer::create(4096));
+      EXPECT_EQ(p, bp2.c_str());
+      // other sizes are not cached
+      bufferptr bp3(buffer::create(4000));
+      EXPECT_NE(p, bp3.c_str());
+    }).join();
+}
+
 #ifdef CEPH_HAVE_SPLICE
 class TestRawPipe : public ::testing::Test {
 protected:
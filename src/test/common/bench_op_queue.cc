@@ -0,0 +1,108 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * OpQueue microbenchmark.
+ *
+ * Pushes the same randomized stream of ops (mixed priorities, costs and
+ * classes) through each OpQueue implementation, keeping a fixed number
+ * of ops queued as the OSD's sharded op queue does under load, and
+ * reports enqueue+dequeue throughput.
+ *
+ *   ceph_bench_op_queue [ops] [classes] [depth]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "include/assert.h"
+#include "common/PrioritizedQueue.h"
+#include "common/WeightedPriorityQueue.h"
+#include "common/mClockPriorityQueue.h"
+
+struct Op {
+  unsigned klass;
+  unsigned priority;
+  unsigned cost;
+  bool strict;
+};
+
+typedef OpQueue<Op, unsigned> Queue;
+
+static void bench(const char *name, Queue *q, const std::vector<Op>& ops,
+		  unsigned depth)
+{
+  using namespace std::chrono;
+  auto push = [q](const Op& op) {
+    if (op.strict) {
+      q->enqueue_strict(op.klass, op.priority, op);
+    } else {
+      q->enqueue(op.klass, op.priority, op.cost, op);
+    }
+  };
+
+  auto t0 = high_resolution_clock::now();
+  size_t i = 0;
+  for (; i < depth && i < ops.size(); ++i) {
+    push(ops[i]);
+  }
+  uint64_t sum = 0;
+  for (; i < ops.size(); ++i) {
+    sum += q->dequeue().cost;
+    push(ops[i]);
+  }
+  while (!q->empty()) {
+    sum += q->dequeue().cost;
+  }
+  auto t1 = high_resolution_clock::now();
+
+  auto us = duration_cast<microseconds>(t1 - t0).count();
+  std::cout << name << ": " << ops.size() << " ops in " << us << "us ("
+	    << (ops.size() * 1000000ull / (us + 1)) << " ops/s)"
+	    << " checksum " << sum << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned num_ops = argc > 1 ? atoi(argv[1]) : 1000000;
+  unsigned classes = argc > 2 ? atoi(argv[2]) : 100;
+  unsigned depth = argc > 3 ? atoi(argv[3]) : 1000;
+
+  std::mt19937 rng(0);
+  std::vector<Op> ops(num_ops);
+  for (auto& op : ops) {
+    op.klass = rng() % classes;
+    // mostly client ops (63), some recovery (3) and scrub (5) and a few
+    // high priority (>= 196) ops for the strict queue
+    unsigned r = rng() % 100;
+    op.priority = r < 80 ? 63 : (r < 90 ? 3 : (r < 98 ? 5 : 196));
+    op.strict = op.priority >= 196;
+    op.cost = 4096 << (rng() % 10);
+  }
+
+  std::cout << num_ops << " ops, " << classes << " classes, "
+	    << depth << " queued" << std::endl;
+  {
+    std::unique_ptr<Queue> q(
+      new PrioritizedQueue<Op, unsigned>(4194304, 65536));
+    bench("prio", q.get(), ops, depth);
+  }
+  {
+    std::unique_ptr<Queue> q(
+      new WeightedPriorityQueue<Op, unsigned>(4194304, 65536));
+    bench("wpq", q.get(), ops, depth);
+  }
+  {
+    // give every class a reservation, weight and limit so all three
+    // mClock phases are exercised
+    std::unique_ptr<Queue> q(
+      new mClockQueue<Op, unsigned>([](const unsigned& k) {
+	  return mClockClientInfo(100.0 * (k % 4), 1.0 + k % 10,
+				  k % 3 ? 0.0 : 100000.0);
+	}));
+    bench("mclock", q.get(), ops, depth);
+  }
+  return 0;
+}
@@ -265,3 +265,76 @@ TEST(Crc32c, RangeNull) {
     ASSERT_EQ(crc, *check);
   }
 }
+
+TEST(Crc32c, Shift) {
+  unsigned len = 65536;
+  unsigned char *a = (unsigned char *)malloc(len);
+  for (unsigned i = 0; i < len; i++)
+    a[i] = rand();
+  unsigned lens[] = { 1, 3, 512, 4096, 65536 };
+  for (unsigned l : lens) {
+    struct ceph_crc32c_shift s;
+    ceph_crc32c_shift_init(&s, l);
+    uint32_t seeds[] = { 0, 1, 0xffffffff, 0x12345678 };
+    for (uint32_t seed : seeds) {
+      ASSERT_EQ(ceph_crc32c(seed, NULL, l), ceph_crc32c_shift_apply(&s, seed));
+      // the crc of a block with seed, from its crc with -1
+      uint32_t stored = ceph_crc32c(-1, a, l);
+      ASSERT_EQ(ceph_crc32c(seed, a, l),
+		stored ^ ceph_crc32c_shift_apply(&s, seed ^ 0xffffffff));
+    }
+  }
+  free(a);
+}
+
+TEST(Crc32c, Multi) {
+  unsigned len = 1024 * 1024 + 37;
+  unsigned char *a = (unsigned char *)malloc(len);
+  for (unsigned i = 0; i < len; i++)
+    a[i] = rand();
+  // interleaved lanes plus leftover blocks, with and without a partial
+  // final word in each block
+  unsigned block_lens[] = { 1, 7, 8, 24, 512, 4096, 4099, 65536 };
+  for (unsigned block_len : block_lens) {
+    unsigned blocks = std::min(len / block_len, 1027u);
+    vector<uint32_t> out(blocks);
+    ceph_crc32c_multi(-1, a, block_len, blocks, &out[0]);
+    for (unsigned i = 0; i < blocks; i++) {
+      ASSERT_EQ(ceph_crc32c_sctp(-1, a + i * block_len, block_len), out[i])
+	<< "block_len " << block_len << " block " << i;
+    }
+    ceph_crc32c_multi(1234, a + 3, block_len, blocks, &out[0]);
+    for (unsigned i = 0; i < blocks; i++) {
+      ASSERT_EQ(ceph_crc32c_sctp(1234, a + 3 + i * block_len, block_len),
+		out[i]);
+    }
+  }
+  free(a);
+}
+
+TEST(Crc32c, MultiPerformance) {
+  unsigned len = 256 * 1024 * 1024;
+  unsigned block_len = 4096;
+  unsigned blocks = len / block_len;
+  unsigned char *a = (unsigned char *)malloc(len);
+  for (unsigned i = 0; i < len; i++)
+    a[i] = i & 0xff;
+  vector<uint32_t> out(blocks);
+  {
+    utime_t start = ceph_clock_now();
+    for (unsigned i = 0; i < blocks; i++)
+      out[i] = ceph_crc32c(-1, a + i * block_len, block_len);
+    utime_t end = ceph_clock_now();
+    float rate = (float)len / (float)(1024*1024) / (float)(end - start);
+    std::cout << "4K blocks, one at a time = " << rate << " MB/sec"
+	      << std::endl;
+  }
+  {
+    utime_t start = ceph_clock_now();
+    ceph_crc32c_multi(-1, a, block_len, blocks, &out[0]);
+    utime_t end = ceph_clock_now();
+    float rate = (float)len / (float)(1024*1024) / (float)(end - start);
+    std::cout << "4K blocks, multi = " << rate << " MB/sec" << std::endl;
+  }
+  free(a);
+}
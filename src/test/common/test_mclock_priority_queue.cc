@@ -0,0 +1,174 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+#include "common/Formatter.h"
+#include "common/mClockPriorityQueue.h"
+
+#include <list>
+#include <map>
+#include <sstream>
+
+struct Request {
+  int value;
+  explicit Request(int v = 0) : value(v) {}
+};
+
+class MClockQueueTest : public testing::Test {
+protected:
+  typedef unsigned Client;
+  typedef mClockQueue<Request, Client> Queue;
+
+  std::map<Client, mClockClientInfo> infos;
+
+  Queue::ClientInfoFunc info_f() {
+    return [this](const Client& c) {
+      auto i = infos.find(c);
+      return i == infos.end() ? mClockClientInfo() : i->second;
+    };
+  }
+};
+
+TEST_F(MClockQueueTest, Empty) {
+  Queue q(info_f());
+  ASSERT_TRUE(q.empty());
+  ASSERT_EQ(0u, q.length());
+  q.enqueue(1, 0, 0, Request(1));
+  ASSERT_FALSE(q.empty());
+  ASSERT_EQ(1u, q.length());
+  ASSERT_EQ(1, q.dequeue().value);
+  ASSERT_TRUE(q.empty());
+}
+
+TEST_F(MClockQueueTest, FifoPerClient) {
+  Queue q(info_f());
+  for (int i = 0; i < 10; ++i) {
+    q.enqueue(1, 0, 0, Request(i));
+  }
+  q.enqueue_front(1, 0, 0, Request(-1));
+  ASSERT_EQ(11u, q.length());
+  for (int i = -1; i < 10; ++i) {
+    ASSERT_EQ(i, q.dequeue().value);
+  }
+  ASSERT_TRUE(q.empty());
+}
+
+TEST_F(MClockQueueTest, StrictFirst) {
+  Queue q(info_f());
+  q.enqueue(1, 0, 0, Request(1));
+  q.enqueue_strict(2, 10, Request(2));
+  q.enqueue_strict(2, 20, Request(3));
+  q.enqueue_strict_front(2, 20, Request(4));
+  ASSERT_EQ(4u, q.length());
+  ASSERT_EQ(4, q.dequeue().value);
+  ASSERT_EQ(3, q.dequeue().value);
+  ASSERT_EQ(2, q.dequeue().value);
+  ASSERT_EQ(1, q.dequeue().value);
+  ASSERT_TRUE(q.empty());
+}
+
+TEST_F(MClockQueueTest, Weight) {
+  infos[1] = mClockClientInfo(0.0, 2.0, 0.0);
+  infos[2] = mClockClientInfo(0.0, 1.0, 0.0);
+  Queue q(info_f());
+  for (int i = 0; i < 300; ++i) {
+    q.enqueue(1, 0, 0, Request(1));
+    q.enqueue(2, 0, 0, Request(2));
+  }
+  unsigned counts[3] = {0, 0, 0};
+  for (int i = 0; i < 150; ++i) {
+    ++counts[q.dequeue().value];
+  }
+  ASSERT_NEAR(100u, counts[1], 2u);
+  ASSERT_NEAR(50u, counts[2], 2u);
+  ASSERT_EQ(450u, q.length());
+}
+
+TEST_F(MClockQueueTest, Reservation) {
+  // a reserved client is served ahead of a much heavier one as long as
+  // its reservation is not met
+  infos[1] = mClockClientInfo(1e9, 1.0, 0.0);
+  infos[2] = mClockClientInfo(0.0, 1000.0, 0.0);
+  Queue q(info_f());
+  for (int i = 0; i < 100; ++i) {
+    q.enqueue(2, 0, 0, Request(2));
+  }
+  for (int i = 0; i < 100; ++i) {
+    q.enqueue(1, 0, 0, Request(1));
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(1, q.dequeue().value);
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(2, q.dequeue().value);
+  }
+}
+
+TEST_F(MClockQueueTest, Limit) {
+  // a client over its limit only runs when nothing else can
+  infos[1] = mClockClientInfo(0.0, 1.0, 0.0);
+  infos[2] = mClockClientInfo(0.0, 1000.0, 0.001);
+  Queue q(info_f());
+  for (int i = 0; i < 100; ++i) {
+    q.enqueue(2, 0, 0, Request(2));
+    q.enqueue(1, 0, 0, Request(1));
+  }
+  unsigned counts[3] = {0, 0, 0};
+  for (int i = 0; i < 100; ++i) {
+    ++counts[q.dequeue().value];
+  }
+  ASSERT_GE(1u, counts[2]);
+  while (!q.empty()) {
+    ++counts[q.dequeue().value];
+  }
+  ASSERT_EQ(100u, counts[1]);
+  ASSERT_EQ(100u, counts[2]);
+}
+
+TEST_F(MClockQueueTest, RemoveByClass) {
+  Queue q(info_f());
+  for (int i = 0; i < 10; ++i) {
+    q.enqueue(i % 3, 0, 0, Request(i));
+    q.enqueue_strict(i % 3, 100, Request(i));
+  }
+  std::list<Request> removed;
+  q.remove_by_class(1, &removed);
+  ASSERT_EQ(6u, removed.size());
+  ASSERT_EQ(14u, q.length());
+  for (auto& r : removed) {
+    ASSERT_EQ(1, r.value % 3);
+  }
+  q.remove_by_class(5, &removed);
+  ASSERT_EQ(6u, removed.size());
+  while (!q.empty()) {
+    ASSERT_NE(1, q.dequeue().value % 3);
+  }
+}
+
+TEST_F(MClockQueueTest, RemoveByFilter) {
+  Queue q(info_f());
+  for (int i = 0; i < 100; ++i) {
+    q.enqueue(i % 7, 0, 0, Request(i));
+    q.enqueue_strict(i % 7, 100, Request(i));
+  }
+  q.remove_by_filter([](Request r) {
+      return r.value % 2 == 0;
+    });
+  ASSERT_EQ(100u, q.length());
+  while (!q.empty()) {
+    ASSERT_EQ(1, q.dequeue().value % 2);
+  }
+}
+
+TEST_F(MClockQueueTest, Dump) {
+  Queue q(info_f());
+  q.enqueue(1, 0, 0, Request(1));
+  q.enqueue_strict(1, 10, Request(2));
+  JSONFormatter f;
+  f.open_object_section("queue");
+  q.dump(&f);
+  f.close_section();
+  std::stringstream ss;
+  f.flush(ss);
+  ASSERT_NE(std::string::npos, ss.str().find("num_clients"));
+}
@@ -0,0 +1,181 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Compressor microbenchmark.
+ *
+ * Compresses and decompresses blobs of the sizes BlueStore writes with
+ * each compression plugin, with and without a trained dictionary where
+ * the plugin supports one, and reports the compression ratio and
+ * throughput.  The data is a stream of small, similar JSON records, or
+ * the contents of a file.
+ *
+ *   ceph_bench_compressor [--file path] [--iterations n]
+ *                         [--plugins a,b,...] [--sizes n,n,...]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "common/ceph_argparse.h"
+#include "common/config.h"
+#include "compressor/Compressor.h"
+#include "global/global_context.h"
+#include "global/global_init.h"
+
+using namespace std::chrono;
+
+static bufferlist make_records(size_t len, unsigned seed)
+{
+  bufferlist bl;
+  unsigned i = seed;
+  while (bl.length() < len) {
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+	     "{\"bucket\": \"logs-%u\", \"key\": \"obj-%u\", "
+	     "\"size\": %u, \"etag\": \"%08x\"}\n",
+	     i % 7, i, (i * 131) % 65536, i * 2654435761u);
+    bl.append(buf);
+    ++i;
+  }
+  bufferlist out;
+  out.substr_of(bl, 0, len);
+  return out;
+}
+
+static bufferlist slice(const bufferlist& data, size_t len, size_t i)
+{
+  size_t n = data.length() / len;
+  bufferlist bl;
+  bl.substr_of(data, (i % n) * len, len);
+  bl.rebuild();
+  return bl;
+}
+
+static void bench(CompressorRef c, const char *mode,
+		  Compressor::DictionaryRef dict, const bufferlist& data,
+		  size_t size, unsigned iterations)
+{
+  uint64_t in = 0, out = 0;
+  nanoseconds ctime(0), dtime(0);
+  for (unsigned i = 0; i < iterations; ++i) {
+    bufferlist orig = slice(data, size, i);
+    bufferlist compressed, decompressed;
+    auto t0 = high_resolution_clock::now();
+    int r = dict ? c->compress_with_dict(orig, compressed, *dict) :
+      c->compress(orig, compressed);
+    auto t1 = high_resolution_clock::now();
+    assert(r == 0);
+    bufferlist::iterator p = compressed.begin();
+    r = dict ? c->decompress_with_dict(p, compressed.length(), decompressed,
+				       *dict) :
+      c->decompress(p, compressed.length(), decompressed);
+    auto t2 = high_resolution_clock::now();
+    assert(r == 0);
+    assert(decompressed.length() == orig.length());
+    ctime += duration_cast<nanoseconds>(t1 - t0);
+    dtime += duration_cast<nanoseconds>(t2 - t1);
+    in += orig.length();
+    out += compressed.length();
+  }
+  std::cout << c->get_type_name() << " " << mode << " " << size << ": ratio "
+	    << (double)out / in << ", compress "
+	    << (in * 1000 / (ctime.count() + 1)) << " MB/s, decompress "
+	    << (in * 1000 / (dtime.count() + 1)) << " MB/s" << std::endl;
+}
+
+static vector<string> split(const string& s)
+{
+  vector<string> ret;
+  std::stringstream ss(s);
+  string i;
+  while (std::getline(ss, i, ',')) {
+    ret.push_back(i);
+  }
+  return ret;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  string file;
+  unsigned iterations = 1000;
+  vector<string> plugins = { "snappy", "zlib", "zstd", "lz4" };
+  vector<size_t> sizes = { 16384, 32768, 65536, 131072, 524288 };
+  string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_witharg(args, i, &val, "--file", (char*)NULL)) {
+      file = val;
+    } else if (ceph_argparse_witharg(args, i, &val, "--iterations",
+				     (char*)NULL)) {
+      iterations = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--plugins",
+				     (char*)NULL)) {
+      plugins = split(val);
+    } else if (ceph_argparse_witharg(args, i, &val, "--sizes", (char*)NULL)) {
+      sizes.clear();
+      for (auto& s : split(val)) {
+	sizes.push_back(atoi(s.c_str()));
+      }
+    } else {
+      cerr << "unrecognized argument " << *i << std::endl;
+      return 1;
+    }
+  }
+
+  size_t max_size = 0;
+  for (auto s : sizes) {
+    max_size = MAX(max_size, s);
+  }
+  bufferlist data;
+  if (file.length()) {
+    string err;
+    if (data.read_file(file.c_str(), &err) < 0) {
+      cerr << "unable to read " << file << ": " << err << std::endl;
+      return 1;
+    }
+    if (data.length() < max_size) {
+      cerr << file << " is smaller than " << max_size << " bytes" << std::endl;
+      return 1;
+    }
+  } else {
+    data = make_records(max_size * 64, 0);
+  }
+  // train dictionaries on other data than they are used on, where we can
+  std::vector<bufferlist> samples;
+  for (unsigned i = 0; i < 128; ++i) {
+    if (file.length()) {
+      samples.push_back(slice(data, 16384, i * 7 + 1));
+    } else {
+      samples.push_back(make_records(16384, 1000000 + i * 1000));
+    }
+  }
+
+  for (auto& plugin : plugins) {
+    CompressorRef c = Compressor::create(g_ceph_context, plugin);
+    if (!c) {
+      cerr << "unable to load " << plugin << ", skipping" << std::endl;
+      continue;
+    }
+    Compressor::DictionaryRef dict;
+    bufferlist raw;
+    if (c->train_dictionary(samples, 65536, &raw) == 0) {
+      dict = c->load_dictionary(raw);
+    }
+    for (auto size : sizes) {
+      bench(c, "plain", Compressor::DictionaryRef(), data, size, iterations);
+      if (dict) {
+	bench(c, "dict", dict, data, size, iterations);
+      }
+    }
+  }
+  return 0;
+}
@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include "gtest/gtest.h"
+#include "acconfig.h"
 #include "common/config.h"
 #include "compressor/Compressor.h"
 #include "compressor/CompressionPlugin.h"
@@ -317,6 +318,49 @@ TEST_P(CompressorTest, decompress_16384)
   test_decompress(compressor, 16384);
 }
 
+TEST_P(CompressorTest, dictionary_round_trip)
+{
+  // small, similar records, as BlueStore sees for e.g. json objects
+  auto record = [](unsigned i) {
+    bufferlist bl;
+    for (unsigned j = 0; j < 64; ++j) {
+      char buf[160];
+      snprintf(buf, sizeof(buf),
+	       "{\"bucket\": \"logs-%u\", \"key\": \"obj-%u-%u\", "
+	       "\"size\": %u, \"etag\": \"%08x\"}\n",
+	       i % 7, i, j, (i * 131 + j) % 65536, i * 2654435761u + j);
+      bl.append(buf);
+    }
+    return bl;
+  };
+  std::vector<bufferlist> samples;
+  for (unsigned i = 0; i < 200; ++i) {
+    samples.push_back(record(i));
+  }
+  bufferlist dict;
+  int r = compressor->train_dictionary(samples, 16384, &dict);
+  if (r == -EOPNOTSUPP) {
+    ASSERT_FALSE(compressor->load_dictionary(bufferlist()));
+    return;
+  }
+  ASSERT_EQ(0, r);
+  ASSERT_LE(dict.length(), 16384u);
+  Compressor::DictionaryRef ref = compressor->load_dictionary(dict);
+  ASSERT_TRUE(ref);
+
+  bufferlist orig = record(1000);
+  bufferlist plain, compressed;
+  ASSERT_EQ(0, compressor->compress(orig, plain));
+  ASSERT_EQ(0, compressor->compress_with_dict(orig, compressed, *ref));
+  bufferlist decompressed;
+  bufferlist::iterator p = compressed.begin();
+  ASSERT_EQ(0, compressor->decompress_with_dict(p, compressed.length(),
+						decompressed, *ref));
+  ASSERT_TRUE(decompressed.contents_equal(orig));
+  cout << "orig " << orig.length() << " compressed " << plain.length()
+       << " with dictionary " << compressed.length()
+       << " with " << GetParam() << std::endl;
+}
 
 INSTANTIATE_TEST_CASE_P(
   Compressor,
@@ -325,6 +369,9 @@ INSTANTIATE_TEST_CASE_P(
     "zlib/isal",
     "zlib/noisal",
     "snappy",
+#ifdef HAVE_LZ4
+    "lz4",
+#endif
     "zstd"));
 
 TEST(ZlibCompressor, zlib_isal_compatibility)
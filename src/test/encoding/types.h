@@ -120,6 +120,7 @@ TYPE(SequencerPosition)
 #include "os/bluestore/bluestore_types.h"
 TYPE(bluestore_cnode_t)
 TYPE(bluestore_compression_header_t)
+TYPE(bluestore_compression_dict_t)
 TYPE(bluestore_extent_ref_map_t)
 TYPE(bluestore_pextent_t)
 TYPE(bluestore_blob_t)
@@ -283,6 +283,133 @@ TEST_F(IsaErasureCodeTest, minimum_to_decode)
   }
 }
 
+TEST_F(IsaErasureCodeTest, parity_delta)
+{
+  int matrices[] = { ErasureCodeIsaDefault::kVandermonde,
+                     ErasureCodeIsaDefault::kCauchy };
+  const char *ms[] = { "1", "3" };
+  for (int matrix = 0; matrix < 2; matrix++) {
+    for (int mi = 0; mi < 2; mi++) {
+      ErasureCodeIsaDefault Isa(tcache, matrices[matrix]);
+      ErasureCodeProfile profile;
+      profile["k"] = "4";
+      profile["m"] = ms[mi];
+      Isa.init(profile, &cerr);
+      EXPECT_TRUE(Isa.supports_parity_delta());
+      unsigned int k = Isa.get_data_chunk_count();
+      unsigned int n = Isa.get_chunk_count();
+
+      unsigned int chunk_size = 4096;
+      bufferlist old_in, new_in;
+      for (unsigned int i = 0; i < k * chunk_size; i++) {
+        old_in.append((char)(i * 13 + i / 251));
+        // chunks 1 and 3 change
+        unsigned int c = i / chunk_size;
+        new_in.append((char)(c == 1 || c == 3 ? i * 7 + 5 : i * 13 + i / 251));
+      }
+      set<int> want;
+      for (unsigned int i = 0; i < n; i++)
+        want.insert(i);
+      map<int, bufferlist> old_encoded, new_encoded;
+      EXPECT_EQ(0, Isa.encode(want, old_in, &old_encoded));
+      EXPECT_EQ(0, Isa.encode(want, new_in, &new_encoded));
+      EXPECT_EQ(chunk_size, old_encoded[0].length());
+
+      map<int, bufferptr> deltas;
+      int changed[] = { 1, 3 };
+      for (int c : changed) {
+        bufferptr delta(buffer::create_page_aligned(chunk_size));
+        EXPECT_EQ(0, Isa.encode_delta(bufferptr(old_encoded[c].c_str(),
+                                                chunk_size),
+                                      bufferptr(new_encoded[c].c_str(),
+                                                chunk_size),
+                                      &delta));
+        deltas[c] = delta;
+      }
+      // update all the coding chunks, then only the last one
+      map<int, bufferptr> coding;
+      for (unsigned int i = k; i < n; i++)
+        coding[i] = bufferptr(old_encoded[i].c_str(), chunk_size);
+      EXPECT_EQ(0, Isa.apply_delta(deltas, &coding));
+      for (unsigned int i = k; i < n; i++)
+        EXPECT_EQ(0, memcmp(coding[i].c_str(), new_encoded[i].c_str(),
+                            chunk_size));
+
+      map<int, bufferptr> last;
+      last[n - 1] = bufferptr(old_encoded[n - 1].c_str(), chunk_size);
+      last[n - 1].c_str()[0] ^= 1;
+      EXPECT_EQ(0, Isa.apply_delta(deltas, &last));
+      EXPECT_EQ(new_encoded[n - 1].c_str()[0] ^ 1, last[n - 1].c_str()[0]);
+      EXPECT_EQ(0, memcmp(last[n - 1].c_str() + 1,
+                          new_encoded[n - 1].c_str() + 1, chunk_size - 1));
+    }
+  }
+}
+
+TEST_F(IsaErasureCodeTest, encode_decode_stripes)
+{
+  int matrices[] = { ErasureCodeIsaDefault::kVandermonde,
+                     ErasureCodeIsaDefault::kCauchy };
+  for (int matrix = 0; matrix < 2; matrix++) {
+    ErasureCodeIsaDefault Isa(tcache, matrices[matrix]);
+    ErasureCodeProfile profile;
+    profile["k"] = "3";
+    profile["m"] = "2";
+    Isa.init(profile, &cerr);
+    unsigned int k = Isa.get_data_chunk_count();
+    unsigned int n = Isa.get_chunk_count();
+
+    const unsigned int stripes = 5;
+    unsigned int chunk_size = Isa.get_chunk_size(1);
+    unsigned int stripe_width = chunk_size * k;
+    bufferlist in;
+    for (unsigned int i = 0; i < stripes * stripe_width; i++)
+      in.append((char)(i * 11 + i / 17));
+
+    // encode each stripe on its own as a reference
+    set<int> want;
+    for (unsigned int i = 0; i < n; i++)
+      want.insert(i);
+    map<int, bufferlist> expected;
+    for (unsigned int s = 0; s < stripes; s++) {
+      bufferlist stripe;
+      stripe.substr_of(in, s * stripe_width, stripe_width);
+      map<int, bufferlist> encoded;
+      EXPECT_EQ(0, Isa.encode(want, stripe, &encoded));
+      for (unsigned int i = 0; i < n; i++)
+        expected[i].append(encoded[i]);
+    }
+
+    map<int, bufferlist> chunks;
+    for (unsigned int i = 0; i < n; i++) {
+      bufferptr ptr(buffer::create_page_aligned(stripes * chunk_size));
+      ptr.zero();
+      chunks[i].push_back(ptr);
+    }
+    for (unsigned int s = 0; s < stripes; s++)
+      for (unsigned int i = 0; i < k; i++)
+        in.copy(s * stripe_width + i * chunk_size, chunk_size,
+                chunks[i].c_str() + s * chunk_size);
+    EXPECT_EQ(0, Isa.encode_stripes(want, chunk_size, &chunks));
+    for (unsigned int i = 0; i < n; i++)
+      EXPECT_TRUE(expected[i].contents_equal(chunks[i]));
+
+    // a data chunk and a coding chunk are missing
+    chunks[1].zero();
+    chunks[3].zero();
+    int available_chunks[] = { 0, 2, 4 };
+    int want_to_decode[] = { 1, 3 };
+    EXPECT_EQ(0, Isa.decode_stripes(set<int>(want_to_decode,
+                                             want_to_decode+2),
+                                    set<int>(available_chunks,
+                                             available_chunks+3),
+                                    chunk_size,
+                                    &chunks));
+    for (unsigned int i = 0; i < n; i++)
+      EXPECT_TRUE(expected[i].contents_equal(chunks[i]));
+  }
+}
+
 TEST_F(IsaErasureCodeTest, chunk_size)
 {
   {
@@ -129,6 +129,113 @@ TYPED_TEST(ErasureCodeTest, encode_decode)
   }
 }
 
+TYPED_TEST(ErasureCodeTest, encode_decode_stripes)
+{
+  TypeParam jerasure;
+  ErasureCodeProfile profile;
+  profile["k"] = "2";
+  profile["m"] = "2";
+  profile["packetsize"] = "8";
+  jerasure.init(profile, &cerr);
+
+  const unsigned int stripes = 5;
+  unsigned int chunk_size = jerasure.get_chunk_size(1);
+  unsigned int stripe_width = chunk_size * 2;
+  bufferlist in;
+  for (unsigned int i = 0; i < stripes * stripe_width; i++)
+    in.append((char)(i * 7 + i / 13));
+
+  // encode each stripe on its own as a reference
+  int want_to_encode[] = { 0, 1, 2, 3 };
+  set<int> want(want_to_encode, want_to_encode+4);
+  map<int, bufferlist> expected;
+  for (unsigned int s = 0; s < stripes; s++) {
+    bufferlist stripe;
+    stripe.substr_of(in, s * stripe_width, stripe_width);
+    map<int, bufferlist> encoded;
+    EXPECT_EQ(0, jerasure.encode(want, stripe, &encoded));
+    for (int i = 0; i < 4; i++)
+      expected[i].append(encoded[i]);
+  }
+
+  map<int, bufferlist> chunks;
+  for (int i = 0; i < 4; i++) {
+    bufferptr ptr(buffer::create_page_aligned(stripes * chunk_size));
+    ptr.zero();
+    chunks[i].push_back(ptr);
+  }
+  for (unsigned int s = 0; s < stripes; s++)
+    for (int i = 0; i < 2; i++)
+      in.copy(s * stripe_width + i * chunk_size, chunk_size,
+	      chunks[i].c_str() + s * chunk_size);
+  EXPECT_EQ(0, jerasure.encode_stripes(want, chunk_size, &chunks));
+  for (int i = 0; i < 4; i++)
+    EXPECT_TRUE(expected[i].contents_equal(chunks[i]));
+
+  // a data chunk and a coding chunk are missing
+  chunks[0].zero();
+  chunks[3].zero();
+  int available_chunks[] = { 1, 2 };
+  int want_to_decode[] = { 0 };
+  EXPECT_EQ(0, jerasure.decode_stripes(set<int>(want_to_decode,
+						want_to_decode+1),
+				       set<int>(available_chunks,
+						available_chunks+2),
+				       chunk_size,
+				       &chunks));
+  EXPECT_TRUE(expected[0].contents_equal(chunks[0]));
+}
+
+TYPED_TEST(ErasureCodeTest, parity_delta)
+{
+  TypeParam jerasure;
+  ErasureCodeProfile profile;
+  profile["k"] = "4";
+  profile["m"] = "2";
+  profile["packetsize"] = "8";
+  jerasure.init(profile, &cerr);
+
+  map<int, bufferptr> deltas;
+  map<int, bufferptr> coding;
+  if (!jerasure.supports_parity_delta()) {
+    EXPECT_EQ(-EOPNOTSUPP, jerasure.apply_delta(deltas, &coding));
+    return;
+  }
+
+  unsigned int chunk_size = jerasure.get_chunk_size(4 * 4096);
+
+  bufferlist old_in, new_in;
+  for (unsigned int i = 0; i < 4 * chunk_size; i++) {
+    old_in.append((char)(i * 13 + i / 251));
+    // chunks 0 and 2 change
+    unsigned int c = i / chunk_size;
+    new_in.append((char)(c == 0 || c == 2 ? i * 7 + 5 : i * 13 + i / 251));
+  }
+  int want_to_encode[] = { 0, 1, 2, 3, 4, 5 };
+  set<int> want(want_to_encode, want_to_encode+6);
+  map<int, bufferlist> old_encoded, new_encoded;
+  EXPECT_EQ(0, jerasure.encode(want, old_in, &old_encoded));
+  EXPECT_EQ(0, jerasure.encode(want, new_in, &new_encoded));
+  EXPECT_EQ(chunk_size, old_encoded[0].length());
+
+  int changed[] = { 0, 2 };
+  for (int c : changed) {
+    bufferptr delta(buffer::create_page_aligned(chunk_size));
+    EXPECT_EQ(0, jerasure.encode_delta(bufferptr(old_encoded[c].c_str(),
+						 chunk_size),
+				       bufferptr(new_encoded[c].c_str(),
+						 chunk_size),
+				       &delta));
+    deltas[c] = delta;
+  }
+  for (int i = 4; i < 6; i++)
+    coding[i] = bufferptr(old_encoded[i].c_str(), chunk_size);
+  EXPECT_EQ(0, jerasure.apply_delta(deltas, &coding));
+  for (int i = 4; i < 6; i++)
+    EXPECT_EQ(0, memcmp(coding[i].c_str(), new_encoded[i].c_str(),
+			chunk_size));
+}
+
 TYPED_TEST(ErasureCodeTest, minimum_to_decode)
 {
   TypeParam jerasure;
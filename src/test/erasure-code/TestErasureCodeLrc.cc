@@ -730,6 +730,79 @@ TEST(ErasureCodeLrc, encode_decode)
   }
 }
 
+TEST(ErasureCodeLrc, encode_decode_stripes)
+{
+  // lrc relies on the per stripe ErasureCode::encode_stripes and
+  // ErasureCode::decode_stripes
+  ErasureCodeLrc lrc(g_conf->erasure_code_dir);
+  ErasureCodeProfile profile;
+  profile["mapping"] =
+    "__DD__DD";
+  const char *description_string =
+    "[ "
+    "  [ \"_cDD_cDD\", \"\" ]," // global layer
+    "  [ \"c_DD____\", \"\" ]," // first local layer
+    "  [ \"____cDDD\", \"\" ]," // second local layer
+    "]";
+  profile["layers"] = description_string;
+  EXPECT_EQ(0, lrc.init(profile, &cerr));
+  const unsigned int k = lrc.get_data_chunk_count();
+  const unsigned int n = lrc.get_chunk_count();
+  const vector<int> &mapping = lrc.get_chunk_mapping();
+
+  const unsigned int stripes = 5;
+  unsigned int chunk_size = lrc.get_chunk_size(1);
+  unsigned int stripe_width = chunk_size * k;
+  bufferlist in;
+  for (unsigned int i = 0; i < stripes * stripe_width; i++)
+    in.append((char)(i * 7 + i / 13));
+
+  // encode each stripe on its own as a reference
+  set<int> want;
+  for (unsigned int i = 0; i < n; i++)
+    want.insert(i);
+  map<int, bufferlist> expected;
+  for (unsigned int s = 0; s < stripes; s++) {
+    bufferlist stripe;
+    stripe.substr_of(in, s * stripe_width, stripe_width);
+    map<int, bufferlist> encoded;
+    EXPECT_EQ(0, lrc.encode(want, stripe, &encoded));
+    for (unsigned int i = 0; i < n; i++)
+      expected[i].append(encoded[i]);
+  }
+
+  // the data chunks go where the mapping says
+  map<int, bufferlist> chunks;
+  for (unsigned int i = 0; i < n; i++) {
+    bufferptr ptr(buffer::create_page_aligned(stripes * chunk_size));
+    ptr.zero();
+    chunks[i].push_back(ptr);
+  }
+  for (unsigned int s = 0; s < stripes; s++)
+    for (unsigned int i = 0; i < k; i++)
+      in.copy(s * stripe_width + i * chunk_size, chunk_size,
+	      chunks[mapping[i]].c_str() + s * chunk_size);
+  EXPECT_EQ(0, lrc.encode_stripes(want, chunk_size, &chunks));
+  for (unsigned int i = 0; i < n; i++)
+    EXPECT_TRUE(expected[i].contents_equal(chunks[i]));
+
+  // the first local layer recovers 2, the second lost two chunks and
+  // 7 is left to the global layer
+  chunks[2].zero();
+  chunks[4].zero();
+  chunks[7].zero();
+  int available_chunks[] = { 0, 1, 3, 5, 6 };
+  int want_to_decode[] = { 2, 7 };
+  EXPECT_EQ(0, lrc.decode_stripes(set<int>(want_to_decode,
+					   want_to_decode+2),
+				  set<int>(available_chunks,
+					   available_chunks+5),
+				  chunk_size,
+				  &chunks));
+  EXPECT_TRUE(expected[2].contents_equal(chunks[2]));
+  EXPECT_TRUE(expected[7].contents_equal(chunks[7]));
+}
+
 TEST(ErasureCodeLrc, encode_decode_2)
 {
   ErasureCodeLrc lrc(g_conf->erasure_code_dir);
@@ -27,6 +27,7 @@ function run() {
     export CEPH_ARGS
     CEPH_ARGS+="--fsid=$(uuidgen) --auth-supported=none "
     CEPH_ARGS+="--mon-host=$CEPH_MON "
+    CEPH_ARGS+="--enable-experimental-unrecoverable-data-corrupting-features=debug_white_box_testing_ec_overwrites "
 
     local funcs=${@:-$(set | sed -n -e 's/^\(TEST_[0-9a-z_]*\) .*/\1/p')}
     for func in $funcs ; do
@@ -330,6 +331,107 @@ function TEST_rados_get_with_subreadall_eio_shard_1() {
     delete_pool $poolname
 }
 
+# Overwrite length bytes of objname at offset with random data, in
+# $dir/ORIGINAL as well
+function rados_overwrite() {
+    local dir=$1
+    local poolname=$2
+    local objname=$3
+    local offset=$4
+    local length=$5
+
+    dd if=/dev/urandom of=$dir/UPDATE bs=$length count=1 || return 1
+    dd if=$dir/UPDATE of=$dir/ORIGINAL bs=1 seek=$offset conv=notrunc \
+        2> /dev/null || return 1
+    rados --pool $poolname put $objname $dir/UPDATE --offset $offset \
+        || return 1
+    rm $dir/UPDATE
+}
+
+function grep_primary_log() {
+    local dir=$1
+    local poolname=$2
+    local objname=$3
+    local pattern=$4
+
+    local primary=$(get_primary $poolname $objname)
+    CEPH_ARGS='' ceph --admin-daemon $dir/ceph-osd.$primary.asok log flush \
+        || return 1
+    grep -q "$pattern" $dir/osd.$primary.log
+}
+
+#
+# Small overwrites on an overwrite-enabled EC pool are written as parity
+# deltas (osd_ec_parity_delta_write): only the data chunk touched and the
+# coding chunk are read and written.  The data must read back intact,
+# also when it has to be decoded from the updated coding chunk.
+#
+function TEST_ec_overwrite_parity_delta() {
+    local dir=$1
+    setup_osds || return 1
+
+    local poolname=pool-jerasure
+    create_erasure_coded_pool $poolname || return 1
+    ceph osd pool set $poolname debug_white_box_testing_ec_overwrites true \
+        || return 1
+    local objname=obj-delta-$$
+
+    # k=2 and 4096 bytes stripes: three stripes of two 2048 bytes chunks
+    dd if=/dev/urandom of=$dir/ORIGINAL bs=4096 count=3 || return 1
+    rados --pool $poolname put $objname $dir/ORIGINAL || return 1
+
+    # one within data chunk 0 of stripe 1, one within chunk 1 of stripe 2
+    rados_overwrite $dir $poolname $objname 5000 100 || return 1
+    rados_overwrite $dir $poolname $objname 10250 100 || return 1
+    grep_primary_log $dir $poolname $objname "parity delta" || return 1
+    rados_get $dir $poolname $objname || return 1
+
+    #
+    # take out the OSD with data chunk 1: reading it back decodes chunk 1
+    # from chunk 0 and the coding chunk the deltas were applied to
+    #
+    local -a initial_osds=($(get_osds $poolname $objname))
+    local osd=${initial_osds[1]}
+    kill_daemons $dir TERM osd.$osd >&2 < /dev/null || return 1
+    ceph osd out $osd || return 1
+    ! get_osds $poolname $objname | grep '\<'$osd'\>' || return 1
+    rados_get $dir $poolname $objname || return 1
+    ceph osd in $osd || return 1
+    run_osd $dir $osd || return 1
+    wait_for_clean || return 1
+    rados_get $dir $poolname $objname || return 1
+
+    rm $dir/ORIGINAL
+    delete_pool $poolname
+}
+
+#
+# If reading the chunks for a parity delta fails, the overwrite falls
+# back to the full read-modify-write of the stripes.
+#
+function TEST_ec_overwrite_parity_delta_read_eio() {
+    local dir=$1
+    setup_osds || return 1
+
+    local poolname=pool-jerasure
+    create_erasure_coded_pool $poolname || return 1
+    ceph osd pool set $poolname debug_white_box_testing_ec_overwrites true \
+        || return 1
+    local objname=obj-delta-eio-$$
+
+    dd if=/dev/urandom of=$dir/ORIGINAL bs=4096 count=3 || return 1
+    rados --pool $poolname put $objname $dir/ORIGINAL || return 1
+
+    # the coding chunk, which the delta read needs and a full rmw doesn't
+    inject_eio $objname $dir 2 || return 1
+    rados_overwrite $dir $poolname $objname 5000 100 || return 1
+    grep_primary_log $dir $poolname $objname "falling back to rmw" || return 1
+    rados_get $dir $poolname $objname || return 1
+
+    rm $dir/ORIGINAL
+    delete_pool $poolname
+}
+
 main test-erasure-eio "$@"
 
 # Local Variables:
@@ -3268,6 +3268,295 @@ TEST_F(TestLibRBD, LargeCacheRead)
   rados_ioctx_destroy(ioctx);
 }
 
+namespace {
+
+// points the persistent cache at a private directory and restores the
+// cache settings of the cluster handle when it goes out of scope
+class ScopedPersistentCache {
+public:
+  explicit ScopedPersistentCache(librados::Rados &rados) : m_rados(rados) {
+    char dir[] = "/tmp/rbd_persistent_cache.XXXXXX";
+    if (mkdtemp(dir) != nullptr) {
+      path = dir;
+    }
+    m_rados.conf_get("rbd_persistent_cache", m_orig_enabled);
+    m_rados.conf_get("rbd_persistent_cache_path", m_orig_path);
+    m_rados.conf_set("rbd_persistent_cache_path", path.c_str());
+  }
+  ~ScopedPersistentCache() {
+    m_rados.conf_set("rbd_persistent_cache", m_orig_enabled.c_str());
+    m_rados.conf_set("rbd_persistent_cache_path", m_orig_path.c_str());
+    if (!path.empty()) {
+      rmdir(path.c_str());
+    }
+  }
+
+  int enable(bool enabled) {
+    return m_rados.conf_set("rbd_persistent_cache",
+                            enabled ? "true" : "false");
+  }
+
+  std::string path;
+
+private:
+  librados::Rados &m_rados;
+  std::string m_orig_enabled;
+  std::string m_orig_path;
+};
+
+// writes through the persistent cache of a separate client and fences
+// that client off before its log is written back, which leaves the log
+// and the image lock as a crashed client would
+void write_and_fence(librados::Rados &rados, const std::string &pool_name,
+                     const std::string &image_name,
+                     const std::string &cache_path, uint64_t off,
+                     bufferlist &bl) {
+  librados::Rados cluster;
+  ASSERT_EQ("", connect_cluster_pp(cluster));
+  ASSERT_EQ(0, cluster.conf_set("rbd_persistent_cache", "true"));
+  ASSERT_EQ(0, cluster.conf_set("rbd_persistent_cache_path",
+                                cache_path.c_str()));
+  ASSERT_EQ(0, cluster.conf_set("rbd_persistent_cache_debug_hold_writeback",
+                                "true"));
+
+  librados::IoCtx ioctx;
+  ASSERT_EQ(0, cluster.ioctx_create(pool_name.c_str(), ioctx));
+
+  librbd::RBD rbd;
+  librbd::Image image;
+  ASSERT_EQ(0, rbd.open(ioctx, image, image_name.c_str(), NULL));
+  ASSERT_EQ((ssize_t)bl.length(), image.write(off, bl.length(), bl));
+
+  std::list<librbd::locker_t> lockers;
+  bool exclusive;
+  std::string tag;
+  ASSERT_EQ(0, image.list_lockers(&lockers, &exclusive, &tag));
+  ASSERT_EQ(1U, lockers.size());
+  ASSERT_EQ(0, rados.blacklist_add(lockers.front().address, 0));
+  ASSERT_EQ(0, cluster.wait_for_latest_osdmap());
+
+  // the log cannot be written back and is kept
+  image.close();
+}
+
+} // anonymous namespace
+
+TEST_F(TestLibRBD, PersistentCacheIOPP)
+{
+  REQUIRE_FEATURE(RBD_FEATURE_EXCLUSIVE_LOCK);
+
+  librados::IoCtx ioctx;
+  ASSERT_EQ(0, _rados.ioctx_create(m_pool_name.c_str(), ioctx));
+
+  ScopedPersistentCache cache(_rados);
+  ASSERT_FALSE(cache.path.empty());
+  ASSERT_EQ(0, cache.enable(true));
+
+  librbd::RBD rbd;
+  int order = 20;
+  std::string name = get_temp_image_name();
+  uint64_t size = 8 << order;
+  ASSERT_EQ(0, create_image_pp(rbd, ioctx, name.c_str(), size, &order));
+
+  std::string expected(size, '\0');
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    // overlapping and adjacent writes must be written back in order
+    for (int i = 0; i < 64; ++i) {
+      uint64_t len = 512 * (1 + rand() % 64);
+      uint64_t off = 512 * (rand() % ((size - len) / 512));
+      bufferlist bl;
+      bl.append(std::string(len, 'a' + (i % 26)));
+      ASSERT_EQ((ssize_t)len, image.write(off, len, bl));
+      expected.replace(off, len, bl.c_str(), len);
+    }
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+    ASSERT_EQ(expected, read_bl.to_str());
+
+    ASSERT_EQ(0, image.discard(1 << order, 1 << order));
+    expected.replace(1 << order, 1 << order, std::string(1 << order, '\0'));
+
+    read_bl.clear();
+    ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+    ASSERT_EQ(expected, read_bl.to_str());
+
+    ASSERT_EQ(0, image.flush());
+  }
+
+  // everything must have reached the image once it is closed
+  ASSERT_EQ(0, cache.enable(false));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+    ASSERT_EQ(expected, read_bl.to_str());
+  }
+
+  ASSERT_EQ(0, rbd.remove(ioctx, name.c_str()));
+  ioctx.close();
+}
+
+TEST_F(TestLibRBD, PersistentCacheSnapReadPP)
+{
+  REQUIRE_FEATURE(RBD_FEATURE_EXCLUSIVE_LOCK);
+
+  librados::IoCtx ioctx;
+  ASSERT_EQ(0, _rados.ioctx_create(m_pool_name.c_str(), ioctx));
+
+  ScopedPersistentCache cache(_rados);
+  ASSERT_FALSE(cache.path.empty());
+
+  librbd::RBD rbd;
+  int order = 20;
+  std::string name = get_temp_image_name();
+  uint64_t size = 2 << order;
+  uint64_t half = size / 2;
+  ASSERT_EQ(0, create_image_pp(rbd, ioctx, name.c_str(), size, &order));
+
+  // the second half of HEAD differs from the snapshot but is not cached
+  std::string expected_snap(size, 'a');
+  std::string expected_head = std::string(half, 'b') + std::string(half, 'c');
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist bl;
+    bl.append(expected_snap);
+    ASSERT_EQ((ssize_t)size, image.write(0, size, bl));
+    ASSERT_EQ(0, image.snap_create("snap"));
+
+    bl.clear();
+    bl.append(std::string(half, 'c'));
+    ASSERT_EQ((ssize_t)half, image.write(half, half, bl));
+  }
+
+  ASSERT_EQ(0, cache.enable(true));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist bl;
+    bl.append(std::string(half, 'b'));
+    ASSERT_EQ((ssize_t)half, image.write(0, half, bl));
+
+    // neither cached HEAD data nor promoted snapshot data may leak
+    // between the snapshot and HEAD
+    ASSERT_EQ(0, image.snap_set("snap"));
+    for (int i = 0; i < 2; ++i) {
+      bufferlist read_bl;
+      ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+      ASSERT_EQ(expected_snap, read_bl.to_str());
+    }
+
+    ASSERT_EQ(0, image.snap_set(NULL));
+    for (int i = 0; i < 2; ++i) {
+      bufferlist read_bl;
+      ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+      ASSERT_EQ(expected_head, read_bl.to_str());
+    }
+  }
+
+  ASSERT_EQ(0, cache.enable(false));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)size, image.read(0, size, read_bl));
+    ASSERT_EQ(expected_head, read_bl.to_str());
+    ASSERT_EQ(0, image.snap_remove("snap"));
+  }
+
+  ASSERT_EQ(0, rbd.remove(ioctx, name.c_str()));
+  ioctx.close();
+}
+
+TEST_F(TestLibRBD, PersistentCacheReplayPP)
+{
+  REQUIRE_FEATURE(RBD_FEATURE_EXCLUSIVE_LOCK);
+  REQUIRE(!is_librados_test_stub());
+
+  librados::IoCtx ioctx;
+  ASSERT_EQ(0, _rados.ioctx_create(m_pool_name.c_str(), ioctx));
+
+  ScopedPersistentCache cache(_rados);
+  ASSERT_FALSE(cache.path.empty());
+
+  librbd::RBD rbd;
+  int order = 20;
+  std::string name = get_temp_image_name();
+  uint64_t size = 2 << order;
+  uint64_t len = 1 << order;
+  ASSERT_EQ(0, create_image_pp(rbd, ioctx, name.c_str(), size, &order));
+
+  bufferlist a_bl;
+  a_bl.append(std::string(len, 'a'));
+  bufferlist b_bl;
+  b_bl.append(std::string(len, 'b'));
+
+  // nobody took over the crashed client's lock: its log is replayed
+  ASSERT_NO_FATAL_FAILURE(write_and_fence(_rados, m_pool_name, name,
+                                          cache.path, 0, a_bl));
+  ASSERT_EQ(0, cache.enable(true));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)len, image.read(0, len, read_bl));
+    ASSERT_TRUE(a_bl.contents_equal(read_bl));
+  }
+
+  ASSERT_EQ(0, cache.enable(false));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)len, image.read(0, len, read_bl));
+    ASSERT_TRUE(a_bl.contents_equal(read_bl));
+  }
+
+  // another client wrote the image after breaking the crashed client's
+  // lock: the stale log must not be replayed over its data
+  ASSERT_NO_FATAL_FAILURE(write_and_fence(_rados, m_pool_name, name,
+                                          cache.path, len, a_bl));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+    ASSERT_EQ((ssize_t)len, image.write(len, len, b_bl));
+  }
+
+  ASSERT_EQ(0, cache.enable(true));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)len, image.read(len, len, read_bl));
+    ASSERT_TRUE(b_bl.contents_equal(read_bl));
+  }
+
+  ASSERT_EQ(0, cache.enable(false));
+  {
+    librbd::Image image;
+    ASSERT_EQ(0, rbd.open(ioctx, image, name.c_str(), NULL));
+
+    bufferlist read_bl;
+    ASSERT_EQ((ssize_t)len, image.read(len, len, read_bl));
+    ASSERT_TRUE(b_bl.contents_equal(read_bl));
+  }
+
+  ASSERT_EQ(0, rbd.remove(ioctx, name.c_str()));
+  ioctx.close();
+}
+
 TEST_F(TestLibRBD, TestPendingAio)
 {
   rados_ioctx_t ioctx;
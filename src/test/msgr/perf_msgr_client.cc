@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <string>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <iostream>
 
 using namespace std;
@@ -166,6 +167,14 @@ void usage(const string &name) {
   cerr << "       [ios]: how much messages sent for each client" << std::endl;
   cerr << "       [thinktime]: sleep time when do fast dispatching(match client logic)" << std::endl;
   cerr << "       [msg length]: message data bytes" << std::endl;
+  cerr << "   Compare e.g. --ms_async_zerocopy_send=false and =true runs by" << std::endl;
+  cerr << "   the cpu seconds per GB reported at the end." << std::endl;
+}
+
+static double cpu_seconds(const struct rusage &ru)
+{
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
 }
 
 int main(int argc, char **argv)
@@ -199,10 +208,20 @@ int main(int argc, char **argv)
   MessengerClient client(g_ceph_context->_conf->ms_type, args[0], think_time);
   client.ready(concurrent, numjobs, ios, len);
   Cycles::init();
+  struct rusage ru_start, ru_stop;
+  getrusage(RUSAGE_SELF, &ru_start);
   uint64_t start = Cycles::rdtsc();
   client.start();
   uint64_t stop = Cycles::rdtsc();
+  getrusage(RUSAGE_SELF, &ru_stop);
   cerr << " Total op " << ios << " run time " << Cycles::to_microseconds(stop - start) << "us." << std::endl;
 
+  double cpu = cpu_seconds(ru_stop) - cpu_seconds(ru_start);
+  double gb = (double)numjobs * ios * len / (1024.0 * 1024 * 1024);
+  cerr << " cpu " << cpu << "s for " << gb << " GB data, "
+       << (gb > 0 ? cpu / gb : 0) << " cpu s/GB"
+       << " (zerocopy " << g_ceph_context->_conf->ms_async_zerocopy_send
+       << ")" << std::endl;
+
   return 0;
 }
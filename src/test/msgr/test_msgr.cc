@@ -22,6 +22,10 @@
 #include "common/Mutex.h"
 #include "common/Cond.h"
 #include "common/ceph_argparse.h"
+#include "common/ceph_json.h"
+#include "common/common_init.h"
+#include "common/perf_counters.h"
+#include "include/stringify.h"
 #include "global/global_init.h"
 #include "msg/Dispatcher.h"
 #include "msg/msg_types.h"
@@ -766,6 +770,94 @@ TEST_P(MessengerTest, MessageTest) {
   client_msgr->wait();
 }
 
+class OrderedDispatcher : public Dispatcher {
+ public:
+  Mutex lock;
+  Cond cond;
+  map<Connection*, int> last;
+  int count;
+  bool in_order;
+
+  OrderedDispatcher(): Dispatcher(g_ceph_context), lock("OrderedDispatcher::lock"),
+                       count(0), in_order(true) {}
+  bool ms_can_fast_dispatch_any() const { return false; }
+  bool ms_dispatch(Message *m) {
+    MCommand *c = static_cast<MCommand*>(m);
+    int seq = atoi(c->cmd[0].c_str());
+    Mutex::Locker l(lock);
+    auto p = last.insert(make_pair(m->get_connection().get(), -1)).first;
+    if (seq != p->second + 1)
+      in_order = false;
+    p->second = seq;
+    ++count;
+    cond.Signal();
+    m->put();
+    return true;
+  }
+  bool ms_handle_reset(Connection *con) { return true; }
+  void ms_handle_remote_reset(Connection *con) {}
+  bool ms_handle_refused(Connection *con) { return false; }
+  bool ms_verify_authorizer(Connection *con, int peer_type, int protocol,
+                            bufferlist& authorizer, bufferlist& authorizer_reply,
+                            bool& isvalid, CryptoKey& session_key) {
+    isvalid = true;
+    return true;
+  }
+};
+
+TEST_P(MessengerTest, ShardedDispatchTest) {
+  // messages from each connection keep their order when spread over
+  // several dispatch threads
+  g_ceph_context->_conf->set_val("ms_dispatch_shards", "4");
+  Messenger *msgr = Messenger::create(g_ceph_context, string(GetParam()),
+                                      entity_name_t::OSD(1), "sharded", getpid(), 0);
+  g_ceph_context->_conf->set_val("ms_dispatch_shards", "1");
+  msgr->set_default_policy(Messenger::Policy::stateless_server(0, 0));
+  OrderedDispatcher srv_dispatcher;
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  msgr->bind(bind_addr);
+  msgr->add_dispatcher_head(&srv_dispatcher);
+  msgr->start();
+
+  const int num_clients = 8, num_msgs = 200;
+  FakeDispatcher cli_dispatcher(false);
+  vector<Messenger*> clients;
+  for (int i = 0; i < num_clients; ++i) {
+    Messenger *c = Messenger::create(g_ceph_context, string(GetParam()),
+                                     entity_name_t::CLIENT(-1), "client", getpid(), 0);
+    c->set_default_policy(Messenger::Policy::lossy_client(0, 0));
+    c->add_dispatcher_head(&cli_dispatcher);
+    c->start();
+    clients.push_back(c);
+  }
+  uuid_d uuid;
+  for (int j = 0; j < num_msgs; ++j) {
+    for (auto c : clients) {
+      MCommand *m = new MCommand(uuid);
+      m->cmd.push_back(stringify(j));
+      c->get_connection(msgr->get_myinst())->send_message(m);
+    }
+  }
+  {
+    utime_t t;
+    t += 1000*1000*500;
+    Mutex::Locker l(srv_dispatcher.lock);
+    while (srv_dispatcher.count < num_clients * num_msgs)
+      if (srv_dispatcher.cond.WaitInterval(srv_dispatcher.lock, t) == ETIMEDOUT)
+        break;
+    ASSERT_EQ(num_clients * num_msgs, srv_dispatcher.count);
+    ASSERT_TRUE(srv_dispatcher.in_order);
+  }
+  for (auto c : clients) {
+    c->shutdown();
+    c->wait();
+    delete c;
+  }
+  msgr->shutdown();
+  msgr->wait();
+  delete msgr;
+}
 
 class SyntheticWorkload;
 
@@ -1494,6 +1586,194 @@ TEST_P(MessengerTest, MarkdownTest) {
   delete server_msgr2;
 }
 
+class CompressionDispatcher : public Dispatcher {
+ public:
+  Mutex lock;
+  Cond cond;
+  bool is_server;
+  list<pair<vector<string>, bufferlist> > got;
+
+  CompressionDispatcher(CephContext *cct, bool s)
+    : Dispatcher(cct), lock("CompressionDispatcher::lock"), is_server(s) {}
+  bool ms_can_fast_dispatch_any() const { return false; }
+  bool ms_dispatch(Message *m) {
+    assert(m->get_type() == MSG_COMMAND);
+    MCommand *c = static_cast<MCommand*>(m);
+    if (is_server) {
+      MCommand *r = new MCommand(c->fsid);
+      r->cmd = c->cmd;
+      r->set_data(c->get_data());
+      m->get_connection()->send_message(r);
+    }
+    Mutex::Locker l(lock);
+    got.push_back(make_pair(c->cmd, c->get_data()));
+    cond.Signal();
+    m->put();
+    return true;
+  }
+  bool ms_handle_reset(Connection *con) { return true; }
+  void ms_handle_remote_reset(Connection *con) {}
+  bool ms_handle_refused(Connection *con) { return false; }
+  bool ms_verify_authorizer(Connection *con, int peer_type, int protocol,
+                            bufferlist& authorizer, bufferlist& authorizer_reply,
+                            bool& isvalid, CryptoKey& session_key) {
+    isvalid = true;
+    return true;
+  }
+};
+
+// bytes the async messengers of cct offered to on-wire compression
+static uint64_t get_compress_in_bytes(CephContext *cct)
+{
+  JSONFormatter f;
+  cct->get_perfcounters_collection()->dump_formatted(&f, false);
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser parser;
+  assert(parser.parse(s.c_str(), s.length()));
+  uint64_t bytes = 0;
+  for (JSONObjIter p = parser.find_first(); !p.end(); ++p) {
+    if ((*p)->get_name().find("AsyncMessenger::Worker") != 0)
+      continue;
+    JSONObj *o = (*p)->find_obj("msgr_compress_in_bytes");
+    if (o)
+      bytes += strtoull(o->get_data().c_str(), NULL, 10);
+  }
+  return bytes;
+}
+
+static void set_compression_conf(CephContext *cct, const char *alg,
+                                 const char *min_size)
+{
+  cct->_conf->set_val("ms_compression_algorithm", alg);
+  cct->_conf->set_val("ms_compression_min_size", min_size);
+  cct->_conf->apply_changes(NULL);
+}
+
+// a context whose plugin registry can't load any compressor
+static CephContext *create_cct_without_compressors()
+{
+  CephInitParameters iparams(CEPH_ENTITY_TYPE_CLIENT);
+  CephContext *cct = common_preinit(iparams, CODE_ENVIRONMENT_UTILITY, 0);
+  cct->_conf->set_val("plugin_dir", "/nonexistent");
+  cct->_conf->set_val("auth_cluster_required", "none");
+  cct->_conf->set_val("auth_service_required", "none");
+  cct->_conf->set_val("auth_client_required", "none");
+  cct->_conf->set_val("enable_experimental_unrecoverable_data_corrupting_features", "ms-type-async");
+  cct->_conf->set_val("ms_die_on_bad_msg", "true");
+  set_compression_conf(cct, "snappy", "4096");
+  return cct;
+}
+
+// send compressible commands from client to server and check that the
+// echoed replies come back intact
+static void compression_round_trip(Messenger *server, Messenger *client,
+                                   CompressionDispatcher& cli_dispatcher)
+{
+  uuid_d uuid;
+  uuid.generate_random();
+  string s("abcdefghijklmnopqrstuvwxyz");
+  vector<string> cmd;
+  for (int i = 0; i < 1024; i++)
+    cmd.push_back(s + stringify(i));
+  bufferlist data;
+  for (int i = 0; i < 1024*10; i++)
+    data.append(s);
+  const int n = 10;
+
+  ConnectionRef conn = client->get_connection(server->get_myinst());
+  for (int i = 0; i < n; i++) {
+    MCommand *m = new MCommand(uuid);
+    m->cmd = cmd;
+    m->cmd.push_back(stringify(i));
+    m->set_data(data);
+    ASSERT_EQ(conn->send_message(m), 0);
+  }
+  {
+    utime_t t;
+    t += 60;
+    Mutex::Locker l(cli_dispatcher.lock);
+    while (cli_dispatcher.got.size() < n) {
+      if (cli_dispatcher.cond.WaitInterval(cli_dispatcher.lock, t))
+        break;
+    }
+    ASSERT_EQ(n, (int)cli_dispatcher.got.size());
+    int i = 0;
+    for (auto& p : cli_dispatcher.got) {
+      vector<string> expected = cmd;
+      expected.push_back(stringify(i++));
+      ASSERT_EQ(expected, p.first);
+      ASSERT_TRUE(data.contents_equal(p.second));
+    }
+    cli_dispatcher.got.clear();
+  }
+  conn->mark_down();
+}
+
+TEST_P(MessengerTest, CompressionTest) {
+  // only the async messenger compresses
+  if (string(GetParam()) != "async")
+    return;
+  set_compression_conf(g_ceph_context, "snappy", "4096");
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+
+  // 1. both sides have the compressor
+  {
+    CompressionDispatcher cli_dispatcher(g_ceph_context, false);
+    CompressionDispatcher srv_dispatcher(g_ceph_context, true);
+    server_msgr->bind(bind_addr);
+    server_msgr->add_dispatcher_head(&srv_dispatcher);
+    server_msgr->start();
+    client_msgr->add_dispatcher_head(&cli_dispatcher);
+    client_msgr->start();
+
+    uint64_t before = get_compress_in_bytes(g_ceph_context);
+    compression_round_trip(server_msgr, client_msgr, cli_dispatcher);
+    // both the front and the data of both directions were compressed
+    ASSERT_GT(get_compress_in_bytes(g_ceph_context), before + 10 * 2 * 2 * 4096);
+
+    server_msgr->shutdown();
+    client_msgr->shutdown();
+    server_msgr->wait();
+    client_msgr->wait();
+  }
+
+  // 2. one side can't load the algorithm: the sessions fall back to
+  // no compression instead of failing to decode what the other sends
+  for (int no_plugin_on_server = 0; no_plugin_on_server < 2; no_plugin_on_server++) {
+    CephContext *cct = create_cct_without_compressors();
+    CephContext *srv_cct = no_plugin_on_server ? cct : g_ceph_context;
+    CephContext *cli_cct = no_plugin_on_server ? g_ceph_context : cct;
+    Messenger *server = Messenger::create(srv_cct, string(GetParam()), entity_name_t::OSD(0), "server", getpid(), 0);
+    Messenger *client = Messenger::create(cli_cct, string(GetParam()), entity_name_t::CLIENT(-1), "client", getpid(), 0);
+    server->set_default_policy(Messenger::Policy::stateless_server(0, 0));
+    client->set_default_policy(Messenger::Policy::lossy_client(0, 0));
+    CompressionDispatcher cli_dispatcher(cli_cct, false);
+    CompressionDispatcher srv_dispatcher(srv_cct, true);
+    server->bind(bind_addr);
+    server->add_dispatcher_head(&srv_dispatcher);
+    server->start();
+    client->add_dispatcher_head(&cli_dispatcher);
+    client->start();
+
+    uint64_t before = get_compress_in_bytes(g_ceph_context);
+    compression_round_trip(server, client, cli_dispatcher);
+    ASSERT_EQ(before, get_compress_in_bytes(g_ceph_context));
+    ASSERT_EQ(0u, get_compress_in_bytes(cct));
+
+    server->shutdown();
+    client->shutdown();
+    server->wait();
+    client->wait();
+    delete server;
+    delete client;
+    cct->put();
+  }
+  set_compression_conf(g_ceph_context, "none", "65536");
+}
+
 INSTANTIATE_TEST_CASE_P(
   Messenger,
   MessengerTest,
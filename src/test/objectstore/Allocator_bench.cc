@@ -0,0 +1,150 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Allocator fragmentation benchmark.
+ *
+ * Fills a simulated device with a mix of object sized allocations,
+ * then churns it with random frees and re-allocations (as overwrites
+ * and deletes do on a long lived OSD) and reports throughput and how
+ * fragmented each allocator leaves the free space.
+ */
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+#include "include/stringify.h"
+#include "os/bluestore/Allocator.h"
+
+#if GTEST_HAS_PARAM_TEST
+
+class AllocBench : public ::testing::TestWithParam<const char*> {
+public:
+  boost::scoped_ptr<Allocator> alloc;
+
+  void init_alloc(int64_t size, uint64_t min_alloc_size) {
+    alloc.reset(Allocator::create(g_ceph_context, string(GetParam()), size,
+				  min_alloc_size));
+    ASSERT_TRUE(alloc);
+  }
+};
+
+struct extent_rec_t {
+  uint64_t offset;
+  uint64_t length;
+};
+
+static void bench_fragmentation(const char *name,
+				Allocator *alloc, uint64_t capacity,
+				uint64_t alloc_unit, unsigned rounds)
+{
+  std::mt19937_64 rng(0);
+  std::vector<extent_rec_t> allocated;
+  uint64_t used = 0;
+  uint64_t failed = 0;
+  uint64_t ops = 0;
+
+  auto do_alloc = [&](uint64_t want) {
+    if (alloc->reserve(want) < 0) {
+      ++failed;
+      return;
+    }
+    AllocExtentVector extents;
+    int64_t got = alloc->allocate(want, alloc_unit, 0, 0, &extents);
+    ++ops;
+    if (got <= 0) {
+      alloc->unreserve(want);
+      ++failed;
+      return;
+    }
+    alloc->unreserve(want - got);
+    for (auto& e : extents) {
+      allocated.push_back(extent_rec_t{e.offset, e.length});
+    }
+    used += got;
+  };
+  auto do_release = [&]() {
+    size_t i = rng() % allocated.size();
+    alloc->release(allocated[i].offset, allocated[i].length);
+    used -= allocated[i].length;
+    allocated[i] = allocated.back();
+    allocated.pop_back();
+    ++ops;
+  };
+  // mostly small (4-64K) writes with some large (up to 4M) ones
+  auto pick_size = [&]() {
+    uint64_t units = (rng() % 10) ? 1 + rng() % 16 : 1 + rng() % 1024;
+    return units * alloc_unit;
+  };
+
+  using namespace std::chrono;
+  auto t0 = high_resolution_clock::now();
+  while (used < capacity * 8 / 10) {
+    do_alloc(pick_size());
+  }
+  auto t1 = high_resolution_clock::now();
+  for (unsigned r = 0; r < rounds; ++r) {
+    if (used > capacity * 7 / 10 || (rng() & 1)) {
+      do_release();
+    } else {
+      do_alloc(pick_size());
+    }
+  }
+  auto t2 = high_resolution_clock::now();
+
+  auto fill_us = duration_cast<microseconds>(t1 - t0).count();
+  auto churn_us = duration_cast<microseconds>(t2 - t1).count();
+  std::cout << name << ": "
+	    << "fill " << fill_us << "us, churn " << rounds << " ops in "
+	    << churn_us << "us (" << (rounds * 1000000ull / (churn_us + 1))
+	    << " ops/s), " << ops << " total ops, " << failed << " failed, "
+	    << "free " << alloc->get_free()
+	    << ", fragmentation " << alloc->get_fragmentation(alloc_unit)
+	    << std::endl;
+
+  for (auto& e : allocated) {
+    alloc->release(e.offset, e.length);
+  }
+}
+
+TEST_P(AllocBench, fragmentation_4k)
+{
+  uint64_t capacity = 16ull << 30;
+  init_alloc(capacity, 4096);
+  alloc->init_add_free(0, capacity);
+  bench_fragmentation(GetParam(), alloc.get(), capacity, 4096, 1000000);
+  alloc->shutdown();
+}
+
+TEST_P(AllocBench, fragmentation_64k)
+{
+  uint64_t capacity = 256ull << 30;
+  init_alloc(capacity, 65536);
+  alloc->init_add_free(0, capacity);
+  bench_fragmentation(GetParam(), alloc.get(), capacity, 65536, 1000000);
+  alloc->shutdown();
+}
+
+TEST_P(AllocBench, fragmentation_4k_spill)
+{
+  // force the hybrid allocator to keep most extents in its bitmap
+  g_conf->set_val("bluestore_hybrid_alloc_mem_cap", stringify(1 << 20));
+  uint64_t capacity = 16ull << 30;
+  init_alloc(capacity, 4096);
+  alloc->init_add_free(0, capacity);
+  bench_fragmentation(GetParam(), alloc.get(), capacity, 4096, 1000000);
+  alloc->shutdown();
+  g_conf->set_val("bluestore_hybrid_alloc_mem_cap",
+		  stringify(64 * 1024 * 1024));
+}
+
+INSTANTIATE_TEST_CASE_P(
+  Allocator,
+  AllocBench,
+  ::testing::Values("stupid", "bitmap", "hybrid"));
+
+#else
+
+TEST(DummyTest, ValueParameterizedTestsAreNotSupportedOnThisPlatform) {}
+#endif
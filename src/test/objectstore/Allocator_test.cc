@@ -31,6 +31,27 @@ public:
     void init_close() {
       alloc.reset(0);
     }
+
+    // config a test changes; put back on teardown, however it ends
+    map<string, string> saved_conf;
+    void set_conf(const string& key, const string& val) {
+      if (!saved_conf.count(key)) {
+	char buf[256], *p = buf;
+	ASSERT_EQ(0, g_conf->get_val(key.c_str(), &p, sizeof(buf)));
+	saved_conf[key] = buf;
+      }
+      g_conf->set_val(key.c_str(), val.c_str());
+      g_conf->apply_changes(NULL);
+    }
+    void TearDown() override {
+      if (saved_conf.empty())
+	return;
+      for (auto& p : saved_conf) {
+	g_conf->set_val(p.first.c_str(), p.second.c_str());
+      }
+      g_conf->apply_changes(NULL);
+      saved_conf.clear();
+    }
 };
 
 TEST_P(AllocTest, test_alloc_init)
@@ -244,11 +265,70 @@ TEST_P(AllocTest, test_alloc_hint_bmap)
   EXPECT_EQ(extents[0].offset, (uint64_t) 0);
 }
 
+TEST_P(AllocTest, test_alloc_fragmented)
+{
+  /*
+   * Checkerboard the device and free everything again.  For the
+   * hybrid allocator use a tiny memory cap so that most free extents
+   * end up in the bitmap.
+   */
+  if (GetParam() == std::string("hybrid")) {
+    set_conf("bluestore_hybrid_alloc_mem_cap", "4096");
+  }
+  int64_t block_size = 4096;
+  int64_t blocks = BitMapZone::get_total_blocks() * 4;
+  init_alloc(blocks * block_size, block_size);
+  alloc->init_add_free(0, blocks * block_size);
+
+  AllocExtentVector extents;
+  EXPECT_EQ(alloc->reserve(blocks * block_size), 0);
+  EXPECT_EQ(blocks * block_size,
+	    alloc->allocate(blocks * block_size, block_size, block_size,
+			    (int64_t) 0, &extents));
+  EXPECT_EQ(0u, alloc->get_free());
+  std::sort(extents.begin(), extents.end(),
+	    [](const AllocExtent& a, const AllocExtent& b) {
+	      return a.offset < b.offset;
+	    });
+  for (unsigned i = 0; i < extents.size(); i += 2) {
+    alloc->release(extents[i].offset, extents[i].length);
+  }
+  EXPECT_EQ((uint64_t)(blocks / 2 * block_size), alloc->get_free());
+
+  AllocExtentVector again;
+  EXPECT_EQ(alloc->reserve(8 * block_size), 0);
+  EXPECT_EQ(8 * block_size,
+	    alloc->allocate(8 * block_size, block_size, 0, (int64_t) 0,
+			    &again));
+  for (auto& e : again) {
+    EXPECT_EQ(e.length, (uint64_t)block_size);
+    alloc->release(e.offset, e.length);
+  }
+  // a 2-block allocation can't be satisfied from a checkerboard
+  EXPECT_EQ(alloc->reserve(2 * block_size), 0);
+  again.clear();
+  EXPECT_EQ(-ENOSPC,
+	    alloc->allocate(2 * block_size, 2 * block_size, 0, (int64_t) 0,
+			    &again));
+  alloc->unreserve(2 * block_size);
+
+  for (unsigned i = 1; i < extents.size(); i += 2) {
+    alloc->release(extents[i].offset, extents[i].length);
+  }
+  EXPECT_EQ((uint64_t)(blocks * block_size), alloc->get_free());
+  again.clear();
+  EXPECT_EQ(alloc->reserve(blocks * block_size), 0);
+  EXPECT_EQ(blocks * block_size,
+	    alloc->allocate(blocks * block_size, block_size, 0, (int64_t) 0,
+			    &again));
+  alloc->shutdown();
+}
+
 
 INSTANTIATE_TEST_CASE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap"));
+  ::testing::Values("stupid", "bitmap", "hybrid"));
 
 #else
 
@@ -0,0 +1,38 @@
+#!/bin/bash
+# vim: ts=8 sw=2 smarttab
+#
+# bdev_ioring_bench.sh - compare the libaio and io_uring KernelDevice
+# backends with ceph_objectstore_bench on bluestore.
+#
+# usage: bdev_ioring_bench.sh <block device or file> [bench args...]
+#
+# Each backend gets a fresh store in a temporary osd_data directory on top
+# of the given device.  Any extra arguments are passed to
+# ceph_objectstore_bench (e.g. --threads 16 --block-size 4096).
+#
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <block device or file> [ceph_objectstore_bench args...]" >&2
+  exit 1
+fi
+
+dev=$1
+shift
+bench=${CEPH_BIN:-.}/ceph_objectstore_bench
+args=${@:-"--size 1G --block-size 4096 --threads 16 --multi-object"}
+
+run() {
+  local name=$1
+  shift
+  local dir=$(mktemp -d)
+  echo "== $name"
+  $bench --osd-objectstore bluestore --osd-data $dir \
+    --bluestore-block-path $dev --bluestore-fsck-on-mount false \
+    "$@" $args 2>&1 | grep -E 'Wrote'
+  rm -rf $dir
+}
+
+run libaio --bdev-ioring false
+run io_uring --bdev-ioring true
@@ -934,6 +934,289 @@ TEST_P(StoreTest, CompressionTest) {
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
+static bufferlist make_records(size_t len, unsigned seed)
+{
+  bufferlist bl;
+  unsigned i = seed;
+  while (bl.length() < len) {
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+	     "{\"bucket\": \"logs-%u\", \"key\": \"obj-%u\", "
+	     "\"size\": %u, \"etag\": \"%08x\"}\n",
+	     i % 7, i, (i * 131) % 65536, i * 2654435761u);
+    bl.append(buf);
+    ++i;
+  }
+  bufferlist out;
+  out.substr_of(bl, 0, len);
+  return out;
+}
+
+TEST_P(StoreTest, BluestoreCompressionDictTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  const int num_objs = 32;
+  const size_t len = 16384;
+
+  g_conf->set_val("bluestore_compression_algorithm", "zstd");
+  g_conf->set_val("bluestore_compression_mode", "force");
+  g_conf->set_val("bluestore_min_alloc_size", "4096");
+  g_conf->set_val("bluestore_compression_dict_samples", "8");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+
+  // the objects written to each pool, to clean up
+  map<int64_t, vector<ghobject_t>> objs;
+  auto create_pool = [&](int64_t pool) {
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = apply_transaction(store, &osr, std::move(t));
+    EXPECT_EQ(r, 0);
+  };
+  // return the compressed bytes an object took
+  auto write_obj = [&](int64_t pool, const string& name, unsigned seed) {
+    struct store_statfs_t before, after;
+    EXPECT_EQ(0, store->statfs(&before));
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    ghobject_t hoid(hobject_t(object_t(name), "", CEPH_NOSNAP,
+			      objs[pool].size(), pool, ""));
+    objs[pool].push_back(hoid);
+    bufferlist bl = make_records(len, seed);
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    int r = apply_transaction(store, &osr, std::move(t));
+    EXPECT_EQ(r, 0);
+    EXPECT_EQ(0, store->statfs(&after));
+    return after.compressed - before.compressed;
+  };
+  // write the same data to pool 1 without a dictionary, and to pool 2
+  // with one
+  auto write_pool = [&](int64_t pool) {
+    int64_t compressed = 0;
+    for (int i = 0; i < num_objs; ++i) {
+      compressed += write_obj(pool, "obj" + stringify(i), i * 1000);
+    }
+    return compressed;
+  };
+  auto verify_pool = [&](int64_t pool) {
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    for (auto& hoid : objs[pool]) {
+      if (hoid.hobj.oid.name.find("obj") != 0)
+	continue;
+      unsigned seed = atoi(hoid.hobj.oid.name.c_str() + 3) * 1000;
+      bufferlist expected = make_records(len, seed), bl;
+      int r = store->read(cid, hoid, 0, len, bl);
+      ASSERT_EQ((int)len, r);
+      ASSERT_TRUE(bl_eq(expected, bl));
+      // and a part of the blob
+      bl.clear();
+      r = store->read(cid, hoid, 1000, 3000, bl);
+      ASSERT_EQ(3000, r);
+      bufferlist part;
+      part.substr_of(expected, 1000, 3000);
+      ASSERT_TRUE(bl_eq(part, bl));
+    }
+  };
+
+  g_conf->set_val("bluestore_compression_dict_size", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+  create_pool(1);
+  int64_t plain = write_pool(1);
+  int64_t plain_first = write_obj(1, "first", 0);
+
+  // the dictionary is trained in the background: give it samples, then
+  // write until a blob uses it
+  g_conf->set_val("bluestore_compression_dict_size", "16384");
+  g_ceph_context->_conf->apply_changes(NULL);
+  create_pool(2);
+  for (int i = 0; i < 8; ++i) {
+    write_obj(2, "sample" + stringify(i), i * 1000 + 500);
+  }
+  for (int i = 0; write_obj(2, "probe" + stringify(i), 0) >= plain_first;
+       ++i) {
+    ASSERT_LT(i, 1000);
+    usleep(10000);
+  }
+  int64_t with_dict = write_pool(2);
+  cerr << "compressed without dictionary " << plain << ", with " << with_dict
+       << std::endl;
+  ASSERT_GT(plain, 0);
+  ASSERT_LT(with_dict, plain);
+  verify_pool(1);
+  verify_pool(2);
+
+  // the dictionary must come back from the kv store, not the cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  verify_pool(1);
+  verify_pool(2);
+
+  // blobs are still readable after the pool switches to an algorithm
+  // without dictionaries
+  g_conf->set_val("bluestore_compression_algorithm", "snappy");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  verify_pool(2);
+
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+
+  for (auto& p : objs) {
+    coll_t cid(spg_t(pg_t(0, p.first), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    for (auto& hoid : p.second) {
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    int r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // removing the pools' collections removed their dictionaries too;
+  // fsck complains about any left behind
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+
+  g_conf->set_val("bluestore_compression_dict_size", "0");
+  g_conf->set_val("bluestore_compression_dict_samples", "128");
+  g_conf->set_val("bluestore_compression_mode", "none");
+  g_conf->set_val("bluestore_min_alloc_size", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, BluestoreScrubCrc32cTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t plain(hobject_t(sobject_t("plain", CEPH_NOSNAP)));
+  ghobject_t compressed(hobject_t(sobject_t("compressed", CEPH_NOSNAP)));
+  int r;
+
+  // the objects' contents, to know what the crc should be
+  map<ghobject_t, bufferlist, ghobject_t::BitwiseComparator> contents;
+  auto write = [&](const ghobject_t& hoid, uint64_t off, bufferlist& bl) {
+    bufferlist& c = contents[hoid];
+    if (c.length() < off + bl.length())
+      c.append_zero(off + bl.length() - c.length());
+    bufferlist t;
+    t.substr_of(c, 0, off);
+    t.append(bl);
+    if (off + bl.length() < c.length()) {
+      bufferlist tail;
+      tail.substr_of(c, off + bl.length(), c.length() - off - bl.length());
+      t.append(tail);
+    }
+    c.swap(t);
+    ObjectStore::Transaction tx;
+    tx.write(cid, hoid, off, bl.length(), bl);
+    r = apply_transaction(store, &osr, std::move(tx));
+    ASSERT_EQ(r, 0);
+  };
+  auto make_data = [](size_t len, unsigned seed) {
+    bufferlist bl;
+    bufferptr bp(len);
+    for (size_t i = 0; i < len; ++i)
+      bp.c_str()[i] = (char)(i / 256 + seed);
+    bl.append(bp);
+    return bl;
+  };
+  // scrub_crc32c must give what reading and hashing the range gives,
+  // both in one go and in the strides be_deep_scrub uses
+  auto check = [&](const ghobject_t& hoid) {
+    ObjectStore::CollectionHandle ch = store->open_collection(cid);
+    uint64_t size = contents[hoid].length();
+    vector<pair<uint64_t,uint64_t> > ranges = {
+      {0, size}, {0, size + 4096}, {1, size - 2}, {1000, 70000},
+      {4095, 4097}, {65536, 65536}, {size - 1, 100}, {size, 100},
+      {size + 4096, 100} };
+    for (auto& p : ranges) {
+      for (uint32_t seed : { (uint32_t)-1, (uint32_t)0x12345678 }) {
+	bufferlist bl;
+	r = store->read(ch, hoid, p.first, p.second, bl);
+	ASSERT_GE(r, 0);
+	uint32_t expected = bl.crc32c(seed);
+	uint32_t crc = seed;
+	r = store->scrub_crc32c(ch, hoid, p.first, p.second, &crc);
+	ASSERT_EQ((int)bl.length(), r);
+	ASSERT_EQ(expected, crc) << hoid << " 0x" << std::hex << p.first
+				 << "~" << p.second;
+      }
+    }
+    for (uint64_t stride : { 65536, 524288, 12345 }) {
+      uint32_t crc = -1;
+      uint64_t pos = 0;
+      while (true) {
+	r = store->scrub_crc32c(ch, hoid, pos, stride, &crc);
+	ASSERT_GE(r, 0);
+	if (r == 0)
+	  break;
+	pos += r;
+      }
+      ASSERT_EQ(size, pos);
+      ASSERT_EQ(contents[hoid].crc32c(-1), crc);
+    }
+  };
+  auto remount = [&]() {
+    // drop the buffer cache
+    ASSERT_EQ(0, store->umount());
+    ASSERT_EQ(0, store->mount());
+  };
+
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // holes, and writes which only partly cover csum chunks
+  {
+    bufferlist bl = make_data(65536, 1);
+    write(plain, 0, bl);
+    bl = make_data(65536, 2);
+    write(plain, 196608, bl);
+    bl = make_data(5000, 3);
+    write(plain, 300001, bl);
+    bl = make_data(100, 4);
+    write(plain, 1000, bl);
+  }
+  remount();
+  check(plain);   // from disk
+  check(plain);   // from the cache, which the reads above filled
+
+  // compressed blobs
+  g_conf->set_val("bluestore_compression_algorithm", "snappy");
+  g_conf->set_val("bluestore_compression_mode", "force");
+  g_ceph_context->_conf->apply_changes(NULL);
+  {
+    bufferlist bl = make_data(262144, 5);
+    write(compressed, 0, bl);
+    bl = make_data(7000, 6);
+    write(compressed, 100000, bl);
+  }
+  g_conf->set_val("bluestore_compression_mode", "none");
+  g_ceph_context->_conf->apply_changes(NULL);
+  remount();
+  check(compressed);
+  check(compressed);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, plain);
+    t.remove(cid, compressed);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, SimpleObjectTest) {
   ObjectStore::Sequencer osr("test");
   int r;
@@ -1398,6 +1681,71 @@ TEST_P(StoreTest, BluestoreStatFSTest) {
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
+TEST_P(StoreTest, BluestoreParallelFsck) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  const int num_colls = 16, num_objs = 20;
+  for (int i = 0; i < num_colls; ++i) {
+    coll_t cid(spg_t(pg_t(0, i + 1), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (int j = 0; j < num_objs; ++j) {
+      ghobject_t hoid(hobject_t(object_t("obj" + stringify(j)), "",
+				CEPH_NOSNAP, j, i + 1, ""));
+      bufferlist bl;
+      bl.append(string(4096 * (j % 4 + 1), 'a' + j % 26));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      if (j % 3 == 0) {
+	map<string, bufferlist> m;
+	m["key"] = bl;
+	t.omap_setkeys(cid, hoid, m);
+      }
+    }
+    int r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // the freelist must come back the same however many threads load it
+  struct store_statfs_t statfs1, statfs8;
+  g_conf->set_val("bluestore_freelist_load_threads", "1");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  ASSERT_EQ(0, store->statfs(&statfs1));
+  g_conf->set_val("bluestore_freelist_load_threads", "8");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  ASSERT_EQ(0, store->statfs(&statfs8));
+  ASSERT_EQ(statfs1.available, statfs8.available);
+
+  ASSERT_EQ(0, store->umount());
+  g_conf->set_val("bluestore_fsck_threads", "1");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->fsck(true));
+  g_conf->set_val("bluestore_fsck_threads", "8");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->fsck(true));
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+
+  for (int i = 0; i < num_colls; ++i) {
+    coll_t cid(spg_t(pg_t(0, i + 1), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    for (int j = 0; j < num_objs; ++j) {
+      t.remove(cid, ghobject_t(hobject_t(object_t("obj" + stringify(j)), "",
+					 CEPH_NOSNAP, j, i + 1, "")));
+    }
+    t.remove_collection(cid);
+    int r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_freelist_load_threads", "4");
+  g_conf->set_val("bluestore_fsck_threads", "4");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST_P(StoreTest, BluestoreFragmentedBlobTest) {
   if(string(GetParam()) != "bluestore")
     return;
@@ -1758,6 +2106,97 @@ TEST_P(StoreTest, AppendWalVsTailCache) {
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
+TEST_P(StoreTest, BluestoreWALBatchReleaseTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // hold wal writes in their batch long enough for a later txc to free
+  // the blob they overwrite and for another sequencer to allocate
+  g_conf->set_val("bluestore_wal_batch_window", "1.0");
+  g_conf->set_val("bluestore_min_alloc_size", "65536");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+
+  ObjectStore::Sequencer osr1("test1"), osr2("test2");
+  coll_t cid1(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD));
+  coll_t cid2(spg_t(pg_t(0, 2), shard_id_t::NO_SHARD));
+  ghobject_t a(hobject_t(sobject_t("a", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("b", CEPH_NOSNAP)));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid1, 0);
+    r = apply_transaction(store, &osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid2, 0);
+    r = apply_transaction(store, &osr2, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(4096, 'a'));
+    t.write(cid1, a, 0, bl.length(), bl);
+    r = apply_transaction(store, &osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // an overwrite of used space goes through the wal
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(4096, 'b'));
+    t.write(cid1, a, 0, bl.length(), bl);
+    r = apply_transaction(store, &osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid1, a);
+    r = apply_transaction(store, &osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist expected;
+  expected.append(string(65536, 'c'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid2, b, 0, expected.length(), expected);
+    r = apply_transaction(store, &osr2, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // drop the cache; the batch is written out by now either way
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist actual;
+    ASSERT_EQ((int)expected.length(),
+	      store->read(cid2, b, 0, expected.length(), actual));
+    ASSERT_TRUE(bl_eq(expected, actual));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid2, b);
+    t.remove_collection(cid2);
+    r = apply_transaction(store, &osr2, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid1);
+    r = apply_transaction(store, &osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_wal_batch_window", "0");
+  g_conf->set_val("bluestore_min_alloc_size", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+}
+
 TEST_P(StoreTest, AppendZeroTrailingSharedBlock) {
   ObjectStore::Sequencer osr("test");
   int r;
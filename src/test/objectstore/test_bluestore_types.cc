@@ -6,12 +6,14 @@
 #include "gtest/gtest.h"
 #include "include/stringify.h"
 #include "common/ceph_time.h"
+#include "common/perf_counters.h"
 #include "os/bluestore/BlueStore.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
 #include "global/global_context.h"
 
 #include <sstream>
+#include <thread>
 
 #define _STR(x) #x
 #define STRINGIFY(x) _STR(x)
@@ -290,6 +292,51 @@ TEST(bluestore_blob_t, calc_csum)
   }
 }
 
+TEST(bluestore_blob_t, calc_csum_fragmented)
+{
+  // blocks straddling buffers must checksum the same as contiguous ones
+  bufferptr bp(65536);
+  for (unsigned i = 0; i < bp.length(); ++i)
+    bp.c_str()[i] = rand();
+  bufferlist contig;
+  contig.append(bp);
+  bufferlist frag;
+  unsigned sizes[] = { 100, 4096, 3996, 8192, 1, 12287 };
+  unsigned off = 0;
+  for (unsigned i = 0; off < bp.length(); ++i) {
+    unsigned l = std::min(sizes[i % 6], bp.length() - off);
+    frag.append(bufferptr(bp, off, l));
+    off += l;
+  }
+  ASSERT_GT(frag.get_num_buffers(), 1u);
+
+  for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+       csum_type < Checksummer::CSUM_MAX;
+       ++csum_type) {
+    bluestore_blob_t a, b;
+    a.init_csum(csum_type, 12, contig.length());
+    b.init_csum(csum_type, 12, frag.length());
+    a.calc_csum(0, contig);
+    b.calc_csum(0, frag);
+    ASSERT_EQ(a.csum_data.length(), b.csum_data.length());
+    ASSERT_EQ(0, memcmp(a.csum_data.c_str(), b.csum_data.c_str(),
+			a.csum_data.length()));
+
+    int bad_off;
+    uint64_t bad_csum;
+    ASSERT_EQ(0, a.verify_csum(0, frag, &bad_off, &bad_csum));
+    ASSERT_EQ(-1, bad_off);
+
+    // corrupt one block in the middle of a batch
+    bufferlist bad;
+    bad.append(frag);
+    bad.rebuild();
+    bad.c_str()[5 * 4096 + 17] ^= 1;
+    ASSERT_EQ(-1, a.verify_csum(0, bad, &bad_off, &bad_csum));
+    ASSERT_EQ(5 * 4096, bad_off);
+  }
+}
+
 TEST(bluestore_blob_t, csum_bench)
 {
   bufferlist bl;
@@ -297,6 +344,10 @@ TEST(bluestore_blob_t, csum_bench)
   for (char *a = bp.c_str(); a < bp.c_str() + bp.length(); ++a)
     *a = (unsigned long)a & 0xff;
   bl.append(bp);
+  // the same data as 64K buffers, like reads assembled from many extents
+  bufferlist frag;
+  for (unsigned off = 0; off < bp.length(); off += 65536)
+    frag.append(bufferptr(bp, off, 65536));
   int count = 256;
   for (unsigned csum_type = 1;
        csum_type < Checksummer::CSUM_MAX;
@@ -313,6 +364,19 @@ TEST(bluestore_blob_t, csum_bench)
     cout << "csum_type " << Checksummer::get_csum_type_string(csum_type)
 	 << ", " << dur << " seconds, "
 	 << mbsec << " MB/sec" << std::endl;
+
+    int bad_off;
+    uint64_t bad_csum;
+    start = ceph::mono_clock::now();
+    for (int i = 0; i<count; ++i) {
+      b.verify_csum(0, frag, &bad_off, &bad_csum);
+    }
+    end = ceph::mono_clock::now();
+    dur = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    mbsec = (double)count * (double)bl.length() / 1000000.0 / (double)dur.count() * 1000000000.0;
+    cout << "csum_type " << Checksummer::get_csum_type_string(csum_type)
+	 << " verify 64K buffers, " << dur << " seconds, "
+	 << mbsec << " MB/sec" << std::endl;
   }
 }
 
@@ -815,6 +879,320 @@ TEST(Blob, split)
   }
 }
 
+static PerfCounters *create_cache_logger()
+{
+  // the cache only bumps hit/miss counters, but the builder wants them all
+  static std::vector<std::string> names;
+  if (names.empty()) {
+    for (int i = l_bluestore_first + 1; i < l_bluestore_last; ++i) {
+      names.push_back("c" + stringify(i));
+    }
+  }
+  PerfCountersBuilder b(g_ceph_context, "bluestore_cache_test",
+			l_bluestore_first, l_bluestore_last);
+  for (int i = l_bluestore_first + 1; i < l_bluestore_last; ++i) {
+    b.add_u64(i, names[i - l_bluestore_first - 1].c_str());
+  }
+  return b.create_perf_counters();
+}
+
+TEST(OnodeSpace, trim_referenced)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  PerfCounters *logger = create_cache_logger();
+  BlueStore::Cache *cache = BlueStore::Cache::create(
+    g_ceph_context, "lru", logger);
+  {
+    BlueStore::Collection coll(&store, cache, coll_t());
+    mempool::bluestore_meta_other::string key;
+    vector<ghobject_t> oids;
+    for (unsigned i = 0; i < 10; ++i) {
+      ghobject_t oid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+      coll.onode_map.add(oid, new BlueStore::Onode(&coll, oid, key));
+      oids.push_back(oid);
+    }
+
+    // a hit on the oldest onode saves it from the next trim
+    ASSERT_TRUE(coll.onode_map.lookup(oids[0]).get());
+    {
+      std::lock_guard<std::recursive_mutex> l(cache->lock);
+      cache->_trim(5, 0);
+    }
+    uint64_t onodes = 0, extents = 0, blobs = 0, buffers = 0, bytes = 0;
+    cache->add_stats(&onodes, &extents, &blobs, &buffers, &bytes);
+    ASSERT_EQ(5u, onodes);
+    ASSERT_TRUE(coll.onode_map.lookup(oids[0]).get());
+    for (unsigned i = 1; i < 6; ++i) {
+      ASSERT_FALSE(coll.onode_map.lookup(oids[i]).get());
+    }
+    for (unsigned i = 6; i < 10; ++i) {
+      ASSERT_TRUE(coll.onode_map.lookup(oids[i]).get());
+    }
+
+    // the same goes for buffers
+    BlueStore::SharedBlobRef sb(new BlueStore::SharedBlob(&coll));
+    for (unsigned i = 0; i < 4; ++i) {
+      bufferlist bl;
+      bl.append(std::string(4096, 'a' + i));
+      sb->bc.did_read(cache, i * 4096, bl);
+    }
+    BlueStore::ready_regions_t res;
+    interval_set<uint32_t> res_intervals;
+    sb->bc.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(4096u, res_intervals.size());
+    {
+      std::lock_guard<std::recursive_mutex> l(cache->lock);
+      cache->_trim(5, 2 * 4096);
+    }
+    sb->bc.read(cache, 0, 4 * 4096, res, res_intervals);
+    ASSERT_EQ(2 * 4096u, res_intervals.size());
+    ASSERT_TRUE(res_intervals.contains(0, 4096));
+    ASSERT_EQ('a', res[0][0]);
+    ASSERT_EQ('d', res[3 * 4096][0]);
+  }
+  delete cache;
+  delete logger;
+}
+
+TEST(OnodeSpace, lookup_bench)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  PerfCounters *logger = create_cache_logger();
+  BlueStore::Cache *cache = BlueStore::Cache::create(
+    g_ceph_context, "2q", logger);
+  {
+    BlueStore::Collection coll(&store, cache, coll_t());
+    mempool::bluestore_meta_other::string key;
+    vector<ghobject_t> oids;
+    for (unsigned i = 0; i < 1000; ++i) {
+      ghobject_t oid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+      coll.onode_map.add(oid, new BlueStore::Onode(&coll, oid, key));
+      oids.push_back(oid);
+    }
+    BlueStore::SharedBlobRef sb(new BlueStore::SharedBlob(&coll));
+    for (unsigned i = 0; i < 64; ++i) {
+      bufferlist bl;
+      bl.append(std::string(4096, 'a'));
+      sb->bc.did_read(cache, i * 4096, bl);
+    }
+
+    // every thread hits the same cache shard
+    const unsigned count = 200000;
+    for (unsigned nthreads = 1; nthreads <= 8; nthreads *= 2) {
+      vector<std::thread> threads;
+      ceph::mono_clock::time_point start = ceph::mono_clock::now();
+      for (unsigned t = 0; t < nthreads; ++t) {
+	threads.emplace_back([&, t] {
+	    BlueStore::ready_regions_t res;
+	    interval_set<uint32_t> res_intervals;
+	    for (unsigned i = 0; i < count; ++i) {
+	      unsigned n = (i * 7919 + t * 104729) % oids.size();
+	      ASSERT_TRUE(coll.onode_map.lookup(oids[n]).get());
+	      sb->bc.read(cache, (n % 64) * 4096, 4096, res, res_intervals);
+	    }
+	  });
+      }
+      for (auto& t : threads) {
+	t.join();
+      }
+      ceph::mono_clock::time_point end = ceph::mono_clock::now();
+      auto dur = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+      double ops = (double)nthreads * count / (double)dur.count() * 1000000000.0;
+      cout << nthreads << " threads, " << dur << " seconds, "
+	   << ops << " onode+buffer lookups/sec" << std::endl;
+    }
+  }
+  delete cache;
+  delete logger;
+}
+
+TEST(WALBatch, write)
+{
+  BlueStore::WALBatch b(g_ceph_context, nullptr);
+  auto fill = [](char c, unsigned len) {
+    bufferlist bl;
+    bl.append(string(len, c));
+    return bl;
+  };
+  auto expect = [&b](uint64_t offset, string s) {
+    auto p = b.iomap.find(offset);
+    ASSERT_NE(b.iomap.end(), p);
+    ASSERT_EQ(s, p->second.to_str());
+  };
+
+  bufferlist bl = fill('a', 4);
+  b.write(100, bl);
+  bl = fill('b', 4);
+  b.write(200, bl);
+  ASSERT_EQ(2u, b.iomap.size());
+  ASSERT_EQ(8u, b.bytes);
+
+  // adjacent writes coalesce
+  bl = fill('c', 4);
+  b.write(104, bl);
+  ASSERT_EQ(2u, b.iomap.size());
+  expect(100, "aaaacccc");
+  bl = fill('d', 4);
+  b.write(196, bl);
+  ASSERT_EQ(2u, b.iomap.size());
+  expect(196, "ddddbbbb");
+  ASSERT_EQ(16u, b.bytes);
+
+  // later data wins where writes overlap
+  bl = fill('e', 4);
+  b.write(102, bl);
+  expect(100, "aaeeeecc");
+  bl = fill('f', 4);
+  b.write(98, bl);
+  expect(98, "ffffeeeecc");
+  ASSERT_EQ(2u, b.iomap.size());
+  ASSERT_EQ(18u, b.bytes);
+
+  // bridging the gap merges everything into one io
+  bl = fill('g', 90);
+  b.write(106, bl);
+  ASSERT_EQ(1u, b.iomap.size());
+  expect(98, "ffffeeee" + string(90, 'g') + "ddddbbbb");
+  ASSERT_EQ(106u, b.bytes);
+
+  // rewriting the whole range replaces it
+  bl = fill('h', 106);
+  b.write(98, bl);
+  ASSERT_EQ(1u, b.iomap.size());
+  expect(98, string(106, 'h'));
+  ASSERT_EQ(106u, b.bytes);
+}
+
+TEST(CacheAutotune, init)
+{
+  uint64_t meta, data, kv;
+  BlueStore::init_cache_targets(1000, 300, .9, &meta, &data, &kv);
+  ASSERT_EQ(300u, kv);
+  ASSERT_EQ(630u, meta);
+  ASSERT_EQ(70u, data);
+
+  // the kv cache gets at most half
+  BlueStore::init_cache_targets(1000, 800, .5, &meta, &data, &kv);
+  ASSERT_EQ(500u, kv);
+  ASSERT_EQ(250u, meta);
+  ASSERT_EQ(250u, data);
+
+  // no kv cache we can size
+  BlueStore::init_cache_targets(1000, -1, .9, &meta, &data, &kv);
+  ASSERT_EQ(0u, kv);
+  ASSERT_EQ(900u, meta);
+  ASSERT_EQ(100u, data);
+
+  BlueStore::init_cache_targets(1000, 0, 1, &meta, &data, &kv);
+  ASSERT_EQ(0u, kv);
+  ASSERT_EQ(1000u, meta);
+  ASSERT_EQ(0u, data);
+}
+
+TEST(CacheAutotune, balance)
+{
+  const uint64_t chunk = 10, min_bytes = 50;
+  uint64_t meta, data, kv;
+  BlueStore::cache_state_t caches[3] = {
+    { "meta", &meta, 0, -1.0 },
+    { "data", &data, 0, -1.0 },
+    { "kv", &kv, 0, -1.0 },
+  };
+  BlueStore::cache_state_t *grow, *shrink;
+  auto set = [&](unsigned i, uint64_t target, uint64_t used, double miss) {
+    *caches[i].target = target;
+    caches[i].used = used;
+    caches[i].miss_ratio = miss;
+  };
+
+  // no lookups anywhere: nothing moves
+  set(0, 500, 500, -1.0);
+  set(1, 500, 500, -1.0);
+  ASSERT_FALSE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+						&grow, &shrink));
+
+  // both full: the one missing more grows
+  set(0, 500, 500, .5);
+  set(1, 500, 495, .1);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(&caches[0], grow);
+  ASSERT_EQ(&caches[1], shrink);
+  ASSERT_EQ(510u, meta);
+  ASSERT_EQ(490u, data);
+
+  set(0, 500, 500, .1);
+  set(1, 500, 500, .5);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(&caches[1], grow);
+  ASSERT_EQ(490u, meta);
+  ASSERT_EQ(510u, data);
+
+  // a cache not filling its target gives memory away, however badly it
+  // misses
+  set(0, 500, 500, .1);
+  set(1, 500, 100, .9);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(&caches[0], grow);
+  ASSERT_EQ(&caches[1], shrink);
+
+  // ... but one which isn't full doesn't grow
+  set(0, 500, 100, .9);
+  set(1, 500, 100, .9);
+  ASSERT_FALSE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+						&grow, &shrink));
+  ASSERT_EQ(nullptr, grow);
+
+  // equally bad: leave it be
+  set(0, 500, 500, .5);
+  set(1, 500, 500, .5);
+  ASSERT_FALSE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+						&grow, &shrink));
+  ASSERT_EQ(500u, meta);
+  ASSERT_EQ(500u, data);
+
+  // nothing shrinks below min_bytes
+  set(0, 940, 940, .5);
+  set(1, min_bytes + chunk - 1, 0, -1.0);
+  ASSERT_FALSE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+						&grow, &shrink));
+  ASSERT_EQ(nullptr, shrink);
+  ASSERT_EQ(940u, meta);
+  set(1, min_bytes + chunk, 0, -1.0);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(950u, meta);
+  ASSERT_EQ(min_bytes, data);
+  ASSERT_FALSE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+						&grow, &shrink));
+  ASSERT_EQ(950u, meta);
+  ASSERT_EQ(min_bytes, data);
+
+  // with the kv cache: the least needy of the others gives
+  set(0, 400, 400, .2);
+  set(1, 300, 300, .1);
+  set(2, 300, 300, .6);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 3, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(&caches[2], grow);
+  ASSERT_EQ(&caches[1], shrink);
+  ASSERT_EQ(400u, meta);
+  ASSERT_EQ(290u, data);
+  ASSERT_EQ(310u, kv);
+
+  // ... and the kv cache is left alone when not taking part
+  set(1, 300, 300, .1);
+  set(2, 300, 300, .6);
+  ASSERT_TRUE(BlueStore::balance_cache_targets(caches, 2, chunk, min_bytes,
+					       &grow, &shrink));
+  ASSERT_EQ(&caches[0], grow);
+  ASSERT_EQ(410u, meta);
+  ASSERT_EQ(290u, data);
+  ASSERT_EQ(300u, kv);
+}
+
 TEST(ExtentMap, find_lextent)
 {
   BlueStore store(g_ceph_context, "", 4096);
@@ -17,6 +17,9 @@
 #include <errno.h>
 #include <signal.h>
 #include "osd/ECBackend.h"
+#include "erasure-code/ErasureCodePlugin.h"
+#include "global/global_context.h"
+#include "common/config.h"
 #include "gtest/gtest.h"
 
 TEST(ECUtil, stripe_info_t)
@@ -58,3 +61,122 @@ TEST(ECUtil, stripe_info_t)
             make_pair((uint64_t)0, 2*swidth));
 }
 
+
+// Encode a few stripes, check the data chunks landed where the chunk
+// mapping says and that the shards match encoding stripe by stripe,
+// then decode without the shards in missing.
+static void encode_decode(const string &plugin,
+			  ErasureCodeProfile &profile,
+			  const set<int> &missing)
+{
+  ErasureCodeInterfaceRef ec_impl;
+  ASSERT_EQ(0, ErasureCodePluginRegistry::instance().factory(
+	      plugin,
+	      g_conf->erasure_code_dir,
+	      profile,
+	      &ec_impl,
+	      &cerr));
+  const unsigned int k = ec_impl->get_data_chunk_count();
+  const unsigned int n = ec_impl->get_chunk_count();
+  const vector<int> &mapping = ec_impl->get_chunk_mapping();
+  const uint64_t chunk_size = ec_impl->get_chunk_size(k * 4096);
+  ECUtil::stripe_info_t sinfo(k, k * chunk_size);
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  const unsigned int stripes = 5;
+
+  bufferlist in;
+  for (unsigned int i = 0; i < stripes * stripe_width; ++i)
+    in.append((char)(i * 7 + i / 13));
+
+  set<int> want;
+  for (unsigned int i = 0; i < n; ++i)
+    want.insert(i);
+  map<int, bufferlist> encoded;
+  ASSERT_EQ(0, ECUtil::encode(sinfo, ec_impl, in, want, &encoded));
+  ASSERT_EQ(n, encoded.size());
+
+  map<int, bufferlist> expected;
+  for (unsigned int s = 0; s < stripes; ++s) {
+    bufferlist stripe;
+    stripe.substr_of(in, s * stripe_width, stripe_width);
+    map<int, bufferlist> chunks;
+    ASSERT_EQ(0, ec_impl->encode(want, stripe, &chunks));
+    for (unsigned int i = 0; i < n; ++i)
+      expected[i].append(chunks[i]);
+
+    for (unsigned int i = 0; i < k; ++i) {
+      bufferlist data;
+      data.substr_of(in, s * stripe_width + i * chunk_size, chunk_size);
+      bufferlist shard;
+      shard.substr_of(encoded[mapping.size() > i ? mapping[i] : i],
+		      s * chunk_size, chunk_size);
+      ASSERT_TRUE(data.contents_equal(shard)) << "stripe " << s
+					      << " data chunk " << i;
+    }
+  }
+  for (unsigned int i = 0; i < n; ++i)
+    ASSERT_TRUE(expected[i].contents_equal(encoded[i])) << "shard " << i;
+
+  map<int, bufferlist> to_decode;
+  for (unsigned int i = 0; i < n; ++i)
+    if (!missing.count(i))
+      to_decode[i] = encoded[i];
+
+  {
+    bufferlist out;
+    ASSERT_EQ(0, ECUtil::decode(sinfo, ec_impl, to_decode, &out));
+    ASSERT_TRUE(in.contents_equal(out));
+  }
+  {
+    map<int, bufferlist> decoded;
+    map<int, bufferlist*> out;
+    for (set<int>::const_iterator i = missing.begin();
+	 i != missing.end();
+	 ++i)
+      out[*i] = &decoded[*i];
+    ASSERT_EQ(0, ECUtil::decode(sinfo, ec_impl, to_decode, out));
+    for (set<int>::const_iterator i = missing.begin();
+	 i != missing.end();
+	 ++i)
+      ASSERT_TRUE(encoded[*i].contents_equal(decoded[*i])) << "shard " << *i;
+  }
+  {
+    // nothing to reconstruct
+    map<int, bufferlist> decoded;
+    map<int, bufferlist*> out;
+    int shard = to_decode.begin()->first;
+    out[shard] = &decoded[shard];
+    ASSERT_EQ(0, ECUtil::decode(sinfo, ec_impl, to_decode, out));
+    ASSERT_TRUE(encoded[shard].contents_equal(decoded[shard]));
+  }
+}
+
+TEST(ECUtil, encode_decode)
+{
+  ErasureCodeProfile profile;
+  profile["technique"] = "reed_sol_van";
+  profile["k"] = "4";
+  profile["m"] = "2";
+  set<int> missing;
+  missing.insert(1);
+  missing.insert(4);
+  encode_decode("jerasure", profile, missing);
+}
+
+TEST(ECUtil, encode_decode_remapped)
+{
+  ErasureCodeProfile profile;
+  profile["mapping"] =
+    "__DD__DD";
+  profile["layers"] =
+    "[ "
+    "  [ \"_cDD_cDD\", \"\" ],"
+    "  [ \"c_DD____\", \"\" ],"
+    "  [ \"____cDDD\", \"\" ],"
+    "]";
+  // data chunks 0 and 3 are stored on shards 2 and 7
+  set<int> missing;
+  missing.insert(2);
+  missing.insert(7);
+  encode_decode("lrc", profile, missing);
+}
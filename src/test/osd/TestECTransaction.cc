@@ -0,0 +1,347 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <errno.h>
+#include "include/stringify.h"
+#include "osd/ECTransaction.h"
+#include "erasure-code/ErasureCodePlugin.h"
+#include "global/global_context.h"
+#include "common/config.h"
+#include "gtest/gtest.h"
+
+typedef map<uint64_t, set<unsigned int> > touched_t;
+
+class TestPrefix : public DoutPrefixProvider {
+public:
+  string gen_prefix() const override { return "test "; }
+  CephContext *get_cct() const override { return g_ceph_context; }
+  unsigned get_subsys() const override { return ceph_subsys_osd; }
+};
+
+static hobject_t make_oid(const string &name)
+{
+  return hobject_t(object_t(name), "", CEPH_NOSNAP, 0, 1, "");
+}
+
+static bufferlist random_buffer(uint64_t len)
+{
+  bufferptr bp(len);
+  for (uint64_t i = 0; i < len; ++i)
+    bp[i] = rand() % 256;
+  bufferlist bl;
+  bl.append(bp);
+  return bl;
+}
+
+static void write_random(PGTransaction *t, const hobject_t &hoid,
+			 uint64_t off, uint64_t len)
+{
+  bufferlist bl = random_buffer(len);
+  t->write(hoid, off, len, bl);
+}
+
+static touched_t touched(const ECUtil::stripe_info_t &sinfo,
+			 uint64_t off, uint64_t len)
+{
+  extent_set extents;
+  extents.insert(off, len);
+  return ECTransaction::get_touched_data_chunks(sinfo, extents);
+}
+
+TEST(ECTransaction, get_touched_data_chunks)
+{
+  const uint64_t chunk_size = 4096;
+  ECUtil::stripe_info_t sinfo(4, 4 * chunk_size);
+
+  // within a single chunk
+  ASSERT_EQ((touched_t{{0, {0}}}), touched(sinfo, 100, 10));
+  ASSERT_EQ((touched_t{{0, {1}}}), touched(sinfo, chunk_size, chunk_size));
+  // across a chunk boundary
+  ASSERT_EQ((touched_t{{0, {0, 1}}}), touched(sinfo, 4090, 10));
+  // across a stripe boundary
+  ASSERT_EQ((touched_t{{0, {3}}, {16384, {0}}}), touched(sinfo, 16380, 8));
+  // spanning a whole stripe
+  ASSERT_EQ((touched_t{{0, {1, 2, 3}},
+	                {16384, {0, 1, 2, 3}},
+	                {32768, {0, 1, 2}}}),
+	    touched(sinfo, 5000, 40000));
+
+  // several extents, some in the same stripe
+  extent_set extents;
+  extents.insert(100, 10);
+  extents.insert(9000, 10);
+  extents.insert(20000, 10);
+  ASSERT_EQ((touched_t{{0, {0, 2}}, {16384, {0}}}),
+	    ECTransaction::get_touched_data_chunks(sinfo, extents));
+}
+
+TEST(ECTransaction, write_plan_overwrites)
+{
+  const uint64_t stripe_width = 8192;
+  const uint64_t object_size = 3 * stripe_width;
+  ECUtil::stripe_info_t sinfo(2, stripe_width);
+  TestPrefix dpp;
+
+  hobject_t inside = make_oid("inside");
+  hobject_t past_end = make_oid("past_end");
+  hobject_t truncated = make_oid("truncated");
+  hobject_t created = make_oid("created");
+
+  PGTransactionUPtr t(new PGTransaction);
+  // entirely within the object: may be written as a parity delta
+  write_random(t.get(), inside, 5000, 100);
+  write_random(t.get(), inside, 20000, 10);
+  // extends the object
+  write_random(t.get(), past_end, object_size - 10, 100);
+  // a truncate is never an overwrite
+  t->truncate(truncated, 10000);
+  write_random(t.get(), truncated, 100, 10);
+  // neither is a new object
+  t->create(created);
+  write_random(t.get(), created, 0, 100);
+
+  ECTransaction::WritePlan plan = ECTransaction::get_write_plan(
+    sinfo,
+    std::move(t),
+    [&](const hobject_t &i) {
+      ECUtil::HashInfoRef hinfo(new ECUtil::HashInfo(3));
+      hinfo->set_projected_total_logical_size(
+	sinfo, i == created ? 0 : object_size);
+      return hinfo;
+    },
+    &dpp);
+
+  ASSERT_EQ(1u, plan.overwrites.size());
+  ASSERT_EQ(1u, plan.overwrites.count(inside));
+  extent_set raw;
+  raw.insert(5000, 100);
+  raw.insert(20000, 10);
+  ASSERT_EQ(raw, plan.overwrites[inside]);
+
+  // the full rmw fallback still has whole stripes to read and write
+  extent_set stripes;
+  stripes.insert(0, stripe_width);
+  stripes.insert(2 * stripe_width, stripe_width);
+  ASSERT_EQ(stripes, plan.will_write[inside]);
+  ASSERT_EQ(stripes, plan.to_read[inside]);
+
+  ASSERT_EQ(4u, plan.hash_infos.size());
+  ASSERT_EQ(1u, plan.will_write.count(past_end));
+  ASSERT_EQ(1u, plan.will_write.count(truncated));
+  ASSERT_EQ(1u, plan.will_write.count(created));
+}
+
+static void apply_write(bufferlist &chunk, uint64_t off, bufferlist &data)
+{
+  ASSERT_LE(off + data.length(), chunk.length());
+  bufferlist result;
+  result.substr_of(chunk, 0, off);
+  result.append(data);
+  bufferlist tail;
+  tail.substr_of(chunk, off + data.length(),
+		 chunk.length() - off - data.length());
+  result.append(tail);
+  chunk.swap(result);
+}
+
+TEST(ECTransaction, parity_delta)
+{
+  ErasureCodeProfile profile;
+  profile["technique"] = "reed_sol_van";
+  profile["k"] = "4";
+  profile["m"] = "2";
+  ErasureCodeInterfaceRef ec_impl;
+  ASSERT_EQ(0, ErasureCodePluginRegistry::instance().factory(
+	      "jerasure",
+	      g_conf->erasure_code_dir,
+	      profile,
+	      &ec_impl,
+	      &cerr));
+  ASSERT_TRUE(ec_impl->supports_parity_delta());
+
+  const unsigned int k = ec_impl->get_data_chunk_count();
+  const unsigned int km = ec_impl->get_chunk_count();
+  const uint64_t chunk_size = ec_impl->get_chunk_size(k * 4096);
+  ECUtil::stripe_info_t sinfo(k, k * chunk_size);
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  TestPrefix dpp;
+  pg_t pgid(0, 1);
+  hobject_t oid = make_oid("delta");
+  const eversion_t version(1, 2);
+
+  set<int> want;
+  for (unsigned int i = 0; i < km; ++i)
+    want.insert(i);
+
+  bufferlist old_content = random_buffer(3 * stripe_width);
+  map<int, bufferlist> old_chunks;
+  ASSERT_EQ(0, ECUtil::encode(sinfo, ec_impl, old_content, want, &old_chunks));
+  ECUtil::HashInfoRef hinfo(new ECUtil::HashInfo(km));
+  hinfo->append(0, old_chunks);
+  hinfo->set_projected_total_logical_size(sinfo, old_content.length());
+
+  // two small updates: data chunk 1 of stripe 1 and chunks 2..3 of stripe 2
+  map<uint64_t, bufferlist> updates;
+  updates[stripe_width + chunk_size + 100] = random_buffer(1000);
+  updates[2 * stripe_width + 3 * chunk_size - 50] = random_buffer(100);
+
+  bufferlist new_content;
+  new_content.append(old_content.c_str(), old_content.length());
+  ObjectContextRef obc(new ObjectContext);
+  obc->obs.oi.soid = oid;
+  PGTransactionUPtr t(new PGTransaction);
+  t->add_obc(obc);
+  for (auto &&i: updates) {
+    i.second.copy(0, i.second.length(), new_content.c_str() + i.first);
+    bufferlist bl = i.second;
+    t->write(oid, i.first, bl.length(), bl);
+  }
+  map<int, bufferlist> new_chunks;
+  ASSERT_EQ(0, ECUtil::encode(sinfo, ec_impl, new_content, want, &new_chunks));
+
+  ECTransaction::WritePlan plan = ECTransaction::get_write_plan(
+    sinfo,
+    std::move(t),
+    [&](const hobject_t &) { return hinfo; },
+    &dpp);
+  ASSERT_EQ(1u, plan.overwrites.count(oid));
+  extent_set stripes;
+  stripes.insert(stripe_width, 2 * stripe_width);
+  ASSERT_EQ(stripes, plan.will_write[oid]);
+
+  // what the primary reads for a delta: the stripes to be written, from
+  // the data shards updated and from every coding shard
+  touched_t data_chunks = ECTransaction::get_touched_data_chunks(
+    sinfo, plan.overwrites[oid]);
+  ASSERT_EQ((touched_t{{stripe_width, {1}},
+	                {2 * stripe_width, {2, 3}}}),
+	    data_chunks);
+  set<int> shards_written;
+  for (auto &&stripe: data_chunks)
+    shards_written.insert(stripe.second.begin(), stripe.second.end());
+  for (unsigned int i = k; i < km; ++i)
+    shards_written.insert(i);
+
+  hobject_t::bitwisemap<map<int, extent_map> > delta_reads;
+  for (auto &&shard: shards_written) {
+    for (auto extent = stripes.begin(); extent != stripes.end(); ++extent) {
+      uint64_t off = sinfo.aligned_logical_offset_to_chunk_offset(
+	extent.get_start());
+      uint64_t len = sinfo.aligned_logical_offset_to_chunk_offset(
+	extent.get_len());
+      bufferlist bl;
+      bl.substr_of(old_chunks[shard], off, len);
+      delta_reads[oid][shard].insert(off, len, bl);
+    }
+  }
+
+  vector<pg_log_entry_t> entries;
+  entries.push_back(
+    pg_log_entry_t(pg_log_entry_t::MODIFY, oid, version, eversion_t(1, 1),
+		   0, osd_reqid_t(), utime_t(), 0));
+  hobject_t::bitwisemap<extent_map> partial_extents;
+  hobject_t::bitwisemap<extent_map> written;
+  map<shard_id_t, ObjectStore::Transaction> transactions;
+  for (unsigned int i = 0; i < km; ++i)
+    transactions[shard_id_t(i)];
+  set<hobject_t, hobject_t::BitwiseComparator> temp_added;
+  set<hobject_t, hobject_t::BitwiseComparator> temp_removed;
+  ECTransaction::generate_transactions(
+    plan,
+    ec_impl,
+    pgid,
+    false,
+    sinfo,
+    partial_extents,
+    delta_reads,
+    entries,
+    &written,
+    &transactions,
+    &temp_added,
+    &temp_removed,
+    &dpp);
+
+  ASSERT_TRUE(entries[0].mod_desc.can_rollback());
+
+  extent_set rollback;
+  rollback.insert(sinfo.aligned_logical_offset_to_chunk_offset(stripe_width),
+		  sinfo.aligned_logical_offset_to_chunk_offset(
+		    2 * stripe_width));
+  map<int, bufferlist> chunks = old_chunks;
+  for (auto &&st: transactions) {
+    int shard = st.first.id;
+    bool touched_rollback = false;
+    bool wrote = false;
+    extent_set cloned;
+    ObjectStore::Transaction::iterator i = st.second.begin();
+    while (i.have_op()) {
+      ObjectStore::Transaction::Op *op = i.decode_op();
+      switch (op->op) {
+      case ObjectStore::Transaction::OP_TOUCH:
+	if (i.get_oid(op->oid).generation == version.version)
+	  touched_rollback = true;
+	break;
+      case ObjectStore::Transaction::OP_CLONERANGE2:
+	{
+	  ASSERT_EQ(ghobject_t::NO_GEN, i.get_oid(op->oid).generation);
+	  ASSERT_EQ(version.version, i.get_oid(op->dest_oid).generation);
+	  ASSERT_EQ(op->off, op->dest_off);
+	  cloned.insert(op->off, op->len);
+	}
+	break;
+      case ObjectStore::Transaction::OP_WRITE:
+	{
+	  bufferlist bl;
+	  i.decode_bl(bl);
+	  ASSERT_EQ(ghobject_t::NO_GEN, i.get_oid(op->oid).generation);
+	  apply_write(chunks[shard], op->off, bl);
+	  wrote = true;
+	}
+	break;
+      case ObjectStore::Transaction::OP_SETATTR:
+	{
+	  bufferlist bl;
+	  i.decode_string();
+	  i.decode_bl(bl);
+	}
+	break;
+      case ObjectStore::Transaction::OP_SETATTRS:
+	{
+	  map<string, bufferlist> attrs;
+	  i.decode_attrset(attrs);
+	}
+	break;
+      case ObjectStore::Transaction::OP_RMATTR:
+	i.decode_string();
+	break;
+      default:
+	ADD_FAILURE() << "shard " << shard << " unexpected op " << op->op;
+      }
+    }
+    // every shard saves the stripes overwritten for rollback ...
+    ASSERT_TRUE(touched_rollback) << "shard " << shard;
+    ASSERT_EQ(rollback, cloned) << "shard " << shard;
+    // ... but only the updated data shards and the coding shards are written
+    ASSERT_EQ(shards_written.count(shard) > 0, wrote) << "shard " << shard;
+    ASSERT_TRUE(new_chunks[shard].contents_equal(chunks[shard]))
+      << "shard " << shard;
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "cd ../.. ;
+ *   make unittest_ec_transaction &&
+ *   valgrind --tool=memcheck ./unittest_ec_transaction
+ *      --gtest_filter=*.* --log-to-stderr=true --debug-osd=20"
+ * End:
+ */
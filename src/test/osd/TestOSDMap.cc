@@ -411,3 +411,120 @@ TEST_F(OSDMapTest, PrimaryAffinity) {
     osdmap.set_primary_affinity(1, 0x10000);
   }
 }
+
+TEST_F(OSDMapTest, PoolToRawOsds) {
+  set_up_map();
+
+  // make one pg of each pool non-trivial for the up/acting comparison
+  OSDMap::Incremental pgtemp_map(osdmap.get_epoch() + 1);
+  for (auto& p : osdmap.get_pools()) {
+    pgtemp_map.new_pg_temp[pg_t(1, p.first)] = {0, 1, 2};
+    pgtemp_map.new_primary_temp[pg_t(2, p.first)] = 3;
+  }
+  osdmap.apply_incremental(pgtemp_map);
+
+  for (auto& p : osdmap.get_pools()) {
+    for (unsigned nthreads : {1, 4}) {
+      OSDMap::PoolRawMapping m;
+      ASSERT_EQ(0, osdmap.pool_to_raw_osds(p.first, &m, nthreads));
+      ASSERT_EQ(p.second.get_pg_num(), m.get_num_pgs());
+      for (unsigned ps = 0; ps < m.get_num_pgs(); ++ps) {
+	pg_t pgid(ps, p.first);
+	vector<int> raw, batch_raw;
+	int primary, batch_primary;
+	osdmap.pg_to_raw_osds(pgid, &raw, &primary);
+	m.get(ps, &batch_raw, &batch_primary);
+	ASSERT_EQ(raw, batch_raw);
+	ASSERT_EQ(primary, batch_primary);
+
+	vector<int> up, acting, batch_up, batch_acting;
+	int up_primary, acting_primary, batch_up_primary, batch_acting_primary;
+	osdmap.pg_to_up_acting_osds(pgid, &up, &up_primary,
+				    &acting, &acting_primary);
+	osdmap.pg_raw_to_up_acting_osds(pgid, batch_raw, batch_primary,
+					&batch_up, &batch_up_primary,
+					&batch_acting, &batch_acting_primary);
+	ASSERT_EQ(up, batch_up);
+	ASSERT_EQ(up_primary, batch_up_primary);
+	ASSERT_EQ(acting, batch_acting);
+	ASSERT_EQ(acting_primary, batch_acting_primary);
+      }
+    }
+  }
+  OSDMap::PoolRawMapping m;
+  ASSERT_EQ(-ENOENT, osdmap.pool_to_raw_osds(12345, &m));
+}
+
+TEST_F(OSDMapTest, PGMapping) {
+  set_up_map();
+
+  OSDMap cached;
+  cached.deepish_copy_from(osdmap);
+  cached.set_pg_mapping_threads(2);
+
+  auto check = [&]() {
+    for (auto& p : osdmap.get_pools()) {
+      for (unsigned ps = 0; ps < p.second.get_pg_num(); ++ps) {
+	pg_t pgid(ps, p.first);
+	vector<int> up, acting, cup, cacting;
+	int up_primary, acting_primary, cup_primary, cacting_primary;
+	osdmap.pg_to_up_acting_osds(pgid, &up, &up_primary,
+				    &acting, &acting_primary);
+	cached.pg_to_up_acting_osds(pgid, &cup, &cup_primary,
+				    &cacting, &cacting_primary);
+	ASSERT_EQ(up, cup);
+	ASSERT_EQ(up_primary, cup_primary);
+	ASSERT_EQ(acting, cacting);
+	ASSERT_EQ(acting_primary, cacting_primary);
+      }
+    }
+  };
+  auto apply = [&](OSDMap::Incremental& inc) {
+    inc.fsid = osdmap.get_fsid();
+    osdmap.apply_incremental(inc);
+    cached.apply_incremental(inc);
+  };
+  check();
+
+  int64_t pool = osdmap.lookup_pg_pool_name("ec");
+  ASSERT_LE(0, pool);
+  pg_t pg_with_temp(3, pool);
+  {
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.new_pg_temp[pg_with_temp] = {0, 1, 2};
+    inc.new_primary_temp[pg_t(4, pool)] = 5;
+    apply(inc);
+    check();
+  }
+  {
+    // osd.1 goes down, which changes the acting set of the pg_temp pg too
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.new_state[1] = CEPH_OSD_UP;
+    apply(inc);
+    ASSERT_TRUE(cached.is_down(1));
+    check();
+  }
+  {
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.new_weight[2] = CEPH_OSD_IN / 2;
+    inc.new_primary_affinity[3] = 0;
+    apply(inc);
+    check();
+  }
+  {
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.new_weight[2] = CEPH_OSD_IN;
+    inc.new_pg_temp[pg_with_temp] = {};
+    apply(inc);
+    check();
+  }
+  {
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    pg_pool_t p = *osdmap.get_pg_pool(pool);
+    p.set_pg_num(128);
+    p.set_pgp_num(128);
+    inc.new_pools[pool] = p;
+    apply(inc);
+    check();
+  }
+}
@@ -0,0 +1,330 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Objecter microbenchmark.
+ *
+ * Client threads keep a number of reads in flight each through one
+ * Objecter, whose messenger is faked: every osd answers each op it is
+ * sent from its own thread, as a messenger's dispatch thread would,
+ * with no network in between.  This times op submission and reply
+ * handling, with and without objecter_fast_submit.
+ *
+ *   ceph_bench_objecter [--osds n] [--ops n] [--depth n]
+ *                       [--threads n,n,...]
+ */
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "common/ceph_argparse.h"
+#include "common/Finisher.h"
+#include "global/global_context.h"
+#include "global/global_init.h"
+#include "messages/MOSDOp.h"
+#include "messages/MOSDOpReply.h"
+#include "mon/MonClient.h"
+#include "msg/Messenger.h"
+#include "osdc/Objecter.h"
+
+using namespace std::chrono;
+
+class FakeMessenger;
+
+struct FakeConnection : public Connection {
+  FakeMessenger *fake;
+  int osd;
+  FakeConnection(CephContext *cct, FakeMessenger *m, int osd);
+  bool is_connected() override { return true; }
+  int send_message(Message *m) override;
+  void send_keepalive() override {}
+  void mark_down() override {}
+  void mark_disposable() override {}
+};
+
+/// answers every MOSDOp sent to osd i from thread i
+class FakeMessenger : public Messenger {
+  struct OSD {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Message*> q;
+    bool stop = false;
+    std::thread t;
+  };
+  std::vector<OSD> osds;
+  std::mutex lock;
+  map<int, ConnectionRef> conns;
+
+  void run(int osd) {
+    OSD &o = osds[osd];
+    std::unique_lock<std::mutex> l(o.lock);
+    while (true) {
+      if (o.q.empty()) {
+	if (o.stop)
+	  break;
+	o.cond.wait(l);
+	continue;
+      }
+      std::deque<Message*> q;
+      q.swap(o.q);
+      l.unlock();
+      for (auto m : q) {
+	MOSDOp *op = static_cast<MOSDOp*>(m);
+	MOSDOpReply *reply = new MOSDOpReply(
+	  op, 0, epoch, CEPH_OSD_FLAG_ACK | CEPH_OSD_FLAG_ONDISK, true);
+	reply->set_src(entity_name_t::OSD(osd));
+	op->put();
+	objecter->ms_fast_dispatch(reply);
+      }
+      l.lock();
+    }
+  }
+
+public:
+  Objecter *objecter = nullptr;
+  epoch_t epoch = 0;
+
+  FakeMessenger(CephContext *cct, int num_osds)
+    : Messenger(cct, entity_name_t::CLIENT(-1)), osds(num_osds) {}
+
+  void start_osds() {
+    for (unsigned i = 0; i < osds.size(); ++i) {
+      osds[i].t = std::thread([this, i] { run(i); });
+    }
+  }
+  void stop_osds() {
+    for (auto& o : osds) {
+      {
+	std::lock_guard<std::mutex> l(o.lock);
+	o.stop = true;
+      }
+      o.cond.notify_one();
+      o.t.join();
+    }
+  }
+  void queue(int osd, Message *m) {
+    OSD &o = osds[osd];
+    std::lock_guard<std::mutex> l(o.lock);
+    o.q.push_back(m);
+    o.cond.notify_one();
+  }
+
+  ConnectionRef get_connection(const entity_inst_t& dest) override {
+    std::lock_guard<std::mutex> l(lock);
+    int osd = dest.name.num();
+    auto p = conns.find(osd);
+    if (p == conns.end()) {
+      ConnectionRef con(new FakeConnection(cct, this, osd));
+      con->set_peer_addr(dest.addr);
+      p = conns.insert(make_pair(osd, con)).first;
+    }
+    return p->second;
+  }
+  int send_message(Message *m, const entity_inst_t& dest) override {
+    return get_connection(dest)->send_message(m);
+  }
+
+  void set_addr_unknowns(const entity_addr_t &addr) override {}
+  int get_dispatch_queue_len() override { return 0; }
+  double get_dispatch_queue_max_age(utime_t now) override { return 0; }
+  void set_cluster_protocol(int p) override {}
+  void set_default_policy(Policy p) override {}
+  void set_policy(int type, Policy p) override {}
+  Policy get_policy(int t) override { return Policy(); }
+  Policy get_default_policy() override { return Policy(); }
+  void set_policy_throttlers(int type, Throttle *bytes,
+			     Throttle *msgs) override {}
+  int bind(const entity_addr_t& bind_addr) override { return 0; }
+  int client_bind(const entity_addr_t& bind_addr) override { return 0; }
+  void wait() override {}
+  ConnectionRef get_loopback_connection() override { return ConnectionRef(); }
+  void mark_down(const entity_addr_t& a) override {}
+  void mark_down_all() override {}
+};
+
+FakeConnection::FakeConnection(CephContext *cct, FakeMessenger *m, int osd)
+  : Connection(cct, m), fake(m), osd(osd)
+{
+  set_peer_type(CEPH_ENTITY_TYPE_OSD);
+}
+
+int FakeConnection::send_message(Message *m)
+{
+  fake->queue(osd, m);
+  return 0;
+}
+
+static void build_map(OSDMap *osdmap, int num_osds, int64_t *pool)
+{
+  uuid_d fsid;
+  osdmap->build_simple(g_ceph_context, 0, fsid, num_osds, 6, 6);
+  OSDMap::Incremental inc(osdmap->get_epoch() + 1);
+  inc.fsid = osdmap->get_fsid();
+  entity_addr_t addr;
+  uuid_d uuid;
+  for (int i = 0; i < num_osds; ++i) {
+    uuid.generate_random();
+    addr.nonce = i;
+    inc.new_state[i] = CEPH_OSD_EXISTS | CEPH_OSD_NEW;
+    inc.new_up_client[i] = addr;
+    inc.new_up_cluster[i] = addr;
+    inc.new_hb_back_up[i] = addr;
+    inc.new_hb_front_up[i] = addr;
+    inc.new_weight[i] = CEPH_OSD_IN;
+    inc.new_uuid[i] = uuid;
+  }
+  osdmap->apply_incremental(inc);
+
+  OSDMap::Incremental pool_inc(osdmap->get_epoch() + 1);
+  pool_inc.fsid = osdmap->get_fsid();
+  pool_inc.new_pool_max = osdmap->get_pool_max();
+  pg_pool_t empty;
+  *pool = ++pool_inc.new_pool_max;
+  pg_pool_t *p = pool_inc.get_new_pool(*pool, &empty);
+  p->size = 3;
+  p->set_pg_num(1024);
+  p->set_pgp_num(1024);
+  p->type = pg_pool_t::TYPE_REPLICATED;
+  p->crush_ruleset = 0;
+  pool_inc.new_pool_names[*pool] = "bench";
+  osdmap->apply_incremental(pool_inc);
+}
+
+struct Inflight {
+  std::mutex lock;
+  std::condition_variable cond;
+  unsigned n = 0;
+};
+
+class C_Done : public Context {
+  Inflight *in;
+public:
+  explicit C_Done(Inflight *in) : in(in) {}
+  void finish(int r) override {
+    assert(r == 0);
+    std::lock_guard<std::mutex> l(in->lock);
+    --in->n;
+    in->cond.notify_one();
+  }
+};
+
+static void client(Objecter *objecter, int64_t pool, unsigned id,
+		   unsigned ops, unsigned depth)
+{
+  Inflight in;
+  object_locator_t oloc(pool);
+  for (unsigned i = 0; i < ops; ++i) {
+    {
+      std::unique_lock<std::mutex> l(in.lock);
+      while (in.n >= depth)
+	in.cond.wait(l);
+      ++in.n;
+    }
+    char oid[64];
+    snprintf(oid, sizeof(oid), "obj.%u.%u", id, i % 4096);
+    objecter->read(object_t(oid), oloc, 0, 4096, CEPH_NOSNAP, NULL, 0,
+		   new C_Done(&in));
+  }
+  std::unique_lock<std::mutex> l(in.lock);
+  while (in.n)
+    in.cond.wait(l);
+}
+
+static void bench(Objecter *objecter, int64_t pool, bool fast,
+		  unsigned threads, unsigned ops, unsigned depth)
+{
+  g_ceph_context->_conf->set_val("objecter_fast_submit",
+				 fast ? "true" : "false");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  auto t0 = high_resolution_clock::now();
+  std::vector<std::thread> ts;
+  for (unsigned i = 0; i < threads; ++i) {
+    ts.emplace_back([=] { client(objecter, pool, i, ops, depth); });
+  }
+  for (auto& t : ts) {
+    t.join();
+  }
+  auto us = duration_cast<microseconds>(high_resolution_clock::now() - t0).count();
+  uint64_t total = (uint64_t)threads * ops;
+  std::cout << (fast ? "fast  " : "locked") << " " << threads
+	    << " threads: " << total << " ops in " << us << "us ("
+	    << (total * 1000000ull / (us + 1)) << " ops/s)" << std::endl;
+}
+
+static vector<unsigned> split(const string& s)
+{
+  vector<unsigned> ret;
+  std::stringstream ss(s);
+  string i;
+  while (std::getline(ss, i, ',')) {
+    ret.push_back(atoi(i.c_str()));
+  }
+  return ret;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
+			 CODE_ENVIRONMENT_UTILITY,
+			 CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+  // our map is flat: spread replicas across osds, not hosts
+  g_ceph_context->_conf->set_val("osd_crush_chooseleaf_type", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  unsigned num_osds = 8, ops = 200000, depth = 32;
+  vector<unsigned> threads = { 1, 2, 4, 8, 16 };
+  string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_witharg(args, i, &val, "--osds", (char*)NULL)) {
+      num_osds = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)NULL)) {
+      ops = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--depth", (char*)NULL)) {
+      depth = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads",
+				     (char*)NULL)) {
+      threads = split(val);
+    } else {
+      cerr << "unrecognized argument " << *i << std::endl;
+      return 1;
+    }
+  }
+
+  OSDMap osdmap;
+  int64_t pool;
+  build_map(&osdmap, num_osds, &pool);
+
+  FakeMessenger msgr(g_ceph_context, num_osds);
+  MonClient monc(g_ceph_context);
+  Finisher finisher(g_ceph_context);
+  finisher.start();
+  Objecter objecter(g_ceph_context, &msgr, &monc, &finisher, 0, 0);
+  msgr.objecter = &objecter;
+  msgr.epoch = osdmap.get_epoch();
+  msgr.start_osds();
+  objecter.init();
+  objecter.start(&osdmap);
+
+  std::cout << num_osds << " osds, " << ops << " ops per thread, "
+	    << depth << " in flight per thread" << std::endl;
+  for (auto n : threads) {
+    bench(&objecter, pool, false, n, ops, depth);
+    bench(&objecter, pool, true, n, ops, depth);
+  }
+
+  objecter.shutdown();
+  msgr.stop_osds();
+  finisher.wait_for_empty();
+  finisher.stop();
+  return 0;
+}
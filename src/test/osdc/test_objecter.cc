@@ -0,0 +1,480 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Objecter op submission against a faked messenger and cluster.
+ *
+ * Client threads submit ops while the osdmap changes under them and
+ * osd sessions are reset.  Each op must complete exactly once: either
+ * answered by the osd it maps to, after being resent there, or with
+ * -ETIMEDOUT.
+ */
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "common/Finisher.h"
+#include "global/global_context.h"
+#include "messages/MOSDMap.h"
+#include "messages/MOSDOp.h"
+#include "messages/MOSDOpReply.h"
+#include "mon/MonClient.h"
+#include "msg/Messenger.h"
+#include "osdc/Objecter.h"
+#include "gtest/gtest.h"
+
+using namespace std::chrono;
+
+class FakeMessenger;
+
+struct FakeConnection : public Connection {
+  FakeMessenger *fake;
+  int osd;  ///< -1 for the monitor, whose messages we drop
+  std::atomic<bool> closed;
+  FakeConnection(CephContext *cct, FakeMessenger *m, int osd);
+  bool is_connected() override { return !closed; }
+  int send_message(Message *m) override;
+  void send_keepalive() override {}
+  void mark_down() override { closed = true; }
+  void mark_disposable() override {}
+};
+
+/**
+ * Every osd answers the ops it gets from its own thread, unless hold()
+ * is on.  Like a real cluster it drops ops for pgs it isn't the primary
+ * of in the current map, and ops which came in on a connection that has
+ * since been marked down, leaving it to the Objecter to resend them.
+ */
+class FakeMessenger : public Messenger {
+  struct OSD {
+    std::condition_variable cond;
+    std::deque<pair<ConnectionRef, Message*> > q;
+    std::thread t;
+  };
+  std::mutex lock;  ///< protects everything below
+  std::vector<OSD> osds;
+  map<int, ConnectionRef> conns;
+  bool holding = false;
+  bool stopping = false;
+  unsigned dropped = 0;
+
+  bool is_primary(int osd, const pg_t& pgid) {
+    vector<int> acting;
+    int primary;
+    osdmap.pg_to_acting_osds(pgid, &acting, &primary);
+    return primary == osd;
+  }
+
+  void run(int osd) {
+    OSD &o = osds[osd];
+    std::unique_lock<std::mutex> l(lock);
+    while (!stopping) {
+      if (holding || o.q.empty()) {
+	o.cond.wait(l);
+	continue;
+      }
+      std::deque<pair<ConnectionRef, Message*> > q;
+      q.swap(o.q);
+      std::vector<MOSDOpReply*> replies;
+      for (auto& p : q) {
+	Message *m = p.second;
+	if (m->get_type() != CEPH_MSG_OSD_OP) {
+	  m->put();
+	  continue;
+	}
+	MOSDOp *op = static_cast<MOSDOp*>(m);
+	if (!p.first->is_connected() || !is_primary(osd, op->get_pg())) {
+	  ++dropped;
+	  op->put();
+	  continue;
+	}
+	MOSDOpReply *reply = new MOSDOpReply(
+	  op, 0, osdmap.get_epoch(), CEPH_OSD_FLAG_ACK | CEPH_OSD_FLAG_ONDISK,
+	  true);
+	reply->set_src(entity_name_t::OSD(osd));
+	op->put();
+	replies.push_back(reply);
+      }
+      l.unlock();
+      for (auto reply : replies) {
+	objecter->ms_fast_dispatch(reply);
+      }
+      l.lock();
+    }
+    for (auto& p : o.q) {
+      p.second->put();
+    }
+    o.q.clear();
+  }
+
+public:
+  Objecter *objecter = nullptr;
+  OSDMap osdmap;  ///< the cluster's current map; only changed by publish()
+
+  FakeMessenger(CephContext *cct, int num_osds)
+    : Messenger(cct, entity_name_t::CLIENT(-1)), osds(num_osds) {}
+
+  void start_osds() {
+    for (unsigned i = 0; i < osds.size(); ++i) {
+      osds[i].t = std::thread([this, i] { run(i); });
+    }
+  }
+  void stop_osds() {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      stopping = true;
+      for (auto& o : osds) {
+	o.cond.notify_one();
+      }
+    }
+    for (auto& o : osds) {
+      o.t.join();
+    }
+  }
+  void queue(FakeConnection *con, Message *m) {
+    std::lock_guard<std::mutex> l(lock);
+    OSD &o = osds[con->osd];
+    o.q.push_back(make_pair(ConnectionRef(con), m));
+    o.cond.notify_one();
+  }
+
+  /// stop the osds from answering ops, or let them catch up again
+  void hold(bool h) {
+    std::lock_guard<std::mutex> l(lock);
+    holding = h;
+    for (auto& o : osds) {
+      o.cond.notify_one();
+    }
+  }
+  /// @return the osd with most ops waiting, and how many
+  pair<int, unsigned> get_busiest_osd() {
+    std::lock_guard<std::mutex> l(lock);
+    pair<int, unsigned> ret(-1, 0);
+    for (unsigned i = 0; i < osds.size(); ++i) {
+      if (osds[i].q.size() >= ret.second)
+	ret = make_pair(i, osds[i].q.size());
+    }
+    return ret;
+  }
+  unsigned get_dropped() {
+    std::lock_guard<std::mutex> l(lock);
+    return dropped;
+  }
+
+  /// apply inc to the cluster, then hand it to the Objecter
+  void publish(const OSDMap::Incremental& inc) {
+    bufferlist bl;
+    inc.encode(bl);
+    {
+      std::lock_guard<std::mutex> l(lock);
+      osdmap.apply_incremental(inc);
+    }
+    MOSDMap *m = new MOSDMap(osdmap.get_fsid());
+    m->incremental_maps[inc.epoch] = bl;
+    m->oldest_map = 1;
+    m->newest_map = inc.epoch;
+    objecter->handle_osd_map(m);
+    m->put();
+  }
+
+  /// the connection to osd resets, as a lossy client's would on a fault
+  void reset(int osd) {
+    ConnectionRef con;
+    {
+      std::lock_guard<std::mutex> l(lock);
+      auto p = conns.find(osd);
+      if (p == conns.end())
+	return;
+      con = p->second;
+      conns.erase(p);
+    }
+    con->mark_down();
+    objecter->ms_handle_reset(con.get());
+  }
+
+  ConnectionRef get_connection(const entity_inst_t& dest) override {
+    if (dest.name.is_mon()) {
+      ConnectionRef con(new FakeConnection(cct, this, -1));
+      con->set_peer_addr(dest.addr);
+      return con;
+    }
+    std::lock_guard<std::mutex> l(lock);
+    int osd = dest.name.num();
+    auto p = conns.find(osd);
+    if (p == conns.end() || !p->second->is_connected()) {
+      ConnectionRef con(new FakeConnection(cct, this, osd));
+      con->set_peer_addr(dest.addr);
+      conns[osd] = con;
+      return con;
+    }
+    return p->second;
+  }
+  int send_message(Message *m, const entity_inst_t& dest) override {
+    return get_connection(dest)->send_message(m);
+  }
+
+  void set_addr_unknowns(const entity_addr_t &addr) override {}
+  int get_dispatch_queue_len() override { return 0; }
+  double get_dispatch_queue_max_age(utime_t now) override { return 0; }
+  void set_cluster_protocol(int p) override {}
+  void set_default_policy(Policy p) override {}
+  void set_policy(int type, Policy p) override {}
+  Policy get_policy(int t) override { return Policy(); }
+  Policy get_default_policy() override { return Policy(); }
+  void set_policy_throttlers(int type, Throttle *bytes,
+			     Throttle *msgs) override {}
+  int bind(const entity_addr_t& bind_addr) override { return 0; }
+  int client_bind(const entity_addr_t& bind_addr) override { return 0; }
+  void wait() override {}
+  ConnectionRef get_loopback_connection() override { return ConnectionRef(); }
+  void mark_down(const entity_addr_t& a) override {}
+  void mark_down_all() override {}
+};
+
+FakeConnection::FakeConnection(CephContext *cct, FakeMessenger *m, int osd)
+  : Connection(cct, m), fake(m), osd(osd), closed(false)
+{
+  set_peer_type(osd < 0 ? CEPH_ENTITY_TYPE_MON : CEPH_ENTITY_TYPE_OSD);
+}
+
+int FakeConnection::send_message(Message *m)
+{
+  if (osd < 0 || closed) {
+    m->put();
+    return 0;
+  }
+  fake->queue(this, m);
+  return 0;
+}
+
+struct Completions {
+  std::mutex lock;
+  std::condition_variable cond;
+  vector<int> done;    ///< completions of each op
+  vector<int> result;  ///< of the last completion of each op
+  unsigned pending;
+
+  explicit Completions(unsigned n) : done(n), result(n), pending(n) {}
+  bool wait(seconds timeout) {
+    std::unique_lock<std::mutex> l(lock);
+    return cond.wait_for(l, timeout, [this] { return pending == 0; });
+  }
+};
+
+class C_Complete : public Context {
+  Completions *c;
+  unsigned i;
+public:
+  C_Complete(Completions *c, unsigned i) : c(c), i(i) {}
+  void finish(int r) override {
+    std::lock_guard<std::mutex> l(c->lock);
+    EXPECT_EQ(1, ++c->done[i]) << "op " << i << " completed again, r=" << r;
+    if (c->done[i] == 1)
+      --c->pending;
+    c->result[i] = r;
+    c->cond.notify_all();
+  }
+};
+
+class ObjecterTest : public ::testing::Test {
+protected:
+  static const int num_osds = 8;
+  int64_t pool = -1;
+  FakeMessenger *msgr = nullptr;
+  MonClient *monc = nullptr;
+  Finisher *finisher = nullptr;
+  Objecter *objecter = nullptr;
+  // outlives the objecter, to catch late completions
+  std::unique_ptr<Completions> c;
+
+  void SetUp() override {
+    // our map is flat: spread replicas across osds, not hosts
+    g_conf->set_val("osd_crush_chooseleaf_type", "0");
+    // a monitor to subscribe to maps from, which never answers
+    g_conf->set_val("mon_host", "127.0.0.1:6789");
+    g_conf->set_val("auth_client_required", "none");
+    g_conf->apply_changes(NULL);
+  }
+
+  void TearDown() override {
+    if (objecter) {
+      objecter->shutdown();
+      msgr->stop_osds();
+      monc->shutdown();
+      finisher->wait_for_empty();
+      finisher->stop();
+      delete objecter;
+      delete finisher;
+      delete monc;
+      delete msgr;
+    }
+    g_conf->set_val("objecter_debug_inject_relock_delay", "false");
+    g_conf->apply_changes(NULL);
+  }
+
+  void build_map(OSDMap *osdmap) {
+    uuid_d fsid;
+    osdmap->build_simple(g_ceph_context, 0, fsid, num_osds, 6, 6);
+    OSDMap::Incremental inc(osdmap->get_epoch() + 1);
+    inc.fsid = osdmap->get_fsid();
+    entity_addr_t addr;
+    uuid_d uuid;
+    for (int i = 0; i < num_osds; ++i) {
+      uuid.generate_random();
+      addr.nonce = i;
+      inc.new_state[i] = CEPH_OSD_EXISTS | CEPH_OSD_NEW;
+      inc.new_up_client[i] = addr;
+      inc.new_up_cluster[i] = addr;
+      inc.new_hb_back_up[i] = addr;
+      inc.new_hb_front_up[i] = addr;
+      inc.new_weight[i] = CEPH_OSD_IN;
+      inc.new_uuid[i] = uuid;
+    }
+    osdmap->apply_incremental(inc);
+
+    OSDMap::Incremental pool_inc(osdmap->get_epoch() + 1);
+    pool_inc.fsid = osdmap->get_fsid();
+    pool_inc.new_pool_max = osdmap->get_pool_max();
+    pg_pool_t empty;
+    pool = ++pool_inc.new_pool_max;
+    pg_pool_t *p = pool_inc.get_new_pool(pool, &empty);
+    p->size = 3;
+    p->set_pg_num(64);
+    p->set_pgp_num(64);
+    p->type = pg_pool_t::TYPE_REPLICATED;
+    p->crush_ruleset = 0;
+    pool_inc.new_pool_names[pool] = "test";
+    osdmap->apply_incremental(pool_inc);
+  }
+
+  void start(double osd_timeout) {
+    msgr = new FakeMessenger(g_ceph_context, num_osds);
+    build_map(&msgr->osdmap);
+    monc = new MonClient(g_ceph_context);
+    monc->set_messenger(msgr);
+    ASSERT_EQ(0, monc->build_initial_monmap());
+    ASSERT_EQ(0, monc->init());
+    finisher = new Finisher(g_ceph_context);
+    finisher->start();
+    objecter = new Objecter(g_ceph_context, msgr, monc, finisher, 0,
+			    osd_timeout);
+    msgr->objecter = objecter;
+    msgr->start_osds();
+    objecter->init();
+    objecter->start(&msgr->osdmap);
+  }
+
+  OSDMap::Incremental next_inc() {
+    OSDMap::Incremental inc(msgr->osdmap.get_epoch() + 1);
+    inc.fsid = msgr->osdmap.get_fsid();
+    return inc;
+  }
+  /// mark osd down or up, and pause writes to the pool or resume them
+  void change_map(int osd, bool up, bool full) {
+    OSDMap::Incremental inc = next_inc();
+    if (up) {
+      entity_addr_t addr = msgr->osdmap.get_addr(osd);
+      inc.new_up_client[osd] = addr;
+      inc.new_up_cluster[osd] = addr;
+      inc.new_hb_back_up[osd] = addr;
+      inc.new_hb_front_up[osd] = addr;
+    } else {
+      inc.new_state[osd] = CEPH_OSD_UP;
+    }
+    pg_pool_t *p = inc.get_new_pool(pool, msgr->osdmap.get_pg_pool(pool));
+    if (full)
+      p->set_flag(pg_pool_t::FLAG_FULL);
+    else
+      p->unset_flag(pg_pool_t::FLAG_FULL);
+    msgr->publish(inc);
+  }
+
+  /// writes to even, reads from odd ops
+  void submit(unsigned first, unsigned n, Completions *c) {
+    object_locator_t oloc(pool);
+    bufferlist bl;
+    bl.append(string(4096, 'x'));
+    for (unsigned i = first; i < first + n; ++i) {
+      char oid[32];
+      snprintf(oid, sizeof(oid), "obj.%u", i);
+      if (i % 2)
+	objecter->read(object_t(oid), oloc, 0, bl.length(), CEPH_NOSNAP, NULL,
+		       0, new C_Complete(c, i));
+      else
+	objecter->write(object_t(oid), oloc, 0, bl.length(), SnapContext(),
+			bl, ceph::real_clock::now(), 0, new C_Complete(c, i));
+    }
+  }
+};
+
+TEST_F(ObjecterTest, ResendOnMapChange) {
+  start(0);
+  const unsigned threads = 4, ops = 4000;
+  c.reset(new Completions(threads * ops));
+
+  // let some ops pile up at their osds, to be sure there are ops in
+  // flight to the osd we mark down first
+  msgr->hold(true);
+  std::vector<std::thread> ts;
+  for (unsigned t = 0; t < threads; ++t) {
+    ts.emplace_back([this, t] { submit(t * ops, ops, c.get()); });
+  }
+  while (msgr->get_busiest_osd().second < 16)
+    std::this_thread::sleep_for(milliseconds(1));
+
+  // move primaries, pause the pool's writes and reset a session, then
+  // undo it all again, while the clients keep submitting
+  int osd = msgr->get_busiest_osd().first;
+  for (unsigned round = 0; round < 10; ++round) {
+    change_map(osd, false, true);
+    if (round == 0)
+      msgr->hold(false);
+    msgr->reset((osd + 1) % num_osds);
+    std::this_thread::sleep_for(milliseconds(5));
+    change_map(osd, true, false);
+    osd = (osd + 3) % num_osds;
+  }
+
+  for (auto& t : ts) {
+    t.join();
+  }
+  ASSERT_TRUE(c->wait(seconds(60)));
+  // the ops held by the first osd we marked down were dropped by it
+  // and must have been resent to the new primaries to complete
+  ASSERT_GT(msgr->get_dropped(), 0u);
+
+  std::lock_guard<std::mutex> l(c->lock);
+  for (unsigned i = 0; i < threads * ops; ++i) {
+    ASSERT_EQ(0, c->result[i]) << "op " << i;
+  }
+}
+
+TEST_F(ObjecterTest, TimeoutWhileSubmitting) {
+  // opening a session drops the rwlock for a second, longer than
+  // osd_timeout: the timeout must still find and cancel the op
+  g_conf->set_val("objecter_debug_inject_relock_delay", "true");
+  g_conf->apply_changes(NULL);
+  start(0.5);
+  const unsigned threads = 4, ops = 64;
+  c.reset(new Completions(threads * ops));
+
+  // the osds never answer
+  msgr->hold(true);
+  std::vector<std::thread> ts;
+  for (unsigned t = 0; t < threads; ++t) {
+    ts.emplace_back([this, t] { submit(t * ops, ops, c.get()); });
+  }
+  change_map(0, false, false);
+  msgr->reset(1);
+  for (auto& t : ts) {
+    t.join();
+  }
+
+  ASSERT_TRUE(c->wait(seconds(60)));
+  std::lock_guard<std::mutex> l(c->lock);
+  for (unsigned i = 0; i < threads * ops; ++i) {
+    ASSERT_EQ(-ETIMEDOUT, c->result[i]) << "op " << i;
+  }
+}
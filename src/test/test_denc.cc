@@ -264,6 +264,47 @@ TEST(denc, vector)
   }
 }
 
+template<typename T>
+void test_vector_bulk(const vector<T>& v)
+{
+  // bulk copied vectors encode the same as element-wise lists
+  test_denc(v);
+  list<T> l(v.begin(), v.end());
+  bufferlist vbl, lbl;
+  ::encode(v, vbl);
+  ::encode(l, lbl);
+  ASSERT_TRUE(vbl.contents_equal(lbl));
+  vector<T> out;
+  ::decode(out, lbl);
+  ASSERT_EQ(v, out);
+}
+
+TEST(denc, vector_bulk)
+{
+  vector<uint64_t> v64;
+  vector<int32_t> v32;
+  vector<uint16_t> v16;
+  vector<uint8_t> v8;
+  for (int i = 0; i < 1000; ++i) {
+    v64.push_back(0x0102030405060708ull * i);
+    v32.push_back(-i * 1000);
+    v16.push_back(i * 37);
+    v8.push_back(i);
+  }
+  test_vector_bulk(v64);
+  test_vector_bulk(v32);
+  test_vector_bulk(v16);
+  test_vector_bulk(v8);
+  test_vector_bulk(vector<uint64_t>());
+
+  // a count beyond the end of the buffer is caught before allocating
+  bufferlist bl;
+  ::encode((uint32_t)0x10000000, bl);
+  ::encode((uint64_t)1, bl);
+  bufferlist::iterator p = bl.begin();
+  ASSERT_THROW(::decode(v64, p), buffer::end_of_buffer);
+}
+
 template<typename T>
 using default_list = std::list<T>;
 
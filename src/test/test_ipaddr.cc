@@ -501,3 +501,30 @@ TEST(CommonIPAddr, ParseNetwork_IPv6_9000)
   ipv6(&want, "2001:1234:5678:90ab::dead:beef");
   ASSERT_EQ(0, memcmp(want.sin6_addr.s6_addr, network.sin6_addr.s6_addr, sizeof(network.sin6_addr.s6_addr)));
 }
+
+TEST(CommonIPAddr, NetworkContains_IPv4)
+{
+  struct sockaddr_in network, a;
+  unsigned int prefix_len;
+
+  ASSERT_TRUE(parse_network("10.1.0.0/16", (struct sockaddr*)&network, &prefix_len));
+  ipv4(&a, "10.1.2.3");
+  ASSERT_TRUE(network_contains((struct sockaddr*)&network, prefix_len, (struct sockaddr*)&a));
+  ipv4(&a, "10.2.2.3");
+  ASSERT_FALSE(network_contains((struct sockaddr*)&network, prefix_len, (struct sockaddr*)&a));
+}
+
+TEST(CommonIPAddr, NetworkContains_IPv6)
+{
+  struct sockaddr_in6 network, a;
+  struct sockaddr_in a4;
+  unsigned int prefix_len;
+
+  ASSERT_TRUE(parse_network("2001:1234:5678:90ab::/64", (struct sockaddr*)&network, &prefix_len));
+  ipv6(&a, "2001:1234:5678:90ab::dead:beef");
+  ASSERT_TRUE(network_contains((struct sockaddr*)&network, prefix_len, (struct sockaddr*)&a));
+  ipv6(&a, "2001:1234:5678:90ac::dead:beef");
+  ASSERT_FALSE(network_contains((struct sockaddr*)&network, prefix_len, (struct sockaddr*)&a));
+  ipv4(&a4, "10.1.2.3");
+  ASSERT_FALSE(network_contains((struct sockaddr*)&network, prefix_len, (struct sockaddr*)&a4));
+}
@@ -14,6 +14,7 @@
 
 #include <string>
 #include <sys/stat.h>
+#include <thread>
 
 #include "common/ceph_argparse.h"
 #include "common/errno.h"
@@ -352,6 +353,10 @@ int main(int argc, const char **argv)
       
       cout << "pool " << p->first
 	   << " pg_num " << p->second.get_pg_num() << std::endl;
+      OSDMap::PoolRawMapping rawmap;
+      if (!test_random)
+	osdmap.pool_to_raw_osds(p->first, &rawmap,
+				std::thread::hardware_concurrency());
       for (unsigned i = 0; i < p->second.get_pg_num(); ++i) {
 	pg_t pgid = pg_t(i, p->first);
 
@@ -363,12 +368,13 @@ int main(int argc, const char **argv)
 	    osds[i] = rand() % osdmap.get_max_osd();
 	  }
 	  primary = osds[0];
-	} else if (test_map_pgs_dump_all) {
-         osdmap.pg_to_raw_osds(pgid, &raw, &calced_primary);
-         osdmap.pg_to_up_acting_osds(pgid, &up, &up_primary,
-                                &acting, &acting_primary);         
-       } else {
-	  osdmap.pg_to_acting_osds(pgid, &osds, &primary);
+	} else {
+	  rawmap.get(i, &raw, &calced_primary);
+	  osdmap.pg_raw_to_up_acting_osds(pgid, raw, calced_primary,
+					  &up, &up_primary,
+					  &acting, &acting_primary);
+	  osds = acting;
+	  primary = acting_primary;
 	}
 	size[osds.size()]++;
 